@@ -14,6 +14,12 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "lib/libOllama-C-lient.h"
 
@@ -24,6 +30,11 @@
 
 #define	RESPONSE_SPEED					0
 #define	MIN_STDOUT_BUFFER_SIZE			0
+#define	OUTPUT_TICK_US					20000
+#define	CHUNKINGS_SIZE					8196
+#define	TOKEN_QUEUE_SIZE				(1024*64)
+#define	TOKEN_SPAN_MAX					(TOKEN_QUEUE_SIZE/2)
+#define	INPUT_BLOCK_SIZE				(1024*1024)
 
 OCl *ocl=NULL;
 
@@ -34,7 +45,7 @@ enum msgTypes{
 };
 
 struct OclParams{
-	char serverAddr[16];
+	char serverAddr[512];
 	char serverPort[6];
 	char socketConnTo[8];
 	char socketSendTo[8];
@@ -57,7 +68,23 @@ struct OclParams{
 	char *systemRoleFile;
 	char *contextFile;
 	char *staticContextFile;
+	char const *staticContextIndex;
+	char const *embedModel;
+	bool generate;
+	char const *generateContextFile;
+	int staticContextTopK;
 	char *toolsFile;
+	char *endpoints[16];
+	int cantEndpoints;
+	int endpointPolicy;
+	int compression;
+	int compressionLevel;
+	int compressionMinSize;
+	char const *format;
+	char const *stops[OCL_MAX_STOP_SEQUENCES];
+	int cantStops;
+	int maxChars;
+	int maxTime;
 };
 
 struct Colors{
@@ -70,6 +97,17 @@ struct Colors{
 struct ProgramOpts{
 	struct OclParams ocl;
 	long int responseSpeed;
+	int retryAttempts;
+	int retryBackoff;
+	OCl_race_branch race[OCL_RACE_MAX_BRANCHES];
+	int cantRace;
+	int racePolicy;
+	int raceQuorum;
+	OCl_race_branch ensemble[OCL_RACE_MAX_BRANCHES];
+	int cantEnsemble;
+	char const *ensemblePrompt;
+	int loadTimeout;
+	bool warmUp;
 	bool executeTools;
 	bool showThoughts;
 	bool showResponseInfo;
@@ -84,16 +122,46 @@ struct ProgramOpts{
 
 struct SendingMessage{
 	char *input;
+	size_t inputMapped;
 	char *imageFile;
 };
 
+struct TokenSpan{
+	size_t len;
+	int responseType;
+	bool done;
+};
+
+struct JsonDecoder{
+	char pending[8];
+	int pendingLen;
+	unsigned int highSurrogate;
+};
+
+struct TokenQueue{
+	char ring[TOKEN_QUEUE_SIZE];
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_bool producerWaiting;
+	sem_t spans;
+	sem_t room;
+	bool stalled;
+	unsigned long stalls;
+};
+
 struct ProgramOpts po={0};
 struct SendingMessage sm={0};
 bool thinking=false;
-char chunkings[8196]="";
+char chunkings[CHUNKINGS_SIZE]="";
+size_t chunkingsLen=0;
+// One per stream (content, thoughts): an escape cut at the end of one isn't completed with the other's bytes.
+struct JsonDecoder outputDecoders[2];
+bool chunkingsThinking=false;
+uint64_t excludeChars[4]={0};
 int toolsRecv=0;
 char *toolsResponses[128]={NULL};
 char program[512]="";
+struct TokenQueue tq={0};
 
 static void show_help(char *programName){
 	BANNER
@@ -101,15 +169,33 @@ static void show_help(char *programName){
 	printf("\nOptions:\n\n");
 	printf("--version \t\t\t\t\t\t shows version.\n");
 	printf("--help \t\t\t\t\t\t\t shows this.\n");
-	printf("--server-addr \t\t\t string:'127.0.0.1' \t URL or IP of the server.\n");
+	printf("--server-addr \t\t\t string:'127.0.0.1' \t URL or IP (v4 or v6) of the server.\n");
 	printf("--server-port \t\t\t int:443 [1-65535] \t listening port. Must be SSL/TLS.\n");
+	printf("--endpoint \t\t\t string:NULL \t\t additional server ('addr', 'addr:port' or '[IPv6]:port'). Can be repeated (max. 16).\n");
+	printf("--endpoint-policy \t\t string:'round-robin' [round-robin, least-outstanding, latency, model-affinity]\t how the server of every query is chosen.\n");
+	printf("--race \t\t\t\t string:NULL \t\t branch ('model', 'model@addr', 'model@addr:port' or 'model@[IPv6]:port') the query is raced on. Can be repeated (max. 16).\n");
+	printf("--race-policy \t\t\t string:'first-token' [first-token, first-done, quorum]\t which branch wins. The rest are canceled.\n");
+	printf("--race-quorum \t\t\t int:2 [>=1] \t\t with 'quorum', branches to wait for. The answer given by most of them wins.\n");
+	printf("--ensemble \t\t\t string:NULL \t\t member (same format as '--race') asked at once. Their answers are the static context of '--model'. Can be repeated (max. 16).\n");
+	printf("--ensemble-prompt \t\t string:'. Give an answer based on the context provided.' \t appended to the query sent to '--model'.\n");
+	printf("--compression \t\t\t string:'none' [none, gzip, zstd]\t compresses the requests (if built with zlib/zstd), and accepts compressed responses.\n");
+	printf("--compression-level \t\t int:0 [>=0] \t\t compression level (0: the algorithm's default).\n");
+	printf("--compression-min-size \t\t int:32768 [>=0] \t in bytes, requests smaller than this are sent uncompressed.\n");
+	printf("--format \t\t\t string:NULL \t\t 'json', or a JSON schema, the response must follow. Checked as it streams: a response not valid is stopped.\n");
+	printf("--stop \t\t\t\t string:NULL \t\t sequence that ends the response (not included). Can be repeated (max. 16).\n");
+	printf("--max-chars \t\t\t int:0 [>=0] \t\t max. chars of the response (0: no limit). Reached, the generation is stopped.\n");
+	printf("--max-time \t\t\t int:0 [>=0] \t\t in milliseconds, max. time of the response (0: no limit). Reached, the generation is stopped.\n");
 	printf("--response-speed \t\t int:0 [>=0] \t\t in microseconds, if > 0, the responses will be sending out to stdout at the interval set up.\n");
 	printf("--socket-conn-to \t\t int:5 [>=0] \t\t in seconds, sets up the connection time out.\n");
 	printf("--socket-send-to \t\t int:5 [>=0] \t\t in seconds, sets up the sending time out.\n");
 	printf("--socket-recv-to \t\t int:15 [>=0] \t\t in seconds, sets up the receiving time out.\n");
+	printf("--load-timeout \t\t\t int:120 [>=1] \t\t in seconds, sets up the receiving time out when loading the model.\n");
+	printf("--warm-up \t\t\t N/A:false \t\t starts loading the model while the query is being read.\n");
+	printf("--retry-attempts \t\t int:1 [>=1] \t\t max. attempts per query when the connection fails or the response is cut. Retries continue the response already received.\n");
+	printf("--retry-backoff \t\t int:500 [>=0] \t\t in milliseconds, initial delay between attempts (doubled, and jittered, on every retry).\n");
 	printf("--api-key \t\t\t string:NULL \t\t sets the API key.\n");
 	printf("--model \t\t\t string:NULL \t\t model to use.\n");
-	printf("--think \t\t\t string:\"false\" [false, true, low, medium, high, max]\t\t sets the thinking-level for the model.\n");
+	printf("--think \t\t\t string:\"false\" [false, true, low, medium, high]\t\t sets the thinking-level for the model.\n");
 	printf("--temperature \t\t\t double:0.5 [>=0] \t sets the temperature parameter.\n");
 	printf("--seed \t\t\t\t int:0 [>=0] \t\t sets the seed parameter.\n");
 	printf("--repeat-last-n \t\t int:64 [>=-1] \t\t sets the repeat_last_n parameter.\n");
@@ -125,6 +211,11 @@ static void show_help(char *programName){
 	printf("--system-role-file \t\t string:NULL \t\t sets the path to the file that include the system role.\n");
 	printf("--context-file \t\t\t string:NULL \t\t file where the interactions (except the queries ended with ';') will be stored.\n");
 	printf("--static-context-file \t\t string:NULL \t\t file where the interactions included into it (separated by '\\t') will be include (statically) as interactions in every query.\n");
+	printf("--static-context-index \t\t string:NULL \t\t index file (built if missing or outdated) of the static context embeddings. Only the most relevant interactions are included.\n");
+	printf("--static-context-top-k \t\t int:4 [>=1] \t\t interactions of the static context included when '--static-context-index' is set.\n");
+	printf("--embed-model \t\t\t string:NULL \t\t model used for embedding the static context and the queries.\n");
+	printf("--generate \t\t\t N/A:false \t\t uses '/api/generate', carrying the conversation as the tokens context returned by the server.\n");
+	printf("--generate-context-file \t string:NULL \t\t file where the tokens context of '--generate' is stored (binary).\n");
 	printf("--tools-file \t\t\t string:NULL \t\t file where the tools to be incorporated to the interactions are included.\n");
 	printf("--image-file \t\t\t string:NULL \t\t Image file to attach to the query.\n");
 	printf("--color-font-response \t\t string:'00;00;00' \t in ANSI format, set the color used for responses.\n");
@@ -145,6 +236,51 @@ static void show_help(char *programName){
 	printf("\nSee https://github.com/lucho-a/ollama-c-lient for a full description & more examples.\n\n");
 }
 
+/*
+ * stdin redirected from a file is mapped (private: only the page of the trailing '\n' is copied when it's cut),
+ * over an anonymous mapping one byte longer, so the input is null-terminated even when its size fills the last page.
+ * Pipes are read in large blocks into a buffer doubled as needed.
+ */
+static char *read_input(int fd, size_t *mapped){
+	struct stat st;
+	*mapped=0;
+	if(fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0 && lseek(fd, 0, SEEK_CUR)==0){
+		long pageSize=sysconf(_SC_PAGESIZE);
+		size_t size=((st.st_size+1+pageSize-1)/pageSize)*pageSize;
+		char *area=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(area!=MAP_FAILED){
+			if(mmap(area, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0)!=MAP_FAILED){
+				madvise(area, st.st_size, MADV_SEQUENTIAL);
+				*mapped=size;
+				return area;
+			}
+			munmap(area, size);
+		}
+	}
+	size_t len=0, size=INPUT_BLOCK_SIZE;
+	char *input=malloc(size);
+	if(input==NULL) return NULL;
+	ssize_t bytesRead=0;
+	while((bytesRead=read(fd, input+len, size-len-1))!=0){
+		if(bytesRead<0){
+			if(errno==EINTR && !oclCanceled) continue;
+			break;
+		}
+		len+=bytesRead;
+		if(size-len-1<INPUT_BLOCK_SIZE/2){
+			char *newInput=realloc(input, size*2);
+			if(newInput==NULL){
+				free(input);
+				return NULL;
+			}
+			input=newInput;
+			size*=2;
+		}
+	}
+	input[len]=0;
+	return input;
+}
+
 static int close_program(bool finishWithErrors){
 	oclCanceled=true;
 	if(ocl) OCl_free(ocl);
@@ -159,7 +295,8 @@ static int close_program(bool finishWithErrors){
 	po.ocl.systemRoleFile=NULL;
 	free(po.ocl.toolsFile);
 	po.ocl.toolsFile=NULL;
-	free(sm.input);
+	if(sm.inputMapped>0) munmap(sm.input, sm.inputMapped);
+	else free(sm.input);
 	sm.input=NULL;
 	for(int i=0;i<toolsRecv;i++) free(toolsResponses[i]);
 	if(isatty(fileno(stdout))) fputs("\x1b[0m",stdout);
@@ -168,6 +305,45 @@ static int close_program(bool finishWithErrors){
 	exit(EXIT_SUCCESS);
 }
 
+static void output_write(int fd, char const *buffer, size_t len){
+	fflush((fd==STDERR_FILENO)?stderr:stdout);
+	size_t totalBytesWritten=0;
+	while(totalBytesWritten<len){
+		ssize_t bytesWritten=write(fd, buffer+totalBytesWritten, len-totalBytesWritten);
+		if(bytesWritten<0){
+			if(errno==EINTR) continue;
+			return;
+		}
+		totalBytesWritten+=bytesWritten;
+	}
+}
+
+/*
+ * '--response-speed' keeps its meaning (microseconds per char), but the chars are released in batches, once per
+ * OUTPUT_TICK_US, against absolute deadlines. So, one write() per tick instead of one fputc()+fflush()+usleep() per char.
+ */
+static void output_paced_write(int fd, char const *buffer, size_t len, bool stopOnCancel){
+	if(po.responseSpeed<=0){
+		output_write(fd, buffer, len);
+		return;
+	}
+	size_t batch=OUTPUT_TICK_US/po.responseSpeed;
+	if(batch==0) batch=1;
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	size_t pos=0;
+	while(pos<len && !(stopOnCancel && oclCanceled)){
+		size_t n=(len-pos<batch)?len-pos:batch;
+		while(pos+n<len && (buffer[pos+n] & 0xC0)==0x80) n++;
+		long int delay=n*po.responseSpeed;
+		deadline.tv_sec+=(deadline.tv_nsec/1000+delay)/1000000;
+		deadline.tv_nsec=((deadline.tv_nsec/1000+delay)%1000000)*1000;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)==EINTR && !(stopOnCancel && oclCanceled));
+		output_write(fd, buffer+pos, n);
+		pos+=n;
+	}
+}
+
 static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int msgType){
 	char sdterrMsg[1024]="";
 	switch(msgType){
@@ -198,11 +374,7 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 	if(msgType==INFO_MSG){
 		fputs(sdterrMsg,stderr);
 	}else{
-		for(size_t i=0;i<strlen(sdterrMsg);i++){
-			fputc(sdterrMsg[i],stderr);
-			fflush(stderr);
-			usleep(po.responseSpeed);
-		}
+		output_paced_write(STDERR_FILENO, sdterrMsg, strlen(sdterrMsg), false);
 	}
 	if(exitProgram) close_program(true);
 	}
@@ -221,6 +393,23 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 		}
 	}
 
+	static void print_branches_info(char const *label, OCl_race_branch const *branches, int cantBranches){
+		char buffer[1024]="";
+		for(int i=0;i<cantBranches;i++){
+			OCl_race_branch const *branch=&branches[i];
+			char state[64]="";
+			if(branch->winner) snprintf(state, sizeof(state), "winner");
+			else if(branch->canceled) snprintf(state, sizeof(state), "canceled");
+			else if(branch->result<0) snprintf(state, sizeof(state), "error (%d)", branch->result);
+			else snprintf(state, sizeof(state), "finished");
+			snprintf(buffer,1024,"- %s '%s%s%s': %s. First token: %.4fs. Elapsed: %.4fs. Tokens: %d (%.4f/s)", label
+					,(branch->model!=NULL)?branch->model:po.ocl.model, (branch->serverAddr!=NULL)?"@":""
+					,(branch->serverAddr!=NULL)?branch->serverAddr:"", state, branch->firstToken, branch->elapsed
+					,branch->evalCount, branch->tokensPerSec);
+			print_msg_to_stderr(buffer,"",false,INFO_MSG);
+		}
+	}
+
 	static void print_response_info(){
 		char buffer[1024]="";
 		snprintf(buffer,1024,"\n\n- Time spent loading the model (load_duration): %.4fs",OCL_get_response_load_duration(ocl));
@@ -239,65 +428,186 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 		print_msg_to_stderr(buffer,"",false,INFO_MSG);
 		snprintf(buffer,1024,"- Characters in content: %d",OCL_get_response_chars_content(ocl));
 		print_msg_to_stderr(buffer,"",false,INFO_MSG);
+		OCl_warmup_stats stats;
+		if(po.warmUp && OCl_warmup_get_stats(ocl, po.ocl.model, &stats)==OCL_RETURN_OK && stats.loads>0){
+			snprintf(buffer,1024,"- Time spent by the warm-up loading the model: %.4fs",stats.lastLoadTime);
+			print_msg_to_stderr(buffer,"",false,INFO_MSG);
+		}
+		if(tq.stalls>0){
+			snprintf(buffer,1024,"- Receiving paused by the output (render stalls): %lu",tq.stalls);
+			print_msg_to_stderr(buffer,"",false,INFO_MSG);
+		}
+		char const *stopReasons[]={"","stop sequence","max. chars","max. time"};
+		if(OCL_get_response_stop_reason(ocl)!=OCL_STOP_NONE){
+			snprintf(buffer,1024,"- Generation stopped by the client: %s",stopReasons[OCL_get_response_stop_reason(ocl)]);
+			print_msg_to_stderr(buffer,"",false,INFO_MSG);
+		}
 		snprintf(buffer,1024,"- Response size: %.2f kb",OCL_get_response_size(ocl)/1024.0);
+		print_branches_info("Race branch", po.race, po.cantRace);
+		print_branches_info("Ensemble member", po.ensemble, po.cantEnsemble);
 	}
 
-	char *parse_output(const char *in, bool parse, bool removeChars){
-		char buffer[5]="";
-		char *buff=malloc(strlen(in)+1);
-		memset(buff,0,strlen(in)+1);
-		int cont=0;
-		for(size_t i=0;i<strlen(in);i++){
-			if(parse){
-				if(in[i]=='\\'){
-					switch(in[i+1]){
-					case 'n':
-						buff[cont++]='\n';
-						break;
-					case 'f':
-						buff[cont++]='\f';
-						break;
-					case 'r':
-						buff[cont++]='\r';
-						break;
-					case 't':
-						buff[cont++]='\r';
-						break;
-					case '\\':
-						buff[cont++]='\\';
-						break;
-					case '"':
-						buff[cont++]='\"';
-						break;
-					case 'u':
-						snprintf(buffer,5,"%c%c%c%c",in[i+2],in[i+3],in[i+4],in[i+5]);
-						buff[cont++]=(int)strtol(buffer,NULL,16);
-						i+=4;
-						break;
-					default:
-						break;
-					}
-					i++;
-					continue;
+	static int hex_quad(char const *hex){
+		int value=0;
+		for(int i=0;i<4;i++){
+			char c=hex[i];
+			int digit=(c>='0' && c<='9')?c-'0':(c>='a' && c<='f')?c-'a'+10:(c>='A' && c<='F')?c-'A'+10:-1;
+			if(digit<0) return -1;
+			value=(value<<4)|digit;
+		}
+		return value;
+	}
+
+	static size_t utf8_encode(unsigned int cp, char *out){
+		if(cp<0x80){
+			out[0]=cp;
+			return 1;
+		}
+		if(cp<0x800){
+			out[0]=0xc0|(cp>>6);
+			out[1]=0x80|(cp&0x3f);
+			return 2;
+		}
+		if(cp<0x10000){
+			out[0]=0xe0|(cp>>12);
+			out[1]=0x80|((cp>>6)&0x3f);
+			out[2]=0x80|(cp&0x3f);
+			return 3;
+		}
+		out[0]=0xf0|(cp>>18);
+		out[1]=0x80|((cp>>12)&0x3f);
+		out[2]=0x80|((cp>>6)&0x3f);
+		out[3]=0x80|(cp&0x3f);
+		return 4;
+	}
+
+	static void output_put(char *out, size_t *cont, unsigned char c, bool removeChars){
+		if(removeChars && (excludeChars[c>>6]&(1ULL<<(c&63)))) return;
+		out[(*cont)++]=c;
+	}
+
+	/*
+	 * Decodes a JSON string (v.gr. the tokens) into UTF-8. With a decoder, it works across calls: an escape cut at the
+	 * end of 'in' (or a high surrogate waiting for its low half) is carried over to the next one. Without it, 'in' is
+	 * taken as complete. Broken surrogates are written as U+FFFD.
+	 */
+	char *parse_output(struct JsonDecoder *decoder, const char *in, bool parse, bool removeChars){
+		struct JsonDecoder oneShot={0};
+		if(decoder==NULL) decoder=&oneShot;
+		size_t inLen=strlen(in), len=inLen;
+		char *work=NULL;
+		char const *src=in;
+		if(decoder->pendingLen>0){
+			len=decoder->pendingLen+inLen;
+			if((work=malloc(len+1))==NULL) return NULL;
+			memcpy(work, decoder->pending, decoder->pendingLen);
+			memcpy(work+decoder->pendingLen, in, inLen+1);
+			src=work;
+			decoder->pendingLen=0;
+		}
+		// Escapes only shrink; at most a pending U+FFFD (3 bytes) is added.
+		char *buff=malloc(len+8);
+		if(buff==NULL){
+			free(work);
+			return NULL;
+		}
+		size_t i=0, cont=0;
+		while(i<len){
+			if(!parse || src[i]!='\\'){
+				if(decoder->highSurrogate!=0){
+					cont+=utf8_encode(0xfffd, buff+cont);
+					decoder->highSurrogate=0;
 				}
+				output_put(buff, &cont, src[i++], removeChars);
+				continue;
 			}
-			if(removeChars){
-				bool ok=true;
-				for(size_t j=0;j<strlen(po.charsToExclude);j++){
-					if(in[i]==po.charsToExclude[j]){
-						ok=false;
-						break;
+			if(i+1>=len) break;
+			if(src[i+1]=='u'){
+				if(i+6>len) break;
+				int cp=hex_quad(src+i+2);
+				if(cp<0){
+					output_put(buff, &cont, src[i++], removeChars);
+					continue;
+				}
+				i+=6;
+				if(cp>=0xdc00 && cp<=0xdfff && decoder->highSurrogate!=0){
+					cp=0x10000+((decoder->highSurrogate-0xd800)<<10)+(cp-0xdc00);
+					decoder->highSurrogate=0;
+				}else{
+					if(decoder->highSurrogate!=0){
+						cont+=utf8_encode(0xfffd, buff+cont);
+						decoder->highSurrogate=0;
+					}
+					if(cp>=0xd800 && cp<=0xdbff){
+						decoder->highSurrogate=cp;
+						continue;
 					}
+					if(cp>=0xdc00 && cp<=0xdfff) cp=0xfffd;
 				}
-				if(ok) buff[cont++]=in[i];
+				if(cp==0) continue;
+				if(cp<0x80) output_put(buff, &cont, cp, removeChars);
+				else cont+=utf8_encode(cp, buff+cont);
 				continue;
 			}
-			buff[cont++]=in[i];
+			if(decoder->highSurrogate!=0){
+				cont+=utf8_encode(0xfffd, buff+cont);
+				decoder->highSurrogate=0;
+			}
+			char c=src[i+1];
+			switch(c){
+			case 'n':
+				c='\n';
+				break;
+			case 'f':
+				c='\f';
+				break;
+			case 'r':
+				c='\r';
+				break;
+			case 't':
+				c='\t';
+				break;
+			case 'b':
+				c='\b';
+				break;
+			default:
+				// '\\', '"', '/' and unknown ones, as they are.
+				break;
+			}
+			output_put(buff, &cont, c, removeChars);
+			i+=2;
+		}
+		if(i<len){
+			if(decoder==&oneShot){
+				while(i<len) output_put(buff, &cont, src[i++], removeChars);
+			}else{
+				decoder->pendingLen=len-i;
+				memcpy(decoder->pending, src+i, decoder->pendingLen);
+			}
 		}
+		if(decoder==&oneShot && decoder->highSurrogate!=0) cont+=utf8_encode(0xfffd, buff+cont);
 		buff[cont]=0;
+		free(work);
 		return buff;
 	}
 
+	// The buffered output (a single stream), decoded with its stream's decoder.
+	static void output_flush(bool chunked, bool done){
+		struct JsonDecoder *decoder=&outputDecoders[chunkingsThinking];
+		char *parsedOut=parse_output(decoder, chunkings, chunked || po.stdoutParsed, true);
+		if(done) *decoder=(struct JsonDecoder){0};
+		if(parsedOut!=NULL){
+			if(chunked){
+				output_write(STDOUT_FILENO, parsedOut, strlen(parsedOut));
+			}else{
+				output_paced_write(STDOUT_FILENO, parsedOut, strlen(parsedOut), true);
+			}
+		}
+		free(parsedOut);
+		chunkings[0]=0;
+		chunkingsLen=0;
+	}
+
 	static void print_response(char const *token, bool done, int responseType){
 		if(responseType==OCL_TOOL_TYPE){
 			if(po.executeTools){
@@ -334,18 +644,19 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 					strcat(cmd, argums[i]);
 				}
 				FILE *fp=popen(cmd, "r");
-				char c=0;
-				int cont=0, initialBuffer=1024*10;
-				toolsResponses[toolsRecv]=malloc(initialBuffer);
-				memset(toolsResponses[toolsRecv],0,initialBuffer);
-				while ((c=fgetc(fp)) != EOF && !oclCanceled) {
-					if(cont>=initialBuffer) toolsResponses[toolsRecv]=realloc(toolsResponses[toolsRecv],initialBuffer*=2);
-					if(!po.stdoutJson){
-						usleep(po.responseSpeed);
-						fputc(c, stdout);
-						fflush(stdout);
+				size_t cont=0, bytesRead=0, bufferSize=1024*10;
+				toolsResponses[toolsRecv]=malloc(bufferSize);
+				toolsResponses[toolsRecv][0]=0;
+				char block[1024*4];
+				while((bytesRead=fread(block, 1, sizeof(block), fp))>0 && !oclCanceled){
+					if(cont+bytesRead+1>bufferSize){
+						while(cont+bytesRead+1>bufferSize) bufferSize*=2;
+						toolsResponses[toolsRecv]=realloc(toolsResponses[toolsRecv],bufferSize);
 					}
-					toolsResponses[toolsRecv][cont++]=c;
+					memcpy(toolsResponses[toolsRecv]+cont, block, bytesRead);
+					cont+=bytesRead;
+					toolsResponses[toolsRecv][cont]=0;
+					if(!po.stdoutJson) output_paced_write(STDOUT_FILENO, block, bytesRead, true);
 				}
 				toolsRecv++;
 				pclose(fp);
@@ -357,6 +668,15 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 			}
 			return;
 		}
+		// The stream changed: what's buffered of the previous one is written (before the marks), and its decoder reset.
+		if((responseType==OCL_THINKING_TYPE)!=chunkingsThinking){
+			if(chunkingsLen>0){
+				output_flush(po.stdoutChunked && !po.stdoutJson, true);
+			}else{
+				outputDecoders[chunkingsThinking]=(struct JsonDecoder){0};
+			}
+			chunkingsThinking=(responseType==OCL_THINKING_TYPE);
+		}
 		if(responseType==OCL_THINKING_TYPE && !thinking && !po.stdoutJson){
 			thinking=true;
 			fputs("(Thinking...)\n", stdout);
@@ -367,45 +687,100 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 			fputs("(Stop thinking...)\n", stdout);
 			fflush(stdout);
 		}
+		size_t tokenLen=strlen(token);
 		if(po.stdoutChunked && !po.stdoutJson){
 			if(responseType==OCL_THINKING_TYPE && !po.showThoughts) return;
-			if((strstr(token, "\\n") && ((int) strlen(chunkings))>po.stdoutBufferSize) || done){
-				char *parsedOut=parse_output(chunkings, true, true);
-				fputs(parsedOut, stdout);
-				fflush(stdout);
-				memset(chunkings,0,8196);
-				free(parsedOut);
-				parsedOut=NULL;
+			if((strstr(token, "\\n") && ((int) chunkingsLen)>po.stdoutBufferSize) || done
+					|| chunkingsLen+tokenLen>=CHUNKINGS_SIZE){
+				output_flush(true, done);
 			}
-			strncat(chunkings,token,8196-1);
+			if(tokenLen>=CHUNKINGS_SIZE) tokenLen=CHUNKINGS_SIZE-1;
+			memcpy(chunkings+chunkingsLen, token, tokenLen);
+			chunkingsLen+=tokenLen;
+			chunkings[chunkingsLen]=0;
 			return;
 		}
 		if(po.responseSpeed==0) return;
 		if(responseType==OCL_THINKING_TYPE && !po.showThoughts) return;
-		strncat(chunkings,token,8196-1);
-		if((int)strlen(chunkings)>po.stdoutBufferSize || done){
-			if(po.stdoutParsed){
-				char *parsedOut=parse_output(chunkings, true, true);
-				for(size_t i=0;i<strlen(parsedOut) && !oclCanceled;i++){
-					usleep(po.responseSpeed);
-					fputc(parsedOut[i], stdout);
-					fflush(stdout);
-				}
-				free(parsedOut);
-				parsedOut=NULL;
-			}else{
-				char *parsedOut=parse_output(chunkings, false, true);
-				for(size_t i=0;i<strlen(parsedOut) && !oclCanceled;i++){
-					usleep(po.responseSpeed);
-					fputc(parsedOut[i], stdout);
-					fflush(stdout);
-				}
-				free(parsedOut);
-				parsedOut=NULL;
+		if(tokenLen>=CHUNKINGS_SIZE-chunkingsLen) tokenLen=CHUNKINGS_SIZE-chunkingsLen-1;
+		memcpy(chunkings+chunkingsLen, token, tokenLen);
+		chunkingsLen+=tokenLen;
+		chunkings[chunkingsLen]=0;
+		if((int) chunkingsLen>po.stdoutBufferSize || done || chunkingsLen>=CHUNKINGS_SIZE-1) output_flush(false, done);
+		return;
+	}
+
+	static void token_queue_write(size_t pos, void const *src, size_t len){
+		size_t idx=pos&(TOKEN_QUEUE_SIZE-1), first=TOKEN_QUEUE_SIZE-idx;
+		if(first>len) first=len;
+		memcpy(tq.ring+idx, src, first);
+		memcpy(tq.ring, (char const *) src+first, len-first);
+	}
+
+	static void token_queue_read(size_t pos, void *dst, size_t len){
+		size_t idx=pos&(TOKEN_QUEUE_SIZE-1), first=TOKEN_QUEUE_SIZE-idx;
+		if(first>len) first=len;
+		memcpy(dst, tq.ring+idx, first);
+		memcpy((char *) dst+first, tq.ring, len-first);
+	}
+
+	static void token_queue_push(char const *token, size_t len, bool done, int responseType){
+		struct TokenSpan span={len, responseType, done};
+		size_t need=sizeof(span)+len;
+		size_t head=atomic_load_explicit(&tq.head, memory_order_relaxed);
+		// A stall lasts from the ring getting full until it's half empty again: counted once, not per token waiting.
+		if(TOKEN_QUEUE_SIZE-(head-atomic_load_explicit(&tq.tail, memory_order_acquire))>=TOKEN_QUEUE_SIZE/2)
+			tq.stalled=false;
+		while(TOKEN_QUEUE_SIZE-(head-atomic_load_explicit(&tq.tail, memory_order_acquire))<need){
+			// Ring full: stop reading the socket until the render thread frees room.
+			if(!tq.stalled) tq.stalls++;
+			tq.stalled=true;
+			atomic_store(&tq.producerWaiting, true);
+			if(TOKEN_QUEUE_SIZE-(head-atomic_load(&tq.tail))>=need){
+				if(!atomic_exchange(&tq.producerWaiting, false)) while(sem_wait(&tq.room)==-1 && errno==EINTR);
+				break;
 			}
-			memset(chunkings,0,8196);
+			while(sem_wait(&tq.room)==-1 && errno==EINTR);
 		}
-		return;
+		token_queue_write(head, &span, sizeof(span));
+		token_queue_write(head+sizeof(span), token, len);
+		atomic_store_explicit(&tq.head, head+need, memory_order_release);
+		sem_post(&tq.spans);
+	}
+
+	static void enqueue_response(char const *token, bool done, int responseType){
+		size_t len=strlen(token);
+		if(responseType==OCL_TOOL_TYPE && len>TOKEN_SPAN_MAX) len=TOKEN_SPAN_MAX;
+		do{
+			size_t spanLen=(len>TOKEN_SPAN_MAX)?TOKEN_SPAN_MAX:len;
+			token_queue_push(token, spanLen, done && spanLen==len, responseType);
+			token+=spanLen;
+			len-=spanLen;
+		}while(len>0);
+	}
+
+	static void *render_responses(void *arg){
+		(void) arg;
+		char *token=NULL;
+		size_t tokenSize=0;
+		while(true){
+			while(sem_wait(&tq.spans)==-1 && errno==EINTR);
+			size_t tail=atomic_load_explicit(&tq.tail, memory_order_relaxed);
+			struct TokenSpan span;
+			token_queue_read(tail, &span, sizeof(span));
+			if(span.responseType<0) break;
+			if(span.len+1>tokenSize){
+				tokenSize=span.len+1;
+				token=realloc(token, tokenSize);
+			}
+			token_queue_read(tail+sizeof(span), token, span.len);
+			token[span.len]=0;
+			atomic_store(&tq.tail, tail+sizeof(span)+span.len);
+			if(atomic_exchange(&tq.producerWaiting, false)) sem_post(&tq.room);
+			print_response(token, span.done, span.responseType);
+		}
+		free(token);
+		pthread_exit(NULL);
 	}
 
 	void create_models_json(char models[][512], int cantModels){
@@ -530,15 +905,50 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 		free(inParsed);
 	}
 
+	// 'model', 'model@addr', 'model@addr:port' or 'model@[IPv6]:port'.
+	static void parse_branch(char *spec, OCl_race_branch *branch){
+		char *addr=strchr(spec, '@'), *port=NULL;
+		branch->model=spec;
+		if(addr!=NULL){
+			*addr++=0;
+			if(addr[0]=='['){
+				addr++;
+				if((port=strchr(addr, ']'))!=NULL) *port++=0;
+				if(port!=NULL && port[0]==':') port++;
+			}else{
+				if((port=strrchr(addr, ':'))!=NULL) *port++=0;
+			}
+			branch->serverAddr=addr;
+			if(port!=NULL && port[0]!=0){
+				char *tail=NULL;
+				branch->serverPort=strtol(port, &tail, 10);
+				if(branch->serverPort<1 || branch->serverPort>65535 || tail[0]!=0)
+					print_msg_to_stderr("Branch port not valid.","",true, ERROR_MSG);
+			}
+		}
+		if(branch->model[0]==0) branch->model=NULL;
+	}
+
 	void *start_sending_message(void *arg){
 		struct SendingMessage *sm=arg;
-		int retVal=OCl_send_chat(ocl,sm->input,sm->imageFile ,print_response);
-		if(retVal!=OCL_RETURN_OK){
+		int retVal=0;
+		if(po.cantRace>0)
+			retVal=OCl_race(ocl, sm->input, sm->imageFile, po.race, po.cantRace, po.racePolicy, po.raceQuorum, enqueue_response);
+		else if(po.cantEnsemble>0)
+			retVal=OCl_ensemble(ocl, sm->input, sm->imageFile, po.ensemble, po.cantEnsemble, po.ensemblePrompt, enqueue_response);
+		else
+			retVal=OCl_send_chat(ocl,sm->input,sm->imageFile ,enqueue_response);
+		if(retVal<0){
 			if(oclCanceled) printf("\n");
 			oclCanceled=true;
 			print_msg_to_stderr(OCL_error_handling(ocl, retVal),"",false, ERROR_MSG);
 			pthread_exit("-1");
 		}
+		if(po.ocl.generate && po.ocl.generateContextFile!=NULL && !oclCanceled
+				&& (retVal=OCl_save_generate_context(ocl, po.ocl.generateContextFile))!=OCL_RETURN_OK){
+			print_msg_to_stderr(OCL_error_handling(ocl, retVal),"",false, ERROR_MSG);
+			pthread_exit("-1");
+		}
 		pthread_exit(NULL);
 	}
 
@@ -550,25 +960,18 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 		signal(SIGSEGV, signal_handler);
 		po.responseSpeed=RESPONSE_SPEED;
 		po.stdoutBufferSize=MIN_STDOUT_BUFFER_SIZE;
+		po.retryAttempts=OCL_RETRY_MAX_ATTEMPTS;
+		po.retryBackoff=OCL_RETRY_BACKOFF_MS;
+		po.racePolicy=OCL_RACE_FIRST_TOKEN;
+		po.raceQuorum=2;
+		po.loadTimeout=OCL_LOAD_TIMEOUT_S;
+		po.ocl.staticContextTopK=OCL_STATIC_CONTEXT_TOP_K;
+		po.ocl.compressionMinSize=OCL_COMPRESSION_MIN_SIZE;
 		snprintf(po.colors.colorFontResponse,16,"\x1b[0m");
 		snprintf(po.colors.colorFontError,16,"\x1b[0m");
 		snprintf(po.colors.colorFontSystem,16,"\x1b[0m");
 		snprintf(po.colors.colorFontInfo,16,"\x1b[0m");
 		snprintf(po.ocl.think,16,"false");
-		if(!isatty(fileno(stdin))){
-			char *line=NULL;
-			size_t len=0;
-			long int chars=0;
-			sm.input=malloc(1);
-			sm.input[0]=0;
-			while((chars=getline(&line, &len, stdin))!=-1){
-				sm.input=realloc(sm.input,strlen(sm.input)+chars+1);
-				strcat(sm.input,line);
-			}
-			sm.input[strlen(sm.input)-1]=0;
-			free(line);
-			line=NULL;
-		}
 		snprintf(program,512,"%s",argv[0]);
 		int retVal=0;
 		if((retVal=OCl_init())!=OCL_RETURN_OK)
@@ -584,7 +987,7 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 			}
 			if(strcmp(argv[i],"--server-addr")==0){
 				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
-				snprintf(po.ocl.serverAddr,16,"%s",argv[i+1]);
+				snprintf(po.ocl.serverAddr,512,"%s",argv[i+1]);
 				i++;
 				continue;
 			}
@@ -594,6 +997,113 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 				i++;
 				continue;
 			}
+			if(strcmp(argv[i],"--endpoint")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				if(po.ocl.cantEndpoints>=16) print_msg_to_stderr("Too many endpoints.","",true, ERROR_MSG);
+				po.ocl.endpoints[po.ocl.cantEndpoints++]=argv[i+1];
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--endpoint-policy")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char const *policies[]={"round-robin","least-outstanding","latency","model-affinity"};
+				po.ocl.endpointPolicy=-1;
+				for(int j=0;j<4;j++) if(strcmp(argv[i+1],policies[j])==0) po.ocl.endpointPolicy=OCL_POLICY_ROUND_ROBIN+j;
+				if(po.ocl.endpointPolicy<0) print_msg_to_stderr("Endpoint policy not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--race")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				if(po.cantRace>=OCL_RACE_MAX_BRANCHES) print_msg_to_stderr("Too many race branches.","",true, ERROR_MSG);
+				parse_branch(argv[i+1], &po.race[po.cantRace++]);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--race-policy")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char const *policies[]={"first-token","first-done","quorum"};
+				po.racePolicy=-1;
+				for(int j=0;j<3;j++) if(strcmp(argv[i+1],policies[j])==0) po.racePolicy=OCL_RACE_FIRST_TOKEN+j;
+				if(po.racePolicy<0) print_msg_to_stderr("Race policy not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--race-quorum")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.raceQuorum=strtol(argv[i+1], &tail, 10);
+				if(po.raceQuorum<1 || tail[0]!=0) print_msg_to_stderr("Race quorum not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--ensemble")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				if(po.cantEnsemble>=OCL_RACE_MAX_BRANCHES) print_msg_to_stderr("Too many ensemble members.","",true, ERROR_MSG);
+				parse_branch(argv[i+1], &po.ensemble[po.cantEnsemble++]);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--ensemble-prompt")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				po.ensemblePrompt=argv[i+1];
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--compression")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char const *algorithms[]={"none","gzip","zstd"};
+				po.ocl.compression=-1;
+				for(int j=0;j<3;j++) if(strcmp(argv[i+1],algorithms[j])==0) po.ocl.compression=OCL_COMPRESSION_NONE+j;
+				if(po.ocl.compression<0) print_msg_to_stderr("Compression not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--compression-level")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.ocl.compressionLevel=strtol(argv[i+1], &tail, 10);
+				if(po.ocl.compressionLevel<0 || tail[0]!=0) print_msg_to_stderr("Compression level not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--compression-min-size")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.ocl.compressionMinSize=strtol(argv[i+1], &tail, 10);
+				if(po.ocl.compressionMinSize<0 || tail[0]!=0) print_msg_to_stderr("Compression min. size not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--format")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				po.ocl.format=argv[i+1];
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--stop")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				if(po.ocl.cantStops>=OCL_MAX_STOP_SEQUENCES) print_msg_to_stderr("Too many stop sequences.","",true, ERROR_MSG);
+				po.ocl.stops[po.ocl.cantStops++]=argv[i+1];
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--max-chars")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.ocl.maxChars=strtol(argv[i+1], &tail, 10);
+				if(po.ocl.maxChars<0 || tail[0]!=0) print_msg_to_stderr("Max. chars not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--max-time")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.ocl.maxTime=strtol(argv[i+1], &tail, 10);
+				if(po.ocl.maxTime<0 || tail[0]!=0) print_msg_to_stderr("Max. time not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
 			if(strcmp(argv[i],"--socket-conn-to")==0){
 				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
 				snprintf(po.ocl.socketConnTo,8,"%s",argv[i+1]);
@@ -612,6 +1122,34 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 				i++;
 				continue;
 			}
+			if(strcmp(argv[i],"--retry-attempts")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.retryAttempts=strtol(argv[i+1], &tail, 10);
+				if(po.retryAttempts<1 || tail[0]!=0) print_msg_to_stderr("Retry attempts not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--retry-backoff")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.retryBackoff=strtol(argv[i+1], &tail, 10);
+				if(po.retryBackoff<0 || tail[0]!=0) print_msg_to_stderr("Retry backoff not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--load-timeout")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.loadTimeout=strtol(argv[i+1], &tail, 10);
+				if(po.loadTimeout<1 || tail[0]!=0) print_msg_to_stderr("Load timeout not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--warm-up")==0){
+				po.warmUp=true;
+				continue;
+			}
 			if(strcmp(argv[i],"--response-speed")==0){
 				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
 				char *tail=NULL;
@@ -743,6 +1281,36 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 				i++;
 				continue;
 			}
+			if(strcmp(argv[i],"--generate")==0){
+				po.ocl.generate=true;
+				continue;
+			}
+			if(strcmp(argv[i],"--generate-context-file")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				po.ocl.generateContextFile=argv[i+1];
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--static-context-index")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				po.ocl.staticContextIndex=argv[i+1];
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--static-context-top-k")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				char *tail=NULL;
+				po.ocl.staticContextTopK=strtol(argv[i+1], &tail, 10);
+				if(po.ocl.staticContextTopK<1 || tail[0]!=0) print_msg_to_stderr("Static context top-k not valid.","",true, ERROR_MSG);
+				i++;
+				continue;
+			}
+			if(strcmp(argv[i],"--embed-model")==0){
+				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
+				po.ocl.embedModel=argv[i+1];
+				i++;
+				continue;
+			}
 			if(strcmp(argv[i],"--context-file")==0){
 				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
 				po.ocl.contextFile=malloc(strlen(argv[i+1])+1);
@@ -825,6 +1393,10 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 			if(strcmp(argv[i],"--exclude-chars")==0){
 				if(!argv[i+1]) print_msg_to_stderr("Argument missing: ",argv[i],true, ERROR_MSG);
 				snprintf(po.charsToExclude,1024,"%s",argv[i+1]);
+				for(size_t j=0;po.charsToExclude[j]!=0;j++){
+					unsigned char c=po.charsToExclude[j];
+					excludeChars[c>>6]|=1ULL<<(c&63);
+				}
 				i++;
 				continue;
 			}
@@ -842,6 +1414,7 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 			}
 			print_msg_to_stderr(argv[i],": not a valid option",true, ERROR_MSG);
 		}
+		if(po.cantRace>0 && po.cantEnsemble>0) print_msg_to_stderr("'--race' and '--ensemble' are mutually exclusive.","",true, ERROR_MSG);
 		if((retVal=OCl_get_instance(
 				&ocl,
 				po.ocl.serverAddr,
@@ -869,6 +1442,55 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 				po.ocl.staticContextFile,
 				po.ocl.toolsFile))!=OCL_RETURN_OK)
 			print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		if((retVal=OCl_set_retry_policy(ocl, po.retryAttempts, po.retryBackoff, NULL, 0))!=OCL_RETURN_OK)
+			print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		for(int i=0;i<po.ocl.cantEndpoints;i++){
+			char *addr=po.ocl.endpoints[i], *port=NULL;
+			if(addr[0]=='['){
+				addr++;
+				if((port=strchr(addr, ']'))!=NULL) *port++=0;
+				if(port!=NULL && port[0]==':') port++;
+				if(port!=NULL && port[0]==0) port=NULL;
+			}else{
+				if((port=strrchr(addr, ':'))!=NULL) *port++=0;
+			}
+			if((retVal=OCl_add_endpoint(ocl, addr, port))!=OCL_RETURN_OK)
+				print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		}
+		if((retVal=OCl_set_endpoint_policy(ocl, po.ocl.endpointPolicy))!=OCL_RETURN_OK)
+			print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		if((retVal=OCl_set_load_timeout(ocl, po.loadTimeout))!=OCL_RETURN_OK)
+			print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		if((retVal=OCl_set_compression(ocl, po.ocl.compression, po.ocl.compressionLevel, po.ocl.compressionMinSize))!=OCL_RETURN_OK)
+			print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		if((retVal=OCl_set_format(ocl, po.ocl.format))!=OCL_RETURN_OK)
+			print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		if((retVal=OCl_set_stop(ocl, po.ocl.stops, po.ocl.cantStops))!=OCL_RETURN_OK
+				|| (retVal=OCl_set_budget(ocl, po.ocl.maxChars, po.ocl.maxTime))!=OCL_RETURN_OK)
+			print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		if(po.ocl.generate){
+			OCl_set_generate(ocl, true);
+			if(po.ocl.generateContextFile!=NULL
+					&& (retVal=OCl_load_generate_context(ocl, po.ocl.generateContextFile))!=OCL_RETURN_OK)
+				print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		}
+		if(po.ocl.staticContextIndex!=NULL && !po.showModels){
+			if((retVal=OCl_set_static_context_index(ocl, po.ocl.staticContextIndex, po.ocl.embedModel
+					, po.ocl.staticContextTopK))!=OCL_RETURN_OK)
+				print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		}
+		// The model is loaded by the scheduler while the query is being read.
+		if(po.warmUp && !po.showModels){
+			if((retVal=OCl_warmup_add(ocl, po.ocl.model, OCL_WARMUP_ALWAYS, 0, 0))!=OCL_RETURN_OK
+					|| (retVal=OCl_warmup_start(ocl))!=OCL_RETURN_OK)
+				print_msg_to_stderr("",OCL_error_handling(ocl,retVal),true, ERROR_MSG);
+		}
+		if(!isatty(fileno(stdin))){
+			if((sm.input=read_input(fileno(stdin), &sm.inputMapped))==NULL)
+				print_msg_to_stderr("Error reading the input: ",strerror(errno),true, ERROR_MSG);
+			size_t len=strlen(sm.input);
+			if(len>0 && sm.input[len-1]=='\n') sm.input[len-1]=0;
+		}
 		if(isatty(fileno(stdout))) printf("%s",po.colors.colorFontResponse);
 		if(po.showModels){
 			char models[512][512]={""};
@@ -879,11 +1501,7 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 			}else{
 				for(int i=0;i<cantModels;i++){
 					printf("  - ");
-					for(size_t j=0;j<strlen(models[i]);j++){
-						usleep(po.responseSpeed);
-						fputc(models[i][j], stdout);
-						fflush(stdout);
-					}
+					output_paced_write(STDOUT_FILENO, models[i], strlen(models[i]), true);
 					printf("\n");
 				}
 			}
@@ -891,10 +1509,17 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 			if(po.stdoutJson) po.responseSpeed=0;
 			if(po.stdoutChunked) po.stdoutParsed=true;
 			if(sm.input){
-				pthread_t tSendingMessage;
+				pthread_t tSendingMessage, tRendering;
 				void *tRetVal=NULL;
+				sem_init(&tq.spans, 0, 0);
+				sem_init(&tq.room, 0, 0);
+				pthread_create(&tRendering, NULL, render_responses, NULL);
 				pthread_create(&tSendingMessage, NULL, start_sending_message, &sm);
 				pthread_join(tSendingMessage,&tRetVal);
+				token_queue_push("", 0, true, -1);
+				pthread_join(tRendering,NULL);
+				sem_destroy(&tq.spans);
+				sem_destroy(&tq.room);
 				if(tRetVal!=NULL) close_program(true);
 				if(po.responseSpeed==0 && !oclCanceled){
 					if(po.stdoutJson){
@@ -913,12 +1538,13 @@ static void print_msg_to_stderr(char *msg, char *extraMsg, bool exitProgram, int
 								char *out=NULL;
 								if(po.showThoughts){
 									fputs("<thinking>", stdout);
-									out=parse_output(OCL_get_response_thoughts(ocl),false, true);
-									fputs(out, stdout);
+									out=parse_output(NULL, OCL_get_response_thoughts(ocl), true, true);
+									if(out!=NULL) fputs(out, stdout);
 									fputs("</thinking>\n", stdout);
+									free(out);
 								}
-								out=parse_output(OCL_get_response(ocl),false, true);
-								fputs(out, stdout);
+								out=parse_output(NULL, OCL_get_response(ocl), true, true);
+								if(out!=NULL) fputs(out, stdout);
 								fflush(stdout);
 								free(out);
 								out=NULL;
@@ -0,0 +1,748 @@
+/*
+ ============================================================================
+ Name        : ocl-bench.c
+ Author      : L. (lucho-a.github.io)
+ Copyright   : GNU General Public License v3.0
+ Description : Replay benchmark of libOCl against a local mock Ollama server
+ ============================================================================
+ */
+
+/*
+ * The mock server (OpenSSL, self-signed certificate generated on start) answers '/api/chat' with a recorded
+ * ('--replay') or synthetic NDJSON stream, paced at a token rate, grouped into HTTP chunks and split into TLS
+ * records of a given size. It runs in a forked process, so the client's figures (CPU, allocations, RSS) are only
+ * libOCl's: OCl_send_chat() is timed for every combination of the parameters' lists.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509v3.h>
+#include <openssl/pem.h>
+
+#include "../lib/libOllama-C-lient.h"
+
+#define PROGRAM_NAME					"ocl-bench"
+
+#define	BENCH_RUNS						20
+#define	BENCH_TOKENS					"2048"
+#define	BENCH_RATE						"0"
+#define	BENCH_CHUNK						"1"
+#define	BENCH_RECORD					"0"
+#define	BENCH_QUERY_SIZE				256
+#define	BENCH_MODEL						"bench"
+#define	BENCH_MAX_VALUES				16
+#define	BENCH_CERT_FILE					"/tmp/ocl-bench-cert.pem"
+
+struct BenchList{
+	int values[BENCH_MAX_VALUES];
+	int cant;
+};
+
+struct BenchOpts{
+	int runs;
+	struct BenchList tokens;
+	struct BenchList rate;
+	struct BenchList chunk;
+	struct BenchList record;
+	int querySize;
+	char const *replayFile;
+	bool csv;
+	int servePort;
+};
+
+struct BenchParams{
+	int tokens;
+	int rate;
+	int chunk;
+	int record;
+};
+
+// The NDJSON lines (each one ending with '\n') are kept in a single block.
+struct BenchStream{
+	char *data;
+	size_t *offsets;
+	int cantLines;
+};
+
+struct BenchConn{
+	SSL *ssl;
+	int socket;
+	char *buffer;
+	size_t len;
+	size_t size;
+};
+
+static struct BenchParams const *serverParams=NULL;
+static struct BenchStream const *serverStream=NULL;
+static SSL_CTX *serverCtx=NULL;
+
+/*
+ * Allocations' counting: glibc's malloc() is interposed (also counting OpenSSL's, which goes through it), only while
+ * a run is measured.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static atomic_bool countAllocs=false;
+static atomic_long cantAllocs=0;
+static atomic_long allocatedBytes=0;
+
+static void count_alloc(size_t size){
+	if(!atomic_load_explicit(&countAllocs, memory_order_relaxed)) return;
+	atomic_fetch_add_explicit(&cantAllocs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&allocatedBytes, size, memory_order_relaxed);
+}
+
+void *malloc(size_t size){
+	count_alloc(size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size){
+	count_alloc(nmemb*size);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size){
+	count_alloc(size);
+	return __libc_realloc(ptr, size);
+}
+
+static void print_usage(){
+	printf("\nUsage: %s [options]\n\n", PROGRAM_NAME);
+	printf("  --runs n           measured chats per combination (default: %d)\n", BENCH_RUNS);
+	printf("  --tokens list      response sizes, in tokens (default: %s)\n", BENCH_TOKENS);
+	printf("  --rate list        tokens per second streamed by the server, 0: unpaced (default: %s)\n", BENCH_RATE);
+	printf("  --chunk list       NDJSON lines per HTTP chunk (default: %s)\n", BENCH_CHUNK);
+	printf("  --record list      max. bytes per TLS record, 0: a record per HTTP chunk (default: %s)\n", BENCH_RECORD);
+	printf("  --query-size n     bytes of the query sent (default: %d)\n", BENCH_QUERY_SIZE);
+	printf("  --replay file      recorded '/api/chat' NDJSON stream, instead of the synthetic one ('--tokens' ignored)\n");
+	printf("  --csv              results as CSV\n");
+	printf("  --serve port       only runs the mock server (first value of every list), v.gr. for ollama-c-lient\n\n");
+	printf("Lists are comma-separated values (max. %d), v.gr. '--rate 0,50 --record 0,16'. Every combination is run.\n\n"
+			, BENCH_MAX_VALUES);
+}
+
+static void print_error(char const *msg, char const *arg){
+	fprintf(stderr, "%s: %s%s\n", PROGRAM_NAME, msg, arg);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_list(struct BenchList *list, char const *value, int min){
+	list->cant=0;
+	char const *p=value;
+	while(*p!=0){
+		if(list->cant>=BENCH_MAX_VALUES) print_error("Too many values: ", value);
+		char *tail=NULL;
+		long int v=strtol(p, &tail, 10);
+		if(tail==p || (*tail!=',' && *tail!=0) || v<min || v>INT32_MAX) print_error("Value not valid: ", value);
+		list->values[list->cant++]=v;
+		p=(*tail==',')?tail+1:tail;
+	}
+	if(list->cant==0) print_error("Value not valid: ", value);
+}
+
+static int parse_int(char const *value, int min){
+	char *tail=NULL;
+	long int v=strtol(value, &tail, 10);
+	if(tail==value || *tail!=0 || v<min || v>INT32_MAX) print_error("Value not valid: ", value);
+	return v;
+}
+
+/*
+ * Stream
+ */
+static int stream_add_line(struct BenchStream *s, size_t *size, char const *line, size_t lineLen){
+	size_t len=s->offsets[s->cantLines];
+	if(len+lineLen+1>*size){
+		size_t newSize=(*size==0)?64*1024:*size;
+		while(len+lineLen+1>newSize) newSize*=2;
+		char *data=realloc(s->data, newSize);
+		if(data==NULL) return -1;
+		s->data=data;
+		*size=newSize;
+	}
+	size_t *offsets=realloc(s->offsets, sizeof(size_t)*(s->cantLines+2));
+	if(offsets==NULL) return -1;
+	s->offsets=offsets;
+	memcpy(s->data+len, line, lineLen);
+	s->data[len+lineLen]='\n';
+	s->offsets[++s->cantLines]=len+lineLen+1;
+	return 0;
+}
+
+static int stream_init(struct BenchStream *s){
+	s->data=NULL;
+	s->cantLines=0;
+	if((s->offsets=malloc(sizeof(size_t)))==NULL) return -1;
+	s->offsets[0]=0;
+	return 0;
+}
+
+// Escapes and multi-byte chars included, so the decoding paths are measured too.
+static char const *vocabulary[]={"The"," quick"," brown"," fox"," jumps"," over"," the"," lazy"," dog",".\\n"
+		," \\\"quoted\\\""," caf\\u00e9"," na\\u00efve"," \\ud83d\\ude00"," 1234"," tab\\t"," \\\\path"," end"};
+
+static int stream_synthetic(struct BenchStream *s, int tokens, int rate){
+	if(stream_init(s)!=0) return -1;
+	size_t size=0;
+	char line[512];
+	int cantVocabulary=sizeof(vocabulary)/sizeof(vocabulary[0]);
+	for(int i=0;i<tokens;i++){
+		int len=snprintf(line, sizeof(line), "{\"model\":\"%s\",\"created_at\":\"2026-01-01T00:00:00.000000Z\""
+				",\"message\":{\"role\":\"assistant\",\"content\":\"%s\"},\"done\":false}", BENCH_MODEL
+				, vocabulary[i%cantVocabulary]);
+		if(stream_add_line(s, &size, line, len)!=0) return -1;
+	}
+	long int evalDuration=(rate>0)?(long int) tokens*1000000000/rate:(long int) tokens*1000000;
+	int len=snprintf(line, sizeof(line), "{\"model\":\"%s\",\"created_at\":\"2026-01-01T00:00:00.000000Z\""
+			",\"message\":{\"role\":\"assistant\",\"content\":\"\"},\"done_reason\":\"stop\",\"done\":true"
+			",\"total_duration\":%ld,\"load_duration\":1000000,\"prompt_eval_count\":26"
+			",\"prompt_eval_duration\":2000000,\"eval_count\":%d,\"eval_duration\":%ld}", BENCH_MODEL
+			, evalDuration+3000000, tokens, evalDuration);
+	return stream_add_line(s, &size, line, len);
+}
+
+static int stream_replay(struct BenchStream *s, char const *fileName){
+	FILE *f=fopen(fileName, "r");
+	if(f==NULL) return -1;
+	if(stream_init(s)!=0){
+		fclose(f);
+		return -1;
+	}
+	size_t size=0, lineSize=0;
+	char *line=NULL;
+	ssize_t len=0;
+	while((len=getline(&line, &lineSize, f))!=-1){
+		while(len>0 && (line[len-1]=='\n' || line[len-1]=='\r')) len--;
+		if(len==0) continue;
+		if(stream_add_line(s, &size, line, len)!=0) break;
+	}
+	free(line);
+	fclose(f);
+	return (s->cantLines>0)?0:-1;
+}
+
+/*
+ * Mock server
+ */
+static int bench_certificate(EVP_PKEY **key, X509 **cert){
+	if((*key=EVP_EC_gen("P-256"))==NULL || (*cert=X509_new())==NULL) return -1;
+	X509_set_version(*cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(*cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(*cert), -3600);
+	X509_gmtime_adj(X509_getm_notAfter(*cert), 7*24*3600);
+	X509_set_pubkey(*cert, *key);
+	X509_NAME *name=X509_get_subject_name(*cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const *) "localhost", -1, -1, 0);
+	X509_set_issuer_name(*cert, name);
+	X509V3_CTX v3Ctx;
+	X509V3_set_ctx(&v3Ctx, *cert, *cert, NULL, NULL, 0);
+	char const *exts[][2]={{"basicConstraints","critical,CA:TRUE"},{"subjectAltName","DNS:localhost,IP:127.0.0.1,IP:::1"}};
+	for(size_t i=0;i<sizeof(exts)/sizeof(exts[0]);i++){
+		X509_EXTENSION *ext=X509V3_EXT_conf(NULL, &v3Ctx, exts[i][0], exts[i][1]);
+		if(ext==NULL) return -1;
+		X509_add_ext(*cert, ext, -1);
+		X509_EXTENSION_free(ext);
+	}
+	return (X509_sign(*cert, *key, EVP_sha256())>0)?0:-1;
+}
+
+static int bench_write_certificate(X509 *cert, char const *fileName){
+	FILE *f=fopen(fileName, "w");
+	if(f==NULL) return -1;
+	int retVal=PEM_write_X509(f, cert)?0:-1;
+	fclose(f);
+	return retVal;
+}
+
+static int bench_listen(int port, int *listenPort){
+	int s=socket(AF_INET, SOCK_STREAM, 0);
+	if(s<0) return -1;
+	int on=1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	socklen_t addrLen=sizeof(addr);
+	if(bind(s, (struct sockaddr *) &addr, sizeof(addr))<0 || listen(s, 64)<0
+			|| getsockname(s, (struct sockaddr *) &addr, &addrLen)<0){
+		close(s);
+		return -1;
+	}
+	*listenPort=ntohs(addr.sin_port);
+	return s;
+}
+
+static int conn_fill(struct BenchConn *conn){
+	if(conn->size-conn->len<16*1024){
+		size_t newSize=(conn->size==0)?64*1024:conn->size*2;
+		char *buffer=realloc(conn->buffer, newSize);
+		if(buffer==NULL) return -1;
+		conn->buffer=buffer;
+		conn->size=newSize;
+	}
+	int n=SSL_read(conn->ssl, conn->buffer+conn->len, conn->size-conn->len-1);
+	if(n<=0) return -1;
+	conn->len+=n;
+	conn->buffer[conn->len]=0;
+	return 0;
+}
+
+// Position of 'what' from 'from', reading until it's received.
+static int conn_find(struct BenchConn *conn, size_t from, char const *what, size_t *pos){
+	for(;;){
+		if(conn->len>from){
+			char *found=memmem(conn->buffer+from, conn->len-from, what, strlen(what));
+			if(found!=NULL){
+				*pos=found-conn->buffer;
+				return 0;
+			}
+		}
+		if(conn_fill(conn)!=0) return -1;
+	}
+}
+
+static int conn_need(struct BenchConn *conn, size_t len){
+	while(conn->len<len) if(conn_fill(conn)!=0) return -1;
+	return 0;
+}
+
+// Reads a whole request (the body is discarded), with Content-Length or chunked.
+static int conn_read_request(struct BenchConn *conn, char *path, size_t pathSize, bool *keepAlive){
+	size_t headersEnd=0;
+	if(conn_find(conn, 0, "\r\n\r\n", &headersEnd)!=0) return -1;
+	headersEnd+=4;
+	path[0]=0;
+	char const *pathStart=memchr(conn->buffer, ' ', headersEnd);
+	if(pathStart!=NULL){
+		size_t pathLen=strcspn(++pathStart, " \r\n");
+		snprintf(path, pathSize, "%.*s", (int) pathLen, pathStart);
+	}
+	bool chunked=false;
+	size_t contentLength=0;
+	*keepAlive=true;
+	for(char *line=strstr(conn->buffer, "\r\n");line!=NULL && (size_t) (line-conn->buffer)<headersEnd-4;
+			line=strstr(line, "\r\n")){
+		line+=2;
+		if(strncasecmp(line, "Content-Length:", 15)==0) contentLength=strtoul(line+15, NULL, 10);
+		if(strncasecmp(line, "Transfer-Encoding:", 18)==0 && strstr(line, "chunked")!=NULL) chunked=true;
+		if(strncasecmp(line, "Connection:", 11)==0 && strncasecmp(line+11, " close", 6)==0) *keepAlive=false;
+	}
+	size_t end=headersEnd+contentLength;
+	if(chunked){
+		end=headersEnd;
+		for(;;){
+			size_t lineEnd=0;
+			if(conn_find(conn, end, "\r\n", &lineEnd)!=0) return -1;
+			size_t chunkSize=strtoul(conn->buffer+end, NULL, 16);
+			end=lineEnd+2+chunkSize+2;
+			if(conn_need(conn, end)!=0) return -1;
+			if(chunkSize==0) break;
+		}
+	}else if(conn_need(conn, end)!=0){
+		return -1;
+	}
+	memmove(conn->buffer, conn->buffer+end, conn->len-end);
+	conn->len-=end;
+	return 0;
+}
+
+// Every write is, at least, one TLS record.
+static int conn_write(struct BenchConn *conn, char const *data, size_t len, int record){
+	while(len>0){
+		size_t n=(record>0 && (size_t) record<len)?(size_t) record:len;
+		int sent=SSL_write(conn->ssl, data, n);
+		if(sent<=0) return -1;
+		data+=sent;
+		len-=sent;
+	}
+	return 0;
+}
+
+static int conn_reply(struct BenchConn *conn, char const *contentType, char const *payload){
+	char reply[1024];
+	int len=snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n%s"
+			, contentType, strlen(payload), payload);
+	return conn_write(conn, reply, len, 0);
+}
+
+// The lines are grouped in HTTP chunks, every one sent when its last token is due.
+static int conn_reply_stream(struct BenchConn *conn, struct BenchParams const *p, struct BenchStream const *s){
+	char const *headers="HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\nTransfer-Encoding: chunked\r\n\r\n";
+	size_t headersLen=strlen(headers), size=0;
+	char *out=NULL;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int retVal=0;
+	for(int i=0;i<s->cantLines && retVal==0;i+=p->chunk){
+		int last=(i+p->chunk<s->cantLines)?i+p->chunk:s->cantLines;
+		size_t dataLen=s->offsets[last]-s->offsets[i], len=0;
+		if(size<headersLen+dataLen+32){
+			size=headersLen+dataLen+32;
+			char *temp=realloc(out, size);
+			if(temp==NULL){
+				retVal=-1;
+				break;
+			}
+			out=temp;
+		}
+		if(i==0){
+			memcpy(out, headers, headersLen);
+			len=headersLen;
+		}
+		len+=sprintf(out+len, "%zx\r\n", dataLen);
+		memcpy(out+len, s->data+s->offsets[i], dataLen);
+		len+=dataLen;
+		len+=sprintf(out+len, (last==s->cantLines)?"\r\n0\r\n\r\n":"\r\n");
+		if(p->rate>0){
+			long int due=(long int) last*1000000000/p->rate;
+			struct timespec deadline={start.tv_sec+(start.tv_nsec+due)/1000000000, (start.tv_nsec+due)%1000000000};
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+		}
+		retVal=conn_write(conn, out, len, p->record);
+	}
+	free(out);
+	return retVal;
+}
+
+static void *conn_handler(void *arg){
+	struct BenchConn *conn=arg;
+	if(SSL_accept(conn->ssl)==1){
+		char path[256];
+		bool keepAlive=true;
+		while(keepAlive && conn_read_request(conn, path, sizeof(path), &keepAlive)==0){
+			int retVal=0;
+			if(strcmp(path, "/api/chat")==0){
+				retVal=conn_reply_stream(conn, serverParams, serverStream);
+			}else if(strcmp(path, "/api/ps")==0 || strcmp(path, "/api/tags")==0){
+				retVal=conn_reply(conn, "application/json", "{\"models\":[]}");
+			}else{
+				retVal=conn_reply(conn, "text/plain", "Ollama is running");
+			}
+			if(retVal!=0) break;
+		}
+		SSL_shutdown(conn->ssl);
+	}
+	SSL_free(conn->ssl);
+	close(conn->socket);
+	free(conn->buffer);
+	free(conn);
+	return NULL;
+}
+
+static void bench_serve(int listenSocket, EVP_PKEY *key, X509 *cert, struct BenchParams const *p
+		, struct BenchStream const *s){
+	signal(SIGPIPE, SIG_IGN);
+	if((serverCtx=SSL_CTX_new(TLS_server_method()))==NULL || SSL_CTX_use_certificate(serverCtx, cert)!=1
+			|| SSL_CTX_use_PrivateKey(serverCtx, key)!=1) print_error("Server's TLS context not valid.", "");
+	serverParams=p;
+	serverStream=s;
+	for(;;){
+		int clientSocket=accept(listenSocket, NULL, NULL);
+		if(clientSocket<0){
+			if(errno==EINTR) continue;
+			break;
+		}
+		// Small records aren't coalesced by Nagle's algorithm.
+		int on=1;
+		setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		struct BenchConn *conn=calloc(1, sizeof(struct BenchConn));
+		if(conn==NULL || (conn->ssl=SSL_new(serverCtx))==NULL){
+			free(conn);
+			close(clientSocket);
+			continue;
+		}
+		conn->socket=clientSocket;
+		SSL_set_fd(conn->ssl, clientSocket);
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, conn_handler, conn)!=0){
+			SSL_free(conn->ssl);
+			close(clientSocket);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Client
+ */
+static long int receivedTokens=0;
+
+static void bench_callback(char const *token, bool done, int responseType){
+	if(!done && responseType==OCL_CONTENT_TYPE && token[0]!=0) receivedTokens++;
+}
+
+static double elapsed_since(struct timespec const *start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec-start->tv_sec)+(now.tv_nsec-start->tv_nsec)/1e9;
+}
+
+static double cpu_seconds(){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec+usage.ru_utime.tv_usec/1e6+usage.ru_stime.tv_sec+usage.ru_stime.tv_usec/1e6;
+}
+
+static long int peak_rss_kb(){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+static int compare_doubles(void const *a, void const *b){
+	double x=*(double const *) a, y=*(double const *) b;
+	return (x>y)-(x<y);
+}
+
+struct BenchResult{
+	int retVal;
+	long int tokens;
+	long int allocs;
+	long int allocBytes;
+	long int peakRss;
+	double total;
+	double median;
+	double cpu;
+	char error[512];
+};
+
+/*
+ * Runs in a forked process, with its own instance: the peak RSS is the combination's, not inherited from the
+ * previous ones (the parent holds little more than the certificate).
+ */
+static void bench_client(struct BenchOpts const *bo, int port, char const *query, struct BenchResult *res){
+	char srvPort[16];
+	snprintf(srvPort, sizeof(srvPort), "%d", port);
+	OCl *ocl=NULL;
+	res->retVal=OCl_get_instance(&ocl, "127.0.0.1", srvPort, NULL, NULL, NULL, OCL_API_KEY, BENCH_MODEL, "false", NULL
+			, OCL_SYSTEM_ROLE, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+	double *times=malloc(sizeof(double)*bo->runs);
+	if(times==NULL) res->retVal=OCL_ERR_MALLOC;
+	// The first chat (not measured) warms the instance's buffers up.
+	for(int i=-1;i<bo->runs && res->retVal>=0;i++){
+		OCl_flush_context(ocl);
+		receivedTokens=0;
+		atomic_store(&cantAllocs, 0);
+		atomic_store(&allocatedBytes, 0);
+		struct timespec start;
+		double cpuStart=cpu_seconds();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		atomic_store(&countAllocs, i>=0);
+		res->retVal=OCl_send_chat(ocl, query, NULL, bench_callback);
+		atomic_store(&countAllocs, false);
+		if(i<0 || res->retVal<0) continue;
+		times[i]=elapsed_since(&start);
+		res->cpu+=cpu_seconds()-cpuStart;
+		res->tokens+=receivedTokens;
+		res->allocs+=atomic_load(&cantAllocs);
+		res->allocBytes+=atomic_load(&allocatedBytes);
+	}
+	if(res->retVal>=0){
+		for(int i=0;i<bo->runs;i++) res->total+=times[i];
+		qsort(times, bo->runs, sizeof(double), compare_doubles);
+		res->median=times[bo->runs/2];
+	}
+	res->peakRss=peak_rss_kb();
+	if(res->retVal<0) snprintf(res->error, sizeof(res->error), "%s", OCL_error_handling(ocl, res->retVal));
+	free(times);
+	if(ocl!=NULL) OCl_free(ocl);
+}
+
+static int bench_run(struct BenchOpts const *bo, struct BenchParams const *p, char const *query, EVP_PKEY *key
+		, X509 *cert){
+	int port=0, listenSocket=bench_listen(0, &port), streamPipe[2], resultPipe[2];
+	if(listenSocket<0) print_error("Listening socket not created: ", strerror(errno));
+	pid_t server=-1, client=-1;
+	if(pipe(streamPipe)<0 || (server=fork())<0) print_error("Mock server not started: ", strerror(errno));
+	// The stream is built by the server, so the client's RSS doesn't include it. Its size is sent back.
+	if(server==0){
+		struct BenchStream s;
+		close(streamPipe[0]);
+		if(((bo->replayFile!=NULL)?stream_replay(&s, bo->replayFile):stream_synthetic(&s, p->tokens, p->rate))!=0)
+			print_error("Stream not valid: ", (bo->replayFile!=NULL)?bo->replayFile:"synthetic");
+		long int streamSize=s.offsets[s.cantLines];
+		if(write(streamPipe[1], &streamSize, sizeof(streamSize))!=sizeof(streamSize)) exit(EXIT_FAILURE);
+		close(streamPipe[1]);
+		bench_serve(listenSocket, key, cert, p, &s);
+	}
+	close(listenSocket);
+	close(streamPipe[1]);
+	long int streamSize=0;
+	bool streamBuilt=read(streamPipe[0], &streamSize, sizeof(streamSize))==sizeof(streamSize);
+	close(streamPipe[0]);
+	struct BenchResult res={OCL_ERR_UNKNOWN, 0, 0, 0, 0, 0, 0, 0, "Mock server or client not started"};
+	if(streamBuilt && pipe(resultPipe)==0){
+		if((client=fork())==0){
+			close(resultPipe[0]);
+			struct BenchResult childRes={OCL_RETURN_OK, 0, 0, 0, 0, 0, 0, 0, ""};
+			bench_client(bo, port, query, &childRes);
+			_exit((write(resultPipe[1], &childRes, sizeof(childRes))==sizeof(childRes))?EXIT_SUCCESS:EXIT_FAILURE);
+		}
+		close(resultPipe[1]);
+		if(client>0 && read(resultPipe[0], &res, sizeof(res))!=sizeof(res)){
+			res.retVal=OCL_ERR_UNKNOWN;
+			snprintf(res.error, sizeof(res.error), "Client ended with no results");
+		}
+		close(resultPipe[0]);
+		if(client>0) waitpid(client, NULL, 0);
+	}
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	if(res.retVal<0){
+		fprintf(stderr, "%s: %s\n", PROGRAM_NAME, res.error);
+		return res.retVal;
+	}
+	// The tokens received (not the requested: a replay sets its own), and the NDJSON stream's throughput.
+	double tokensPerSec=res.tokens/res.total, mbPerSec=(double) streamSize*bo->runs/res.total/(1024*1024)
+			, cpuPerToken=(res.tokens>0)?res.cpu/res.tokens*1e6:0;
+	if(bo->csv){
+		printf("%ld,%d,%d,%d,%d,%.3f,%.3f,%.1f,%.2f,%.3f,%ld,%ld,%ld\n", res.tokens/bo->runs, p->rate, p->chunk
+				, p->record, bo->querySize, res.median*1000, res.total/bo->runs*1000, tokensPerSec, mbPerSec
+				, cpuPerToken, res.allocs/bo->runs, res.allocBytes/bo->runs, res.peakRss);
+	}else{
+		printf("%8ld %6d %6d %7d %8.2f %11.1f %7.2f %10.3f %11ld %11ld %10ld\n", res.tokens/bo->runs, p->rate
+				, p->chunk, p->record, res.median*1000, tokensPerSec, mbPerSec, cpuPerToken, res.allocs/bo->runs
+				, res.allocBytes/bo->runs, res.peakRss);
+	}
+	fflush(stdout);
+	return OCL_RETURN_OK;
+}
+
+// Text with chars to escape, so the request builder does its whole work.
+static char *bench_query(int size){
+	char const *text="Summarize the following log:\n\t\"ERROR\" at C:\\temp\\x.log, line 42; ";
+	char *query=malloc(size+2);
+	if(query==NULL) return NULL;
+	size_t textLen=strlen(text);
+	for(int i=0;i<size;i++) query[i]=text[i%textLen];
+	// Not ended with ';': it's kept in the history, as a usual query.
+	query[size]='.';
+	query[size+1]=0;
+	return query;
+}
+
+int main(int argc, char *argv[]){
+	struct BenchOpts bo;
+	bo.runs=BENCH_RUNS;
+	parse_list(&bo.tokens, BENCH_TOKENS, 1);
+	parse_list(&bo.rate, BENCH_RATE, 0);
+	parse_list(&bo.chunk, BENCH_CHUNK, 1);
+	parse_list(&bo.record, BENCH_RECORD, 0);
+	bo.querySize=BENCH_QUERY_SIZE;
+	bo.replayFile=NULL;
+	bo.csv=false;
+	bo.servePort=-1;
+	for(int i=1;i<argc;i++){
+		if(strcmp(argv[i],"--help")==0){
+			print_usage();
+			exit(EXIT_SUCCESS);
+		}
+		if(strcmp(argv[i],"--csv")==0){
+			bo.csv=true;
+			continue;
+		}
+		if(i+1>=argc) print_error("Argument missing or not valid: ", argv[i]);
+		if(strcmp(argv[i],"--runs")==0){
+			bo.runs=parse_int(argv[++i], 1);
+		}else if(strcmp(argv[i],"--tokens")==0){
+			parse_list(&bo.tokens, argv[++i], 1);
+		}else if(strcmp(argv[i],"--rate")==0){
+			parse_list(&bo.rate, argv[++i], 0);
+		}else if(strcmp(argv[i],"--chunk")==0){
+			parse_list(&bo.chunk, argv[++i], 1);
+		}else if(strcmp(argv[i],"--record")==0){
+			parse_list(&bo.record, argv[++i], 0);
+		}else if(strcmp(argv[i],"--query-size")==0){
+			bo.querySize=parse_int(argv[++i], 1);
+		}else if(strcmp(argv[i],"--replay")==0){
+			bo.replayFile=argv[++i];
+		}else if(strcmp(argv[i],"--serve")==0){
+			bo.servePort=parse_int(argv[++i], 1);
+			if(bo.servePort>65535) print_error("Port not valid: ", argv[i]);
+		}else{
+			print_error("Argument not valid: ", argv[i]);
+		}
+	}
+	EVP_PKEY *key=NULL;
+	X509 *cert=NULL;
+	if(bench_certificate(&key, &cert)!=0) print_error("Self-signed certificate not generated.", "");
+	if(bo.servePort>0){
+		struct BenchParams p={bo.tokens.values[0], bo.rate.values[0], bo.chunk.values[0], bo.record.values[0]};
+		struct BenchStream s;
+		int port=0, listenSocket=bench_listen(bo.servePort, &port);
+		if(listenSocket<0) print_error("Listening socket not created: ", strerror(errno));
+		if(bench_write_certificate(cert, BENCH_CERT_FILE)!=0) print_error("Certificate not written: ", BENCH_CERT_FILE);
+		if(((bo.replayFile!=NULL)?stream_replay(&s, bo.replayFile):stream_synthetic(&s, p.tokens, p.rate))!=0)
+			print_error("Stream not valid: ", (bo.replayFile!=NULL)?bo.replayFile:"synthetic");
+		printf("Serving on 127.0.0.1:%d, v.gr.:\n\nSSL_CERT_FILE=%s ollama-c-lient --server-addr 127.0.0.1 "
+				"--server-port %d --model %s\n\n", port, BENCH_CERT_FILE, port, BENCH_MODEL);
+		fflush(stdout);
+		bench_serve(listenSocket, key, cert, &p, &s);
+	}
+	// The client trusts the generated certificate only.
+	char certFile[]="/tmp/ocl-bench-XXXXXX";
+	int certFd=mkstemp(certFile);
+	if(certFd<0) print_error("Certificate not written: ", strerror(errno));
+	close(certFd);
+	if(bench_write_certificate(cert, certFile)!=0) print_error("Certificate not written: ", certFile);
+	setenv("SSL_CERT_FILE", certFile, 1);
+	char *query=bench_query(bo.querySize);
+	int retVal=OCl_init();
+	if(retVal!=OCL_RETURN_OK || query==NULL){
+		unlink(certFile);
+		print_error("libOCl not initialized.", "");
+	}
+	if(bo.csv){
+		printf("tokens,rate,chunk,record,query_size,median_ms,mean_ms,tokens_per_sec,mb_per_sec,cpu_us_per_token"
+				",allocs_per_chat,alloc_bytes_per_chat,peak_rss_kb\n");
+	}else{
+		printf("%s: %d chats per combination, query of %d bytes%s%s\n\n", PROGRAM_NAME, bo.runs, bo.querySize
+				, (bo.replayFile!=NULL)?", replaying ":"", (bo.replayFile!=NULL)?bo.replayFile:"");
+		printf("%8s %6s %6s %7s %8s %11s %7s %10s %11s %11s %10s\n", "tokens", "rate", "chunk", "record", "ms/chat"
+				, "tokens/s", "MB/s", "cpu us/tok", "allocs/chat", "bytes/chat", "peak RSS");
+	}
+	for(int t=0;t<bo.tokens.cant && retVal>=0;t++){
+		for(int r=0;r<bo.rate.cant && retVal>=0;r++){
+			for(int c=0;c<bo.chunk.cant && retVal>=0;c++){
+				for(int rec=0;rec<bo.record.cant && retVal>=0;rec++){
+					struct BenchParams p={bo.tokens.values[t], bo.rate.values[r], bo.chunk.values[c]
+							, bo.record.values[rec]};
+					retVal=bench_run(&bo, &p, query, key, cert);
+				}
+			}
+		}
+	}
+	unlink(certFile);
+	free(query);
+	OCl_shutdown();
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return (retVal<0)?EXIT_FAILURE:EXIT_SUCCESS;
+}
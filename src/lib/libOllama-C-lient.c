@@ -13,30 +13,125 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <ctype.h>
 #include <sys/poll.h>
+#include <sys/un.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <stdarg.h>
+#include <limits.h>
+#ifdef OCL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef OCL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define BUFFER_SIZE_1K				(1024)
 #define BUFFER_SIZE_2K				(1024*2)
 #define BUFFER_SIZE_16K				(1024*16)
 #define BUFFER_SIZE_1M				(1024*1024)
 
+#define OCL_POLL_SLICE_MS			250
+#define OCL_UPLOAD_SLICE			BUFFER_SIZE_16K
+
+#define OCL_MAX_ENDPOINTS			16
+#define OCL_MAX_REGISTERED_ENDPOINTS	64
+#define OCL_ENDPOINT_EWMA_ALPHA		0.3
+#define OCL_ENDPOINT_COOLDOWN_S		1.0
+#define OCL_ENDPOINT_MAX_COOLDOWN_S	60.0
+#define OCL_ENDPOINT_MODELS_TTL_S	30.0
+
+#define OCL_MODELS_BUCKETS			256
+#define OCL_MODELS_TTL_S			30.0
+#define OCL_MAX_MODELS				512
+
+#define OCL_SCHEDULER_MAX_MODELS	64
+#define OCL_SCHEDULER_MAX_TENANTS	256
+
+#define OCL_MAX_EMBED_CONNECTIONS	32
+#define OCL_EMBED_PIPELINE_DEPTH	2
+
+#define OCL_GENERATE_CONTEXT_MAGIC	"OCLCTX01"
+
+#define OCL_VINDEX_MAX_TOP_K		64
+#define OCL_VINDEX_FILE_MAGIC		"OCLVIX01"
+
+#define OCL_MAX_WARMUP_MODELS		16
+#define OCL_WARMUP_RENEWAL_RATIO	0.8
+#define OCL_WARMUP_RETRY_S			10.0
+#define OCL_WARMUP_TICK_S			30.0
+
+#define OCL_RESOLVER_CACHE_ENTRIES		(OCL_MAX_ENDPOINTS+1)
+#define OCL_RESOLVER_MAX_ADDRS			8
+#define OCL_RESOLVER_TTL_S				60.0
+#define OCL_CONNECTION_ATTEMPT_DELAY_MS	250
+
+#define OCL_FORMAT_MAX_DEPTH			64
+#define OCL_STOP_PENDING_SIZE			(BUFFER_SIZE_2K*2)
+
+/*
+ * Interactions are immutable once created and shared by reference: an instance, its snapshots and forks may all hold
+ * the same 'Message'. The lists are copy-on-write: a list with more than one holder is copied (pointers only) before
+ * being changed.
+ */
 typedef struct Message{
+	atomic_int refs;
 	char *userMessage;
 	char *assistantMessage;
-	struct Message *nextMessage;
 }Message;
 
+typedef struct MessageList{
+	atomic_int refs;
+	int cant;
+	int size;
+	Message *messages[];
+}MessageList;
+
 SSL_CTX *oclSslCtx=NULL;
 int oclSslError=0;
 bool oclCanceled=false;
 
+typedef struct OclArenaBlock{
+	struct OclArenaBlock *prev;
+	size_t size;
+	size_t used;
+	_Alignas(16) char data[];
+}OclArenaBlock;
+
+typedef struct{
+	OclArenaBlock *block;
+	char *last;
+}OclArena;
+
+typedef struct{
+	char host[512];
+	int port;
+	struct sockaddr_storage addrs[OCL_RESOLVER_MAX_ADDRS];
+	socklen_t addrsLen[OCL_RESOLVER_MAX_ADDRS];
+	int cantAddrs;
+	double expires;
+}ResolvedHost;
+
 typedef struct _ocl{
 	char srvAddr[512];
 	int srvPort;
@@ -57,14 +152,49 @@ typedef struct _ocl{
 	int num_predict;
 	int maxHistoryCtx;
 	int maxTokensCtx;
-	Message *rootContextMessages;
-	Message *rootStaticContextMessages;
-	int contContextMessages;
+	MessageList *contextMessages;
+	MessageList *staticContextMessages;
 	char *systemRole;
 	char *staticContextFile;
 	char *contextFile;
 	char *tools;
 	struct _ocl_response *ocl_resp;
+	struct _ocl_cache *cache;
+	struct _ocl_models *models;
+	struct _ocl_warmup *warmup;
+	struct _ocl_vindex *vindex;
+	struct _ocl_format *format;
+	struct _ocl_stop *stop;
+	int maxChars;
+	int maxTime;
+	int loadTimeout;
+	int endpoints[OCL_MAX_ENDPOINTS];
+	int cantEndpoints;
+	int endpointPolicy;
+	int rrNext;
+	ResolvedHost resolved[OCL_RESOLVER_CACHE_ENTRIES];
+	int retryMaxAttempts;
+	int retryBackoffMs;
+	int retryableErrors[64];
+	int cantRetryableErrors;
+	int priority;
+	char tenant[64];
+	int deadlineMs;
+	int embedConnections;
+	int embedBatchInputs;
+	int embedBatchBytes;
+	bool generate;
+	int compression;
+	int compressionLevel;
+	int compressionMinSize;
+	int32_t *genContext;
+	int cantGenContext;
+	char genContextModel[512];
+	OclArena arena;
+	struct HttpStream *stream;
+	atomic_bool canceled;
+	pthread_mutex_t connMutex;
+	int activeSocket;
 }OCl;
 
 struct _ocl_response{
@@ -82,78 +212,211 @@ struct _ocl_response{
 	int evalCount;
 	double tokensPerSec;
 	bool done;
+	int stopReason;
+	int32_t *context;
+	int cantContext;
+	int contextSize;
 };
 
+static void models_free(OCl *);
+static void warmup_free(OCl *);
+static void warmup_touch(OCl *);
+static void vindex_free(OCl *);
+static void format_release(struct _ocl_format *);
+static struct _ocl_format *format_retain(struct _ocl_format *);
+static void stop_release(struct _ocl_stop *);
+static struct _ocl_stop *stop_retain(struct _ocl_stop *);
+static int vindex_fork(OCl const *, OCl *);
+static struct HttpStream *http_stream_new();
+static void http_stream_delete(struct HttpStream *);
+static int vindex_select(OCl *, char const *, int *);
+static int vindex_rows(OCl const *);
+
 static void sfree(void *p){
 	free(p);
 	p=NULL;
 }
 
-int OCl_parse_string(char **stringTo, char const *stringFrom){
-	if(stringFrom==NULL) return OCL_RETURN_OK;
-	int cont=0, contEsc=0;
-	for(size_t i=0;i<strlen(stringFrom);i++){
-		switch(stringFrom[i]){
-		case '\"':
-		case '\n':
-		case '\f':
-		case '\t':
-		case '\r':
-		case '\\':
-			contEsc++;
-			break;
-		default:
-			break;
+// Process wide (ocl_canceled(ocl)), or only this instance's current request (OCl_cancel()).
+static bool ocl_canceled(OCl const *ocl){
+	return oclCanceled || atomic_load(&ocl->canceled);
+}
+
+/*
+ * Per-instance bump arena for the temporaries of a chat (history, body, request, escapes). It's reset, not freed, at
+ * the start of every chat; blocks added by a bigger one are merged into a single block, so in a steady conversation
+ * the arena allocates nothing (the TLS connection, opened per request, still does). Only the last allocation can grow
+ * in place (the buffer being built).
+ */
+#define OCL_ARENA_BLOCK_SIZE		(256*1024)
+#define OCL_ARENA_MAX_RETAINED		(16*1024*1024)
+#define OCL_ARENA_ALIGN(size)		(((size)+15)&~((size_t) 15))
+#define OCL_HOST_SIZE				(512+2)
+
+static void *arena_alloc(OclArena *arena, size_t size){
+	size=OCL_ARENA_ALIGN(size);
+	OclArenaBlock *block=arena->block;
+	if(block==NULL || block->size-block->used<size){
+		size_t blockSize=(block==NULL)?OCL_ARENA_BLOCK_SIZE:block->size*2;
+		while(blockSize<size) blockSize*=2;
+		OclArenaBlock *newBlock=malloc(sizeof(OclArenaBlock)+blockSize);
+		if(newBlock==NULL) return NULL;
+		newBlock->prev=block;
+		newBlock->size=blockSize;
+		newBlock->used=0;
+		arena->block=block=newBlock;
+	}
+	arena->last=block->data+block->used;
+	block->used+=size;
+	return arena->last;
+}
+
+static void *arena_realloc(OclArena *arena, void *ptr, size_t oldSize, size_t newSize){
+	if(ptr!=NULL && ptr==arena->last){
+		size_t offset=(char *) ptr-arena->block->data;
+		if(offset+OCL_ARENA_ALIGN(newSize)<=arena->block->size){
+			arena->block->used=offset+OCL_ARENA_ALIGN(newSize);
+			return ptr;
 		}
 	}
-	if(*stringTo) sfree(*stringTo);
-	*stringTo=malloc(strlen(stringFrom)+contEsc+1);
-	memset(*stringTo,0,strlen(stringFrom)+contEsc+1);
-	for(size_t i=0;i<strlen(stringFrom);i++,cont++){
-		switch(stringFrom[i]){
-		case '\"':
-			(*stringTo)[cont]='\\';
-			(*stringTo)[++cont]='\"';
-			break;
-		case '\n':
-			(*stringTo)[cont]='\\';
-			(*stringTo)[++cont]='n';
-			break;
-		case '\f':
-			(*stringTo)[cont]='\\';
-			(*stringTo)[++cont]='f';
-			break;
-		case '\t':
-			(*stringTo)[cont]='\\';
-			(*stringTo)[++cont]='t';
-			break;
-		case '\r':
-			(*stringTo)[cont]='\\';
-			(*stringTo)[++cont]='r';
-			break;
-		case '\\':
-			(*stringTo)[cont]='\\';
-			(*stringTo)[++cont]='\\';
-			break;
-		default:
-			(*stringTo)[cont]=stringFrom[i];
-			break;
+	void *newPtr=arena_alloc(arena, newSize);
+	if(newPtr!=NULL && ptr!=NULL) memcpy(newPtr, ptr, (oldSize<newSize)?oldSize:newSize);
+	return newPtr;
+}
+
+static void arena_free(OclArena *arena){
+	while(arena->block!=NULL){
+		OclArenaBlock *prev=arena->block->prev;
+		sfree(arena->block);
+		arena->block=prev;
+	}
+	arena->last=NULL;
+}
+
+static void arena_reset(OclArena *arena){
+	arena->last=NULL;
+	if(arena->block==NULL) return;
+	if(arena->block->prev==NULL && arena->block->size<=OCL_ARENA_MAX_RETAINED){
+		arena->block->used=0;
+		return;
+	}
+	size_t size=0;
+	for(OclArenaBlock *block=arena->block;block!=NULL;block=block->prev) size+=block->size;
+	arena_free(arena);
+	// A huge request (v.gr. a piped file) isn't kept for the rest of the conversation.
+	if(size>OCL_ARENA_MAX_RETAINED) size=OCL_ARENA_BLOCK_SIZE;
+	if((arena->block=malloc(sizeof(OclArenaBlock)+size))==NULL) return;
+	arena->block->prev=NULL;
+	arena->block->size=size;
+	arena->block->used=0;
+}
+
+// With an arena, the buffer lives (and grows) in it, and isn't freed. Without it, in the heap.
+static int buffer_reserve(OclArena *arena, char **buffer, size_t *len, size_t *size, size_t dataLen){
+	if(*len+dataLen+1>*size){
+		size_t newSize=(*size==0)?BUFFER_SIZE_16K:*size;
+		while(*len+dataLen+1>newSize) newSize*=2;
+		char *newBuffer=(arena!=NULL)?arena_realloc(arena, *buffer, *size, newSize):realloc(*buffer, newSize);
+		if(newBuffer==NULL) return OCL_ERR_REALLOC;
+		*buffer=newBuffer;
+		*size=newSize;
+	}
+	return OCL_RETURN_OK;
+}
+
+static int buffer_append(OclArena *arena, char **buffer, size_t *len, size_t *size, char const *data, size_t dataLen){
+	int retVal=buffer_reserve(arena, buffer, len, size, dataLen);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	memcpy(*buffer+*len, data, dataLen);
+	*len+=dataLen;
+	(*buffer)[*len]=0;
+	return OCL_RETURN_OK;
+}
+
+static int buffer_printf(OclArena *arena, char **buffer, size_t *len, size_t *size, char const *format, ...){
+	va_list args;
+	va_start(args, format);
+	int n=vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if(n<0) return OCL_ERR_UNKNOWN;
+	int retVal=buffer_reserve(arena, buffer, len, size, n);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	va_start(args, format);
+	vsnprintf(*buffer+*len, n+1, format, args);
+	va_end(args);
+	*len+=n;
+	return OCL_RETURN_OK;
+}
+
+/*
+ * JSON string escaping. 'jsonEscapes' maps every byte to the char following the '\\' (0: copied as is; 'u': '\\u00XX').
+ * UTF-8 (>=0x80) is copied as is. Runs of safe bytes are found 16 at a time (SSE2) and copied in bulk.
+ */
+static unsigned char const jsonEscapes[256]={
+	['\b']='b',['\t']='t',['\n']='n',['\f']='f',['\r']='r',
+	[0x00]='u',[0x01]='u',[0x02]='u',[0x03]='u',[0x04]='u',[0x05]='u',[0x06]='u',[0x07]='u',
+	[0x0b]='u',[0x0e]='u',[0x0f]='u',[0x10]='u',[0x11]='u',[0x12]='u',[0x13]='u',[0x14]='u',[0x15]='u',[0x16]='u',
+	[0x17]='u',[0x18]='u',[0x19]='u',[0x1a]='u',[0x1b]='u',[0x1c]='u',[0x1d]='u',[0x1e]='u',[0x1f]='u',
+	['\"']='\"',['\\']='\\'
+};
+
+static size_t json_safe_run(unsigned char const *from, size_t fromLen){
+	size_t i=0;
+#if defined(__SSE2__)
+	__m128i const controls=_mm_set1_epi8(0x1f), quote=_mm_set1_epi8('\"'), backslash=_mm_set1_epi8('\\');
+	for(;i+16<=fromLen;i+=16){
+		__m128i chars=_mm_loadu_si128((__m128i const *) (from+i));
+		// max(c, 0x1f)==0x1f (unsigned) <=> c<0x20.
+		__m128i unsafe=_mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(chars, controls), controls)
+				, _mm_or_si128(_mm_cmpeq_epi8(chars, quote), _mm_cmpeq_epi8(chars, backslash)));
+		int mask=_mm_movemask_epi8(unsafe);
+		if(mask!=0) return i+__builtin_ctz(mask);
+	}
+#endif
+	while(i<fromLen && jsonEscapes[from[i]]==0) i++;
+	return i;
+}
+
+static int json_escape_append(OclArena *arena, char **buffer, size_t *len, size_t *size, char const *from, size_t fromLen){
+	static char const hex[]="0123456789abcdef";
+	unsigned char const *chars=(unsigned char const *) from;
+	size_t i=0;
+	while(i<fromLen){
+		size_t run=json_safe_run(chars+i, fromLen-i);
+		if(run>0){
+			int retVal=buffer_append(arena, buffer, len, size, from+i, run);
+			if(retVal!=OCL_RETURN_OK) return retVal;
+			i+=run;
+			if(i==fromLen) break;
 		}
+		unsigned char escape=jsonEscapes[chars[i]];
+		char seq[6]={'\\', (char) escape, '0', '0', hex[chars[i]>>4], hex[chars[i]&0x0f]};
+		int retVal=buffer_append(arena, buffer, len, size, seq, (escape=='u')?6:2);
+		if(retVal!=OCL_RETURN_OK) return retVal;
+		i++;
 	}
-	(*stringTo)[cont]=0;
 	return OCL_RETURN_OK;
 }
 
+int OCl_parse_string(char **stringTo, char const *stringFrom){
+	if(stringFrom==NULL) return OCL_RETURN_OK;
+	if(*stringTo) sfree(*stringTo);
+	// Sized for a few escapes, grown (doubled) only if there are more.
+	size_t fromLen=strlen(stringFrom), len=0, size=fromLen+fromLen/16+16;
+	if((*stringTo=malloc(size))==NULL) return OCL_ERR_MALLOC;
+	(*stringTo)[0]=0;
+	return json_escape_append(NULL, stringTo, &len, &size, stringFrom, fromLen);
+}
+
 char * OCL_get_response(OCl *ocl){ return ocl->ocl_resp->content;}
 char * OCL_get_response_thoughts(OCl *ocl){ return ocl->ocl_resp->thoughts;}
 int OCL_get_response_tools(OCl *ocl, char ***tools){
 	if(ocl->ocl_resp->contTools==0) return 0;
 	*tools=(char **) malloc(ocl->ocl_resp->contTools * sizeof(char *));
-	memset(*tools, 0, ocl->ocl_resp->contTools * sizeof(char *));
+	if(*tools==NULL) return OCL_ERR_MALLOC;
 	for(int i=0;i<ocl->ocl_resp->contTools;i++){
-		(*tools)[i]=malloc(512);
-		memset((*tools)[i],0,512);
-		snprintf((*tools)[i],512-1,ocl->ocl_resp->toolCalls[i]);
+		size_t len=strlen(ocl->ocl_resp->toolCalls[i])+1;
+		if(((*tools)[i]=malloc(len))!=NULL) memcpy((*tools)[i], ocl->ocl_resp->toolCalls[i], len);
 	}
 	return ocl->ocl_resp->contTools;
 }
@@ -165,33 +428,49 @@ int OCL_get_response_prompt_eval_count(const OCl *ocl){ return ocl->ocl_resp->pr
 int OCL_get_response_eval_count(const OCl *ocl){ return ocl->ocl_resp->evalCount;}
 double OCL_get_response_tokens_per_sec(const OCl *ocl){ return ocl->ocl_resp->tokensPerSec;}
 int OCL_get_response_chars_content(const OCl *ocl){ return strlen(ocl->ocl_resp->content);}
+int OCL_get_response_stop_reason(const OCl *ocl){ return ocl->ocl_resp->stopReason;}
 long int OCL_get_response_size(const OCl *ocl){ return strlen(ocl->ocl_resp->response);}
 
 int OCl_set_server_addr(OCl *ocl, const char *serverAddr){
-	if(serverAddr!=NULL && strcmp(serverAddr,"")!=0) snprintf(ocl->srvAddr,512,"%s",serverAddr);
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(serverAddr==NULL || strcmp(serverAddr,"")==0) return OCL_RETURN_OK;
+	if(strlen(serverAddr)>=sizeof(ocl->srvAddr)) return OCL_ERR_SERVER_ADDR;
+	snprintf(ocl->srvAddr,sizeof(ocl->srvAddr),"%s",serverAddr);
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_server_port(OCl *ocl, const char *serverPort){
-	if(serverPort!=NULL && strcmp(serverPort,"")!=0){
-		char *tail=NULL;
-		ocl->srvPort=strtol(serverPort, &tail, 10);
-		if(ocl->srvPort<1||ocl->srvPort>65535|| tail[0]!=0) return OCL_ERR_PORT;
-	}
+int OCl_set_server_port(OCl *ocl, int serverPort){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(serverPort<1 || serverPort>65535) return OCL_ERR_PORT;
+	ocl->srvPort=serverPort;
 	return OCL_RETURN_OK;
 }
 
 int OCl_set_apiKey(OCl *ocl, const char *apiKey){
-	snprintf(ocl->apiKey,1024,"%s",apiKey);
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(apiKey==NULL || strlen(apiKey)>=sizeof(ocl->apiKey)) return OCL_ERR_API_KEY;
+	snprintf(ocl->apiKey,sizeof(ocl->apiKey),"%s",apiKey);
 	return OCL_RETURN_OK;
 }
 
 int OCl_set_model(OCl *ocl, const char *model){
-	snprintf(ocl->model,512,"%s",model);
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(model==NULL || strlen(model)>=sizeof(ocl->model)) return OCL_ERR_MODEL_NAME;
+	snprintf(ocl->model,sizeof(ocl->model),"%s",model);
 	return OCL_RETURN_OK;
 }
 
+// The levels accepted by the server's 'think' field ("low", "medium" and "high" are sent as strings).
+static bool think_valid(char const *think){
+	static char const *levels[]={"false", "true", "low", "medium", "high"};
+	if(think==NULL) return false;
+	for(size_t i=0;i<sizeof(levels)/sizeof(levels[0]);i++) if(strcmp(think, levels[i])==0) return true;
+	return false;
+}
+
 int OCl_set_think(OCl *ocl,const char *think){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(!think_valid(think)) return OCL_ERR_THINK;
 	if(strcmp(think,"false")==0 || strcmp(think,"true")==0){
 		snprintf(ocl->think,16,"%s", think);
 	}else{
@@ -200,137 +479,195 @@ int OCl_set_think(OCl *ocl,const char *think){
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_keepalive(OCl *ocl, char const *keepalive){
-	if(keepalive!=NULL && strcmp(keepalive,"")!=0){
-		char *tail=NULL;
-		ocl->keepalive=strtol(keepalive,&tail,10);
-		if(ocl->keepalive<1 || tail[0]!=0) return OCL_ERR_KEEP_ALIVE;
-	}
+int OCl_set_keepalive(OCl *ocl, int keepalive){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(keepalive<1) return OCL_ERR_KEEP_ALIVE;
+	ocl->keepalive=keepalive;
 	return OCL_RETURN_OK;
 }
 
 int OCl_set_role(OCl *ocl, const char *role){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
 	sfree(ocl->systemRole);
-	ocl->systemRole=malloc(1);
+	if((ocl->systemRole=malloc(1))==NULL) return OCL_ERR_MALLOC;
 	ocl->systemRole[0]=0;
-	OCl_parse_string(&(ocl->systemRole), role);
+	return OCl_parse_string(&(ocl->systemRole), role);
+}
+
+int OCl_set_timeouts(OCl *ocl, int connectTo, int sendTo, int recvTo){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(connectTo<1) return OCL_ERR_SOCKET_CONNECTION_TIMEOUT_NOT_VALID;
+	if(sendTo<1) return OCL_ERR_SOCKET_SEND_TIMEOUT_NOT_VALID;
+	if(recvTo<1) return OCL_ERR_SOCKET_RECV_TIMEOUT_NOT_VALID;
+	ocl->socketConnectTimeout=connectTo;
+	ocl->socketSendTimeout=sendTo;
+	ocl->socketRecvTimeout=recvTo;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_connect_timeout(OCl *ocl, char const *connectto){
-	if(connectto!=NULL && strcmp(connectto,"")!=0){
-		char *tail=NULL;
-		ocl->socketConnectTimeout=strtol(connectto, &tail, 10);
-		if(ocl->socketConnectTimeout<1||tail[0]!=0) return OCL_ERR_SOCKET_CONNECTION_TIMEOUT_NOT_VALID;
-	}
+int OCl_set_temp(OCl *ocl, double temp){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(temp<0.0) return OCL_ERR_TEMP;
+	ocl->temp=temp;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_send_timeout(OCl *ocl, char const *sendto){
-	if(sendto!=NULL && strcmp(sendto,"")!=0){
-		char *tail=NULL;
-		ocl->socketSendTimeout=strtol(sendto, &tail, 10);
-		if(ocl->socketSendTimeout<1||tail[0]!=0) return OCL_ERR_SOCKET_SEND_TIMEOUT_NOT_VALID;
-	}
+int OCl_set_repeat_last_n(OCl *ocl, int repeat_last_n){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(repeat_last_n < -1) return OCL_ERR_REPEAT_LAST_N;
+	ocl->repeat_last_n=repeat_last_n;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_recv_timeout(OCl *ocl, char const *recvto){
-	if(recvto!=NULL && strcmp(recvto,"")!=0){
-		char *tail=NULL;
-		ocl->socketRecvTimeout=strtol(recvto, &tail, 10);
-		if(ocl->socketRecvTimeout<1||tail[0]!=0) return OCL_ERR_SOCKET_RECV_TIMEOUT_NOT_VALID;
-	}
+int OCl_set_repeat_penalty(OCl *ocl, double repeat_penalty){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(repeat_penalty<0.0) return OCL_ERR_REPEAT_PENALTY;
+	ocl->repeat_penalty=repeat_penalty;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_temp(OCl *ocl, char const *temp){
-	if(temp!=NULL && strcmp(temp,"")!=0){
-		char *tail=NULL;
-		ocl->temp=strtod(temp,&tail);
-		if(ocl->temp<0.0 || tail[0]!=0) return OCL_ERR_TEMP;
-	}
+int OCl_set_seed(OCl *ocl, int seed){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(seed<0) return OCL_ERR_SEED;
+	ocl->seed=seed;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_repeat_last_n(OCl *ocl, char const *repeat_last_n){
-	if(repeat_last_n!=NULL && strcmp(repeat_last_n,"")!=0){
-		char *tail=NULL;
-		ocl->repeat_last_n=strtol(repeat_last_n,&tail,10);
-		if(ocl->repeat_last_n < -1 || tail[0]!=0) return OCL_ERR_REPEAT_LAST_N;
-	}
+int OCl_set_top_k(OCl *ocl, int top_k){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(top_k<0) return OCL_ERR_TOP_K;
+	ocl->top_k=top_k;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_repeat_penalty(OCl *ocl, char const *repeat_penalty){
-	if(repeat_penalty!=NULL && strcmp(repeat_penalty,"")!=0){
-		char *tail=NULL;
-		ocl->repeat_penalty=strtod(repeat_penalty,&tail);
-		if(ocl->repeat_penalty<0.0 || tail[0]!=0) return OCL_ERR_REPEAT_PENALTY;
-	}
+int OCl_set_top_p(OCl *ocl, double top_p){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(top_p<0) return OCL_ERR_TOP_P;
+	ocl->top_p=top_p;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_seed(OCl *ocl, char const *seed){
-	if(seed!=NULL && strcmp(seed,"")!=0){
-		char *tail=NULL;
-		ocl->seed=strtol(seed,&tail,10);
-		if(ocl->seed<0 || tail[0]!=0) return OCL_ERR_SEED;
-	}
+int OCl_set_min_p(OCl *ocl, double min_p){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(min_p<0) return OCL_ERR_MIN_P;
+	ocl->min_p=min_p;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_top_k(OCl *ocl, char const *top_k){
-	if(top_k!=NULL && strcmp(top_k,"")!=0){
-		char *tail=NULL;
-		ocl->top_k=strtol(top_k,&tail,10);
-		if(ocl->top_k<0 || tail[0]!=0) return OCL_ERR_TOP_K;
-	}
+int OCl_set_num_predict(OCl *ocl, int num_predict){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(num_predict < -1) return OCL_ERR_NUM_PREDICT;
+	ocl->num_predict=num_predict;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_top_p(OCl *ocl, char const *top_p){
-	if(top_p!=NULL && strcmp(top_p,"")!=0){
-		char *tail=NULL;
-		ocl->top_p=strtod(top_p,&tail);
-		if(ocl->top_p<0 || tail[0]!=0) return OCL_ERR_TOP_P;
-	}
+int OCl_set_max_history_ctx(OCl *ocl, int maxHistoryCtx){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(maxHistoryCtx<0) return OCL_ERR_MAX_HISTORY_CTX;
+	ocl->maxHistoryCtx=maxHistoryCtx;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_min_p(OCl *ocl, char const *min_p){
-	if(min_p!=NULL && strcmp(min_p,"")!=0){
-		char *tail=NULL;
-		ocl->min_p=strtod(min_p,&tail);
-		if(ocl->min_p<0 || tail[0]!=0) return OCL_ERR_MIN_P;
-	}
+int OCl_set_max_tokens_ctx(OCl *ocl, int maxTokensCtx){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(maxTokensCtx<0) return OCL_ERR_MAX_TOKENS_CTX;
+	ocl->maxTokensCtx=maxTokensCtx;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_num_predict(OCl *ocl, char const *num_predict){
-	if(num_predict!=NULL && strcmp(num_predict,"")!=0){
-		char *tail=NULL;
-		ocl->num_predict=strtol(num_predict,&tail,10);
-		if(ocl->num_predict < -1 || tail[0]!=0) return OCL_ERR_NUM_PREDICT;
-	}
+/*
+ * Validates every field before touching the instance, so a rejected profile leaves it as it was. Numeric fields are
+ * always applied; NULL strings keep the current value. The file fields are read only by OCl_get_instance_config().
+ */
+int OCl_configure(OCl *ocl, const OCl_config *cfg){
+	if(ocl==NULL || cfg==NULL) return OCL_ERR_NULL_STRUCT;
+	int retVal=OCL_RETURN_OK;
+	if(cfg->serverPort<1 || cfg->serverPort>65535) return OCL_ERR_PORT;
+	if(cfg->connectTimeout<1) return OCL_ERR_SOCKET_CONNECTION_TIMEOUT_NOT_VALID;
+	if(cfg->sendTimeout<1) return OCL_ERR_SOCKET_SEND_TIMEOUT_NOT_VALID;
+	if(cfg->recvTimeout<1) return OCL_ERR_SOCKET_RECV_TIMEOUT_NOT_VALID;
+	if(cfg->keepAlive<1) return OCL_ERR_KEEP_ALIVE;
+	if(cfg->temp<0.0) return OCL_ERR_TEMP;
+	if(cfg->repeatLastN < -1) return OCL_ERR_REPEAT_LAST_N;
+	if(cfg->repeatPenalty<0.0) return OCL_ERR_REPEAT_PENALTY;
+	if(cfg->seed<0) return OCL_ERR_SEED;
+	if(cfg->topK<0) return OCL_ERR_TOP_K;
+	if(cfg->topP<0) return OCL_ERR_TOP_P;
+	if(cfg->minP<0) return OCL_ERR_MIN_P;
+	if(cfg->numPredict < -1) return OCL_ERR_NUM_PREDICT;
+	if(cfg->maxHistoryCtx<0) return OCL_ERR_MAX_HISTORY_CTX;
+	if(cfg->maxTokensCtx<0) return OCL_ERR_MAX_TOKENS_CTX;
+	if(cfg->serverAddr!=NULL && strlen(cfg->serverAddr)>=sizeof(ocl->srvAddr)) return OCL_ERR_SERVER_ADDR;
+	if(cfg->apiKey!=NULL && strlen(cfg->apiKey)>=sizeof(ocl->apiKey)) return OCL_ERR_API_KEY;
+	if(cfg->model!=NULL && strlen(cfg->model)>=sizeof(ocl->model)) return OCL_ERR_MODEL_NAME;
+	if(cfg->think!=NULL && !think_valid(cfg->think)) return OCL_ERR_THINK;
+	// First: the only one that can fail (memory).
+	if(cfg->systemRole!=NULL && (retVal=OCl_set_role(ocl, cfg->systemRole))!=OCL_RETURN_OK) return retVal;
+	OCl_set_server_addr(ocl, cfg->serverAddr);
+	ocl->srvPort=cfg->serverPort;
+	ocl->socketConnectTimeout=cfg->connectTimeout;
+	ocl->socketSendTimeout=cfg->sendTimeout;
+	ocl->socketRecvTimeout=cfg->recvTimeout;
+	if(cfg->apiKey!=NULL) OCl_set_apiKey(ocl, cfg->apiKey);
+	if(cfg->model!=NULL) OCl_set_model(ocl, cfg->model);
+	if(cfg->think!=NULL) OCl_set_think(ocl, cfg->think);
+	ocl->keepalive=cfg->keepAlive;
+	ocl->temp=cfg->temp;
+	ocl->repeat_last_n=cfg->repeatLastN;
+	ocl->repeat_penalty=cfg->repeatPenalty;
+	ocl->seed=cfg->seed;
+	ocl->top_k=cfg->topK;
+	ocl->top_p=cfg->topP;
+	ocl->min_p=cfg->minP;
+	ocl->num_predict=cfg->numPredict;
+	ocl->maxHistoryCtx=cfg->maxHistoryCtx;
+	ocl->maxTokensCtx=cfg->maxTokensCtx;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_max_history_ctx(OCl *ocl, char const *maxHistoryCtx){
-	if(maxHistoryCtx!=NULL && strcmp(maxHistoryCtx,"")!=0){
-		char *tail=NULL;
-		ocl->maxHistoryCtx=strtol(maxHistoryCtx,&tail,10);
-		if(ocl->maxHistoryCtx<0 || tail[0]!=0) return OCL_ERR_MAX_HISTORY_CTX;
-	}
+void OCl_config_defaults(OCl_config *cfg){
+	memset(cfg, 0, sizeof(OCl_config));
+	cfg->serverAddr=OCL_OLLAMA_SERVER_ADDR;
+	cfg->serverPort=strtol(OCL_OLLAMA_SERVER_PORT, NULL, 10);
+	cfg->connectTimeout=strtol(OCL_SOCKET_CONNECT_TIMEOUT_S, NULL, 10);
+	cfg->sendTimeout=strtol(OCL_SOCKET_SEND_TIMEOUT_S, NULL, 10);
+	cfg->recvTimeout=strtol(OCL_SOCKET_RECV_TIMEOUT_S, NULL, 10);
+	cfg->apiKey=OCL_API_KEY;
+	cfg->model=OCL_MODEL;
+	cfg->think="false";
+	cfg->keepAlive=strtol(OCL_KEEPALIVE_S, NULL, 10);
+	cfg->systemRole=OCL_SYSTEM_ROLE;
+	cfg->temp=strtod(OCL_TEMP, NULL);
+	cfg->repeatLastN=strtol(OCL_REPEAT_LAST_N, NULL, 10);
+	cfg->repeatPenalty=strtod(OCL_REPEAT_PENALTY, NULL);
+	cfg->seed=strtol(OCL_SEED, NULL, 10);
+	cfg->topK=strtol(OCL_TOP_K, NULL, 10);
+	cfg->topP=strtod(OCL_TOP_P, NULL);
+	cfg->minP=strtod(OCL_MIN_P, NULL);
+	cfg->numPredict=strtol(OCL_NUM_PREDICT, NULL, 10);
+	cfg->maxHistoryCtx=strtol(OCL_MAX_HISTORY_CTX, NULL, 10);
+	cfg->maxTokensCtx=strtol(OCL_MAX_TOKENS_CTX, NULL, 10);
+}
+
+/*
+ * String front-ends for OCl_get_instance(): NULL or "" keeps the default. The range checks are left to
+ * OCl_configure(), here only the syntax is checked.
+ */
+static int config_parse_int(char const *value, int *out, int error){
+	if(value==NULL || strcmp(value,"")==0) return OCL_RETURN_OK;
+	char *tail=NULL;
+	long int v=strtol(value, &tail, 10);
+	if(tail[0]!=0 || v<INT_MIN || v>INT_MAX) return error;
+	*out=v;
 	return OCL_RETURN_OK;
 }
 
-static int OCl_set_max_tokens_ctx(OCl *ocl, char const *maxTokensCtx){
-	if(maxTokensCtx!=NULL && strcmp(maxTokensCtx,"")!=0){
-		char *tail=NULL;
-		ocl->maxTokensCtx=strtol(maxTokensCtx,&tail,10);
-		if(ocl->maxTokensCtx<0 || tail[0]!=0) return OCL_ERR_MAX_TOKENS_CTX;
-	}
+static int config_parse_double(char const *value, double *out, int error){
+	if(value==NULL || strcmp(value,"")==0) return OCL_RETURN_OK;
+	char *tail=NULL;
+	double v=strtod(value, &tail);
+	if(tail[0]!=0) return error;
+	*out=v;
 	return OCL_RETURN_OK;
 }
 
@@ -349,96 +686,206 @@ int OCl_init(){
 	return OCL_RETURN_OK;
 }
 
-static int OCl_flush_static_context(OCl *ocl){
-	while(ocl->rootStaticContextMessages!=NULL){
-		Message *temp=ocl->rootStaticContextMessages;
-		ocl->rootStaticContextMessages=temp->nextMessage;
-		sfree(temp->userMessage);
-		sfree(temp->assistantMessage);
-		sfree(temp);
+// The strings are kept in the same block.
+static Message *message_new(char const *userMessage, char const *assistantMessage){
+	size_t userLen=strlen(userMessage), assistantLen=strlen(assistantMessage);
+	Message *message=malloc(sizeof(Message)+userLen+assistantLen+2);
+	if(message==NULL) return NULL;
+	atomic_init(&message->refs, 1);
+	message->userMessage=(char *) (message+1);
+	message->assistantMessage=message->userMessage+userLen+1;
+	memcpy(message->userMessage, userMessage, userLen+1);
+	memcpy(message->assistantMessage, assistantMessage, assistantLen+1);
+	return message;
+}
+
+static void message_release(Message *message){
+	if(message!=NULL && atomic_fetch_sub(&message->refs, 1)==1) sfree(message);
+}
+
+static MessageList *message_list_retain(MessageList *list){
+	if(list!=NULL) atomic_fetch_add(&list->refs, 1);
+	return list;
+}
+
+static void message_list_release(MessageList *list){
+	if(list==NULL || atomic_fetch_sub(&list->refs, 1)>1) return;
+	for(int i=0;i<list->cant;i++) message_release(list->messages[i]);
+	sfree(list);
+}
+
+static int message_list_count(MessageList const *list){
+	return (list!=NULL)?list->cant:0;
+}
+
+/*
+ * Makes '*list' writable, with room for one more message: when shared, the holder gets its own copy (the messages
+ * are retained, not copied).
+ */
+static int message_list_own(MessageList **list){
+	MessageList *old=*list;
+	int cant=(old!=NULL)?old->cant:0, size=(old!=NULL)?old->size:0;
+	if(old!=NULL && atomic_load(&old->refs)==1 && cant<size) return OCL_RETURN_OK;
+	if(cant>=size) size=(size>0)?size*2:8;
+	if(old!=NULL && atomic_load(&old->refs)==1){
+		MessageList *list2=realloc(old, sizeof(MessageList)+sizeof(Message *)*size);
+		if(list2==NULL) return OCL_ERR_REALLOC;
+		list2->size=size;
+		*list=list2;
+		return OCL_RETURN_OK;
+	}
+	MessageList *copy=malloc(sizeof(MessageList)+sizeof(Message *)*size);
+	if(copy==NULL) return OCL_ERR_MALLOC;
+	atomic_init(&copy->refs, 1);
+	copy->cant=cant;
+	copy->size=size;
+	for(int i=0;i<cant;i++){
+		copy->messages[i]=old->messages[i];
+		atomic_fetch_add(&copy->messages[i]->refs, 1);
 	}
-	ocl->rootStaticContextMessages=0;
+	message_list_release(old);
+	*list=copy;
 	return OCL_RETURN_OK;
 }
 
-int OCl_flush_context(OCl *ocl){
-	while(ocl->rootContextMessages!=NULL){
-		Message *temp=ocl->rootContextMessages;
-		ocl->rootContextMessages=temp->nextMessage;
-		sfree(temp->userMessage);
-		sfree(temp->assistantMessage);
-		sfree(temp);
+// 'maxMessages'<0: no limit. Otherwise the oldest ones are dropped (keeping, at least, the new one).
+static int message_list_append(MessageList **list, char const *userMessage, char const *assistantMessage
+		, int maxMessages){
+	Message *message=message_new(userMessage, assistantMessage);
+	if(message==NULL) return OCL_ERR_MALLOC;
+	int retVal=message_list_own(list);
+	if(retVal!=OCL_RETURN_OK){
+		message_release(message);
+		return retVal;
 	}
-	ocl->contContextMessages=0;
+	MessageList *l=*list;
+	int drop=(maxMessages>=0 && l->cant>=maxMessages)?l->cant-maxMessages+1:0;
+	if(drop>l->cant) drop=l->cant;
+	if(drop>0){
+		for(int i=0;i<drop;i++) message_release(l->messages[i]);
+		memmove(l->messages, l->messages+drop, sizeof(Message *)*(l->cant-drop));
+		l->cant-=drop;
+	}
+	l->messages[l->cant++]=message;
+	return OCL_RETURN_OK;
+}
+
+static int OCl_flush_static_context(OCl *ocl){
+	message_list_release(ocl->staticContextMessages);
+	ocl->staticContextMessages=NULL;
+	return OCL_RETURN_OK;
+}
+
+int OCl_flush_context(OCl *ocl){
+	message_list_release(ocl->contextMessages);
+	ocl->contextMessages=NULL;
+	sfree(ocl->genContext);
+	ocl->genContext=NULL;
+	ocl->cantGenContext=0;
 	return OCL_RETURN_OK;
 }
 
 int OCl_shutdown(){
+	OCl_metrics_stop_serving();
 	SSL_CTX_free(oclSslCtx);
 	oclSslCtx = NULL;
 	return OCL_RETURN_OK;
 }
 
+static struct _ocl_response *ocl_response_new(){
+	struct _ocl_response *oclResp=malloc(sizeof(struct _ocl_response));
+	oclResp->thoughts=malloc(BUFFER_SIZE_1M);
+	oclResp->thoughts[0]=0;
+	oclResp->content=malloc(BUFFER_SIZE_1M);
+	oclResp->content[0]=0;
+	oclResp->response=malloc(BUFFER_SIZE_1M);
+	oclResp->response[0]=0;
+	oclResp->contTools=0;
+	oclResp->done=false;
+	oclResp->stopReason=OCL_STOP_NONE;
+	memset(oclResp->error,0,BUFFER_SIZE_1K);
+	oclResp->context=NULL;
+	oclResp->cantContext=0;
+	oclResp->contextSize=0;
+	return oclResp;
+}
+
+static void ocl_response_free(struct _ocl_response *oclResp){
+	sfree(oclResp->thoughts);
+	sfree(oclResp->content);
+	sfree(oclResp->response);
+	sfree(oclResp->context);
+	sfree(oclResp);
+}
+
+/*
+ * Shadow: a copy of the connection settings with its own response buffers, for requests made from other threads.
+ * It doesn't own (nor see) context, role, tools or caches.
+ */
+static OCl *ocl_shadow_new(OCl const *ocl){
+	OCl *shadow=malloc(sizeof(OCl));
+	if(shadow==NULL) return NULL;
+	memcpy(shadow, ocl, sizeof(OCl));
+	shadow->contextMessages=NULL;
+	shadow->staticContextMessages=NULL;
+	shadow->systemRole=NULL;
+	shadow->staticContextFile=NULL;
+	shadow->contextFile=NULL;
+	shadow->tools=NULL;
+	shadow->cache=NULL;
+	shadow->models=NULL;
+	shadow->warmup=NULL;
+	shadow->vindex=NULL;
+	shadow->format=NULL;
+	shadow->stop=NULL;
+	shadow->maxChars=shadow->maxTime=0;
+	shadow->genContext=NULL;
+	shadow->cantGenContext=0;
+	memset(&shadow->arena, 0, sizeof(OclArena));
+	shadow->stream=NULL;
+	atomic_init(&shadow->canceled, false);
+	pthread_mutex_init(&shadow->connMutex, NULL);
+	shadow->activeSocket=-1;
+	shadow->ocl_resp=ocl_response_new();
+	return shadow;
+}
+
+static void ocl_shadow_free(OCl *shadow){
+	if(shadow==NULL) return;
+	arena_free(&shadow->arena);
+	pthread_mutex_destroy(&shadow->connMutex);
+	ocl_response_free(shadow->ocl_resp);
+	sfree(shadow);
+}
+
 int OCl_free(OCl *ocl){
 	if(!ocl) return OCL_RETURN_OK;
 	OCl_flush_context(ocl);
 	OCl_flush_static_context(ocl);
-	sfree(ocl->rootContextMessages);
-	sfree(ocl->rootStaticContextMessages);
 	sfree(ocl->staticContextFile);
 	sfree(ocl->contextFile);
 	sfree(ocl->systemRole);
 	sfree(ocl->tools);
-	sfree(ocl->ocl_resp->thoughts);
-	sfree(ocl->ocl_resp->content);
-	sfree(ocl->ocl_resp->response);
-	sfree(ocl->ocl_resp);
+	OCl_set_response_cache(ocl, 0, 0, 0, NULL);
+	warmup_free(ocl);
+	vindex_free(ocl);
+	format_release(ocl->format);
+	stop_release(ocl->stop);
+	models_free(ocl);
+	arena_free(&ocl->arena);
+	http_stream_delete(ocl->stream);
+	pthread_mutex_destroy(&ocl->connMutex);
+	ocl_response_free(ocl->ocl_resp);
 	sfree(ocl);
 	return OCL_RETURN_OK;
 }
 
 static void create_new_static_context_message(OCl *ocl, char *userMessage, char *assistantMessage){
-	Message *newMessage=malloc(sizeof(Message));
-	newMessage->userMessage=malloc(strlen(userMessage)+1);
-	snprintf(newMessage->userMessage,strlen(userMessage)+1,"%s",userMessage);
-	newMessage->assistantMessage=malloc(strlen(assistantMessage)+1);
-	snprintf(newMessage->assistantMessage,strlen(assistantMessage)+1,"%s",assistantMessage);
-	Message *temp=ocl->rootStaticContextMessages;
-	if(temp!=NULL){
-		while(temp->nextMessage!=NULL) temp=temp->nextMessage;
-		temp->nextMessage=newMessage;
-	}else{
-		ocl->rootStaticContextMessages=newMessage;
-	}
-	newMessage->nextMessage=NULL;
+	message_list_append(&ocl->staticContextMessages, userMessage, assistantMessage, -1);
 }
 
 static void create_new_context_message(OCl *ocl, char *userMessage, char *assistantMessage){
-	Message *newMessage=malloc(sizeof(Message));
-	newMessage->userMessage=malloc(strlen(userMessage)+1);
-	snprintf(newMessage->userMessage,strlen(userMessage)+1,"%s",userMessage);
-	newMessage->assistantMessage=malloc(strlen(assistantMessage)+1);
-	snprintf(newMessage->assistantMessage,strlen(assistantMessage)+1,"%s",assistantMessage);
-	if(ocl->rootContextMessages!=NULL){
-		if(ocl->contContextMessages>=ocl->maxHistoryCtx){
-			Message *temp=ocl->rootContextMessages->nextMessage;
-			sfree(ocl->rootContextMessages->userMessage);
-			sfree(ocl->rootContextMessages->assistantMessage);
-			sfree(ocl->rootContextMessages);
-			ocl->rootContextMessages=temp;
-		}
-		Message *temp=ocl->rootContextMessages;
-		if(temp!=NULL){
-			while(temp->nextMessage!=NULL) temp=temp->nextMessage;
-			temp->nextMessage=newMessage;
-		}else{
-			ocl->rootContextMessages=newMessage;
-		}
-	}else{
-		ocl->rootContextMessages=newMessage;
-	}
-	newMessage->nextMessage=NULL;
-	ocl->contContextMessages++;
+	message_list_append(&ocl->contextMessages, userMessage, assistantMessage, ocl->maxHistoryCtx);
 }
 
 static int OCl_import_static_context(OCl *ocl){
@@ -554,53 +1001,47 @@ static int OCl_import_tools(OCl *ocl, const char *toolsFile){
 	return OCL_RETURN_OK;
 }
 
-int OCl_get_instance(OCl **ocl, const char *serverAddr, const char *serverPort, const char *socketConnTo, 
-		const char *socketSendTo,const char *socketRecvTo, const char *apiKey, const char *model
-		, const char *think, const char *keepAlive, const char *systemRole, const char *systemRoleFile
-		,const char *maxContextMsg, const char *temp
-		, const char *repeat_last_n, const char *repeat_penalty, const char *seed
-		, const char *top_k, const char *top_p, const char *min_p,const char *num_predict, const char *maxTokensCtx
-		,const char *contextFile, const char *contextStaticFile, const char *toolsFile){
-	*ocl=malloc(sizeof(OCl));
+int OCl_get_instance_config(OCl **ocl, const OCl_config *cfg){
+	if(cfg==NULL) return OCL_ERR_NULL_STRUCT;
+	if((*ocl=malloc(sizeof(OCl)))==NULL) return OCL_ERR_MALLOC;
 	int retVal=0;
+	memset(&(*ocl)->arena, 0, sizeof(OclArena));
 	(*ocl)->contextFile=NULL;
 	(*ocl)->staticContextFile=NULL;
-	(*ocl)->rootContextMessages=NULL;
-	(*ocl)->rootStaticContextMessages=NULL;
+	(*ocl)->contextMessages=NULL;
+	(*ocl)->staticContextMessages=NULL;
 	(*ocl)->systemRole=NULL;
 	(*ocl)->tools=NULL;
-	(*ocl)->ocl_resp=malloc(sizeof(struct _ocl_response));
-	(*ocl)->ocl_resp->thoughts=malloc(BUFFER_SIZE_1M);
-	(*ocl)->ocl_resp->thoughts[0]=0;
-	(*ocl)->ocl_resp->content=malloc(BUFFER_SIZE_1M);
-	(*ocl)->ocl_resp->content[0]=0;
-	(*ocl)->ocl_resp->response=malloc(BUFFER_SIZE_1M);
-	(*ocl)->ocl_resp->response[0]=0;
-	(*ocl)->ocl_resp->contTools=0;
-	for(int i=0;i<512;i++) memset((*ocl)->ocl_resp->toolCalls[i],0,512);
-	memset((*ocl)->ocl_resp->error,0,BUFFER_SIZE_1K);
-	(*ocl)->contContextMessages=0;
+	(*ocl)->cache=NULL;
+	(*ocl)->cantEndpoints=0;
+	(*ocl)->endpointPolicy=OCL_POLICY_ROUND_ROBIN;
+	(*ocl)->rrNext=0;
+	OCl_set_request_class(*ocl, OCL_PRIORITY_NORMAL, "", 0);
+	OCl_set_embed_pipeline(*ocl, OCL_EMBED_CONNECTIONS, OCL_EMBED_BATCH_INPUTS, OCL_EMBED_BATCH_BYTES);
+	memset((*ocl)->resolved, 0, sizeof((*ocl)->resolved));
+	OCl_set_retry_policy(*ocl, OCL_RETRY_MAX_ATTEMPTS, OCL_RETRY_BACKOFF_MS, NULL, 0);
+	(*ocl)->models=NULL;
+	(*ocl)->warmup=NULL;
+	(*ocl)->vindex=NULL;
+	(*ocl)->format=NULL;
+	(*ocl)->stop=NULL;
+	(*ocl)->maxChars=(*ocl)->maxTime=0;
+	(*ocl)->generate=false;
+	OCl_set_compression(*ocl, OCL_COMPRESSION_NONE, 0, OCL_COMPRESSION_MIN_SIZE);
+	(*ocl)->genContext=NULL;
+	(*ocl)->cantGenContext=0;
+	(*ocl)->genContextModel[0]=0;
+	(*ocl)->loadTimeout=OCL_LOAD_TIMEOUT_S;
+	(*ocl)->ocl_resp=ocl_response_new();
+	(*ocl)->stream=http_stream_new();
+	atomic_init(&(*ocl)->canceled, false);
+	pthread_mutex_init(&(*ocl)->connMutex, NULL);
+	(*ocl)->activeSocket=-1;
 	OCl_set_server_addr(*ocl, OCL_OLLAMA_SERVER_ADDR);
-	OCl_set_server_port(*ocl, OCL_OLLAMA_SERVER_PORT);
-	OCl_set_connect_timeout(*ocl, OCL_SOCKET_CONNECT_TIMEOUT_S);
-	OCl_set_send_timeout(*ocl, OCL_SOCKET_SEND_TIMEOUT_S);
-	OCl_set_recv_timeout(*ocl, OCL_SOCKET_RECV_TIMEOUT_S);
 	OCl_set_apiKey(*ocl, OCL_API_KEY);
 	OCl_set_model(*ocl, OCL_MODEL);
 	OCl_set_think(*ocl, "false");
-	OCl_set_keepalive(*ocl, OCL_KEEPALIVE_S);
-	OCl_set_temp(*ocl, OCL_TEMP);
-	OCl_set_repeat_last_n(*ocl, OCL_REPEAT_LAST_N);
-	OCl_set_repeat_penalty(*ocl, OCL_REPEAT_PENALTY);
-	OCl_set_seed(*ocl, OCL_SEED);
-	OCl_set_top_k(*ocl, OCL_TOP_K);
-	OCl_set_top_p(*ocl, OCL_TOP_P);
-	OCl_set_min_p(*ocl, OCL_MIN_P);
-	OCl_set_num_predict(*ocl, OCL_NUM_PREDICT);
-	OCl_set_max_history_ctx(*ocl, OCL_MAX_HISTORY_CTX);
-	OCl_set_max_tokens_ctx(*ocl, OCL_MAX_TOKENS_CTX);
 	OCl_set_role(*ocl, OCL_SYSTEM_ROLE);
-	OCl_set_role(*ocl, systemRole);
 	(*ocl)->ocl_resp->loadDuration=0.0;
 	(*ocl)->ocl_resp->promptEvalDuration=0.0;
 	(*ocl)->ocl_resp->evalDuration=0.0;
@@ -609,42 +1050,24 @@ int OCl_get_instance(OCl **ocl, const char *serverAddr, const char *serverPort,
 	(*ocl)->ocl_resp->evalCount=0;
 	(*ocl)->ocl_resp->tokensPerSec=0.0;
 	(*ocl)->ocl_resp->done=false;
-	OCl_set_server_addr(*ocl, serverAddr);
-	if((retVal=OCl_set_server_port(*ocl, serverPort))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_connect_timeout(*ocl, socketConnTo))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_send_timeout(*ocl, socketSendTo))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_recv_timeout(*ocl, socketRecvTo))!=OCL_RETURN_OK) return retVal;
-	OCl_set_apiKey(*ocl, apiKey);
-	OCl_set_model(*ocl, model);
-	OCl_set_think(*ocl, think);
-	if((retVal=OCl_set_keepalive(*ocl, keepAlive))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_temp(*ocl, temp))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_repeat_last_n(*ocl, repeat_last_n))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_repeat_penalty(*ocl, repeat_penalty))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_seed(*ocl, seed))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_top_k(*ocl, top_k))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_top_p(*ocl, top_p))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_min_p(*ocl, min_p))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_num_predict(*ocl, num_predict))!=OCL_RETURN_OK) return retVal;;
-	if((retVal=OCl_set_max_history_ctx(*ocl, maxContextMsg))!=OCL_RETURN_OK) return retVal;
-	if((retVal=OCl_set_max_tokens_ctx(*ocl, maxTokensCtx))!=OCL_RETURN_OK) return retVal;
-	if(systemRoleFile){
-		if((retVal=OCl_import_system_role(*ocl, systemRoleFile))!=OCL_RETURN_OK) return retVal;
-	}
-	if(contextStaticFile){
-		(*ocl)->staticContextFile=malloc(strlen(contextStaticFile)+1);
-		memset((*ocl)->staticContextFile,0,strlen(contextStaticFile)+1);
-		snprintf((*ocl)->staticContextFile,strlen(contextStaticFile)+1,"%s",contextStaticFile);
+	if((retVal=OCl_configure(*ocl, cfg))!=OCL_RETURN_OK) return retVal;
+	if(cfg->systemRoleFile){
+		if((retVal=OCl_import_system_role(*ocl, cfg->systemRoleFile))!=OCL_RETURN_OK) return retVal;
+	}
+	if(cfg->staticContextFile){
+		(*ocl)->staticContextFile=malloc(strlen(cfg->staticContextFile)+1);
+		memset((*ocl)->staticContextFile,0,strlen(cfg->staticContextFile)+1);
+		snprintf((*ocl)->staticContextFile,strlen(cfg->staticContextFile)+1,"%s",cfg->staticContextFile);
 		if((retVal=OCl_import_static_context(*ocl))!=OCL_RETURN_OK) return retVal;
 	}
-	if(contextFile){
-		(*ocl)->contextFile=malloc(strlen(contextFile)+1);
-		memset((*ocl)->contextFile,0,strlen(contextFile)+1);
-		snprintf((*ocl)->contextFile,strlen(contextFile)+1,"%s",contextFile);
+	if(cfg->contextFile){
+		(*ocl)->contextFile=malloc(strlen(cfg->contextFile)+1);
+		memset((*ocl)->contextFile,0,strlen(cfg->contextFile)+1);
+		snprintf((*ocl)->contextFile,strlen(cfg->contextFile)+1,"%s",cfg->contextFile);
 		if((retVal=OCl_import_context(*ocl))!=OCL_RETURN_OK) return retVal;
 	}
-	if(toolsFile){
-		if((retVal=OCl_import_tools(*ocl, toolsFile))!=OCL_RETURN_OK) return retVal;
+	if(cfg->toolsFile){
+		if((retVal=OCl_import_tools(*ocl, cfg->toolsFile))!=OCL_RETURN_OK) return retVal;
 	}else{
 		(*ocl)->tools=malloc(1);
 		memset((*ocl)->tools,0,1);
@@ -652,6 +1075,121 @@ int OCl_get_instance(OCl **ocl, const char *serverAddr, const char *serverPort,
 	return OCL_RETURN_OK;
 }
 
+int OCl_get_instance(OCl **ocl, const char *serverAddr, const char *serverPort, const char *socketConnTo, 
+		const char *socketSendTo,const char *socketRecvTo, const char *apiKey, const char *model
+		, const char *think, const char *keepAlive, const char *systemRole, const char *systemRoleFile
+		,const char *maxContextMsg, const char *temp
+		, const char *repeat_last_n, const char *repeat_penalty, const char *seed
+		, const char *top_k, const char *top_p, const char *min_p,const char *num_predict, const char *maxTokensCtx
+		,const char *contextFile, const char *contextStaticFile, const char *toolsFile){
+	OCl_config cfg;
+	int retVal=0;
+	*ocl=NULL;
+	OCl_config_defaults(&cfg);
+	if(serverAddr!=NULL) cfg.serverAddr=serverAddr;
+	if((retVal=config_parse_int(serverPort, &cfg.serverPort, OCL_ERR_PORT))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_int(socketConnTo, &cfg.connectTimeout, OCL_ERR_SOCKET_CONNECTION_TIMEOUT_NOT_VALID))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_int(socketSendTo, &cfg.sendTimeout, OCL_ERR_SOCKET_SEND_TIMEOUT_NOT_VALID))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_int(socketRecvTo, &cfg.recvTimeout, OCL_ERR_SOCKET_RECV_TIMEOUT_NOT_VALID))!=OCL_RETURN_OK) return retVal;
+	if(apiKey!=NULL) cfg.apiKey=apiKey;
+	if(model!=NULL) cfg.model=model;
+	if(think!=NULL) cfg.think=think;
+	if((retVal=config_parse_int(keepAlive, &cfg.keepAlive, OCL_ERR_KEEP_ALIVE))!=OCL_RETURN_OK) return retVal;
+	if(systemRole!=NULL) cfg.systemRole=systemRole;
+	cfg.systemRoleFile=systemRoleFile;
+	if((retVal=config_parse_int(maxContextMsg, &cfg.maxHistoryCtx, OCL_ERR_MAX_HISTORY_CTX))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_double(temp, &cfg.temp, OCL_ERR_TEMP))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_int(repeat_last_n, &cfg.repeatLastN, OCL_ERR_REPEAT_LAST_N))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_double(repeat_penalty, &cfg.repeatPenalty, OCL_ERR_REPEAT_PENALTY))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_int(seed, &cfg.seed, OCL_ERR_SEED))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_int(top_k, &cfg.topK, OCL_ERR_TOP_K))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_double(top_p, &cfg.topP, OCL_ERR_TOP_P))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_double(min_p, &cfg.minP, OCL_ERR_MIN_P))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_int(num_predict, &cfg.numPredict, OCL_ERR_NUM_PREDICT))!=OCL_RETURN_OK) return retVal;
+	if((retVal=config_parse_int(maxTokensCtx, &cfg.maxTokensCtx, OCL_ERR_MAX_TOKENS_CTX))!=OCL_RETURN_OK) return retVal;
+	cfg.contextFile=contextFile;
+	cfg.staticContextFile=contextStaticFile;
+	cfg.toolsFile=toolsFile;
+	return OCl_get_instance_config(ocl, &cfg);
+}
+
+struct _ocl_conversation{
+	MessageList *contextMessages;
+	int32_t *genContext;
+	int cantGenContext;
+	char genContextModel[512];
+};
+
+/*
+ * Snapshot: the conversation of an instance (history and '/api/generate' token context) at a given time. The history
+ * is shared, not copied, so taking it doesn't depend on its length. The instance can go on, or be flushed, meanwhile.
+ */
+int OCl_snapshot(OCl *ocl, OCl_conversation **snapshot){
+	if(ocl==NULL || snapshot==NULL) return OCL_ERR_NULL_STRUCT;
+	OCl_conversation *snap=malloc(sizeof(OCl_conversation));
+	if(snap==NULL) return OCL_ERR_MALLOC;
+	snap->genContext=NULL;
+	snap->cantGenContext=0;
+	if(ocl->cantGenContext>0){
+		if((snap->genContext=malloc(sizeof(int32_t)*ocl->cantGenContext))==NULL){
+			sfree(snap);
+			return OCL_ERR_MALLOC;
+		}
+		memcpy(snap->genContext, ocl->genContext, sizeof(int32_t)*ocl->cantGenContext);
+		snap->cantGenContext=ocl->cantGenContext;
+	}
+	snprintf(snap->genContextModel, sizeof(snap->genContextModel), "%s", ocl->genContextModel);
+	snap->contextMessages=message_list_retain(ocl->contextMessages);
+	*snapshot=snap;
+	return OCL_RETURN_OK;
+}
+
+int OCl_snapshot_free(OCl_conversation *snapshot){
+	if(snapshot==NULL) return OCL_RETURN_OK;
+	message_list_release(snapshot->contextMessages);
+	sfree(snapshot->genContext);
+	sfree(snapshot);
+	return OCL_RETURN_OK;
+}
+
+/*
+ * Fork: a new instance with the settings, role, tools and static context of 'ocl', going on from 'snapshot' (or from
+ * the current conversation of 'ocl', when NULL). Branches are independent instances: they can be sent concurrently
+ * and freed in any order. They don't append to the context file, and get no response cache, warm-up or models
+ * refreshing of their own.
+ */
+int OCl_fork(OCl *ocl, OCl_conversation const *snapshot, OCl **branch){
+	if(ocl==NULL || branch==NULL) return OCL_ERR_NULL_STRUCT;
+	OCl *fork=ocl_shadow_new(ocl);
+	if(fork==NULL) return OCL_ERR_MALLOC;
+	fork->stream=http_stream_new();
+	fork->systemRole=strdup(ocl->systemRole);
+	fork->tools=strdup(ocl->tools);
+	if(ocl->staticContextFile!=NULL) fork->staticContextFile=strdup(ocl->staticContextFile);
+	fork->staticContextMessages=message_list_retain(ocl->staticContextMessages);
+	fork->format=format_retain(ocl->format);
+	fork->stop=stop_retain(ocl->stop);
+	int32_t const *genContext=(snapshot!=NULL)?snapshot->genContext:ocl->genContext;
+	int cantGenContext=(snapshot!=NULL)?snapshot->cantGenContext:ocl->cantGenContext;
+	if(snapshot!=NULL) snprintf(fork->genContextModel, sizeof(fork->genContextModel), "%s", snapshot->genContextModel);
+	fork->contextMessages=message_list_retain((snapshot!=NULL)?snapshot->contextMessages:ocl->contextMessages);
+	if(cantGenContext>0 && (fork->genContext=malloc(sizeof(int32_t)*cantGenContext))!=NULL){
+		memcpy(fork->genContext, genContext, sizeof(int32_t)*cantGenContext);
+		fork->cantGenContext=cantGenContext;
+	}
+	int retVal=OCL_RETURN_OK;
+	if(fork->stream==NULL || fork->systemRole==NULL || fork->tools==NULL
+			|| (ocl->staticContextFile!=NULL && fork->staticContextFile==NULL)
+			|| (cantGenContext>0 && fork->genContext==NULL)) retVal=OCL_ERR_MALLOC;
+	if(retVal==OCL_RETURN_OK) retVal=vindex_fork(ocl, fork);
+	if(retVal!=OCL_RETURN_OK){
+		OCl_free(fork);
+		return retVal;
+	}
+	*branch=fork;
+	return OCL_RETURN_OK;
+}
+
 static void clean_ssl(SSL *ssl){
 	SSL_free_buffers(ssl);
 	SSL_certs_clear(ssl);
@@ -839,6 +1377,78 @@ char * OCL_error_handling(OCl *ocl, int error){
 	case OCL_ERR_MSG_FOUND:
 		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: %s", ocl->ocl_resp->error);
 		break;
+	case OCL_ERR_METRICS_SOCKET:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Error setting up metrics socket: %s", strerror(errno));
+		break;
+	case OCL_ERR_RESPONSE_CACHE:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Response cache settings not valid: %s", strerror(errno));
+		break;
+	case OCL_ERR_RETRY_POLICY:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Retry policy not valid ");
+		break;
+	case OCL_ERR_ENDPOINT:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Endpoint or endpoint policy not valid ");
+		break;
+	case OCL_ERR_MODEL_NOT_FOUND:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Model not found ");
+		break;
+	case OCL_ERR_MODELS_REFRESH_NOT_VALID:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Models refresh interval not valid ");
+		break;
+	case OCL_ERR_WARMUP:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Warm-up settings not valid ");
+		break;
+	case OCL_ERR_SCHEDULER:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Scheduler settings not valid ");
+		break;
+	case OCL_ERR_SCHEDULER_QUEUE_FULL:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Scheduler queue full ");
+		break;
+	case OCL_ERR_SCHEDULER_DEADLINE:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Request deadline exceeded while queued ");
+		break;
+	case OCL_ERR_EMBED:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Embeddings not valid. %s", ocl->ocl_resp->error);
+		break;
+	case OCL_ERR_EMBED_DIMENSIONS:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Embeddings dimensions don't match ");
+		break;
+	case OCL_ERR_VECTOR_INDEX:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Static context index not valid ");
+		break;
+	case OCL_ERR_COMPRESSION:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Compression not valid or not available ");
+		break;
+	case OCL_ERR_RACE:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Race not valid, or no branch answered ");
+		break;
+	case OCL_ERR_FORMAT:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Format not valid ('json' or a JSON schema) ");
+		break;
+	case OCL_ERR_FORMAT_VIOLATION:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Response not valid for the format. Generation stopped ");
+		break;
+	case OCL_ERR_STOP:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Stop sequences not valid ");
+		break;
+	case OCL_ERR_BUDGET:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Budget not valid ");
+		break;
+	case OCL_ERR_LOAD_TIMEOUT_NOT_VALID:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Load timeout value not valid ");
+		break;
+	case OCL_ERR_MODEL_NAME:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Model name not valid (max. 511 chars) ");
+		break;
+	case OCL_ERR_API_KEY:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: API key not valid (max. 1023 chars) ");
+		break;
+	case OCL_ERR_THINK:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Think value not valid (false, true, low, medium or high) ");
+		break;
+	case OCL_ERR_REQUEST_HEADERS:
+		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Request headers too long ");
+		break;
 	case OCL_ERR_UNKNOWN:
 	default:
 		snprintf(error_hndl, BUFFER_SIZE_2K,"OCl ERROR: Unknown. Errno: %s ", strerror(errno));
@@ -847,16 +1457,251 @@ char * OCL_error_handling(OCl *ocl, int error){
 	return error_hndl;
 }
 
-static bool get_string_from_token(char const *text, char const *token, char *result, char endChar, char endCharAlt){
-	memset(result, 0,1024);
+#define OCL_METRICS_MAX_ERRORS		128
+
+static char const *oclErrorNames[]={
+	"OCL_ERR_INIT","OCL_ERR_MALLOC","OCL_ERR_REALLOC","OCL_ERR_GETTING_HOST_INFO","OCL_ERR_SOCKET_CREATION",
+	"OCL_ERR_SOCKET_CONNECTION","OCL_ERR_SOCKET_CONNECTION_TIMEOUT","OCL_ERR_SSLCTX_NULL","OCL_ERR_SSL_CONTEXT",
+	"OCL_ERR_SSL_CERT_PATH_NOT_FOUND","OCL_ERR_SSL_CERT_NOT_FOUND","OCL_ERR_SSL_FD","OCL_ERR_SSL_CONNECT",
+	"OCL_ERR_POLLOUT","OCL_ERR_SEND_TIMEOUT","OCL_ERR_SENDING_PACKETS","OCL_ERR_POLLIN","OCL_ERR_RECV_TIMEOUT",
+	"OCL_ERR_RECEIVING_PACKETS","OCL_ERR_RESPONSE_MESSAGE","OCL_ERR_PARTIAL_RESPONSE_RECV","OCL_ERR_ZEROBYTESSENT",
+	"OCL_ERR_ZEROBYTESRECV","OCL_ERR_MODEL_FILE_NOT_FOUND","OCL_ERR_CONTEXT_FILE_NOT_FOUND","OCL_ERR_BASE64_ENCODING",
+	"OCL_ERR_IMAGE_FILE","OCL_ERR_CERT_FILE_NOT_FOUND","OCL_ERR_OPENING_FILE","OCL_ERR_OPENING_STATIC_CTX_FILE",
+	"OCL_ERR_OPENING_CTX_FILE","OCL_ERR_CONTEXT_FILE_CORRUPTED","OCL_ERR_OPENING_TOOLS_FILE","OCL_ERR_OPENING_ROLE_FILE",
+	"OCL_ERR_NO_HISTORY_CONTEXT","OCL_ERR_CONTEXT_MSGS","OCL_ERR_NULL_STRUCT","OCL_ERR_SERVICE_UNAVAILABLE",
+	"OCL_ERR_UNKNOWN","OCL_ERR_GETTING_MODELS","OCL_ERR_LOADING_MODEL","OCL_ERR_UNLOADING_MODEL","OCL_ERR_SERVER_ADDR",
+	"OCL_ERR_PORT","OCL_ERR_KEEP_ALIVE","OCL_ERR_TEMP","OCL_ERR_REPEAT_LAST_N","OCL_ERR_REPEAT_PENALTY","OCL_ERR_SEED",
+	"OCL_ERR_TOP_K","OCL_ERR_TOP_P","OCL_ERR_MIN_P","OCL_ERR_NUM_PREDICT","OCL_ERR_MAX_HISTORY_CTX",
+	"OCL_ERR_MAX_TOKENS_CTX","OCL_ERR_SOCKET_CONNECTION_TIMEOUT_NOT_VALID","OCL_ERR_SOCKET_SEND_TIMEOUT_NOT_VALID",
+	"OCL_ERR_SOCKET_RECV_TIMEOUT_NOT_VALID","OCL_ERR_RESPONSE_SPEED_NOT_VALID","OCL_ERR_MSG_FOUND",
+	"OCL_ERR_METRICS_SOCKET","OCL_ERR_RESPONSE_CACHE","OCL_ERR_RETRY_POLICY","OCL_ERR_ENDPOINT",
+	"OCL_ERR_MODEL_NOT_FOUND","OCL_ERR_MODELS_REFRESH_NOT_VALID","OCL_ERR_WARMUP","OCL_ERR_SCHEDULER",
+	"OCL_ERR_SCHEDULER_QUEUE_FULL","OCL_ERR_SCHEDULER_DEADLINE","OCL_ERR_EMBED","OCL_ERR_EMBED_DIMENSIONS",
+	"OCL_ERR_VECTOR_INDEX","OCL_ERR_COMPRESSION","OCL_ERR_RACE","OCL_ERR_FORMAT","OCL_ERR_FORMAT_VIOLATION",
+	"OCL_ERR_STOP","OCL_ERR_BUDGET","OCL_ERR_LOAD_TIMEOUT_NOT_VALID","OCL_ERR_MODEL_NAME","OCL_ERR_API_KEY",
+	"OCL_ERR_THINK","OCL_ERR_REQUEST_HEADERS"
+};
+
+static double const ttftBuckets[]={0.05,0.1,0.25,0.5,1.0,2.5,5.0,10.0,30.0,60.0};
+static double const tpsBuckets[]={1.0,5.0,10.0,20.0,40.0,80.0,160.0,320.0};
+static double const loadBuckets[]={0.1,0.5,1.0,2.5,5.0,10.0,30.0,60.0,120.0};
+static double const waitBuckets[]={0.01,0.05,0.1,0.25,0.5,1.0,2.5,5.0,10.0,30.0};
+
+#define OCL_TTFT_BUCKETS			(sizeof(ttftBuckets)/sizeof(ttftBuckets[0]))
+#define OCL_TPS_BUCKETS				(sizeof(tpsBuckets)/sizeof(tpsBuckets[0]))
+#define OCL_LOAD_BUCKETS			(sizeof(loadBuckets)/sizeof(loadBuckets[0]))
+#define OCL_WAIT_BUCKETS			(sizeof(waitBuckets)/sizeof(waitBuckets[0]))
+
+/*
+ * Process wide registry. Everything is updated with relaxed atomics, so the hot path never takes a lock;
+ * histograms keep per-bucket counts (made cumulative when dumped) and the sums in micro-units.
+ */
+static struct{
+	atomic_bool enabled;
+	atomic_ullong requests;
+	atomic_ullong errors[OCL_METRICS_MAX_ERRORS];
+	atomic_ullong bytesSent;
+	atomic_ullong bytesRecv;
+	atomic_ullong connections;
+	atomic_ullong connectionsReused;
+	atomic_ullong ttft[OCL_TTFT_BUCKETS+1];
+	atomic_ullong ttftSumUs;
+	atomic_ullong tps[OCL_TPS_BUCKETS+1];
+	atomic_ullong tpsSumMicro;
+	atomic_ullong cacheHits;
+	atomic_ullong cacheMisses;
+	atomic_ullong retries;
+	atomic_ullong failovers;
+	atomic_ullong load[OCL_LOAD_BUCKETS+1];
+	atomic_ullong loadSumUs;
+	atomic_ullong schedulerRejected;
+	atomic_ullong schedulerWait[OCL_WAIT_BUCKETS+1];
+	atomic_ullong schedulerWaitSumUs;
+}oclMetrics;
+
+static struct{
+	int fd;
+	char path[108];
+	pthread_t thread;
+	bool running;
+}oclMetricsServer={-1,"",0,false};
+
+static double ocl_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+static inline bool metrics_on(){
+	return atomic_load_explicit(&oclMetrics.enabled, memory_order_relaxed);
+}
+
+static inline void metrics_add(atomic_ullong *counter, unsigned long long value){
+	atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static void metrics_observe(atomic_ullong *buckets, double const *bounds, size_t cantBounds, atomic_ullong *sum, double value){
+	size_t i=0;
+	while(i<cantBounds && value>bounds[i]) i++;
+	metrics_add(&buckets[i], 1);
+	metrics_add(sum, (unsigned long long) (value*1000000.0));
+}
+
+static void metrics_count_error(int error){
+	if(!metrics_on() || error>=0) return;
+	int index=error-OCL_ERR_INIT;
+	if(index<0 || index>=OCL_METRICS_MAX_ERRORS) return;
+	metrics_add(&oclMetrics.errors[index], 1);
+}
+
+int OCl_metrics_enable(bool enable){
+	atomic_store(&oclMetrics.enabled, enable);
+	return OCL_RETURN_OK;
+}
+
+static size_t metrics_dump_histogram(char *buffer, size_t len, const char *name, const char *help, atomic_ullong *buckets
+		, double const *bounds, size_t cantBounds, atomic_ullong *sum){
+	size_t pos=snprintf(buffer, len, "# TYPE %s histogram\n# HELP %s %s\n", name, name, help);
+	unsigned long long cumulative=0;
+	for(size_t i=0;i<=cantBounds && pos<len;i++){
+		cumulative+=atomic_load_explicit(&buckets[i], memory_order_relaxed);
+		if(i<cantBounds){
+			pos+=snprintf(buffer+pos, len-pos, "%s_bucket{le=\"%g\"} %llu\n", name, bounds[i], cumulative);
+		}else{
+			pos+=snprintf(buffer+pos, len-pos, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+		}
+	}
+	if(pos<len) pos+=snprintf(buffer+pos, len-pos, "%s_sum %.6f\n%s_count %llu\n", name
+			, atomic_load_explicit(sum, memory_order_relaxed)/1000000.0, name, cumulative);
+	return pos;
+}
+
+int OCl_metrics_dump(int fd){
+	char buffer[BUFFER_SIZE_16K]="";
+	size_t len=BUFFER_SIZE_16K, pos=0;
+	pos+=snprintf(buffer+pos, len-pos,
+			"# TYPE ocl_requests counter\n# HELP ocl_requests Requests sent to the server.\nocl_requests_total %llu\n"
+			"# TYPE ocl_errors counter\n# HELP ocl_errors Errors of the requests sent, by ocl_errors code.\n"
+			,atomic_load_explicit(&oclMetrics.requests, memory_order_relaxed));
+	for(int i=0;i<OCL_METRICS_MAX_ERRORS && pos<len;i++){
+		unsigned long long cont=atomic_load_explicit(&oclMetrics.errors[i], memory_order_relaxed);
+		if(cont==0) continue;
+		if(i<(int) (sizeof(oclErrorNames)/sizeof(oclErrorNames[0]))){
+			pos+=snprintf(buffer+pos, len-pos, "ocl_errors_total{code=\"%s\"} %llu\n", oclErrorNames[i], cont);
+		}else{
+			pos+=snprintf(buffer+pos, len-pos, "ocl_errors_total{code=\"%d\"} %llu\n", i+OCL_ERR_INIT, cont);
+		}
+	}
+	if(pos<len) pos+=snprintf(buffer+pos, len-pos,
+			"# TYPE ocl_sent_bytes counter\n# HELP ocl_sent_bytes Bytes sent to the server.\nocl_sent_bytes_total %llu\n"
+			"# TYPE ocl_received_bytes counter\n# HELP ocl_received_bytes Bytes received from the server.\nocl_received_bytes_total %llu\n"
+			"# TYPE ocl_connections counter\n# HELP ocl_connections Connections opened.\nocl_connections_total %llu\n"
+			"# TYPE ocl_connections_reused counter\n# HELP ocl_connections_reused Embeddings requests sent over an already open connection.\nocl_connections_reused_total %llu\n"
+			"# TYPE ocl_cache_hits counter\n# HELP ocl_cache_hits Chats answered from the response cache.\nocl_cache_hits_total %llu\n"
+			"# TYPE ocl_cache_misses counter\n# HELP ocl_cache_misses Chats not found in the response cache.\nocl_cache_misses_total %llu\n"
+			"# TYPE ocl_retries counter\n# HELP ocl_retries Chats re-issued by the retry policy.\nocl_retries_total %llu\n"
+			"# TYPE ocl_failovers counter\n# HELP ocl_failovers Requests re-sent to another endpoint.\nocl_failovers_total %llu\n"
+			"# TYPE ocl_scheduler_rejected counter\n# HELP ocl_scheduler_rejected Requests rejected by the scheduler (queue full or deadline exceeded).\nocl_scheduler_rejected_total %llu\n"
+			,atomic_load_explicit(&oclMetrics.bytesSent, memory_order_relaxed)
+			,atomic_load_explicit(&oclMetrics.bytesRecv, memory_order_relaxed)
+			,atomic_load_explicit(&oclMetrics.connections, memory_order_relaxed)
+			,atomic_load_explicit(&oclMetrics.connectionsReused, memory_order_relaxed)
+			,atomic_load_explicit(&oclMetrics.cacheHits, memory_order_relaxed)
+			,atomic_load_explicit(&oclMetrics.cacheMisses, memory_order_relaxed)
+			,atomic_load_explicit(&oclMetrics.retries, memory_order_relaxed)
+			,atomic_load_explicit(&oclMetrics.failovers, memory_order_relaxed)
+			,atomic_load_explicit(&oclMetrics.schedulerRejected, memory_order_relaxed));
+	if(pos<len) pos+=metrics_dump_histogram(buffer+pos, len-pos, "ocl_time_to_first_token_seconds"
+			, "Time from the request sent to the first token received.", oclMetrics.ttft, ttftBuckets, OCL_TTFT_BUCKETS
+			, &oclMetrics.ttftSumUs);
+	if(pos<len) pos+=metrics_dump_histogram(buffer+pos, len-pos, "ocl_tokens_per_second"
+			, "Generation speed reported by the server.", oclMetrics.tps, tpsBuckets, OCL_TPS_BUCKETS
+			, &oclMetrics.tpsSumMicro);
+	if(pos<len) pos+=metrics_dump_histogram(buffer+pos, len-pos, "ocl_model_load_seconds"
+			, "Time taken by the model loading (and keep-alive renewal) requests.", oclMetrics.load, loadBuckets, OCL_LOAD_BUCKETS
+			, &oclMetrics.loadSumUs);
+	if(pos<len) pos+=metrics_dump_histogram(buffer+pos, len-pos, "ocl_scheduler_wait_seconds"
+			, "Time spent by the requests queued in the scheduler.", oclMetrics.schedulerWait, waitBuckets, OCL_WAIT_BUCKETS
+			, &oclMetrics.schedulerWaitSumUs);
+	if(pos<len) pos+=snprintf(buffer+pos, len-pos, "# EOF\n");
+	if(pos>=len) pos=len-1;
+	size_t totalBytesWritten=0;
+	while(totalBytesWritten<pos){
+		ssize_t bytesWritten=write(fd, buffer+totalBytesWritten, pos-totalBytesWritten);
+		if(bytesWritten<0){
+			if(errno==EINTR) continue;
+			return OCL_ERR_OPENING_FILE;
+		}
+		totalBytesWritten+=bytesWritten;
+	}
+	return OCL_RETURN_OK;
+}
+
+static void *metrics_serve(void *arg){
+	(void) arg;
+	while(true){
+		int clientConn=accept(oclMetricsServer.fd, NULL, NULL);
+		if(clientConn<0){
+			if(errno==EINTR) continue;
+			break;
+		}
+		OCl_metrics_dump(clientConn);
+		close(clientConn);
+	}
+	return NULL;
+}
+
+int OCl_metrics_serve(const char *socketPath){
+	if(oclMetricsServer.running) OCl_metrics_stop_serving();
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	if(strlen(socketPath)>=sizeof(addr.sun_path)){
+		errno=ENAMETOOLONG;
+		return OCL_ERR_METRICS_SOCKET;
+	}
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath);
+	if((oclMetricsServer.fd=socket(AF_UNIX, SOCK_STREAM, 0))<0) return OCL_ERR_METRICS_SOCKET;
+	unlink(socketPath);
+	if(bind(oclMetricsServer.fd, (struct sockaddr *) &addr, sizeof(addr))<0 || listen(oclMetricsServer.fd, 8)<0){
+		close(oclMetricsServer.fd);
+		oclMetricsServer.fd=-1;
+		return OCL_ERR_METRICS_SOCKET;
+	}
+	snprintf(oclMetricsServer.path, sizeof(oclMetricsServer.path), "%s", socketPath);
+	if(pthread_create(&oclMetricsServer.thread, NULL, metrics_serve, NULL)!=0){
+		close(oclMetricsServer.fd);
+		oclMetricsServer.fd=-1;
+		unlink(socketPath);
+		return OCL_ERR_METRICS_SOCKET;
+	}
+	oclMetricsServer.running=true;
+	OCl_metrics_enable(true);
+	return OCL_RETURN_OK;
+}
+
+int OCl_metrics_stop_serving(){
+	if(!oclMetricsServer.running) return OCL_RETURN_OK;
+	shutdown(oclMetricsServer.fd, SHUT_RDWR);
+	close(oclMetricsServer.fd);
+	pthread_join(oclMetricsServer.thread, NULL);
+	unlink(oclMetricsServer.path);
+	oclMetricsServer.fd=-1;
+	oclMetricsServer.running=false;
+	return OCL_RETURN_OK;
+}
+
+static bool get_string_from_token(char const *text, char const *token, char *result, size_t resultSize, char endChar, char endCharAlt){
+	memset(result, 0, resultSize);
 	char *content=strstr(text,token);
 	if(!content) return false;
-	int cont=0;
+	size_t cont=0;
 	while(content!=NULL){
 		size_t i=0, len=strlen(token);
-		for(i=len;(content[i]!=endChar && content[i]!=endCharAlt);i++){
+		for(i=len;(content[i]!=endChar && content[i]!=endCharAlt) && cont<resultSize-2;i++){
 			if(content[i]=='\\'){
 				result[cont++]=content[i];
+				if(content[i+1]==0) break;
 				result[cont++]=content[++i];
 				continue;
 			}
@@ -868,501 +1713,4427 @@ static bool get_string_from_token(char const *text, char const *token, char *res
 	return true;
 }
 
-static int create_connection(const char *srvAddr, int srvPort, int socketConnectTimeout){
-	static char ollamaServerIp[INET_ADDRSTRLEN]="";
-	struct addrinfo hints, *res;
+/*
+ * Resolver cache: getaddrinfo() (blocking) is only called once per host/port every OCL_RESOLVER_TTL_S seconds, or
+ * after every resolved address failed to connect. The addresses are kept in the order returned by getaddrinfo()
+ * (RFC 6724), interleaving the families as RFC 8305 suggests.
+ */
+static ResolvedHost *resolver_lookup(OCl *ocl, char const *srvAddr, int srvPort){
+	double now=ocl_now();
+	ResolvedHost *slot=&ocl->resolved[0];
+	for(int i=0;i<OCL_RESOLVER_CACHE_ENTRIES;i++){
+		ResolvedHost *rh=&ocl->resolved[i];
+		if(rh->cantAddrs>0 && rh->port==srvPort && strcmp(rh->host, srvAddr)==0){
+			if(rh->expires>now) return rh;
+			slot=rh;
+			break;
+		}
+		if(rh->expires<slot->expires) slot=rh;
+	}
+	struct addrinfo hints, *res=NULL;
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family=AF_INET;
+	hints.ai_family=AF_UNSPEC;
 	hints.ai_socktype=SOCK_STREAM;
-	if(getaddrinfo(srvAddr, NULL, &hints, &res)!=0) return OCL_ERR_GETTING_HOST_INFO;
-	struct sockaddr_in const *ipv4=(struct sockaddr_in *)res->ai_addr;
-	void const *addr=&(ipv4->sin_addr);
-	inet_ntop(res->ai_family, addr, ollamaServerIp, sizeof(ollamaServerIp));
+	hints.ai_flags=AI_ADDRCONFIG;
+	char port[8]="";
+	snprintf(port, sizeof(port), "%d", srvPort);
+	if(getaddrinfo(srvAddr, port, &hints, &res)!=0) return NULL;
+	struct addrinfo *byFamily[2][OCL_RESOLVER_MAX_ADDRS];
+	int cantByFamily[2]={0,0}, firstFamily=-1;
+	for(struct addrinfo *ai=res;ai!=NULL;ai=ai->ai_next){
+		if(ai->ai_family!=AF_INET && ai->ai_family!=AF_INET6) continue;
+		int family=(ai->ai_family==AF_INET6)?1:0;
+		if(firstFamily<0) firstFamily=family;
+		if(cantByFamily[family]<OCL_RESOLVER_MAX_ADDRS) byFamily[family][cantByFamily[family]++]=ai;
+	}
+	memset(slot, 0, sizeof(ResolvedHost));
+	for(int n=0;firstFamily>=0 && slot->cantAddrs<OCL_RESOLVER_MAX_ADDRS && n<OCL_RESOLVER_MAX_ADDRS;n++){
+		for(int f=0;f<2 && slot->cantAddrs<OCL_RESOLVER_MAX_ADDRS;f++){
+			int family=(firstFamily+f)%2;
+			if(n>=cantByFamily[family]) continue;
+			memcpy(&slot->addrs[slot->cantAddrs], byFamily[family][n]->ai_addr, byFamily[family][n]->ai_addrlen);
+			slot->addrsLen[slot->cantAddrs++]=byFamily[family][n]->ai_addrlen;
+		}
+	}
 	freeaddrinfo(res);
+	if(slot->cantAddrs==0) return NULL;
+	snprintf(slot->host, sizeof(slot->host), "%s", srvAddr);
+	slot->port=srvPort;
+	slot->expires=now+OCL_RESOLVER_TTL_S;
+	return slot;
+}
+
+/*
+ * Happy eyeballs (RFC 8305): a new non-blocking attempt is started every OCL_CONNECTION_ATTEMPT_DELAY_MS (or as soon
+ * as the previous one fails), and the first socket to connect wins. The rest are closed.
+ */
+static int create_connection(OCl *ocl, const char *srvAddr, int srvPort, int socketConnectTimeout){
+	ResolvedHost *rh=resolver_lookup(ocl, srvAddr, srvPort);
+	if(rh==NULL) return OCL_ERR_GETTING_HOST_INFO;
+	struct pollfd attempts[OCL_RESOLVER_MAX_ADDRS];
+	int cantAttempts=0, pending=0, next=0, socketConn=0, lastError=0;
+	bool created=false;
+	double startedAt=ocl_now(), deadline=startedAt+socketConnectTimeout;
+	while(socketConn<=0 && !ocl_canceled(ocl)){
+		if(next<rh->cantAddrs && (pending==0 || ocl_now()>=startedAt+(next*OCL_CONNECTION_ATTEMPT_DELAY_MS)/1000.0)){
+			struct sockaddr const *addr=(struct sockaddr const *) &rh->addrs[next];
+			socklen_t addrLen=rh->addrsLen[next++];
+			int fd=socket(addr->sa_family, SOCK_STREAM, 0);
+			if(fd<0){
+				lastError=errno;
+				continue;
+			}
+			created=true;
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+			if(connect(fd, addr, addrLen)<0 && errno!=EINPROGRESS){
+				lastError=errno;
+				close(fd);
+				continue;
+			}
+			attempts[cantAttempts].fd=fd;
+			attempts[cantAttempts++].events=POLLOUT;
+			pending++;
+			continue;
+		}
+		if(pending==0) break;
+		double now=ocl_now(), wait=deadline-now;
+		if(wait<=0) break;
+		if(next<rh->cantAddrs){
+			double nextAttempt=startedAt+(next*OCL_CONNECTION_ATTEMPT_DELAY_MS)/1000.0-now;
+			if(nextAttempt<wait) wait=(nextAttempt>0)?nextAttempt:0;
+		}
+		// In slices, so a cancellation doesn't wait for the whole connection timeout.
+		if(wait>OCL_POLL_SLICE_MS/1000.0) wait=OCL_POLL_SLICE_MS/1000.0;
+		if(poll(attempts, cantAttempts, (int) (wait*1000.0)+1)<0 && errno!=EINTR){
+			lastError=errno;
+			break;
+		}
+		for(int i=0;i<cantAttempts && socketConn<=0;i++){
+			if(attempts[i].fd<0 || attempts[i].revents==0) continue;
+			int soError=0;
+			socklen_t len=sizeof(soError);
+			if(getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &soError, &len)<0) soError=errno;
+			if(soError==0){
+				socketConn=attempts[i].fd;
+			}else{
+				lastError=soError;
+				close(attempts[i].fd);
+			}
+			attempts[i].fd=-1;
+			pending--;
+		}
+	}
+	for(int i=0;i<cantAttempts;i++) if(attempts[i].fd>=0) close(attempts[i].fd);
+	if(socketConn>0){
+		fcntl(socketConn, F_SETFL, fcntl(socketConn, F_GETFL, 0) & ~O_NONBLOCK);
+		// The headers and the body of a request are written separately: the body isn't held back by Nagle.
+		int noDelay=1;
+		setsockopt(socketConn, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		return socketConn;
+	}
+	rh->expires=0;
+	if(!created) return OCL_ERR_SOCKET_CREATION;
+	if(pending>0 || (lastError==0 && !ocl_canceled(ocl))) return OCL_ERR_SOCKET_CONNECTION_TIMEOUT;
+	errno=lastError;
+	return OCL_ERR_SOCKET_CONNECTION;
+}
+
+static void metrics_first_token(bool *firstToken, double sentAt){
+	if(*firstToken) return;
+	*firstToken=true;
+	if(metrics_on()) metrics_observe(oclMetrics.ttft, ttftBuckets, OCL_TTFT_BUCKETS, &oclMetrics.ttftSumUs, ocl_now()-sentAt);
+}
+
+typedef struct HttpStream{
+	char *raw;
+	size_t rawLen;
+	size_t rawSize;
+	char *body;
+	size_t bodyLen;
+	size_t bodySize;
+	char *scratch;
+	size_t scratchSize;
+	bool headersParsed;
+	bool chunked;
+	bool chunkTrailer;
+	bool finished;
+	long contentLength;
+	long bodyReceived;
+	long chunkLeft;
+	int statusCode;
+	char status[128];
+	int encoding;
+	struct BodyDecoder *decoder;
+}HttpStream;
+
+/*
+ * Compression (optional, at build time: -DOCL_HAVE_ZLIB -lz, -DOCL_HAVE_ZSTD -lzstd). Request bodies over the
+ * threshold are compressed as a whole (they're already in memory); responses are decompressed as they stream in,
+ * so NDJSON lines come out of the decoder as soon as their bytes arrive.
+ */
+static char const *oclCompressionNames[]={"identity","gzip","zstd"};
+
+#if defined(OCL_HAVE_ZLIB) && defined(OCL_HAVE_ZSTD)
+#define OCL_ACCEPT_ENCODING			"gzip, deflate, zstd"
+#elif defined(OCL_HAVE_ZLIB)
+#define OCL_ACCEPT_ENCODING			"gzip, deflate"
+#elif defined(OCL_HAVE_ZSTD)
+#define OCL_ACCEPT_ENCODING			"zstd"
+#else
+#define OCL_ACCEPT_ENCODING			"identity"
+#endif
+
+struct BodyDecoder{
+#ifdef OCL_HAVE_ZLIB
+	z_stream zs;
+#endif
+#ifdef OCL_HAVE_ZSTD
+	ZSTD_DCtx *dctx;
+#endif
+	bool initialized;
+};
+
+static bool compression_available(int algorithm){
+	switch(algorithm){
+	case OCL_COMPRESSION_NONE:
+		return true;
+#ifdef OCL_HAVE_ZLIB
+	case OCL_COMPRESSION_GZIP:
+		return true;
+#endif
+#ifdef OCL_HAVE_ZSTD
+	case OCL_COMPRESSION_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+static int compress_body(OCl *ocl, char const *data, size_t len, char **out, size_t *outLen){
+	*out=NULL;
+	*outLen=0;
+	switch(ocl->compression){
+#ifdef OCL_HAVE_ZLIB
+	case OCL_COMPRESSION_GZIP:{
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		// windowBits+16: gzip wrapper.
+		if(deflateInit2(&zs, (ocl->compressionLevel>0)?ocl->compressionLevel:Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8
+				, Z_DEFAULT_STRATEGY)!=Z_OK) return OCL_ERR_COMPRESSION;
+		size_t size=deflateBound(&zs, len);
+		if((*out=arena_alloc(&ocl->arena, size+1))==NULL){
+			deflateEnd(&zs);
+			return OCL_ERR_MALLOC;
+		}
+		zs.next_in=(Bytef *) data;
+		zs.next_out=(Bytef *) *out;
+		zs.avail_out=size;
+		int retVal=Z_OK;
+		size_t left=len;
+		while(retVal==Z_OK){
+			uInt chunk=(left>BUFFER_SIZE_1M)?BUFFER_SIZE_1M:left;
+			zs.avail_in=chunk;
+			left-=chunk;
+			retVal=deflate(&zs, (left==0)?Z_FINISH:Z_NO_FLUSH);
+			if(left>0 && retVal==Z_OK && zs.avail_in!=0) retVal=Z_BUF_ERROR;
+		}
+		*outLen=zs.total_out;
+		deflateEnd(&zs);
+		if(retVal!=Z_STREAM_END){
+			*out=NULL;
+			return OCL_ERR_COMPRESSION;
+		}
+		(*out)[*outLen]=0;
+		return OCL_RETURN_OK;
+	}
+#endif
+#ifdef OCL_HAVE_ZSTD
+	case OCL_COMPRESSION_ZSTD:{
+		size_t size=ZSTD_compressBound(len);
+		if((*out=arena_alloc(&ocl->arena, size+1))==NULL) return OCL_ERR_MALLOC;
+		size_t compressed=ZSTD_compress(*out, size, data, len
+				, (ocl->compressionLevel>0)?ocl->compressionLevel:ZSTD_CLEVEL_DEFAULT);
+		if(ZSTD_isError(compressed)){
+			*out=NULL;
+			return OCL_ERR_COMPRESSION;
+		}
+		*outLen=compressed;
+		(*out)[*outLen]=0;
+		return OCL_RETURN_OK;
+	}
+#endif
+	default:
+		(void) data;
+		(void) len;
+		return OCL_ERR_COMPRESSION;
+	}
+}
+
+static void body_decoder_free(HttpStream *hs){
+	if(hs->decoder==NULL) return;
+#ifdef OCL_HAVE_ZLIB
+	if(hs->encoding==OCL_COMPRESSION_GZIP && hs->decoder->initialized) inflateEnd(&hs->decoder->zs);
+#endif
+#ifdef OCL_HAVE_ZSTD
+	if(hs->encoding==OCL_COMPRESSION_ZSTD && hs->decoder->initialized) ZSTD_freeDCtx(hs->decoder->dctx);
+#endif
+	sfree(hs->decoder);
+	hs->decoder=NULL;
+}
+
+static int body_decoder_feed(HttpStream *hs, char const *data, size_t dataLen){
+	if(!compression_available(hs->encoding)) return OCL_ERR_COMPRESSION;
+	if(hs->decoder==NULL && (hs->decoder=calloc(1, sizeof(struct BodyDecoder)))==NULL) return OCL_ERR_MALLOC;
+	char out[BUFFER_SIZE_16K];
+	int retVal=OCL_RETURN_OK;
+	switch(hs->encoding){
+#ifdef OCL_HAVE_ZLIB
+	case OCL_COMPRESSION_GZIP:{
+		z_stream *zs=&hs->decoder->zs;
+		// windowBits+32: gzip or zlib ('deflate'), detected from the header.
+		if(!hs->decoder->initialized){
+			if(inflateInit2(zs, 15+32)!=Z_OK) return OCL_ERR_COMPRESSION;
+			hs->decoder->initialized=true;
+		}
+		zs->next_in=(Bytef *) data;
+		zs->avail_in=dataLen;
+		while(zs->avail_in>0 && retVal==OCL_RETURN_OK){
+			zs->next_out=(Bytef *) out;
+			zs->avail_out=sizeof(out);
+			int zRetVal=inflate(zs, Z_NO_FLUSH);
+			if(zRetVal!=Z_OK && zRetVal!=Z_STREAM_END && zRetVal!=Z_BUF_ERROR) return OCL_ERR_COMPRESSION;
+			retVal=buffer_append(NULL, &hs->body, &hs->bodyLen, &hs->bodySize, out, sizeof(out)-zs->avail_out);
+			if(zRetVal==Z_STREAM_END || (zRetVal==Z_BUF_ERROR && zs->avail_out==sizeof(out))) break;
+		}
+		return retVal;
+	}
+#endif
+#ifdef OCL_HAVE_ZSTD
+	case OCL_COMPRESSION_ZSTD:{
+		if(!hs->decoder->initialized){
+			if((hs->decoder->dctx=ZSTD_createDCtx())==NULL) return OCL_ERR_COMPRESSION;
+			hs->decoder->initialized=true;
+		}
+		ZSTD_inBuffer in={data, dataLen, 0};
+		while(in.pos<in.size && retVal==OCL_RETURN_OK){
+			ZSTD_outBuffer output={out, sizeof(out), 0};
+			size_t zRetVal=ZSTD_decompressStream(hs->decoder->dctx, &output, &in);
+			if(ZSTD_isError(zRetVal)) return OCL_ERR_COMPRESSION;
+			retVal=buffer_append(NULL, &hs->body, &hs->bodyLen, &hs->bodySize, out, output.pos);
+		}
+		return retVal;
+	}
+#endif
+	default:
+		(void) out;
+		(void) data;
+		(void) dataLen;
+		(void) retVal;
+		return OCL_ERR_COMPRESSION;
+	}
+}
+
+static int http_stream_body_append(HttpStream *hs, char const *data, size_t dataLen){
+	if(hs->encoding==OCL_COMPRESSION_NONE) return buffer_append(NULL, &hs->body, &hs->bodyLen, &hs->bodySize, data, dataLen);
+	return body_decoder_feed(hs, data, dataLen);
+}
+
+int OCl_set_compression(OCl *ocl, int algorithm, int level, int minSize){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(!compression_available(algorithm) || level<0 || minSize<0) return OCL_ERR_COMPRESSION;
+	if((algorithm==OCL_COMPRESSION_GZIP && level>9) || (algorithm==OCL_COMPRESSION_ZSTD && level>22)) return OCL_ERR_COMPRESSION;
+	ocl->compression=algorithm;
+	ocl->compressionLevel=level;
+	ocl->compressionMinSize=minSize;
+	return OCL_RETURN_OK;
+}
+
+static void http_stream_free(HttpStream *hs){
+	sfree(hs->raw);
+	sfree(hs->body);
+	sfree(hs->scratch);
+	body_decoder_free(hs);
+}
+
+static struct HttpStream *http_stream_new(){
+	return calloc(1, sizeof(HttpStream));
+}
+
+static void http_stream_delete(struct HttpStream *hs){
+	if(hs==NULL) return;
+	http_stream_free(hs);
+	sfree(hs);
+}
+
+/*
+ * The receiving buffers are kept by the instance between requests (up to OCL_STREAM_MAX_RETAINED), instead of
+ * allocated (and grown) on every one. Shadow instances don't keep them.
+ */
+#define OCL_STREAM_MAX_RETAINED		BUFFER_SIZE_1M
+
+static void http_stream_borrow(OCl *ocl, HttpStream *hs){
+	if(ocl->stream==NULL) return;
+	hs->raw=ocl->stream->raw;
+	hs->rawSize=ocl->stream->rawSize;
+	hs->body=ocl->stream->body;
+	hs->bodySize=ocl->stream->bodySize;
+	hs->scratch=ocl->stream->scratch;
+	hs->scratchSize=ocl->stream->scratchSize;
+	memset(ocl->stream, 0, sizeof(HttpStream));
+	if(hs->raw!=NULL) hs->raw[0]=0;
+	if(hs->body!=NULL) hs->body[0]=0;
+}
+
+static void http_stream_return(OCl *ocl, HttpStream *hs){
+	body_decoder_free(hs);
+	if(ocl->stream==NULL || ocl->stream->raw!=NULL || hs->rawSize>OCL_STREAM_MAX_RETAINED
+			|| hs->bodySize>OCL_STREAM_MAX_RETAINED || hs->scratchSize>OCL_STREAM_MAX_RETAINED){
+		http_stream_free(hs);
+		return;
+	}
+	ocl->stream->raw=hs->raw;
+	ocl->stream->rawSize=hs->rawSize;
+	ocl->stream->body=hs->body;
+	ocl->stream->bodySize=hs->bodySize;
+	ocl->stream->scratch=hs->scratch;
+	ocl->stream->scratchSize=hs->scratchSize;
+}
+
+static void http_stream_consume_raw(HttpStream *hs, size_t n){
+	memmove(hs->raw, hs->raw+n, hs->rawLen-n);
+	hs->rawLen-=n;
+	hs->raw[hs->rawLen]=0;
+}
+
+static void http_stream_parse_headers(HttpStream *hs, char *headers){
+	char *line=headers, *next=NULL;
+	size_t i=0;
+	for(i=0;line[i]!='\r' && line[i]!=0 && i<sizeof(hs->status)-1;i++) hs->status[i]=line[i];
+	hs->status[i]=0;
+	char const *code=strchr(hs->status,' ');
+	hs->statusCode=(code!=NULL)?strtol(code+1,NULL,10):0;
+	hs->contentLength=-1;
+	while((next=strstr(line,"\r\n"))!=NULL){
+		line=next+2;
+		if(strncasecmp(line,"Content-Length:",15)==0) hs->contentLength=strtol(line+15,NULL,10);
+		if(strncasecmp(line,"Transfer-Encoding:",18)==0 && strstr(line+18,"chunked")!=NULL) hs->chunked=true;
+		if(strncasecmp(line,"Content-Encoding:",17)==0){
+			char const *value=line+17;
+			while(*value==' ') value++;
+			if(strncasecmp(value,"gzip",4)==0 || strncasecmp(value,"deflate",7)==0) hs->encoding=OCL_COMPRESSION_GZIP;
+			else if(strncasecmp(value,"zstd",4)==0) hs->encoding=OCL_COMPRESSION_ZSTD;
+			else if(strncasecmp(value,"identity",8)!=0) hs->encoding=-1;
+		}
+	}
+}
+
+/*
+ * Feeds bytes as they come out of SSL_read(). Headers are parsed once complete, and the body is de-chunked into
+ * hs->body, so the callers see the payload regardless of how it was fragmented into TLS records.
+ */
+static int http_stream_feed(HttpStream *hs, char const *data, size_t dataLen){
+	int retVal=buffer_append(NULL, &hs->raw, &hs->rawLen, &hs->rawSize, data, dataLen);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	if(!hs->headersParsed){
+		// The CRLF closing a previous (pipelined) chunked response.
+		while(hs->rawLen>=2 && hs->raw[0]=='\r' && hs->raw[1]=='\n') http_stream_consume_raw(hs, 2);
+		char *endHeaders=strstr(hs->raw,"\r\n\r\n");
+		if(endHeaders==NULL) return OCL_RETURN_OK;
+		endHeaders[2]=0;
+		http_stream_parse_headers(hs, hs->raw);
+		hs->headersParsed=true;
+		http_stream_consume_raw(hs, endHeaders-hs->raw+4);
+	}
+	if(!hs->chunked){
+		size_t n=hs->rawLen;
+		if(hs->contentLength>=0 && (long) n>hs->contentLength-hs->bodyReceived) n=hs->contentLength-hs->bodyReceived;
+		if((retVal=http_stream_body_append(hs, hs->raw, n))!=OCL_RETURN_OK) return retVal;
+		hs->bodyReceived+=n;
+		http_stream_consume_raw(hs, n);
+		if(hs->contentLength>=0 && hs->bodyReceived>=hs->contentLength) hs->finished=true;
+		return OCL_RETURN_OK;
+	}
+	size_t pos=0;
+	while(pos<hs->rawLen && !hs->finished){
+		if(hs->chunkTrailer){
+			if(hs->rawLen-pos<2) break;
+			pos+=2;
+			hs->chunkTrailer=false;
+			continue;
+		}
+		if(hs->chunkLeft==0){
+			char *endLine=strstr(hs->raw+pos,"\r\n");
+			if(endLine==NULL) break;
+			hs->chunkLeft=strtol(hs->raw+pos,NULL,16);
+			pos=endLine-hs->raw+2;
+			if(hs->chunkLeft==0) hs->finished=true;
+			continue;
+		}
+		size_t n=hs->rawLen-pos;
+		if((long) n>hs->chunkLeft) n=hs->chunkLeft;
+		if((retVal=http_stream_body_append(hs, hs->raw+pos, n))!=OCL_RETURN_OK) return retVal;
+		pos+=n;
+		hs->chunkLeft-=n;
+		if(hs->chunkLeft==0) hs->chunkTrailer=true;
+	}
+	http_stream_consume_raw(hs, pos);
+	return OCL_RETURN_OK;
+}
+
+/*
+ * Keeps what was received after the end of the response: on a keep-alive connection it's the next one.
+ */
+static void http_stream_next(HttpStream *hs){
+	hs->bodyLen=0;
+	if(hs->body) hs->body[0]=0;
+	hs->headersParsed=hs->chunked=hs->chunkTrailer=hs->finished=false;
+	hs->contentLength=-1;
+	hs->bodyReceived=0;
+	hs->chunkLeft=0;
+	hs->statusCode=0;
+	hs->status[0]=0;
+	body_decoder_free(hs);
+	hs->encoding=OCL_COMPRESSION_NONE;
+}
+
+/*
+ * Structured output: the 'format' sent to the server ("json", or a JSON schema) is also checked on the receiving side,
+ * as the content streams in. The schema is compiled once (type, properties, required, additionalProperties, items and
+ * string enums; anything else isn't checked) and the answer is fed, char by char, to a push-down validator. On the
+ * first char that can't lead to a valid document, the connection is closed: the rest isn't waited for.
+ */
+enum format_types{
+	FORMAT_OBJECT=1,
+	FORMAT_ARRAY=2,
+	FORMAT_STRING=4,
+	FORMAT_NUMBER=8,
+	FORMAT_INTEGER=16,
+	FORMAT_BOOLEAN=32,
+	FORMAT_NULL=64
+};
+
+typedef struct FormatSchema{
+	int types;
+	bool closed;
+	int cantProperties;
+	char **names;
+	struct FormatSchema **properties;
+	uint64_t required;
+	struct FormatSchema *items;
+	int cantEnum;
+	char **enumValues;
+}FormatSchema;
+
+struct _ocl_format{
+	atomic_int refs;
+	char *text;
+	FormatSchema *schema;
+};
+
+static void format_schema_free(FormatSchema *schema){
+	if(schema==NULL) return;
+	for(int i=0;i<schema->cantProperties;i++){
+		sfree(schema->names[i]);
+		format_schema_free(schema->properties[i]);
+	}
+	for(int i=0;i<schema->cantEnum;i++) sfree(schema->enumValues[i]);
+	sfree(schema->names);
+	sfree(schema->properties);
+	sfree(schema->enumValues);
+	format_schema_free(schema->items);
+	sfree(schema);
+}
+
+static struct _ocl_format *format_retain(struct _ocl_format *format){
+	if(format!=NULL) atomic_fetch_add(&format->refs, 1);
+	return format;
+}
+
+static void format_release(struct _ocl_format *format){
+	if(format==NULL || atomic_fetch_sub(&format->refs, 1)>1) return;
+	format_schema_free(format->schema);
+	sfree(format->text);
+	sfree(format);
+}
+
+static char const *format_skip_ws(char const *p){
+	while(*p==' ' || *p=='\t' || *p=='\n' || *p=='\r') p++;
+	return p;
+}
+
+// A string's raw body (escapes kept, as the answer's are compared). NULL: not a string.
+static char *format_parse_string(char const **p){
+	char const *start=*p=format_skip_ws(*p);
+	if(*start!='"') return NULL;
+	char const *end=start+1;
+	while(*end!='"' && *end!=0) end+=(*end=='\\' && end[1]!=0)?2:1;
+	if(*end!='"') return NULL;
+	*p=end+1;
+	return strndup(start+1, end-start-1);
+}
+
+static char const *format_skip_value(char const *p, int depth){
+	p=format_skip_ws(p);
+	if(depth>OCL_FORMAT_MAX_DEPTH) return NULL;
+	if(*p=='"'){
+		char *s=format_parse_string(&p);
+		if(s==NULL) return NULL;
+		sfree(s);
+		return p;
+	}
+	if(*p=='{' || *p=='['){
+		char close=(*p=='{')?'}':']';
+		p=format_skip_ws(p+1);
+		if(*p==close) return p+1;
+		while(p!=NULL){
+			if(close=='}'){
+				char *key=format_parse_string(&p);
+				if(key==NULL) return NULL;
+				sfree(key);
+				p=format_skip_ws(p);
+				if(*p++!=':') return NULL;
+			}
+			if((p=format_skip_value(p, depth+1))==NULL) return NULL;
+			p=format_skip_ws(p);
+			if(*p==close) return p+1;
+			if(*p++!=',') return NULL;
+		}
+		return NULL;
+	}
+	char const *start=p;
+	while(*p!=0 && strchr(",}] \t\n\r", *p)==NULL) p++;
+	return (p>start)?p:NULL;
+}
+
+static int format_type_bit(char const *type){
+	char const *names[]={"object","array","string","number","integer","boolean","null"};
+	for(int i=0;i<7;i++) if(strcmp(type, names[i])==0) return 1<<i;
+	return 0;
+}
+
+static int format_add_property(FormatSchema *schema, char *name, FormatSchema *property){
+	char **names=realloc(schema->names, sizeof(char *)*(schema->cantProperties+1));
+	if(names==NULL) return OCL_ERR_MALLOC;
+	schema->names=names;
+	FormatSchema **properties=realloc(schema->properties, sizeof(FormatSchema *)*(schema->cantProperties+1));
+	if(properties==NULL) return OCL_ERR_MALLOC;
+	schema->properties=properties;
+	schema->names[schema->cantProperties]=name;
+	schema->properties[schema->cantProperties++]=property;
+	return OCL_RETURN_OK;
+}
+
+static int format_find_property(FormatSchema const *schema, char const *name){
+	for(int i=0;i<schema->cantProperties;i++) if(strcmp(schema->names[i], name)==0) return i;
+	return -1;
+}
+
+static bool format_expect(char const **p, char c){
+	*p=format_skip_ws(*p);
+	if(**p!=c) return false;
+	*p=format_skip_ws(*p+1);
+	return true;
+}
+
+// The elements of an array of strings, one by one. false: the array ended (or isn't valid: 'valid').
+static bool format_next_string(char const **p, char **value, bool *valid){
+	*value=NULL;
+	if(!*valid || format_expect(p, ']')) return false;
+	if((*value=format_parse_string(p))==NULL || (!format_expect(p, ',') && **p!=']')){
+		sfree(*value);
+		*value=NULL;
+		*valid=false;
+		return false;
+	}
+	return true;
+}
+
+// Parses the (sub)schema at '*p'. NULL: not valid, or out of memory.
+static FormatSchema *format_parse_schema(char const **p, int depth){
+	char const *s=*p;
+	if(depth>OCL_FORMAT_MAX_DEPTH || !format_expect(&s, '{')) return NULL;
+	FormatSchema *schema=calloc(1, sizeof(FormatSchema));
+	if(schema==NULL) return NULL;
+	char *required[64], *value=NULL;
+	int cantRequired=0;
+	bool valid=true, ended=format_expect(&s, '}');
+	while(valid && !ended){
+		char *key=format_parse_string(&s);
+		if(key==NULL || !format_expect(&s, ':')){
+			sfree(key);
+			valid=false;
+			break;
+		}
+		if(strcmp(key, "type")==0 && *s=='['){
+			s++;
+			while(format_next_string(&s, &value, &valid)){
+				valid=(format_type_bit(value)!=0);
+				schema->types|=format_type_bit(value);
+				sfree(value);
+			}
+		}else if(strcmp(key, "type")==0){
+			valid=((value=format_parse_string(&s))!=NULL && (schema->types=format_type_bit(value))!=0);
+			sfree(value);
+		}else if(strcmp(key, "properties")==0){
+			valid=format_expect(&s, '{');
+			while(valid && !format_expect(&s, '}')){
+				char *name=format_parse_string(&s);
+				FormatSchema *property=NULL;
+				valid=(name!=NULL && format_expect(&s, ':') && (property=format_parse_schema(&s, depth+1))!=NULL
+						&& format_add_property(schema, name, property)==OCL_RETURN_OK);
+				if(!valid){
+					sfree(name);
+					format_schema_free(property);
+				}else if(!format_expect(&s, ',') && *s!='}'){
+					valid=false;
+				}
+			}
+		}else if(strcmp(key, "required")==0){
+			valid=format_expect(&s, '[');
+			while(format_next_string(&s, &value, &valid)){
+				if(cantRequired<64) required[cantRequired++]=value;
+				else sfree(value);
+			}
+		}else if(strcmp(key, "additionalProperties")==0){
+			schema->closed=(strncmp(s, "false", 5)==0);
+			valid=((s=format_skip_value(s, depth+1))!=NULL);
+		}else if(strcmp(key, "items")==0 && *s=='{'){
+			valid=((schema->items=format_parse_schema(&s, depth+1))!=NULL);
+		}else if(strcmp(key, "enum")==0 && *s=='['){
+			// Only enums of strings are checked.
+			char const *values=s++;
+			bool strings=true;
+			while(format_next_string(&s, &value, &strings)){
+				char **enumValues=realloc(schema->enumValues, sizeof(char *)*(schema->cantEnum+1));
+				if(enumValues==NULL){
+					sfree(value);
+					valid=false;
+					break;
+				}
+				schema->enumValues=enumValues;
+				schema->enumValues[schema->cantEnum++]=value;
+			}
+			if(!strings){
+				for(int i=0;i<schema->cantEnum;i++) sfree(schema->enumValues[i]);
+				schema->cantEnum=0;
+				valid=((s=format_skip_value(values, depth+1))!=NULL);
+			}
+		}else{
+			valid=((s=format_skip_value(s, depth+1))!=NULL);
+		}
+		sfree(key);
+		if(!valid) break;
+		ended=format_expect(&s, '}');
+		if(!ended) valid=format_expect(&s, ',');
+	}
+	// Required properties not described are of any type.
+	for(int i=0;i<cantRequired;i++){
+		int index=valid?format_find_property(schema, required[i]):-1;
+		if(valid && index<0 && (valid=(format_add_property(schema, required[i], NULL)==OCL_RETURN_OK))){
+			index=schema->cantProperties-1;
+			required[i]=NULL;
+		}
+		if(valid && index<64) schema->required|=(uint64_t) 1<<index;
+		sfree(required[i]);
+	}
+	if(!valid){
+		format_schema_free(schema);
+		return NULL;
+	}
+	*p=s;
+	return schema;
+}
+
+/*
+ * "json" (or NULL/""): any JSON document. Otherwise, a JSON schema. Sent with every chat of the instance (and its
+ * forks), and checked as the answer streams in: a violation ends the chat with OCL_ERR_FORMAT_VIOLATION, keeping the
+ * valid prefix as content. With that error made retryable ('OCl_set_retry_policy()'), the chat is re-asked from scratch.
+ */
+int OCl_set_format(OCl *ocl, const char *format){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	struct _ocl_format *newFormat=NULL;
+	if(format!=NULL && format[0]!=0){
+		if((newFormat=calloc(1, sizeof(struct _ocl_format)))==NULL) return OCL_ERR_MALLOC;
+		atomic_init(&newFormat->refs, 1);
+		if(strcmp(format, "json")==0){
+			newFormat->text=strdup("\"json\"");
+		}else{
+			char const *p=format;
+			if((newFormat->schema=format_parse_schema(&p, 0))==NULL || *format_skip_ws(p)!=0){
+				format_release(newFormat);
+				return OCL_ERR_FORMAT;
+			}
+			newFormat->text=strdup(format);
+		}
+		if(newFormat->text==NULL){
+			format_release(newFormat);
+			return OCL_ERR_MALLOC;
+		}
+	}
+	format_release(ocl->format);
+	ocl->format=newFormat;
+	return OCL_RETURN_OK;
+}
+
+enum format_states{
+	FORMAT_KEY_OR_END=0,
+	FORMAT_KEY,
+	FORMAT_COLON,
+	FORMAT_VALUE,
+	FORMAT_VALUE_OR_END,
+	FORMAT_COMMA_OR_END
+};
+
+typedef struct{
+	FormatSchema const *schema;
+	bool object;
+	int state;
+	int property;
+	uint64_t seen;
+}FormatFrame;
+
+typedef struct{
+	FormatSchema const *root;
+	FormatFrame frames[OCL_FORMAT_MAX_DEPTH];
+	int depth;
+	bool done;
+	// The scalar being read: string, key, number or literal (true, false, null).
+	char scalar;
+	FormatSchema const *scalarSchema;
+	bool escape;
+	int hex;
+	char const *literal;
+	char value[BUFFER_SIZE_1K];
+	size_t valueLen;
+	bool valueCut;
+}FormatValidator;
+
+static void format_validator_init(FormatValidator *fv, struct _ocl_format const *format){
+	memset(fv, 0, sizeof(FormatValidator));
+	fv->root=(format!=NULL)?format->schema:NULL;
+}
+
+static void format_value_push(FormatValidator *fv, char c){
+	if(fv->valueLen<sizeof(fv->value)-1) fv->value[fv->valueLen++]=c;
+	else fv->valueCut=true;
+	fv->value[fv->valueLen]=0;
+}
+
+// -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+static bool format_number_valid(char const *n, bool integer){
+	if(*n=='-') n++;
+	if(*n=='0') n++;
+	else if(isdigit((unsigned char) *n)) while(isdigit((unsigned char) *n)) n++;
+	else return false;
+	if(*n=='.'){
+		if(integer || !isdigit((unsigned char) *++n)) return false;
+		while(isdigit((unsigned char) *n)) n++;
+	}
+	if(*n=='e' || *n=='E'){
+		if(integer) return false;
+		n++;
+		if(*n=='+' || *n=='-') n++;
+		if(!isdigit((unsigned char) *n)) return false;
+		while(isdigit((unsigned char) *n)) n++;
+	}
+	return *n==0;
+}
+
+static bool format_enum_matches(FormatSchema const *schema, char const *value, size_t len, bool whole){
+	if(schema==NULL || schema->cantEnum==0) return true;
+	for(int i=0;i<schema->cantEnum;i++)
+		if(strncmp(schema->enumValues[i], value, len)==0 && (!whole || schema->enumValues[i][len]==0)) return true;
+	return false;
+}
+
+static void format_value_end(FormatValidator *fv){
+	fv->scalar=0;
+	if(fv->depth==0){
+		fv->done=true;
+		return;
+	}
+	FormatFrame *frame=&fv->frames[fv->depth-1];
+	if(frame->object && frame->property>=0 && frame->property<64) frame->seen|=(uint64_t) 1<<frame->property;
+	frame->state=FORMAT_COMMA_OR_END;
+}
+
+static bool format_value_start(FormatValidator *fv, FormatSchema const *schema, char c){
+	int type=0;
+	if(c=='{') type=FORMAT_OBJECT;
+	else if(c=='[') type=FORMAT_ARRAY;
+	else if(c=='"') type=FORMAT_STRING;
+	else if(c=='-' || isdigit((unsigned char) c)) type=FORMAT_NUMBER;
+	else if(c=='t' || c=='f') type=FORMAT_BOOLEAN;
+	else if(c=='n') type=FORMAT_NULL;
+	else return false;
+	if(schema!=NULL){
+		int allowed=schema->types;
+		if(allowed & FORMAT_INTEGER) allowed|=FORMAT_NUMBER;
+		if(allowed!=0 && !(allowed & type)) return false;
+		if(schema->cantEnum>0 && type!=FORMAT_STRING) return false;
+	}
+	fv->scalarSchema=schema;
+	fv->valueLen=0;
+	fv->valueCut=false;
+	if(type==FORMAT_OBJECT || type==FORMAT_ARRAY){
+		if(fv->depth>=OCL_FORMAT_MAX_DEPTH) return false;
+		FormatFrame *frame=&fv->frames[fv->depth++];
+		frame->schema=schema;
+		frame->object=(type==FORMAT_OBJECT);
+		frame->state=frame->object?FORMAT_KEY_OR_END:FORMAT_VALUE_OR_END;
+		frame->property=-1;
+		frame->seen=0;
+		return true;
+	}
+	if(type==FORMAT_STRING){
+		fv->scalar='s';
+	}else if(type==FORMAT_NUMBER){
+		fv->scalar='n';
+		format_value_push(fv, c);
+	}else{
+		fv->scalar='l';
+		fv->literal=(c=='t')?"rue":(c=='f')?"alse":"ull";
+	}
+	return true;
+}
+
+static bool format_number_end(FormatValidator *fv){
+	FormatSchema const *schema=fv->scalarSchema;
+	bool integer=(schema!=NULL && (schema->types & FORMAT_INTEGER) && !(schema->types & FORMAT_NUMBER));
+	if(!fv->valueCut && !format_number_valid(fv->value, integer)) return false;
+	format_value_end(fv);
+	return true;
+}
+
+static bool format_close(FormatValidator *fv){
+	FormatFrame *frame=&fv->frames[fv->depth-1];
+	if(frame->object && frame->schema!=NULL && (frame->schema->required & ~frame->seen)!=0) return false;
+	fv->depth--;
+	format_value_end(fv);
+	return true;
+}
+
+// false: the document can't be valid any more.
+static bool format_feed_char(FormatValidator *fv, char c){
+	if(fv->scalar=='s' || fv->scalar=='k'){
+		if(fv->escape){
+			fv->escape=false;
+			if(c==0 || strchr("\"\\/bfnrtu", c)==NULL) return false;
+			if(c=='u') fv->hex=4;
+		}else if(fv->hex>0){
+			if(!isxdigit((unsigned char) c)) return false;
+			fv->hex--;
+		}else if(c=='\\'){
+			fv->escape=true;
+		}else if(c=='"'){
+			if(fv->scalar=='s'){
+				if(!format_enum_matches(fv->scalarSchema, fv->value, fv->valueLen, true)) return false;
+				format_value_end(fv);
+				return true;
+			}
+			FormatFrame *frame=&fv->frames[fv->depth-1];
+			frame->property=(frame->schema!=NULL && !fv->valueCut)?format_find_property(frame->schema, fv->value):-1;
+			if(frame->property<0 && frame->schema!=NULL && frame->schema->closed) return false;
+			frame->state=FORMAT_COLON;
+			fv->scalar=0;
+			return true;
+		}else if((unsigned char) c<0x20){
+			return false;
+		}
+		format_value_push(fv, c);
+		return fv->scalar=='k' || fv->valueCut || format_enum_matches(fv->scalarSchema, fv->value, fv->valueLen, false);
+	}
+	if(fv->scalar=='l'){
+		if(c!=*fv->literal++) return false;
+		if(*fv->literal==0) format_value_end(fv);
+		return true;
+	}
+	if(fv->scalar=='n'){
+		if(strchr("0123456789+-.eE", c)!=NULL && c!=0){
+			format_value_push(fv, c);
+			return true;
+		}
+		if(!format_number_end(fv)) return false;
+	}
+	if(c==' ' || c=='\t' || c=='\n' || c=='\r') return true;
+	if(fv->depth==0) return !fv->done && format_value_start(fv, fv->root, c);
+	FormatFrame *frame=&fv->frames[fv->depth-1];
+	char close=frame->object?'}':']';
+	switch(frame->state){
+	case FORMAT_KEY_OR_END:
+		if(c=='}') return format_close(fv);
+		// fall through
+	case FORMAT_KEY:
+		if(c!='"') return false;
+		fv->scalar='k';
+		fv->valueLen=0;
+		fv->valueCut=false;
+		return true;
+	case FORMAT_COLON:
+		if(c!=':') return false;
+		frame->state=FORMAT_VALUE;
+		return true;
+	case FORMAT_VALUE_OR_END:
+		if(c==']') return format_close(fv);
+		// fall through
+	case FORMAT_VALUE:
+		if(frame->schema==NULL) return format_value_start(fv, NULL, c);
+		if(frame->object) return format_value_start(fv, (frame->property>=0)?frame->schema->properties[frame->property]:NULL, c);
+		return format_value_start(fv, frame->schema->items, c);
+	case FORMAT_COMMA_OR_END:
+		if(c==close) return format_close(fv);
+		if(c!=',') return false;
+		frame->state=frame->object?FORMAT_KEY:FORMAT_VALUE;
+		return true;
+	}
+	return false;
+}
+
+// A token as streamed (JSON escaped): decoded into the answer's chars. Escapes aren't split between tokens.
+static bool format_feed(FormatValidator *fv, char const *token){
+	for(char const *p=token;*p!=0;p++){
+		if(*p!='\\' || p[1]==0){
+			if(!format_feed_char(fv, *p)) return false;
+			continue;
+		}
+		char c=*++p;
+		if(c=='u'){
+			unsigned int cp=0;
+			for(int i=0;i<4 && isxdigit((unsigned char) p[1]);i++){
+				char h=*++p;
+				cp=cp*16+(isdigit((unsigned char) h)?h-'0':tolower((unsigned char) h)-'a'+10);
+			}
+			// Non-ASCII chars only matter as 'any char' inside strings.
+			if(!format_feed_char(fv, (cp<0x80)?(char) cp:'x')) return false;
+			continue;
+		}
+		char const *from="nrtbf", *to="\n\r\t\b\f";
+		char const *e=strchr(from, c);
+		if(!format_feed_char(fv, (e!=NULL && c!=0)?to[e-from]:c)) return false;
+	}
+	return true;
+}
+
+// At the end of the answer: the document must be complete.
+static bool format_finish(FormatValidator *fv){
+	if(fv->scalar=='n' && !format_number_end(fv)) return false;
+	return fv->done && fv->scalar==0;
+}
+
+/*
+ * Stop sequences: sent to the server ("stop") and also matched here, on the decoded answer, by an Aho-Corasick
+ * automaton (trie with failure links) that keeps its state between tokens, so a sequence split across tokens is found
+ * too. The chars that could be the start of a sequence are held back until it's known they aren't: the callback never
+ * gets any part of a stop sequence. Found one (or a budget exhausted), the connection is closed right away.
+ */
+typedef struct{
+	unsigned char byte;
+	int child;
+	int sibling;
+	int fail;
+	int depth;
+	int match;
+}StopNode;
+
+struct _ocl_stop{
+	atomic_int refs;
+	char *json;
+	int cantNodes;
+	StopNode nodes[];
+};
+
+static struct _ocl_stop *stop_retain(struct _ocl_stop *stop){
+	if(stop!=NULL) atomic_fetch_add(&stop->refs, 1);
+	return stop;
+}
+
+static void stop_release(struct _ocl_stop *stop){
+	if(stop==NULL || atomic_fetch_sub(&stop->refs, 1)>1) return;
+	sfree(stop->json);
+	sfree(stop);
+}
+
+static int stop_child(struct _ocl_stop const *stop, int node, unsigned char byte){
+	for(int child=stop->nodes[node].child;child>0;child=stop->nodes[child].sibling)
+		if(stop->nodes[child].byte==byte) return child;
+	return 0;
+}
+
+static int stop_next(struct _ocl_stop const *stop, int node, unsigned char byte){
+	int child=0;
+	while((child=stop_child(stop, node, byte))==0 && node!=0) node=stop->nodes[node].fail;
+	return child;
+}
+
+// Failure links (breadth first): the longest proper suffix that's in the trie. 'match': the longest sequence ending here.
+static void stop_build_links(struct _ocl_stop *stop){
+	int queue[OCL_MAX_STOP_SEQUENCES*OCL_STOP_MAX_LEN+1], head=0, tail=0;
+	for(int child=stop->nodes[0].child;child>0;child=stop->nodes[child].sibling) queue[tail++]=child;
+	while(head<tail){
+		int node=queue[head++];
+		StopNode *n=&stop->nodes[node];
+		if(n->match==0) n->match=stop->nodes[n->fail].match;
+		for(int child=n->child;child>0;child=stop->nodes[child].sibling){
+			stop->nodes[child].fail=stop_next(stop, n->fail, stop->nodes[child].byte);
+			if(stop->nodes[child].fail==child) stop->nodes[child].fail=0;
+			queue[tail++]=child;
+		}
+	}
+}
+
+/*
+ * Up to OCL_MAX_STOP_SEQUENCES of up to OCL_STOP_MAX_LEN bytes (raw, not escaped). NULL/0: none. Inherited by the
+ * instance's forks. The answer ends before the sequence ('OCL_get_response_stop_reason()': OCL_STOP_SEQUENCE).
+ */
+int OCl_set_stop(OCl *ocl, const char **stops, int cantStops){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(cantStops<0 || cantStops>OCL_MAX_STOP_SEQUENCES || (cantStops>0 && stops==NULL)) return OCL_ERR_STOP;
+	size_t bytes=0;
+	for(int i=0;i<cantStops;i++){
+		size_t len=(stops[i]!=NULL)?strlen(stops[i]):0;
+		if(len==0 || len>OCL_STOP_MAX_LEN) return OCL_ERR_STOP;
+		bytes+=len;
+	}
+	struct _ocl_stop *stop=NULL;
+	if(cantStops>0){
+		if((stop=calloc(1, sizeof(struct _ocl_stop)+sizeof(StopNode)*(bytes+1)))==NULL) return OCL_ERR_MALLOC;
+		atomic_init(&stop->refs, 1);
+		stop->cantNodes=1;
+		size_t len=0, size=0;
+		int retVal=buffer_append(NULL, &stop->json, &len, &size, "[", 1);
+		for(int i=0;i<cantStops && retVal==OCL_RETURN_OK;i++){
+			int node=0;
+			for(unsigned char const *b=(unsigned char const *) stops[i];*b!=0;b++){
+				int child=stop_child(stop, node, *b);
+				if(child==0){
+					child=stop->cantNodes++;
+					stop->nodes[child].byte=*b;
+					stop->nodes[child].depth=stop->nodes[node].depth+1;
+					stop->nodes[child].sibling=stop->nodes[node].child;
+					stop->nodes[node].child=child;
+				}
+				node=child;
+			}
+			stop->nodes[node].match=stop->nodes[node].depth;
+			if((retVal=buffer_append(NULL, &stop->json, &len, &size, (i>0)?",\"":"\"", (i>0)?2:1))==OCL_RETURN_OK
+					&& (retVal=json_escape_append(NULL, &stop->json, &len, &size, stops[i], strlen(stops[i])))==OCL_RETURN_OK)
+				retVal=buffer_append(NULL, &stop->json, &len, &size, "\"", 1);
+		}
+		if(retVal==OCL_RETURN_OK) retVal=buffer_append(NULL, &stop->json, &len, &size, "]", 1);
+		if(retVal!=OCL_RETURN_OK){
+			stop_release(stop);
+			return retVal;
+		}
+		stop_build_links(stop);
+	}
+	stop_release(ocl->stop);
+	ocl->stop=stop;
+	return OCL_RETURN_OK;
+}
+
+/*
+ * Budgets of the answer: 'maxChars' (UTF-8 chars of content) and 'maxTime' (ms since the request was sent). 0: no
+ * limit. When hit, the connection is closed and the answer ends there (OCL_STOP_MAX_CHARS, OCL_STOP_MAX_TIME).
+ */
+int OCl_set_budget(OCl *ocl, int maxChars, int maxTime){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(maxChars<0 || maxTime<0) return OCL_ERR_BUDGET;
+	ocl->maxChars=maxChars;
+	ocl->maxTime=maxTime;
+	return OCL_RETURN_OK;
+}
+
+// The chars held back (as streamed: escaped), by unit (a char or an escape), while they could start a sequence.
+typedef struct{
+	int node;
+	long int charsEmitted;
+	char pending[OCL_STOP_PENDING_SIZE];
+	int pendingLen;
+	int pendingBytes;
+	int cantUnits;
+	short unitLen[OCL_STOP_MAX_LEN+1];
+	unsigned char unitBytes[OCL_STOP_MAX_LEN+1];
+	unsigned char unitChars[OCL_STOP_MAX_LEN+1];
+}StopState;
+
+// The next unit of an escaped token, decoded into UTF-8 ('bytes', max. 4). Returns the bytes decoded.
+static int stop_unit(char const *p, unsigned char *bytes, int *unitLen){
+	*unitLen=1;
+	if(p[0]!='\\' || p[1]==0){
+		bytes[0]=p[0];
+		return 1;
+	}
+	*unitLen=2;
+	char const *from="nrtbf", *to="\n\r\t\b\f";
+	char const *e=strchr(from, p[1]);
+	if(p[1]!='u'){
+		bytes[0]=(e!=NULL)?to[e-from]:p[1];
+		return 1;
+	}
+	unsigned int cp=0;
+	for(int i=2;i<6;i++){
+		if(!isxdigit((unsigned char) p[i])){
+			bytes[0]='u';
+			return 1;
+		}
+		cp=cp*16+(isdigit((unsigned char) p[i])?p[i]-'0':tolower((unsigned char) p[i])-'a'+10);
+	}
+	*unitLen=6;
+	if(cp>=0xD800 && cp<0xDC00 && p[6]=='\\' && p[7]=='u'){
+		unsigned int low=0;
+		int i=8;
+		for(;i<12 && isxdigit((unsigned char) p[i]);i++) low=low*16+(isdigit((unsigned char) p[i])?p[i]-'0':tolower((unsigned char) p[i])-'a'+10);
+		if(i==12 && low>=0xDC00 && low<0xE000){
+			cp=0x10000+((cp-0xD800)<<10)+(low-0xDC00);
+			*unitLen=12;
+		}
+	}
+	if(cp<0x80){
+		bytes[0]=cp;
+		return 1;
+	}
+	if(cp<0x800){
+		bytes[0]=0xC0|(cp>>6);
+		bytes[1]=0x80|(cp&0x3F);
+		return 2;
+	}
+	if(cp<0x10000){
+		bytes[0]=0xE0|(cp>>12);
+		bytes[1]=0x80|((cp>>6)&0x3F);
+		bytes[2]=0x80|(cp&0x3F);
+		return 3;
+	}
+	bytes[0]=0xF0|(cp>>18);
+	bytes[1]=0x80|((cp>>12)&0x3F);
+	bytes[2]=0x80|((cp>>6)&0x3F);
+	bytes[3]=0x80|(cp&0x3F);
+	return 4;
+}
+
+// The first 'cantUnits' held units are handed over ('out'), unless the chars budget runs out (false).
+static bool stop_emit_units(OCl const *ocl, StopState *ss, int cantUnits, char **out){
+	int len=0, bytes=0, i=0;
+	bool withinBudget=true;
+	for(;i<cantUnits;i++){
+		if(ocl->maxChars>0 && ss->charsEmitted+ss->unitChars[i]>ocl->maxChars){
+			withinBudget=false;
+			break;
+		}
+		ss->charsEmitted+=ss->unitChars[i];
+		len+=ss->unitLen[i];
+		bytes+=ss->unitBytes[i];
+	}
+	memcpy(*out, ss->pending, len);
+	*out+=len;
+	memmove(ss->pending, ss->pending+len, ss->pendingLen-len);
+	memmove(ss->unitLen, ss->unitLen+i, sizeof(short)*(ss->cantUnits-i));
+	memmove(ss->unitBytes, ss->unitBytes+i, ss->cantUnits-i);
+	memmove(ss->unitChars, ss->unitChars+i, ss->cantUnits-i);
+	ss->pendingLen-=len;
+	ss->pendingBytes-=bytes;
+	ss->cantUnits-=i;
+	return withinBudget;
+}
+
+/*
+ * Filters a token (escaped) through the stop sequences and the chars budget: what can be handed over is written in
+ * 'out'. 'flush' (the answer is done): nothing is held back. Returns the reason, if the answer must end here.
+ */
+static int stop_filter(OCl const *ocl, StopState *ss, char const *token, char *out, bool flush){
+	struct _ocl_stop const *stop=ocl->stop;
+	int reason=OCL_STOP_NONE;
+	for(char const *p=token;*p!=0 && reason==OCL_STOP_NONE;){
+		unsigned char bytes[4];
+		int unitLen=0, cantBytes=stop_unit(p, bytes, &unitLen), match=0;
+		memcpy(ss->pending+ss->pendingLen, p, unitLen);
+		ss->pendingLen+=unitLen;
+		ss->pendingBytes+=cantBytes;
+		ss->unitLen[ss->cantUnits]=unitLen;
+		ss->unitBytes[ss->cantUnits]=cantBytes;
+		ss->unitChars[ss->cantUnits]=0;
+		for(int i=0;i<cantBytes;i++) if((bytes[i]&0xC0)!=0x80) ss->unitChars[ss->cantUnits]++;
+		ss->cantUnits++;
+		p+=unitLen;
+		for(int i=0;i<cantBytes && stop!=NULL && match==0;i++){
+			ss->node=stop_next(stop, ss->node, bytes[i]);
+			match=stop->nodes[ss->node].match;
+		}
+		int hold=(stop!=NULL)?stop->nodes[ss->node].depth:0, release=0, bytesReleased=0;
+		if(match>0){
+			// The units before the sequence are handed over, the rest dropped.
+			while(release<ss->cantUnits && bytesReleased+ss->unitBytes[release]<=ss->pendingBytes-match)
+				bytesReleased+=ss->unitBytes[release++];
+			reason=OCL_STOP_SEQUENCE;
+		}else{
+			while(release<ss->cantUnits && ss->pendingBytes-bytesReleased-ss->unitBytes[release]>=hold)
+				bytesReleased+=ss->unitBytes[release++];
+		}
+		if(!stop_emit_units(ocl, ss, release, &out)) reason=OCL_STOP_MAX_CHARS;
+		// The budget is spent by the chars held back too: they're handed over, and the answer ends.
+		if(reason==OCL_STOP_NONE && ocl->maxChars>0){
+			long int held=0;
+			for(int i=0;i<ss->cantUnits;i++) held+=ss->unitChars[i];
+			if(ss->charsEmitted+held>=ocl->maxChars){
+				stop_emit_units(ocl, ss, ss->cantUnits, &out);
+				reason=OCL_STOP_MAX_CHARS;
+			}
+		}
+		if(reason!=OCL_STOP_NONE){
+			ss->pendingLen=ss->pendingBytes=ss->cantUnits=0;
+		}
+	}
+	if(reason==OCL_STOP_NONE && flush && !stop_emit_units(ocl, ss, ss->cantUnits, &out)) reason=OCL_STOP_MAX_CHARS;
+	*out=0;
+	return reason;
+}
+
+static int append_response_text(char **text, size_t *len, long int *size, char const *token){
+	size_t tokenLen=strlen(token);
+	if(*len+tokenLen+1>(size_t) *size){
+		long int newSize=*size;
+		while(*len+tokenLen+1>(size_t) newSize) newSize*=2;
+		char *newText=realloc(*text, newSize);
+		if(newText==NULL) return OCL_ERR_REALLOC;
+		*text=newText;
+		*size=newSize;
+	}
+	memcpy(*text+*len, token, tokenLen+1);
+	*len+=tokenLen;
+	return OCL_RETURN_OK;
+}
+
+typedef struct{
+	size_t thoughtsLen;
+	size_t contentLen;
+	long int thoughtsSize;
+	long int contentSize;
+	bool firstToken;
+	double sentAt;
+	FormatValidator format;
+	StopState stop;
+}ResponseState;
+
+/*
+ * '/api/generate' ends with the conversation as tokens ("context":[...]): kept as int32, to be sent back next turn.
+ */
+static int response_parse_context(struct _ocl_response *oclResp, char const *line){
+	oclResp->cantContext=0;
+	char const *p=strstr(line, "\"context\":[");
+	if(p==NULL) return OCL_RETURN_OK;
+	p+=strlen("\"context\":[");
+	while(*p!=']' && *p!=0){
+		char *end=NULL;
+		long token=strtol(p, &end, 10);
+		if(end==p) break;
+		if(oclResp->cantContext>=oclResp->contextSize){
+			int newSize=(oclResp->contextSize==0)?BUFFER_SIZE_1K:oclResp->contextSize*2;
+			int32_t *context=realloc(oclResp->context, sizeof(int32_t)*newSize);
+			if(context==NULL) return OCL_ERR_REALLOC;
+			oclResp->context=context;
+			oclResp->contextSize=newSize;
+		}
+		oclResp->context[oclResp->cantContext++]=(int32_t) token;
+		p=end;
+		while(*p==',' || *p==' ') p++;
+	}
+	return OCL_RETURN_OK;
+}
+
+static int response_content(OCl *ocl, ResponseState *rs, char const *token, void (*callback)(const char *, bool, int)){
+	// Not handed to the callback: the answer ends with the last valid token.
+	if(ocl->format!=NULL && !format_feed(&rs->format, token)) return OCL_ERR_FORMAT_VIOLATION;
+	if(callback!=NULL) callback(token, ocl->ocl_resp->done, OCL_CONTENT_TYPE);
+	return append_response_text(&ocl->ocl_resp->content, &rs->contentLen, &rs->contentSize, token);
+}
+
+// The time budget ran out: the chars held back are handed over, and the answer ends.
+static int response_stop_time(OCl *ocl, ResponseState *rs, void (*callback)(const char *, bool, int)){
+	char token[OCL_STOP_PENDING_SIZE+1];
+	stop_filter(ocl, &rs->stop, "", token, true);
+	ocl->ocl_resp->done=true;
+	ocl->ocl_resp->stopReason=OCL_STOP_MAX_TIME;
+	return response_content(ocl, rs, token, callback);
+}
+
+static int process_response_line(OCl *ocl, HttpStream *hs, char *line, ResponseState *rs, void (*callback)(const char *, bool, int)){
+	size_t lineLen=strlen(line), scratchSize=lineLen+1;
+	if(lineLen==0) return OCL_RETURN_OK;
+	// Room for the filtered content (held chars + token), after the token.
+	bool filtered=(ocl->stop!=NULL || ocl->maxChars>0);
+	if(filtered) scratchSize=scratchSize*2+OCL_STOP_PENDING_SIZE;
+	if(scratchSize>hs->scratchSize){
+		char *scratch=realloc(hs->scratch, scratchSize);
+		if(scratch==NULL) return OCL_ERR_REALLOC;
+		hs->scratch=scratch;
+		hs->scratchSize=scratchSize;
+	}
+	char *token=hs->scratch;
+	int retVal=OCL_RETURN_OK;
+	if(get_string_from_token(line, "\"thinking\":\"", token, hs->scratchSize, '"',0)){
+		metrics_first_token(&rs->firstToken, rs->sentAt);
+		if((retVal=append_response_text(&ocl->ocl_resp->thoughts, &rs->thoughtsLen, &rs->thoughtsSize, token))!=OCL_RETURN_OK) return retVal;
+		if(callback!=NULL) callback(token, ocl->ocl_resp->done, OCL_THINKING_TYPE);
+		return OCL_RETURN_OK;
+	}
+	if(get_string_from_token(line, "\"tool_calls\":[", token, hs->scratchSize, ']',0)){
+		metrics_first_token(&rs->firstToken, rs->sentAt);
+		if(ocl->ocl_resp->contTools>=512) return OCL_RETURN_OK;
+		snprintf(ocl->ocl_resp->toolCalls[ocl->ocl_resp->contTools],512,"%s}}}",token);
+		ocl->ocl_resp->contTools++;
+		if(callback!=NULL) callback(ocl->ocl_resp->toolCalls[ocl->ocl_resp->contTools-1], ocl->ocl_resp->done, OCL_TOOL_TYPE);
+		return OCL_RETURN_OK;
+	}
+	if(get_string_from_token(line, "\"content\":\"", token, hs->scratchSize, '"',0)
+			|| get_string_from_token(line, "\"response\":\"", token, hs->scratchSize, '"',0)){
+		if(token[0]!=0) metrics_first_token(&rs->firstToken, rs->sentAt);
+		if(strstr(line,"\"done\":true")!=NULL || strstr(line,"\"done\": true")!=NULL) ocl->ocl_resp->done=true;
+		if(filtered){
+			char *filteredToken=token+strlen(token)+1;
+			int reason=stop_filter(ocl, &rs->stop, token, filteredToken, ocl->ocl_resp->done);
+			token=filteredToken;
+			if(reason!=OCL_STOP_NONE){
+				ocl->ocl_resp->done=true;
+				ocl->ocl_resp->stopReason=reason;
+			}
+		}
+		if((retVal=response_content(ocl, rs, token, callback))!=OCL_RETURN_OK) return retVal;
+		// Ended here (stop sequence or budget), the answer is cut on purpose: no stats, nor a complete format.
+		if(ocl->ocl_resp->done && ocl->ocl_resp->stopReason==OCL_STOP_NONE){
+			char result[128]="";
+			if(get_string_from_token(line, "\"load_duration\":", result, 128, ',',0)) ocl->ocl_resp->loadDuration=strtod(result,NULL)/1000000000.0;
+			if(get_string_from_token(line, "\"prompt_eval_duration\":", result, 128, ',',0)) ocl->ocl_resp->promptEvalDuration=strtod(result,NULL)/1000000000.0;
+			if(get_string_from_token(line, "\"eval_duration\":", result, 128, '}',0)) ocl->ocl_resp->evalDuration=strtod(result,NULL)/1000000000.0;
+			if(get_string_from_token(line, "\"total_duration\":", result, 128, ',',0)) ocl->ocl_resp->totalDuration=strtod(result,NULL)/1000000000.0;
+			if(get_string_from_token(line, "\"prompt_eval_count\":", result, 128, ',',0)) ocl->ocl_resp->promptEvalCount=strtol(result,NULL,10);
+			if(get_string_from_token(line, "\"eval_count\":", result, 128, '}',',')) ocl->ocl_resp->evalCount=strtol(result,NULL,10);
+			if(ocl->ocl_resp->evalDuration!=0) ocl->ocl_resp->tokensPerSec=ocl->ocl_resp->evalCount/ocl->ocl_resp->evalDuration;
+			if((retVal=response_parse_context(ocl->ocl_resp, line))!=OCL_RETURN_OK) return retVal;
+			if(ocl->format!=NULL && !format_finish(&rs->format)) return OCL_ERR_FORMAT_VIOLATION;
+		}
+		return OCL_RETURN_OK;
+	}
+	char err[512]="";
+	if(get_string_from_token(line,"{\"error\":", err, 512, '}',0)){
+		snprintf(ocl->ocl_resp->error,BUFFER_SIZE_1K,"%s: %s", hs->status, err);
+		return OCL_ERR_MSG_FOUND;
+	}
+	if(hs->statusCode<200 || hs->statusCode>299){
+		snprintf(ocl->ocl_resp->error,BUFFER_SIZE_1K,"%s: %.512s", hs->status, line);
+		return OCL_ERR_MSG_FOUND;
+	}
+	return OCL_RETURN_OK;
+}
+
+static int process_response_body(OCl *ocl, HttpStream *hs, ResponseState *rs, void (*callback)(const char *, bool, int), bool flush){
+	size_t pos=0;
+	int retVal=OCL_RETURN_OK;
+	while(pos<hs->bodyLen && !ocl->ocl_resp->done && retVal==OCL_RETURN_OK){
+		char *endLine=memchr(hs->body+pos,'\n',hs->bodyLen-pos);
+		if(endLine==NULL){
+			if(!flush) break;
+			endLine=hs->body+hs->bodyLen;
+		}
+		*endLine=0;
+		retVal=process_response_line(ocl, hs, hs->body+pos, rs, callback);
+		pos=endLine-hs->body+1;
+	}
+	if(pos>hs->bodyLen) pos=hs->bodyLen;
+	memmove(hs->body, hs->body+pos, hs->bodyLen-pos);
+	hs->bodyLen-=pos;
+	if(hs->body) hs->body[hs->bodyLen]=0;
+	return retVal;
+}
+
+typedef struct{
+	bool tokenReceived;
+	double firstByte;
+}TransmitInfo;
+
+/*
+ * A request's body, sent after its headers. With 'message' (raw), the body is uploaded chunked (see 'upload_body()'):
+ * 'message' is escaped into it, at 'messageAt' of 'data', while it's sent.
+ */
+typedef struct{
+	char const *data;
+	size_t len;
+	char const *message;
+	size_t messageAt;
+}RequestBody;
+
+// The Host header's value: IPv6 literals go between brackets.
+static char const *http_host(char const *addr, char *host, size_t hostSize){
+	if(strchr(addr, ':')==NULL || addr[0]=='[') return addr;
+	snprintf(host, hostSize, "[%s]", addr);
+	return host;
+}
+
+/*
+ * Requests are built with 'Host: ocl->srvAddr'. When sent to another endpoint, the header is rewritten (copy). Only the
+ * headers are copied when the body is sent apart (chats).
+ */
+static char *http_replace_host(char const *payload, size_t payloadLen, char const *srvAddr, size_t *newPayloadLen){
+	char hostBuffer[OCL_HOST_SIZE];
+	char const *host=http_host(srvAddr, hostBuffer, sizeof(hostBuffer));
+	char const *hostHeader=strstr(payload, "\r\nHost: ");
+	if(hostHeader==NULL) return NULL;
+	hostHeader+=strlen("\r\nHost: ");
+	char const *endHost=strstr(hostHeader, "\r\n");
+	if(endHost==NULL) return NULL;
+	size_t headLen=hostHeader-payload, hostLen=strlen(host), tailLen=payloadLen-(endHost-payload);
+	char *newPayload=malloc(headLen+hostLen+tailLen+1);
+	if(newPayload==NULL) return NULL;
+	memcpy(newPayload, payload, headLen);
+	memcpy(newPayload+headLen, host, hostLen);
+	memcpy(newPayload+headLen+hostLen, endHost, tailLen);
+	newPayload[headLen+hostLen+tailLen]=0;
+	*newPayloadLen=headLen+hostLen+tailLen;
+	return newPayload;
+}
+
+static int ssl_open(OCl *ocl, char const *srvAddr, int srvPort, int *socketConn, SSL **sslConn){
+	oclSslError=0;
+	*socketConn=create_connection(ocl, srvAddr, srvPort, ocl->socketConnectTimeout);
+	if(*socketConn<=0) return *socketConn;
+	if(metrics_on()) metrics_add(&oclMetrics.connections, 1);
+	if(oclSslCtx==NULL){
+		close(*socketConn);
+		return OCL_ERR_SSLCTX_NULL;
+	}
+	if((*sslConn=SSL_new(oclSslCtx))==NULL){
+		close(*socketConn);
+		return OCL_ERR_SSL_CONTEXT;
+	}
+	if(!SSL_set_fd(*sslConn, *socketConn)){
+		clean_ssl(*sslConn);
+		close(*socketConn);
+		return OCL_ERR_SSL_FD;
+	}
+	SSL_set_connect_state(*sslConn);
+	SSL_set_tlsext_host_name(*sslConn, srvAddr);
+	if(SSL_connect(*sslConn)<1){
+		oclSslError=ERR_get_error();
+		clean_ssl(*sslConn);
+		close(*socketConn);
+		return OCL_ERR_SSL_CONNECT;
+	}
+	return OCL_RETURN_OK;
+}
+
+static int ssl_send(OCl const *ocl, SSL *sslConn, int socketConn, char const *data, size_t len){
+	struct pollfd po[1];
+	po[0].fd=socketConn;
+	po[0].events=POLLOUT;
+	size_t totalBytesSent=0;
+	while(totalBytesSent<len){
+		int retVal=poll(po,1,ocl->socketSendTimeout*1000);
+		if(retVal<=0) return (retVal==0)?OCL_ERR_SEND_TIMEOUT:OCL_ERR_POLLOUT;
+		if(po[0].revents & POLLOUT){
+			int bytesSent=SSL_write(sslConn, data+totalBytesSent, len-totalBytesSent);
+			if(bytesSent<=0){
+				oclSslError=SSL_get_error(sslConn, bytesSent);
+				return OCL_ERR_SENDING_PACKETS;
+			}
+			totalBytesSent+=bytesSent;
+			if(metrics_on()) metrics_add(&oclMetrics.bytesSent, bytesSent);
+		}
+	}
+	return OCL_RETURN_OK;
+}
+
+// The socket of the request in progress, for OCl_cancel() to shut it down from another thread.
+static void connection_track(OCl *ocl, int socketConn){
+	pthread_mutex_lock(&ocl->connMutex);
+	ocl->activeSocket=socketConn;
+	pthread_mutex_unlock(&ocl->connMutex);
+}
+
+// A polling slice, shortened to wake up at the deadline (0: none).
+static int poll_slice(double deadline){
+	if(deadline<=0 || (deadline-ocl_now())*1000.0>=OCL_POLL_SLICE_MS) return OCL_POLL_SLICE_MS;
+	return (int) ((deadline-ocl_now())*1000.0)+1;
+}
+
+/*
+ * 'Transfer-Encoding: chunked' upload of a body with its message escaped while sent: the escaped message (v.gr. a
+ * piped log) is never held whole. Each chunk, built in the arena's buffer, goes out in a single write; the sizes are
+ * zero-padded (to a fixed width) so they're written in front of the data once it's escaped.
+ */
+static int upload_chunks(OCl *ocl, SSL *sslConn, int socketConn, char **chunk, size_t *chunkSize, char const *data
+		, size_t len, bool escape){
+	for(size_t pos=0;pos<len;){
+		size_t slice=(len-pos<OCL_UPLOAD_SLICE)?len-pos:OCL_UPLOAD_SLICE, chunkLen=10;
+		int retVal=escape?json_escape_append(&ocl->arena, chunk, &chunkLen, chunkSize, data+pos, slice)
+				:buffer_append(&ocl->arena, chunk, &chunkLen, chunkSize, data+pos, slice);
+		if(retVal==OCL_RETURN_OK) retVal=buffer_append(&ocl->arena, chunk, &chunkLen, chunkSize, "\r\n", 2);
+		if(retVal!=OCL_RETURN_OK) return retVal;
+		char size[11];
+		snprintf(size, sizeof(size), "%08zx\r\n", chunkLen-12);
+		memcpy(*chunk, size, 10);
+		if((retVal=ssl_send(ocl, sslConn, socketConn, *chunk, chunkLen))!=OCL_RETURN_OK) return retVal;
+		pos+=slice;
+	}
+	return OCL_RETURN_OK;
+}
+
+static int upload_body(OCl *ocl, SSL *sslConn, int socketConn, RequestBody const *body){
+	char *chunk=NULL;
+	size_t chunkSize=0, chunkLen=0;
+	// Sized for a slice fully escaped ('\\u00XX'), so it isn't grown (nor moved) while uploading.
+	int retVal=buffer_reserve(&ocl->arena, &chunk, &chunkLen, &chunkSize, 10+OCL_UPLOAD_SLICE*6+2);
+	if(retVal==OCL_RETURN_OK)
+		retVal=upload_chunks(ocl, sslConn, socketConn, &chunk, &chunkSize, body->data, body->messageAt, false);
+	if(retVal==OCL_RETURN_OK)
+		retVal=upload_chunks(ocl, sslConn, socketConn, &chunk, &chunkSize, body->message, strlen(body->message), true);
+	if(retVal==OCL_RETURN_OK)
+		retVal=upload_chunks(ocl, sslConn, socketConn, &chunk, &chunkSize, body->data+body->messageAt
+				, body->len-body->messageAt, false);
+	if(retVal==OCL_RETURN_OK) retVal=ssl_send(ocl, sslConn, socketConn, "0\r\n\r\n", 5);
+	return retVal;
+}
+
+// 'body' (optional): sent after 'payload', v.gr. the headers of a chat and its body, so neither is copied to join them.
+static int transmit_message(OCl *ocl, char const *srvAddr, int srvPort, char const *payload, size_t payloadLen
+		, RequestBody const *body, void (*callback)(const char *, bool, int), TransmitInfo *ti){
+	double connectingAt=ocl_now();
 	int socketConn=0;
-	struct sockaddr_in serverAddress;
-	serverAddress.sin_family=AF_INET;
-	serverAddress.sin_port=htons(srvPort);
-	serverAddress.sin_addr.s_addr=inet_addr(ollamaServerIp);
-	if((socketConn=socket(AF_INET, SOCK_STREAM, 0))<0) return OCL_ERR_SOCKET_CREATION;
-	int socketFlags=fcntl(socketConn, F_GETFL, 0);
-	fcntl(socketConn, F_SETFL, socketFlags | O_NONBLOCK);
-	struct timeval tvConnectionTo;
-	int retVal=connect(socketConn, (struct sockaddr *) &serverAddress, sizeof(serverAddress));
-	if(retVal<0 && errno!=EINPROGRESS) return OCL_ERR_SOCKET_CONNECTION;
-	fd_set wFdset;
-	FD_ZERO(&wFdset);
-	FD_SET(socketConn, &wFdset);
-	tvConnectionTo.tv_sec=socketConnectTimeout;
-	tvConnectionTo.tv_usec=0;
-	if((retVal=select(socketConn+1,NULL,&wFdset,NULL,&tvConnectionTo))<=0){
+	SSL *sslConn=NULL;
+	int retVal=ssl_open(ocl, srvAddr, srvPort, &socketConn, &sslConn);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	connection_track(ocl, socketConn);
+	if(ocl_canceled(ocl)){
+		connection_track(ocl, -1);
+		clean_ssl(sslConn);
+		close(socketConn);
+		return OCL_RETURN_OK;
+	}
+	char *hostPayload=NULL;
+	if(strcmp(srvAddr, ocl->srvAddr)!=0 && (hostPayload=http_replace_host(payload, payloadLen, srvAddr, &payloadLen))!=NULL)
+		payload=hostPayload;
+	retVal=ssl_send(ocl, sslConn, socketConn, payload, payloadLen);
+	if(retVal==OCL_RETURN_OK && body!=NULL){
+		retVal=(body->message!=NULL)?upload_body(ocl, sslConn, socketConn, body)
+				:ssl_send(ocl, sslConn, socketConn, body->data, body->len);
+	}
+	if(retVal!=OCL_RETURN_OK){
+		connection_track(ocl, -1);
+		clean_ssl(sslConn);
 		close(socketConn);
-		if(retVal==0) return OCL_ERR_SOCKET_CONNECTION_TIMEOUT;
+		sfree(hostPayload);
+		return ocl_canceled(ocl)?OCL_RETURN_OK:retVal;
+	}
+	sfree(hostPayload);
+	ResponseState rs={0};
+	rs.sentAt=ocl_now();
+	rs.thoughtsSize=rs.contentSize=BUFFER_SIZE_1M;
+	if(ocl->format!=NULL) format_validator_init(&rs.format, ocl->format);
+	ssize_t bytesReceived=0,totalBytesReceived=0;
+	ocl->ocl_resp->thoughts[0]=0;
+	ocl->ocl_resp->content[0]=0;
+	ocl->ocl_resp->response[0]=0;
+	ocl->ocl_resp->contTools=0;
+	ocl->ocl_resp->error[0]=0;
+	ocl->ocl_resp->done=false;
+	ocl->ocl_resp->stopReason=OCL_STOP_NONE;
+	ocl->ocl_resp->cantContext=0;
+	long int bufferAssigned=BUFFER_SIZE_1M;
+	HttpStream hs={0};
+	http_stream_borrow(ocl, &hs);
+	retVal=OCL_RETURN_OK;
+	struct pollfd pi[1];
+	pi[0].fd=socketConn;
+	pi[0].events=POLLIN;
+	double deadline=(ocl->maxTime>0)?rs.sentAt+ocl->maxTime/1000.0:0;
+	while(!ocl_canceled(ocl) && !ocl->ocl_resp->done && !hs.finished && retVal==OCL_RETURN_OK){
+		if(deadline>0 && ocl_now()>=deadline){
+			retVal=response_stop_time(ocl, &rs, callback);
+			break;
+		}
+		if(SSL_pending(sslConn)==0){
+			// Polled in slices, so a cancellation (or the time budget) doesn't wait for the whole receiving timeout.
+			int waited=0;
+			while((retVal=poll(pi,1,poll_slice(deadline)))==0 && !ocl_canceled(ocl) && !(deadline>0 && ocl_now()>=deadline)
+					&& (waited+=OCL_POLL_SLICE_MS)<ocl->socketRecvTimeout*1000);
+			if(ocl_canceled(ocl)) break;
+			if(retVal==0 && deadline>0 && ocl_now()>=deadline){
+				retVal=OCL_RETURN_OK;
+				continue;
+			}
+			if(retVal<=0){
+				retVal=(retVal==0)?OCL_ERR_RECV_TIMEOUT:OCL_ERR_POLLIN;
+				break;
+			}
+			retVal=OCL_RETURN_OK;
+			if(!(pi[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+		}
+		char buffer[BUFFER_SIZE_16K];
+		bytesReceived=SSL_read(sslConn,buffer, BUFFER_SIZE_16K);
+		if(bytesReceived<0){
+			oclSslError=SSL_get_error(sslConn, bytesReceived);
+			retVal=OCL_ERR_RECEIVING_PACKETS;
+			break;
+		}
+		if(bytesReceived==0) break;
+		if(totalBytesReceived==0) ti->firstByte=ocl_now()-connectingAt;
+		totalBytesReceived+=bytesReceived;
+		if(metrics_on()) metrics_add(&oclMetrics.bytesRecv, bytesReceived);
+		if(totalBytesReceived>=bufferAssigned){
+			while(totalBytesReceived>=bufferAssigned) bufferAssigned*=2;
+			char *response=realloc(ocl->ocl_resp->response,bufferAssigned);
+			if(response==NULL){
+				retVal=OCL_ERR_REALLOC;
+				break;
+			}
+			ocl->ocl_resp->response=response;
+		}
+		memcpy(ocl->ocl_resp->response+totalBytesReceived-bytesReceived, buffer, bytesReceived);
+		ocl->ocl_resp->response[totalBytesReceived]=0;
+		if((retVal=http_stream_feed(&hs, buffer, bytesReceived))!=OCL_RETURN_OK) break;
+		if(!hs.headersParsed) continue;
+		if(hs.statusCode>=500){
+			snprintf(ocl->ocl_resp->error,BUFFER_SIZE_1K,"%s", hs.status);
+			retVal=OCL_ERR_SERVICE_UNAVAILABLE;
+			break;
+		}
+		retVal=process_response_body(ocl, &hs, &rs, callback, hs.finished);
+	}
+	if(retVal==OCL_RETURN_OK && !ocl_canceled(ocl) && !ocl->ocl_resp->done){
+		if(!hs.headersParsed && totalBytesReceived==0){
+			retVal=OCL_ERR_ZEROBYTESRECV;
+		}else{
+			retVal=process_response_body(ocl, &hs, &rs, callback, true);
+			if(retVal==OCL_RETURN_OK && hs.headersParsed && (hs.statusCode<200 || hs.statusCode>299)){
+				snprintf(ocl->ocl_resp->error,BUFFER_SIZE_1K,"%s", hs.status);
+				retVal=OCL_ERR_MSG_FOUND;
+			}
+		}
+	}
+	ti->tokenReceived=rs.firstToken;
+	http_stream_return(ocl, &hs);
+	connection_track(ocl, -1);
+	close(socketConn);
+	clean_ssl(sslConn);
+	// Shut down by OCl_cancel(): the read error is the cancellation.
+	if(retVal!=OCL_RETURN_OK && ocl_canceled(ocl)) retVal=OCL_RETURN_OK;
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	return totalBytesReceived;
+}
+
+/*
+ * Endpoints are registered process wide, so every instance pointing to the same server shares its outstanding
+ * requests, latency and health. The table is small and only touched once per request: a mutex is enough.
+ */
+typedef struct{
+	char addr[512];
+	int port;
+	int outstanding;
+	double latencyEwma;
+	double errorRate;
+	int consecutiveFailures;
+	double downUntil;
+	char models[BUFFER_SIZE_2K];
+	double modelsCheckedAt;
+}Endpoint;
+
+static struct{
+	pthread_mutex_t mutex;
+	Endpoint endpoints[OCL_MAX_REGISTERED_ENDPOINTS];
+	int cantEndpoints;
+}oclEndpoints={PTHREAD_MUTEX_INITIALIZER,{{"",0,0,0,0,0,0,"",0}},0};
+
+static int endpoint_register(char const *addr, int port){
+	int index=-1;
+	pthread_mutex_lock(&oclEndpoints.mutex);
+	for(int i=0;i<oclEndpoints.cantEndpoints && index<0;i++){
+		if(oclEndpoints.endpoints[i].port==port && strcmp(oclEndpoints.endpoints[i].addr, addr)==0) index=i;
+	}
+	if(index<0 && oclEndpoints.cantEndpoints<OCL_MAX_REGISTERED_ENDPOINTS){
+		index=oclEndpoints.cantEndpoints++;
+		memset(&oclEndpoints.endpoints[index], 0, sizeof(Endpoint));
+		snprintf(oclEndpoints.endpoints[index].addr, sizeof(oclEndpoints.endpoints[index].addr), "%s", addr);
+		oclEndpoints.endpoints[index].port=port;
+	}
+	pthread_mutex_unlock(&oclEndpoints.mutex);
+	return index;
+}
+
+static int endpoint_index(OCl *ocl, int slot){
+	if(slot==0) return endpoint_register(ocl->srvAddr, ocl->srvPort);
+	return ocl->endpoints[slot-1];
+}
+
+static bool endpoint_has_model(Endpoint const *ep, char const *model){
+	char needle[BUFFER_SIZE_1K]="";
+	snprintf(needle, sizeof(needle), "\n%s\n", model);
+	return strstr(ep->models, needle)!=NULL;
+}
+
+/*
+ * Model affinity: the models loaded in every endpoint (/api/ps) are refreshed, at most, every
+ * OCL_ENDPOINT_MODELS_TTL_S seconds. Asked through a shadow: the caller's response is the chat's one.
+ */
+static void endpoint_refresh_models(OCl *ocl, int index){
+	pthread_mutex_lock(&oclEndpoints.mutex);
+	Endpoint ep=oclEndpoints.endpoints[index];
+	pthread_mutex_unlock(&oclEndpoints.mutex);
+	double now=ocl_now();
+	if(ep.downUntil>now || (ep.modelsCheckedAt!=0 && now-ep.modelsCheckedAt<OCL_ENDPOINT_MODELS_TTL_S)) return;
+	char msg[BUFFER_SIZE_1K]="", models[BUFFER_SIZE_2K]="\n", host[OCL_HOST_SIZE];
+	snprintf(msg,sizeof(msg),
+			"GET /api/ps HTTP/1.1\r\n"
+			"Host: %s\r\n\r\n",http_host(ep.addr, host, sizeof(host)));
+	TransmitInfo ti={0};
+	OCl *shadow=ocl_shadow_new(ocl);
+	if(shadow==NULL) return;
+	if(transmit_message(shadow, ep.addr, ep.port, msg, strlen(msg), NULL, NULL, &ti)>0){
+		char const *name=shadow->ocl_resp->response;
+		size_t len=1;
+		while((name=strstr(name, "\"name\":\""))!=NULL){
+			name+=strlen("\"name\":\"");
+			char const *endName=strchr(name, '"');
+			if(endName==NULL || len+(endName-name)+2>sizeof(models)) break;
+			memcpy(models+len, name, endName-name);
+			len+=endName-name;
+			models[len++]='\n';
+			models[len]=0;
+			name=endName;
+		}
+	}
+	ocl_shadow_free(shadow);
+	pthread_mutex_lock(&oclEndpoints.mutex);
+	snprintf(oclEndpoints.endpoints[index].models, BUFFER_SIZE_2K, "%s", models);
+	oclEndpoints.endpoints[index].modelsCheckedAt=now;
+	pthread_mutex_unlock(&oclEndpoints.mutex);
+}
+
+/*
+ * Picks the slot (0: srvAddr/srvPort, 1..n: added endpoints) to send the next request to, skipping the ones already
+ * tried. Endpoints marked as down are only picked when every remaining one is down (the first to come back, first).
+ */
+static int endpoint_select(OCl *ocl, bool const *tried){
+	int cantSlots=ocl->cantEndpoints+1, best=-1, indexes[OCL_MAX_ENDPOINTS+1];
+	if(cantSlots==1) return 0;
+	for(int i=0;i<cantSlots;i++){
+		indexes[i]=endpoint_index(ocl, i);
+		if(ocl->endpointPolicy==OCL_POLICY_MODEL_AFFINITY && !tried[i] && indexes[i]>=0) endpoint_refresh_models(ocl, indexes[i]);
+	}
+	double now=ocl_now(), bestScore=0;
+	bool bestUp=false;
+	pthread_mutex_lock(&oclEndpoints.mutex);
+	for(int n=0;n<cantSlots;n++){
+		int i=(ocl->rrNext+n)%cantSlots;
+		if(tried[i] || indexes[i]<0) continue;
+		Endpoint const *ep=&oclEndpoints.endpoints[indexes[i]];
+		bool up=ep->downUntil<=now;
+		double score=0;
+		switch(ocl->endpointPolicy){
+		case OCL_POLICY_LEAST_OUTSTANDING:
+			score=ep->outstanding;
+			break;
+		case OCL_POLICY_LATENCY_EWMA:
+			score=ep->latencyEwma*(1.0+ep->errorRate);
+			break;
+		case OCL_POLICY_MODEL_AFFINITY:
+			score=ep->outstanding+(endpoint_has_model(ep, ocl->model)?0:OCL_MAX_ENDPOINTS*1024);
+			break;
+		case OCL_POLICY_ROUND_ROBIN:
+		default:
+			score=n;
+			break;
+		}
+		if(!up) score=ep->downUntil;
+		if(best<0 || (up && !bestUp) || (up==bestUp && score<bestScore)){
+			best=i;
+			bestScore=score;
+			bestUp=up;
+		}
+	}
+	pthread_mutex_unlock(&oclEndpoints.mutex);
+	ocl->rrNext=(ocl->rrNext+1)%cantSlots;
+	return best;
+}
+
+// A receiving timeout once the server answered is a slow generation (v.gr. a model loading), not a failing endpoint.
+static bool endpoint_failure(int error, TransmitInfo const *ti){
+	switch(error){
+	case OCL_ERR_GETTING_HOST_INFO:
+	case OCL_ERR_SOCKET_CREATION:
+	case OCL_ERR_SOCKET_CONNECTION:
+	case OCL_ERR_SOCKET_CONNECTION_TIMEOUT:
+	case OCL_ERR_SSL_CONNECT:
+	case OCL_ERR_POLLOUT:
+	case OCL_ERR_SEND_TIMEOUT:
+	case OCL_ERR_SENDING_PACKETS:
+	case OCL_ERR_POLLIN:
+	case OCL_ERR_RECEIVING_PACKETS:
+	case OCL_ERR_ZEROBYTESRECV:
+	case OCL_ERR_SERVICE_UNAVAILABLE:
+		return true;
+	case OCL_ERR_RECV_TIMEOUT:
+		return ti->firstByte==0;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Passive health: every failure feeds an error-rate EWMA and takes the endpoint out of the rotation for a cool-down
+ * that doubles with the consecutive failures. Any successful response puts it back.
+ */
+static void endpoint_update(int index, int retVal, TransmitInfo const *ti){
+	pthread_mutex_lock(&oclEndpoints.mutex);
+	Endpoint *ep=&oclEndpoints.endpoints[index];
+	ep->outstanding--;
+	bool failed=endpoint_failure(retVal, ti);
+	ep->errorRate=(1.0-OCL_ENDPOINT_EWMA_ALPHA)*ep->errorRate+OCL_ENDPOINT_EWMA_ALPHA*(failed?1.0:0.0);
+	if(ti->firstByte>0){
+		ep->latencyEwma=(ep->latencyEwma==0)?ti->firstByte
+				:(1.0-OCL_ENDPOINT_EWMA_ALPHA)*ep->latencyEwma+OCL_ENDPOINT_EWMA_ALPHA*ti->firstByte;
+	}
+	if(failed){
+		double coolDown=OCL_ENDPOINT_COOLDOWN_S;
+		for(int i=0;i<ep->consecutiveFailures && coolDown<OCL_ENDPOINT_MAX_COOLDOWN_S;i++) coolDown*=2;
+		if(coolDown>OCL_ENDPOINT_MAX_COOLDOWN_S) coolDown=OCL_ENDPOINT_MAX_COOLDOWN_S;
+		ep->consecutiveFailures++;
+		ep->downUntil=ocl_now()+coolDown;
+	}else{
+		ep->consecutiveFailures=0;
+		ep->downUntil=0;
+	}
+	pthread_mutex_unlock(&oclEndpoints.mutex);
+}
+
+int OCl_add_endpoint(OCl *ocl, const char *serverAddr, const char *serverPort){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(serverAddr==NULL || strcmp(serverAddr,"")==0 || strlen(serverAddr)>=sizeof(ocl->srvAddr)) return OCL_ERR_SERVER_ADDR;
+	char *tail=NULL;
+	long int port=strtol((serverPort!=NULL)?serverPort:OCL_OLLAMA_SERVER_PORT, &tail, 10);
+	if(port<1 || port>65535 || tail[0]!=0) return OCL_ERR_PORT;
+	if(ocl->cantEndpoints>=OCL_MAX_ENDPOINTS) return OCL_ERR_ENDPOINT;
+	int index=endpoint_register(serverAddr, port);
+	if(index<0) return OCL_ERR_ENDPOINT;
+	ocl->endpoints[ocl->cantEndpoints++]=index;
+	return OCL_RETURN_OK;
+}
+
+int OCl_set_endpoint_policy(OCl *ocl, int policy){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(policy<OCL_POLICY_ROUND_ROBIN || policy>OCL_POLICY_MODEL_AFFINITY) return OCL_ERR_ENDPOINT;
+	ocl->endpointPolicy=policy;
+	return OCL_RETURN_OK;
+}
+
+/*
+ * Failover: while nothing was handed to the callback, a request failing because of the endpoint is sent to the next
+ * one. Once a token was received, the error is returned (the retry policy, if any, continues the response).
+ */
+static int send_message(OCl *ocl, char const *payload, size_t payloadLen, RequestBody const *body
+		, void (*callback)(const char *, bool, int)){
+	if(metrics_on()) metrics_add(&oclMetrics.requests, 1);
+	bool tried[OCL_MAX_ENDPOINTS+1]={false};
+	int retVal=OCL_ERR_ENDPOINT;
+	for(int i=0;i<=ocl->cantEndpoints && !ocl_canceled(ocl);i++){
+		int slot=endpoint_select(ocl, tried);
+		if(slot<0) break;
+		tried[slot]=true;
+		int index=endpoint_index(ocl, slot);
+		if(index<0) continue;
+		pthread_mutex_lock(&oclEndpoints.mutex);
+		Endpoint *ep=&oclEndpoints.endpoints[index];
+		ep->outstanding++;
+		char srvAddr[512]="";
+		snprintf(srvAddr, sizeof(srvAddr), "%s", ep->addr);
+		int srvPort=ep->port;
+		pthread_mutex_unlock(&oclEndpoints.mutex);
+		TransmitInfo ti={0};
+		retVal=transmit_message(ocl, srvAddr, srvPort, payload, payloadLen, body, callback, &ti);
+		endpoint_update(index, retVal, &ti);
+		if(retVal>=0 || ti.tokenReceived || !endpoint_failure(retVal, &ti)) break;
+		if(i<ocl->cantEndpoints && metrics_on()) metrics_add(&oclMetrics.failovers, 1);
+	}
+	metrics_count_error(retVal);
+	return retVal;
+}
+
+/*
+ * Admission control in front of 'send_message()', process wide (disabled until 'OCl_scheduler_set()'). Each model runs
+ * at most its concurrency cap (the server's parallelism) of requests; the rest wait in a bounded queue. When a slot
+ * frees, the waiter picked is the one of the best priority class, among them the one whose tenant has fewer requests
+ * running (and, on a tie, was served longer ago), and then the oldest. Waiters give up at their deadline.
+ */
+typedef struct SchedWaiter{
+	char const *model;
+	char const *tenant;
+	int priority;
+	unsigned long seq;
+	bool granted;
+	pthread_cond_t cond;
+	struct SchedWaiter *next;
+}SchedWaiter;
+
+typedef struct{
+	char name[512];
+	int running;
+	int maxConcurrency;
+}SchedModel;
+
+typedef struct{
+	char name[64];
+	int running;
+	int waiting;
+	unsigned long lastGrant;
+}SchedTenant;
+
+static struct{
+	pthread_mutex_t mutex;
+	int maxConcurrency;
+	int maxQueued;
+	int cantQueued;
+	SchedWaiter *waiters;
+	SchedModel models[OCL_SCHEDULER_MAX_MODELS];
+	int cantModels;
+	SchedTenant tenants[OCL_SCHEDULER_MAX_TENANTS];
+	int cantTenants;
+	unsigned long seq;
+	unsigned long grants;
+}oclScheduler={.mutex=PTHREAD_MUTEX_INITIALIZER};
+
+static SchedModel *scheduler_model(char const *name, bool create){
+	for(int i=0;i<oclScheduler.cantModels;i++) if(strcmp(oclScheduler.models[i].name, name)==0) return &oclScheduler.models[i];
+	if(!create) return NULL;
+	SchedModel *model=NULL;
+	if(oclScheduler.cantModels<OCL_SCHEDULER_MAX_MODELS){
+		model=&oclScheduler.models[oclScheduler.cantModels++];
+	}else{
+		for(int i=0;i<oclScheduler.cantModels && model==NULL;i++){
+			if(oclScheduler.models[i].running==0 && oclScheduler.models[i].maxConcurrency==0) model=&oclScheduler.models[i];
+		}
+		if(model==NULL) return NULL;
+	}
+	memset(model, 0, sizeof(SchedModel));
+	snprintf(model->name, sizeof(model->name), "%s", name);
+	return model;
+}
+
+static SchedTenant *scheduler_tenant(char const *name, bool create){
+	for(int i=0;i<oclScheduler.cantTenants;i++) if(strcmp(oclScheduler.tenants[i].name, name)==0) return &oclScheduler.tenants[i];
+	if(!create) return NULL;
+	SchedTenant *tenant=NULL;
+	if(oclScheduler.cantTenants<OCL_SCHEDULER_MAX_TENANTS){
+		tenant=&oclScheduler.tenants[oclScheduler.cantTenants++];
+	}else{
+		for(int i=0;i<oclScheduler.cantTenants && tenant==NULL;i++){
+			if(oclScheduler.tenants[i].running==0 && oclScheduler.tenants[i].waiting==0) tenant=&oclScheduler.tenants[i];
+		}
+		if(tenant==NULL) return NULL;
+	}
+	memset(tenant, 0, sizeof(SchedTenant));
+	snprintf(tenant->name, sizeof(tenant->name), "%s", name);
+	return tenant;
+}
+
+static bool scheduler_has_room(char const *name){
+	SchedModel *model=scheduler_model(name, false);
+	if(model==NULL) return true;
+	int maxConcurrency=(model->maxConcurrency>0)?model->maxConcurrency:oclScheduler.maxConcurrency;
+	return model->running<maxConcurrency;
+}
+
+static bool scheduler_precedes(SchedWaiter const *a, SchedWaiter const *b){
+	if(a->priority!=b->priority) return a->priority<b->priority;
+	SchedTenant const *ta=scheduler_tenant(a->tenant, false), *tb=scheduler_tenant(b->tenant, false);
+	if(ta!=tb){
+		if(ta->running!=tb->running) return ta->running<tb->running;
+		if(ta->lastGrant!=tb->lastGrant) return ta->lastGrant<tb->lastGrant;
+	}
+	return a->seq<b->seq;
+}
+
+static void scheduler_unlink(SchedWaiter *waiter){
+	for(SchedWaiter **w=&oclScheduler.waiters;*w!=NULL;w=&(*w)->next){
+		if(*w!=waiter) continue;
+		*w=waiter->next;
+		oclScheduler.cantQueued--;
+		scheduler_tenant(waiter->tenant, false)->waiting--;
+		return;
+	}
+}
+
+static void scheduler_grant(SchedModel *model, SchedTenant *tenant){
+	model->running++;
+	tenant->running++;
+	tenant->lastGrant=++oclScheduler.grants;
+}
+
+static void scheduler_dispatch(){
+	while(true){
+		SchedWaiter *best=NULL;
+		for(SchedWaiter *w=oclScheduler.waiters;w!=NULL;w=w->next){
+			if(scheduler_has_room(w->model) && (best==NULL || scheduler_precedes(w, best))) best=w;
+		}
+		if(best==NULL) return;
+		scheduler_unlink(best);
+		scheduler_grant(scheduler_model(best->model, false), scheduler_tenant(best->tenant, false));
+		best->granted=true;
+		pthread_cond_signal(&best->cond);
+	}
+}
+
+static int scheduler_admit(OCl const *ocl, char const *model, char const *tenant, bool *admitted){
+	*admitted=false;
+	pthread_mutex_lock(&oclScheduler.mutex);
+	if(oclScheduler.maxConcurrency==0){
+		pthread_mutex_unlock(&oclScheduler.mutex);
+		return OCL_RETURN_OK;
+	}
+	SchedModel *schedModel=scheduler_model(model, true);
+	SchedTenant *schedTenant=scheduler_tenant(tenant, true);
+	/*
+	 * A model with room has no waiters (they're granted as soon as a slot frees): the request runs right away. Only
+	 * the ones that have to wait count against the queue's bound.
+	 */
+	if(schedModel!=NULL && schedTenant!=NULL && scheduler_has_room(model)){
+		scheduler_grant(schedModel, schedTenant);
+		pthread_mutex_unlock(&oclScheduler.mutex);
+		if(metrics_on()) metrics_observe(oclMetrics.schedulerWait, waitBuckets, OCL_WAIT_BUCKETS
+				, &oclMetrics.schedulerWaitSumUs, 0);
+		*admitted=true;
+		return OCL_RETURN_OK;
+	}
+	if(schedModel==NULL || schedTenant==NULL || oclScheduler.cantQueued>=oclScheduler.maxQueued){
+		pthread_mutex_unlock(&oclScheduler.mutex);
+		if(metrics_on()) metrics_add(&oclMetrics.schedulerRejected, 1);
+		return OCL_ERR_SCHEDULER_QUEUE_FULL;
+	}
+	double start=ocl_now(), deadline=(ocl->deadlineMs>0)?start+ocl->deadlineMs/1000.0:0;
+	SchedWaiter waiter={model, tenant, ocl->priority, ++oclScheduler.seq, false, PTHREAD_COND_INITIALIZER
+			, oclScheduler.waiters};
+	oclScheduler.waiters=&waiter;
+	oclScheduler.cantQueued++;
+	schedTenant->waiting++;
+	// Timed in slices, so a cancellation doesn't wait for the deadline.
+	while(!waiter.granted && !ocl_canceled(ocl) && (deadline==0 || ocl_now()<deadline)){
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec+=OCL_POLL_SLICE_MS*1000000L;
+		if(until.tv_nsec>=1000000000L){
+			until.tv_sec++;
+			until.tv_nsec-=1000000000L;
+		}
+		pthread_cond_timedwait(&waiter.cond, &oclScheduler.mutex, &until);
+	}
+	if(!waiter.granted) scheduler_unlink(&waiter);
+	pthread_mutex_unlock(&oclScheduler.mutex);
+	pthread_cond_destroy(&waiter.cond);
+	if(metrics_on()) metrics_observe(oclMetrics.schedulerWait, waitBuckets, OCL_WAIT_BUCKETS, &oclMetrics.schedulerWaitSumUs
+			, ocl_now()-start);
+	if(waiter.granted){
+		*admitted=true;
+		return OCL_RETURN_OK;
+	}
+	if(ocl_canceled(ocl)) return OCL_RETURN_OK;
+	if(metrics_on()) metrics_add(&oclMetrics.schedulerRejected, 1);
+	return OCL_ERR_SCHEDULER_DEADLINE;
+}
+
+static void scheduler_release(char const *model, char const *tenant){
+	pthread_mutex_lock(&oclScheduler.mutex);
+	SchedModel *schedModel=scheduler_model(model, false);
+	SchedTenant *schedTenant=scheduler_tenant(tenant, false);
+	if(schedModel!=NULL) schedModel->running--;
+	if(schedTenant!=NULL) schedTenant->running--;
+	scheduler_dispatch();
+	pthread_mutex_unlock(&oclScheduler.mutex);
+}
+
+static int send_scheduled_message(OCl *ocl, char const *payload, size_t payloadLen, RequestBody const *body
+		, void (*callback)(const char *, bool, int)){
+	// Copied: the instance could be switched to another model while the request is running.
+	char model[512]="", tenant[64]="";
+	snprintf(model, sizeof(model), "%s", ocl->model);
+	snprintf(tenant, sizeof(tenant), "%s", ocl->tenant);
+	bool admitted=false;
+	int retVal=scheduler_admit(ocl, model, tenant, &admitted);
+	if(retVal!=OCL_RETURN_OK){
+		metrics_count_error(retVal);
+		return retVal;
+	}
+	if(ocl_canceled(ocl) && !admitted) return OCL_RETURN_OK;
+	retVal=send_message(ocl, payload, payloadLen, body, callback);
+	if(admitted) scheduler_release(model, tenant);
+	return retVal;
+}
+
+int OCl_scheduler_set(int maxConcurrency, int maxQueued){
+	if(maxConcurrency<0 || maxQueued<0) return OCL_ERR_SCHEDULER;
+	pthread_mutex_lock(&oclScheduler.mutex);
+	oclScheduler.maxConcurrency=maxConcurrency;
+	oclScheduler.maxQueued=maxQueued;
+	// Waiters of a disabled scheduler are let through as they are; the ones that fit a raised cap, granted.
+	if(maxConcurrency==0){
+		while(oclScheduler.waiters!=NULL){
+			SchedWaiter *waiter=oclScheduler.waiters;
+			scheduler_unlink(waiter);
+			waiter->granted=true;
+			scheduler_model(waiter->model, false)->running++;
+			scheduler_tenant(waiter->tenant, false)->running++;
+			pthread_cond_signal(&waiter->cond);
+		}
+	}else{
+		scheduler_dispatch();
+	}
+	pthread_mutex_unlock(&oclScheduler.mutex);
+	return OCL_RETURN_OK;
+}
+
+int OCl_scheduler_set_model_concurrency(const char *model, int maxConcurrency){
+	if(model==NULL || strcmp(model,"")==0 || strlen(model)>=512 || maxConcurrency<0) return OCL_ERR_SCHEDULER;
+	pthread_mutex_lock(&oclScheduler.mutex);
+	SchedModel *schedModel=scheduler_model(model, true);
+	if(schedModel!=NULL){
+		schedModel->maxConcurrency=maxConcurrency;
+		scheduler_dispatch();
+	}
+	pthread_mutex_unlock(&oclScheduler.mutex);
+	return (schedModel!=NULL)?OCL_RETURN_OK:OCL_ERR_SCHEDULER;
+}
+
+int OCl_set_request_class(OCl *ocl, int priority, const char *tenant, int deadlineMs){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(priority<OCL_PRIORITY_INTERACTIVE || priority>OCL_PRIORITY_BATCH || deadlineMs<0
+			|| (tenant!=NULL && strlen(tenant)>=sizeof(ocl->tenant))) return OCL_ERR_SCHEDULER;
+	ocl->priority=priority;
+	snprintf(ocl->tenant, sizeof(ocl->tenant), "%s", (tenant!=NULL)?tenant:"");
+	ocl->deadlineMs=deadlineMs;
+	return OCL_RETURN_OK;
+}
+
+static char encoding_table[]=
+{'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+		'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+		'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
+		'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+		'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+		'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+		'w', 'x', 'y', 'z', '0', '1', '2', '3',
+		'4', '5', '6', '7', '8', '9', '+', '/'};
+
+static char *decoding_table=NULL;
+static int mod_table[]={0,2,1};
+
+void build_decoding_table() {
+	decoding_table = malloc(256);
+	for (int i=0;i<64;i++) decoding_table[(unsigned char) encoding_table[i]] = i;
+}
+
+// Read in blocks (multiple of 3) and encoded straight into the arena: the file isn't held in memory.
+static int base64_encode(OclArena *arena, const char* fileName, size_t *outLen, char **encodedData) {
+	FILE *f=fopen(fileName, "rb");
+	if(f==NULL) return OCL_ERR_IMAGE_FILE;
+	fseek(f,0,SEEK_END);
+	size_t inLen=ftell(f);
+	rewind(f);
+	*outLen = 4*((inLen+2)/3);
+	*encodedData = arena_alloc(arena, *outLen+1);
+	if(*encodedData==NULL){
+		fclose(f);
+		return OCL_ERR_IMAGE_FILE;
+	}
+	unsigned char data[3*BUFFER_SIZE_1K*4];
+	size_t j=0, total=0, br=0;
+	while(total<inLen && (br=fread(data,1,(inLen-total<sizeof(data))?inLen-total:sizeof(data),f))>0){
+		total+=br;
+		for(size_t i=0; i<br;) {
+			uint32_t octetA=i<br ? (unsigned char)data[i++] : 0;
+			uint32_t octetB=i<br ? (unsigned char)data[i++] : 0;
+			uint32_t octetC=i<br ? (unsigned char)data[i++] : 0;
+			uint32_t triple = (octetA << 0x10) + (octetB << 0x08) + octetC;
+			(*encodedData)[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
+			(*encodedData)[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
+			(*encodedData)[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
+			(*encodedData)[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
+		}
+	}
+	fclose(f);
+	if(total!=inLen) return OCL_ERR_IMAGE_FILE;
+	for(int i=0; i<mod_table[inLen % 3]; i++) (*encodedData)[*outLen-1-i]='=';
+	(*encodedData)[*outLen]=0;
+	return OCL_RETURN_OK;
+}
+
+#define OCL_CACHE_BUCKETS			1024
+#define OCL_CACHE_FILE_MAGIC		"OCLCACHE1"
+
+typedef struct CacheEntry{
+	char key[65];
+	time_t created;
+	long int size;
+	char *thoughts;
+	char *content;
+	int contTools;
+	char (*toolCalls)[512];
+	double loadDuration;
+	double promptEvalDuration;
+	double evalDuration;
+	double totalDuration;
+	int promptEvalCount;
+	int evalCount;
+	double tokensPerSec;
+	struct CacheEntry *prev;
+	struct CacheEntry *next;
+	struct CacheEntry *bucketNext;
+}CacheEntry;
+
+struct _ocl_cache{
+	CacheEntry *buckets[OCL_CACHE_BUCKETS];
+	CacheEntry *mru;
+	CacheEntry *lru;
+	int entries;
+	int maxEntries;
+	long int bytes;
+	long int maxBytes;
+	int ttl;
+	char *dir;
+};
+
+static void response_cache_key(char const *body, char *key){
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digestLen=0;
+	EVP_Digest(body, strlen(body), digest, &digestLen, EVP_sha256(), NULL);
+	for(unsigned int i=0;i<digestLen && i<32;i++) snprintf(key+i*2, 3, "%02x", digest[i]);
+}
+
+static CacheEntry **cache_bucket(struct _ocl_cache *cache, char const *key){
+	return &cache->buckets[strtoul((char[]){key[0],key[1],key[2],key[3],0}, NULL, 16)%OCL_CACHE_BUCKETS];
+}
+
+static void cache_entry_free(CacheEntry *entry){
+	sfree(entry->thoughts);
+	sfree(entry->content);
+	sfree(entry->toolCalls);
+	sfree(entry);
+}
+
+static void cache_unlink(struct _ocl_cache *cache, CacheEntry *entry){
+	CacheEntry **bucket=cache_bucket(cache, entry->key);
+	while(*bucket!=NULL && *bucket!=entry) bucket=&(*bucket)->bucketNext;
+	if(*bucket!=NULL) *bucket=entry->bucketNext;
+	if(entry->prev!=NULL) entry->prev->next=entry->next;
+	else cache->mru=entry->next;
+	if(entry->next!=NULL) entry->next->prev=entry->prev;
+	else cache->lru=entry->prev;
+	cache->entries--;
+	cache->bytes-=entry->size;
+}
+
+static void cache_push_front(struct _ocl_cache *cache, CacheEntry *entry){
+	entry->prev=NULL;
+	entry->next=cache->mru;
+	if(cache->mru!=NULL) cache->mru->prev=entry;
+	cache->mru=entry;
+	if(cache->lru==NULL) cache->lru=entry;
+}
+
+static void cache_insert(struct _ocl_cache *cache, CacheEntry *entry){
+	CacheEntry **bucket=cache_bucket(cache, entry->key);
+	entry->bucketNext=*bucket;
+	*bucket=entry;
+	cache_push_front(cache, entry);
+	cache->entries++;
+	cache->bytes+=entry->size;
+	while(cache->lru!=NULL && cache->lru!=entry
+			&& (cache->entries>cache->maxEntries || (cache->maxBytes>0 && cache->bytes>cache->maxBytes))){
+		CacheEntry *evicted=cache->lru;
+		cache_unlink(cache, evicted);
+		cache_entry_free(evicted);
+	}
+}
+
+static CacheEntry *cache_find(struct _ocl_cache *cache, char const *key){
+	CacheEntry *entry=*cache_bucket(cache, key);
+	while(entry!=NULL && strcmp(entry->key, key)!=0) entry=entry->bucketNext;
+	return entry;
+}
+
+static bool cache_expired(struct _ocl_cache *cache, time_t created){
+	return cache->ttl>0 && time(NULL)-created>cache->ttl;
+}
+
+static void cache_disk_path(struct _ocl_cache *cache, char const *key, char *path, size_t len){
+	snprintf(path, len, "%s/%s.oclc", cache->dir, key);
+}
+
+static bool cache_write_string(FILE *f, char const *s, size_t len){
+	return fwrite(&len, sizeof(len), 1, f)==1 && fwrite(s, 1, len, f)==len;
+}
+
+static char *cache_read_string(FILE *f, size_t *len){
+	if(fread(len, sizeof(*len), 1, f)!=1 || *len>(size_t) BUFFER_SIZE_1M*256) return NULL;
+	char *s=malloc(*len+1);
+	if(s==NULL) return NULL;
+	if(fread(s, 1, *len, f)!=*len){
+		sfree(s);
+		return NULL;
+	}
+	s[*len]=0;
+	return s;
+}
+
+static void cache_disk_write(struct _ocl_cache *cache, CacheEntry *entry){
+	char path[BUFFER_SIZE_1K]="", tmpPath[BUFFER_SIZE_1K+8]="";
+	cache_disk_path(cache, entry->key, path, BUFFER_SIZE_1K);
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid());
+	FILE *f=fopen(tmpPath, "wb");
+	if(f==NULL) return;
+	int64_t created=entry->created;
+	bool ok=fwrite(OCL_CACHE_FILE_MAGIC, 1, strlen(OCL_CACHE_FILE_MAGIC), f)==strlen(OCL_CACHE_FILE_MAGIC)
+			&& fwrite(&created, sizeof(created), 1, f)==1
+			&& fwrite(&entry->loadDuration, sizeof(double), 1, f)==1
+			&& fwrite(&entry->promptEvalDuration, sizeof(double), 1, f)==1
+			&& fwrite(&entry->evalDuration, sizeof(double), 1, f)==1
+			&& fwrite(&entry->totalDuration, sizeof(double), 1, f)==1
+			&& fwrite(&entry->tokensPerSec, sizeof(double), 1, f)==1
+			&& fwrite(&entry->promptEvalCount, sizeof(int), 1, f)==1
+			&& fwrite(&entry->evalCount, sizeof(int), 1, f)==1
+			&& cache_write_string(f, entry->thoughts, strlen(entry->thoughts))
+			&& cache_write_string(f, entry->content, strlen(entry->content))
+			&& fwrite(&entry->contTools, sizeof(int), 1, f)==1;
+	for(int i=0;i<entry->contTools && ok;i++) ok=cache_write_string(f, entry->toolCalls[i], strlen(entry->toolCalls[i]));
+	if(fclose(f)!=0) ok=false;
+	if(!ok || rename(tmpPath, path)!=0) unlink(tmpPath);
+}
+
+static CacheEntry *cache_disk_read(struct _ocl_cache *cache, char const *key){
+	char path[BUFFER_SIZE_1K]="", magic[16]="";
+	cache_disk_path(cache, key, path, BUFFER_SIZE_1K);
+	FILE *f=fopen(path, "rb");
+	if(f==NULL) return NULL;
+	CacheEntry *entry=calloc(1, sizeof(CacheEntry));
+	int64_t created=0;
+	size_t thoughtsLen=0, contentLen=0, toolLen=0;
+	bool ok=entry!=NULL
+			&& fread(magic, 1, strlen(OCL_CACHE_FILE_MAGIC), f)==strlen(OCL_CACHE_FILE_MAGIC)
+			&& strcmp(magic, OCL_CACHE_FILE_MAGIC)==0
+			&& fread(&created, sizeof(created), 1, f)==1
+			&& fread(&entry->loadDuration, sizeof(double), 1, f)==1
+			&& fread(&entry->promptEvalDuration, sizeof(double), 1, f)==1
+			&& fread(&entry->evalDuration, sizeof(double), 1, f)==1
+			&& fread(&entry->totalDuration, sizeof(double), 1, f)==1
+			&& fread(&entry->tokensPerSec, sizeof(double), 1, f)==1
+			&& fread(&entry->promptEvalCount, sizeof(int), 1, f)==1
+			&& fread(&entry->evalCount, sizeof(int), 1, f)==1
+			&& (entry->thoughts=cache_read_string(f, &thoughtsLen))!=NULL
+			&& (entry->content=cache_read_string(f, &contentLen))!=NULL
+			&& fread(&entry->contTools, sizeof(int), 1, f)==1
+			&& entry->contTools>=0 && entry->contTools<=512;
+	if(ok && entry->contTools>0) ok=(entry->toolCalls=calloc(entry->contTools, 512))!=NULL;
+	for(int i=0;i<entry->contTools && ok;i++){
+		char *tool=cache_read_string(f, &toolLen);
+		if(tool==NULL){
+			ok=false;
+			break;
+		}
+		snprintf(entry->toolCalls[i], 512, "%s", tool);
+		sfree(tool);
+	}
+	fclose(f);
+	if(!ok || cache_expired(cache, created)){
+		if(entry!=NULL) cache_entry_free(entry);
+		unlink(path);
+		return NULL;
+	}
+	snprintf(entry->key, sizeof(entry->key), "%s", key);
+	entry->created=created;
+	entry->size=sizeof(CacheEntry)+thoughtsLen+contentLen+entry->contTools*512;
+	return entry;
+}
+
+static int response_set_text(char **text, char const *value){
+	size_t len=strlen(value)+1;
+	char *newText=malloc((len>BUFFER_SIZE_1M)?len:BUFFER_SIZE_1M);
+	if(newText==NULL) return OCL_ERR_MALLOC;
+	memcpy(newText, value, len);
+	sfree(*text);
+	*text=newText;
+	return OCL_RETURN_OK;
+}
+
+static bool response_cache_replay(OCl *ocl, char const *key, void (*callback)(const char *, bool, int)){
+	struct _ocl_cache *cache=ocl->cache;
+	CacheEntry *entry=cache_find(cache, key);
+	if(entry!=NULL && cache_expired(cache, entry->created)){
+		cache_unlink(cache, entry);
+		cache_entry_free(entry);
+		entry=NULL;
+	}
+	if(entry==NULL && cache->dir!=NULL && (entry=cache_disk_read(cache, key))!=NULL) cache_insert(cache, entry);
+	if(entry==NULL){
+		if(metrics_on()) metrics_add(&oclMetrics.cacheMisses, 1);
+		return false;
+	}
+	if(response_set_text(&ocl->ocl_resp->thoughts, entry->thoughts)!=OCL_RETURN_OK
+			|| response_set_text(&ocl->ocl_resp->content, entry->content)!=OCL_RETURN_OK) return false;
+	if(metrics_on()) metrics_add(&oclMetrics.cacheHits, 1);
+	if(entry!=cache->mru){
+		cache_unlink(cache, entry);
+		cache_insert(cache, entry);
+	}
+	ocl->ocl_resp->response[0]=0;
+	memset(ocl->ocl_resp->error,0,BUFFER_SIZE_1K);
+	ocl->ocl_resp->contTools=entry->contTools;
+	for(int i=0;i<entry->contTools;i++) memcpy(ocl->ocl_resp->toolCalls[i], entry->toolCalls[i], 512);
+	ocl->ocl_resp->loadDuration=entry->loadDuration;
+	ocl->ocl_resp->promptEvalDuration=entry->promptEvalDuration;
+	ocl->ocl_resp->evalDuration=entry->evalDuration;
+	ocl->ocl_resp->totalDuration=entry->totalDuration;
+	ocl->ocl_resp->promptEvalCount=entry->promptEvalCount;
+	ocl->ocl_resp->evalCount=entry->evalCount;
+	ocl->ocl_resp->tokensPerSec=entry->tokensPerSec;
+	ocl->ocl_resp->stopReason=OCL_STOP_NONE;
+	ocl->ocl_resp->done=false;
+	if(callback!=NULL){
+		if(ocl->ocl_resp->thoughts[0]!=0) callback(ocl->ocl_resp->thoughts, false, OCL_THINKING_TYPE);
+		for(int i=0;i<ocl->ocl_resp->contTools;i++) callback(ocl->ocl_resp->toolCalls[i], false, OCL_TOOL_TYPE);
+	}
+	ocl->ocl_resp->done=true;
+	if(callback!=NULL) callback(ocl->ocl_resp->content, true, OCL_CONTENT_TYPE);
+	return true;
+}
+
+static void response_cache_store(OCl *ocl, char const *key){
+	struct _ocl_cache *cache=ocl->cache;
+	CacheEntry *entry=cache_find(cache, key);
+	if(entry!=NULL){
+		cache_unlink(cache, entry);
+		cache_entry_free(entry);
+	}
+	if((entry=calloc(1, sizeof(CacheEntry)))==NULL) return;
+	snprintf(entry->key, sizeof(entry->key), "%s", key);
+	entry->created=time(NULL);
+	entry->thoughts=strdup(ocl->ocl_resp->thoughts);
+	entry->content=strdup(ocl->ocl_resp->content);
+	entry->contTools=ocl->ocl_resp->contTools;
+	if(entry->contTools>0 && (entry->toolCalls=malloc(entry->contTools*512))!=NULL)
+		memcpy(entry->toolCalls, ocl->ocl_resp->toolCalls, entry->contTools*512);
+	if(entry->thoughts==NULL || entry->content==NULL || (entry->contTools>0 && entry->toolCalls==NULL)){
+		cache_entry_free(entry);
+		return;
+	}
+	entry->loadDuration=ocl->ocl_resp->loadDuration;
+	entry->promptEvalDuration=ocl->ocl_resp->promptEvalDuration;
+	entry->evalDuration=ocl->ocl_resp->evalDuration;
+	entry->totalDuration=ocl->ocl_resp->totalDuration;
+	entry->promptEvalCount=ocl->ocl_resp->promptEvalCount;
+	entry->evalCount=ocl->ocl_resp->evalCount;
+	entry->tokensPerSec=ocl->ocl_resp->tokensPerSec;
+	entry->size=sizeof(CacheEntry)+strlen(entry->thoughts)+strlen(entry->content)+entry->contTools*512;
+	if(cache->dir!=NULL) cache_disk_write(cache, entry);
+	if(cache->maxBytes>0 && entry->size>cache->maxBytes){
+		cache_entry_free(entry);
+		return;
+	}
+	cache_insert(cache, entry);
+}
+
+int OCl_flush_response_cache(OCl *ocl){
+	if(ocl->cache==NULL) return OCL_RETURN_OK;
+	while(ocl->cache->mru!=NULL){
+		CacheEntry *entry=ocl->cache->mru;
+		cache_unlink(ocl->cache, entry);
+		cache_entry_free(entry);
+	}
+	return OCL_RETURN_OK;
+}
+
+int OCl_set_response_cache(OCl *ocl, int maxEntries, long int maxBytes, int ttl, const char *cacheDir){
+	if(maxEntries<0 || maxBytes<0 || ttl<0) return OCL_ERR_RESPONSE_CACHE;
+	if(ocl->cache!=NULL){
+		OCl_flush_response_cache(ocl);
+		sfree(ocl->cache->dir);
+		sfree(ocl->cache);
+		ocl->cache=NULL;
+	}
+	if(maxEntries==0) return OCL_RETURN_OK;
+	if(cacheDir!=NULL && mkdir(cacheDir, 0700)!=0 && errno!=EEXIST) return OCL_ERR_RESPONSE_CACHE;
+	if((ocl->cache=calloc(1, sizeof(struct _ocl_cache)))==NULL) return OCL_ERR_MALLOC;
+	ocl->cache->maxEntries=maxEntries;
+	ocl->cache->maxBytes=maxBytes;
+	ocl->cache->ttl=ttl;
+	if(cacheDir!=NULL) ocl->cache->dir=strdup(cacheDir);
+	return OCL_RETURN_OK;
+}
+
+int OCl_set_retry_policy(OCl *ocl, int maxAttempts, int backoffMs, const int *retryableErrors, int cantErrors){
+	static int const defaultRetryableErrors[]={OCL_ERR_SOCKET_CONNECTION, OCL_ERR_SOCKET_CONNECTION_TIMEOUT
+			, OCL_ERR_SSL_CONNECT, OCL_ERR_POLLOUT, OCL_ERR_SEND_TIMEOUT, OCL_ERR_SENDING_PACKETS, OCL_ERR_POLLIN
+			, OCL_ERR_RECV_TIMEOUT, OCL_ERR_RECEIVING_PACKETS, OCL_ERR_PARTIAL_RESPONSE_RECV, OCL_ERR_ZEROBYTESRECV
+			, OCL_ERR_SERVICE_UNAVAILABLE};
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(retryableErrors==NULL){
+		retryableErrors=defaultRetryableErrors;
+		cantErrors=sizeof(defaultRetryableErrors)/sizeof(defaultRetryableErrors[0]);
+	}
+	if(maxAttempts<1 || backoffMs<0 || cantErrors<0 || cantErrors>(int) (sizeof(ocl->retryableErrors)/sizeof(int)))
+		return OCL_ERR_RETRY_POLICY;
+	for(int i=0;i<cantErrors;i++) if(retryableErrors[i]<OCL_ERR_INIT || retryableErrors[i]>=0) return OCL_ERR_RETRY_POLICY;
+	ocl->retryMaxAttempts=maxAttempts;
+	ocl->retryBackoffMs=backoffMs;
+	memcpy(ocl->retryableErrors, retryableErrors, cantErrors*sizeof(int));
+	ocl->cantRetryableErrors=cantErrors;
+	return OCL_RETURN_OK;
+}
+
+static bool retry_is_retryable(OCl const *ocl, int error){
+	for(int i=0;i<ocl->cantRetryableErrors;i++) if(ocl->retryableErrors[i]==error) return true;
+	return false;
+}
+
+/*
+ * Exponential backoff (capped), jittered over the upper half of the delay so clients that failed together don't
+ * retry in lockstep. Sleeps in slices so a cancellation isn't held for the whole delay.
+ */
+static void retry_backoff(OCl const *ocl, int attempt){
+	double delay=ocl->retryBackoffMs;
+	for(int i=1;i<attempt && delay<OCL_RETRY_MAX_BACKOFF_MS;i++) delay*=2;
+	if(delay>OCL_RETRY_MAX_BACKOFF_MS) delay=OCL_RETRY_MAX_BACKOFF_MS;
+	unsigned int seed=(unsigned int) (ocl_now()*1000000.0);
+	delay=delay/2.0+(delay/2.0)*rand_r(&seed)/(double) RAND_MAX;
+	double deadline=ocl_now()+delay/1000.0, remaining=0;
+	while(!ocl_canceled(ocl) && (remaining=deadline-ocl_now())>0){
+		if(remaining>0.1) remaining=0.1;
+		struct timespec ts={0, (long) (remaining*1000000000.0)};
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int body_append_options(OCl *ocl, char **body, size_t *len, size_t *size){
+	if(ocl->format!=NULL && buffer_printf(&ocl->arena, body, len, size, "\"format\": %s,", ocl->format->text)!=OCL_RETURN_OK)
+		return OCL_ERR_MALLOC;
+	return buffer_printf(&ocl->arena, body, len, size,
+			"\"think\": %s,"
+			"\"keep_alive\": %d,"
+			"\"stream\": %s,"
+			"\"options\": {"
+			"\"temperature\": %f,"
+			"\"repeat_last_n\": %d,"
+			"\"repeat_penalty\": %f,"
+			"\"seed\": %d,"
+			"\"top_k\": %d,"
+			"\"top_p\": %f,"
+			"\"min_p\": %f,"
+			"\"num_predict\": %d,"
+			"\"num_ctx\": %d,"
+			"\"stop\": %s}}",
+			ocl->think,
+			ocl->keepalive,
+			"true",
+			ocl->temp,
+			ocl->repeat_last_n,
+			ocl->repeat_penalty,
+			ocl->seed,
+			ocl->top_k,
+			ocl->top_p,
+			ocl->min_p,
+			ocl->num_predict,
+			ocl->maxTokensCtx,
+			(ocl->stop!=NULL)?ocl->stop->json:"null");
+}
+
+/*
+ * The bodies are built in a single growing buffer (in the arena), with the (raw) message escaped straight into it: a
+ * big query (v.gr. a piped log) isn't copied into an escaped string first. 'send_chat_body()' sends the HTTP headers
+ * apart, so the request isn't copied either. With 'messageAt', the message is left out instead, and where it goes is
+ * returned: it's escaped while uploaded (see 'upload_body()').
+ */
+static int body_append_message(OCl *ocl, char **body, size_t *len, size_t *size, char const *message, size_t *messageAt){
+	if(messageAt==NULL) return json_escape_append(&ocl->arena, body, len, size, message, strlen(message));
+	*messageAt=*len;
+	return OCL_RETURN_OK;
+}
+
+static char *build_chat_body(OCl *ocl, char const *context, char const *message, char const *imageFileBase64
+		, char const *assistantPrefix, size_t *messageAt){
+	char *body=NULL;
+	size_t len=0, size=0;
+	int retVal=buffer_printf(&ocl->arena, &body, &len, &size,
+			"{\"model\":\"%s\","
+			"\"messages\":["
+			"{\"role\":\"system\",\"content\":\"%s\"},"
+			"%s""{\"role\": \"user\",\"content\": \"",
+			ocl->model,
+			ocl->systemRole,
+			context);
+	if(retVal==OCL_RETURN_OK) retVal=body_append_message(ocl, &body, &len, &size, message, messageAt);
+	if(retVal==OCL_RETURN_OK) retVal=buffer_append(&ocl->arena, &body, &len, &size, "\"", 1);
+	if(retVal==OCL_RETURN_OK && imageFileBase64!=NULL)
+		retVal=buffer_printf(&ocl->arena, &body, &len, &size, ",\"images\": [\"%s\"]", imageFileBase64);
+	// A trailing assistant message is continued by the server instead of answered.
+	if(retVal==OCL_RETURN_OK && assistantPrefix!=NULL)
+		retVal=buffer_printf(&ocl->arena, &body, &len, &size, "},{\"role\":\"assistant\",\"content\":\"%s\"", assistantPrefix);
+	if(retVal==OCL_RETURN_OK) retVal=buffer_printf(&ocl->arena, &body, &len, &size, "}],\"tools\": [%s],", ocl->tools);
+	if(retVal==OCL_RETURN_OK) retVal=body_append_options(ocl, &body, &len, &size);
+	return (retVal==OCL_RETURN_OK)?body:NULL;
+}
+
+static char *build_generate_body(OCl *ocl, char const *message, char const *imageFileBase64, size_t *messageAt){
+	char *body=NULL;
+	size_t len=0, size=0;
+	int retVal=buffer_printf(&ocl->arena, &body, &len, &size,
+			"{\"model\":\"%s\","
+			"\"system\":\"%s\","
+			"\"prompt\":\"",
+			ocl->model,
+			ocl->systemRole);
+	if(retVal==OCL_RETURN_OK) retVal=body_append_message(ocl, &body, &len, &size, message, messageAt);
+	if(retVal==OCL_RETURN_OK) retVal=buffer_append(&ocl->arena, &body, &len, &size, "\"", 1);
+	if(retVal==OCL_RETURN_OK && imageFileBase64!=NULL)
+		retVal=buffer_printf(&ocl->arena, &body, &len, &size, ",\"images\": [\"%s\"]", imageFileBase64);
+	if(retVal==OCL_RETURN_OK && ocl->cantGenContext>0) retVal=buffer_append(&ocl->arena, &body, &len, &size, ",\"context\": [", 13);
+	for(int i=0;i<ocl->cantGenContext && retVal==OCL_RETURN_OK;i++){
+		char token[16];
+		int tokenLen=snprintf(token, sizeof(token), (i>0)?",%d":"%d", ocl->genContext[i]);
+		retVal=buffer_append(&ocl->arena, &body, &len, &size, token, tokenLen);
+	}
+	if(retVal==OCL_RETURN_OK && ocl->cantGenContext>0) retVal=buffer_append(&ocl->arena, &body, &len, &size, "]", 1);
+	if(retVal==OCL_RETURN_OK) retVal=buffer_append(&ocl->arena, &body, &len, &size, ",", 1);
+	if(retVal==OCL_RETURN_OK) retVal=body_append_options(ocl, &body, &len, &size);
+	return (retVal==OCL_RETURN_OK)?body:NULL;
+}
+
+/*
+ * '/api/generate' is used while the conversation is carried by the token context (same model): the server doesn't
+ * re-tokenize the history. Otherwise (no context yet but history, static context, or tools) the chat is sent with the
+ * 'Message' list, as usual. So, once the server rejects the token context (see 'send_chat()'), the rest of the
+ * conversation goes on with the chat: a context can't be rebuilt from the history. '/api/generate' is used again from
+ * the next conversation, once the history is flushed.
+ */
+static bool generate_wanted(OCl const *ocl, char const *message){
+	if(!ocl->generate || (ocl->tools!=NULL && ocl->tools[0]!=0)) return false;
+	if(ocl->cantGenContext>0) return strcmp(ocl->genContextModel, ocl->model)==0;
+	return message_list_count(ocl->staticContextMessages)==0
+			&& (message_list_count(ocl->contextMessages)==0 || message[strlen(message)-1]==';');
+}
+
+/*
+ * 'body' comes from 'build_*_body()', sent after the headers as is. With 'message' (left out of the body, at
+ * 'messageAt'), it's uploaded chunked, escaping the message on the way.
+ */
+static int send_chat_body(OCl *ocl, char const *endpoint, char *body, char const *message, size_t messageAt
+		, void (*callback)(const char *, bool, int)){
+	size_t bodyLen=strlen(body), encodedLen=0;
+	char *encoded=NULL;
+	char encodingHeaders[BUFFER_SIZE_1K]="";
+	if(ocl->compression!=OCL_COMPRESSION_NONE){
+		if(bodyLen>=(size_t) ocl->compressionMinSize){
+			int retVal=compress_body(ocl, body, bodyLen, &encoded, &encodedLen);
+			if(retVal!=OCL_RETURN_OK) return retVal;
+			// Not worth it (v.gr. a base64 JPEG): sent as is.
+			if(encodedLen>=bodyLen) encoded=NULL;
+		}
+		snprintf(encodingHeaders, sizeof(encodingHeaders), "%s%s%sAccept-Encoding: %s\r\n"
+				, (encoded!=NULL)?"Content-Encoding: ":""
+				, (encoded!=NULL)?oclCompressionNames[ocl->compression]:""
+				, (encoded!=NULL)?"\r\n":""
+				, OCL_ACCEPT_ENCODING);
+	}
+	char *payloadBody=(encoded!=NULL)?encoded:body;
+	size_t payloadBodyLen=(encoded!=NULL)?encodedLen:bodyLen;
+	char header[BUFFER_SIZE_2K+BUFFER_SIZE_1K], host[OCL_HOST_SIZE], length[64];
+	if(message!=NULL) snprintf(length, sizeof(length), "Transfer-Encoding: chunked");
+	else snprintf(length, sizeof(length), "Content-Length: %zu", payloadBodyLen);
+	int headerLen=snprintf(header,sizeof(header),
+			"POST %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"User-agent: Ollama-C-lient/%s (Linux; x64)\r\n"
+			"Accept: */*\r\n"
+			"Content-Type: application/json; charset=utf-8\r\n"
+			"%s"
+			"Authorization: Bearer %s\r\n"
+			"%s\r\n\r\n"
+			,endpoint
+			,http_host(ocl->srvAddr, host, sizeof(host))
+			,OCL_VERSION
+			,encodingHeaders
+			,ocl->apiKey
+			,length);
+	if((size_t) headerLen>=sizeof(header)) return OCL_ERR_REQUEST_HEADERS;
+	RequestBody requestBody={payloadBody, payloadBodyLen, message, messageAt};
+	return send_scheduled_message(ocl, header, headerLen, &requestBody, callback);
+}
+
+static int generate_set_context(OCl *ocl, int32_t const *context, int cantContext){
+	int32_t *genContext=realloc(ocl->genContext, sizeof(int32_t)*(cantContext+1));
+	if(genContext==NULL) return OCL_ERR_REALLOC;
+	memcpy(genContext, context, sizeof(int32_t)*cantContext);
+	ocl->genContext=genContext;
+	ocl->cantGenContext=cantContext;
+	snprintf(ocl->genContextModel, sizeof(ocl->genContextModel), "%s", ocl->model);
+	return OCL_RETURN_OK;
+}
+
+int OCl_set_generate(OCl *ocl, bool generate){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	ocl->generate=generate;
+	return OCL_RETURN_OK;
+}
+
+/*
+ * File: "OCLCTX01", int32 tokens, the model (256 chars) and the int32 tokens.
+ */
+int OCl_save_generate_context(OCl *ocl, const char *file){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(file==NULL) return OCL_ERR_OPENING_FILE;
+	char header[8+4+256]="";
+	int32_t cant=ocl->cantGenContext;
+	memcpy(header, OCL_GENERATE_CONTEXT_MAGIC, 8);
+	memcpy(header+8, &cant, 4);
+	snprintf(header+12, 256, "%.255s", ocl->genContextModel);
+	char tmpFile[BUFFER_SIZE_1K]="";
+	snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", file);
+	FILE *f=fopen(tmpFile, "wb");
+	if(f==NULL) return OCL_ERR_OPENING_FILE;
+	bool written=fwrite(header, sizeof(header), 1, f)==1
+			&& (cant==0 || fwrite(ocl->genContext, sizeof(int32_t), cant, f)==(size_t) cant);
+	written=(fclose(f)==0) && written;
+	if(!written || rename(tmpFile, file)!=0){
+		unlink(tmpFile);
+		return OCL_ERR_OPENING_FILE;
+	}
+	return OCL_RETURN_OK;
+}
+
+int OCl_load_generate_context(OCl *ocl, const char *file){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(file==NULL) return OCL_ERR_OPENING_FILE;
+	FILE *f=fopen(file, "rb");
+	// Nothing saved yet.
+	if(f==NULL) return (errno==ENOENT)?OCL_RETURN_OK:OCL_ERR_OPENING_FILE;
+	char header[8+4+256]="";
+	int32_t cant=0;
+	int32_t *context=NULL;
+	int retVal=OCL_RETURN_OK;
+	if(fread(header, sizeof(header), 1, f)!=1 || memcmp(header, OCL_GENERATE_CONTEXT_MAGIC, 8)!=0){
+		retVal=OCL_ERR_CONTEXT_FILE_CORRUPTED;
+	}else{
+		memcpy(&cant, header+8, 4);
+		header[sizeof(header)-1]=0;
+		if(cant<0 || (context=malloc(sizeof(int32_t)*((size_t) cant+1)))==NULL) retVal=(cant<0)?OCL_ERR_CONTEXT_FILE_CORRUPTED:OCL_ERR_MALLOC;
+		else if(fread(context, sizeof(int32_t), cant, f)!=(size_t) cant) retVal=OCL_ERR_CONTEXT_FILE_CORRUPTED;
+	}
+	fclose(f);
+	if(retVal==OCL_RETURN_OK){
+		sfree(ocl->genContext);
+		ocl->genContext=context;
+		ocl->cantGenContext=cant;
+		snprintf(ocl->genContextModel, sizeof(ocl->genContextModel), "%s", header+12);
+	}else{
+		sfree(context);
+	}
+	return retVal;
+}
+
+/*
+ * 'historyMessage' is what the history records (and what a final ';' is looked for in) in place of 'message': an
+ * ensemble's aggregate prompt keeps the user's own one there.
+ */
+static int send_chat(OCl *ocl, const char *message, const char *historyMessage, const char *imageFile
+		, void (*callback)(const char *, bool, int)){
+	warmup_touch(ocl);
+	// Everything of the previous chat is released at once.
+	arena_reset(&ocl->arena);
+	char *imageFileBase64=NULL;
+	size_t imageFileSize=0;
+	if(imageFile!=NULL){
+		int retVal=base64_encode(&ocl->arena, imageFile, &imageFileSize, &imageFileBase64);
+		if(retVal!=OCL_RETURN_OK) return retVal;
+	}
+	// Only escaped (for the history) once answered: the bodies escape the message themselves.
+	char *messageParsed=NULL, *context=NULL;
+	size_t contextLen=0, contextSize=0;
+	int retVal=buffer_reserve(&ocl->arena, &context, &contextLen, &contextSize, 0);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	context[0]=0;
+	bool generate=generate_wanted(ocl, message);
+	char const *contextTemplate="{\"role\":\"user\",\"content\":\"%s\"},{\"role\":\"assistant\",\"content\":\"%s\"},";
+	int rows[OCL_VINDEX_MAX_TOP_K], cantRows=generate?-1:vindex_select(ocl, message, rows), nextRow=0;
+	int cantStatic=generate?0:message_list_count(ocl->staticContextMessages);
+	// Rows added after the index was built (v.gr. an ensemble's answers) are always sent.
+	int indexedRows=(cantRows>=0)?vindex_rows(ocl):0;
+	for(int row=0;row<cantStatic && retVal==OCL_RETURN_OK;row++){
+		if(row<indexedRows){
+			if(nextRow>=cantRows || rows[nextRow]!=row) continue;
+			nextRow++;
+		}
+		Message const *temp=ocl->staticContextMessages->messages[row];
+		retVal=buffer_printf(&ocl->arena, &context, &contextLen, &contextSize, contextTemplate, temp->userMessage
+				, temp->assistantMessage);
+	}
+	if(historyMessage[strlen(historyMessage)-1]!=';' && !generate){
+		int cantContext=message_list_count(ocl->contextMessages);
+		for(int i=0;i<cantContext && retVal==OCL_RETURN_OK;i++){
+			Message const *temp=ocl->contextMessages->messages[i];
+			retVal=buffer_printf(&ocl->arena, &context, &contextLen, &contextSize, contextTemplate, temp->userMessage
+					, temp->assistantMessage);
+		}
+	}
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	// Neither cached (keyed by the whole body) nor compressed: the message is escaped while uploaded.
+	size_t messageAt=0, *streamed=(ocl->cache==NULL && ocl->compression==OCL_COMPRESSION_NONE)?&messageAt:NULL;
+	char *body=generate?build_generate_body(ocl, message, imageFileBase64, streamed)
+			:build_chat_body(ocl, context, message, imageFileBase64, NULL, streamed);
+	if(body==NULL) return OCL_ERR_MALLOC;
+	char cacheKey[65]="";
+	size_t messageParsedLen=0, messageParsedSize=0;
+	// Not for generations: a replay wouldn't bring the token context back.
+	if(ocl->cache!=NULL && !generate){
+		response_cache_key(body, cacheKey);
+		if(response_cache_replay(ocl, cacheKey, callback)){
+			if(historyMessage[strlen(historyMessage)-1]!=';' && strcmp(ocl->ocl_resp->content,"")!=0
+					&& json_escape_append(&ocl->arena, &messageParsed, &messageParsedLen, &messageParsedSize
+					, historyMessage, strlen(historyMessage))==OCL_RETURN_OK){
+				create_new_context_message(ocl, messageParsed, ocl->ocl_resp->content);
+				if(ocl->maxHistoryCtx>=0) OCl_save_message(ocl, messageParsed, ocl->ocl_resp->content);
+			}
+			return OCL_RETURN_OK;
+		}
+	}
+	/*
+	 * On a retryable failure, the content already streamed (and already handed to the callback) is sent back as an
+	 * assistant prefix, so the model continues it instead of generating (and evaluating the prompt) from scratch.
+	 */
+	char *partial=NULL;
+	size_t partialLen=0, partialSize=0;
+	for(int attempt=1;;attempt++){
+		ocl->ocl_resp->content[0]=0;
+		retVal=send_chat_body(ocl, generate?OCL_GENERATE_ENDPOINT:OCL_ENDPOINT, body, (streamed!=NULL)?message:NULL
+				, messageAt, callback);
+		if(retVal>=0 && !ocl->ocl_resp->done && !ocl_canceled(ocl)){
+			metrics_count_error(OCL_ERR_PARTIAL_RESPONSE_RECV);
+			retVal=OCL_ERR_PARTIAL_RESPONSE_RECV;
+		}
+		if(retVal>=0 || ocl_canceled(ocl) || attempt>=ocl->retryMaxAttempts || !retry_is_retryable(ocl, retVal)) break;
+		// An answer not valid for the format is asked again from scratch.
+		if(retVal==OCL_ERR_FORMAT_VIOLATION){
+			partialLen=0;
+		}else{
+			// A generation can't be continued from an assistant prefix: only retried if nothing was streamed yet.
+			if(generate && ocl->ocl_resp->content[0]!=0) break;
+			if(buffer_append(&ocl->arena, &partial, &partialLen, &partialSize, ocl->ocl_resp->content
+					, strlen(ocl->ocl_resp->content))!=OCL_RETURN_OK) break;
+		}
+		if(metrics_on()) metrics_add(&oclMetrics.retries, 1);
+		retry_backoff(ocl, attempt);
+		if(ocl_canceled(ocl)) break;
+		body=generate?build_generate_body(ocl, message, imageFileBase64, streamed)
+				:build_chat_body(ocl, context, message, imageFileBase64, (partialLen>0)?partial:NULL, streamed);
+		if(body==NULL){
+			retVal=OCL_ERR_MALLOC;
+			break;
+		}
+	}
+	// The server rejected the token context (v.gr. the model was re-created): falls back to the 'Message' list, until
+	// the history is flushed.
+	if(generate && retVal==OCL_ERR_MSG_FOUND && ocl->cantGenContext>0 && ocl->ocl_resp->content[0]==0 && !ocl_canceled(ocl)){
+		ocl->cantGenContext=0;
+		ocl->generate=false;
+		retVal=send_chat(ocl, message, historyMessage, imageFile, callback);
+		ocl->generate=true;
+		return retVal;
+	}
+	if(retVal<0) return ocl_canceled(ocl)?OCL_RETURN_OK:retVal;
+	if(partialLen>0 && !ocl_canceled(ocl)){
+		if(buffer_append(&ocl->arena, &partial, &partialLen, &partialSize, ocl->ocl_resp->content
+				, strlen(ocl->ocl_resp->content))!=OCL_RETURN_OK
+				|| response_set_text(&ocl->ocl_resp->content, partial)!=OCL_RETURN_OK)
+			return OCL_ERR_MALLOC;
+	}
+	if(ocl->ocl_resp->tokensPerSec>0 && metrics_on())
+		metrics_observe(oclMetrics.tps, tpsBuckets, OCL_TPS_BUCKETS, &oclMetrics.tpsSumMicro, ocl->ocl_resp->tokensPerSec);
+	if(!ocl_canceled(ocl) && retVal>0){
+		// A cut answer (stop sequence, budget, max. time) isn't what the request would get the next time.
+		if(ocl->cache!=NULL && !generate && ocl->ocl_resp->stopReason==OCL_STOP_NONE) response_cache_store(ocl, cacheKey);
+		if(generate && message[strlen(message)-1]!=';' && ocl->ocl_resp->cantContext>0){
+			if(generate_set_context(ocl, ocl->ocl_resp->context, ocl->ocl_resp->cantContext)!=OCL_RETURN_OK)
+				return OCL_ERR_MALLOC;
+		}
+		if(historyMessage[strlen(historyMessage)-1]!=';' && strcmp(ocl->ocl_resp->content,"")!=0){
+			if(json_escape_append(&ocl->arena, &messageParsed, &messageParsedLen, &messageParsedSize, historyMessage
+					, strlen(historyMessage))!=OCL_RETURN_OK) return OCL_ERR_MALLOC;
+			create_new_context_message(ocl, messageParsed, ocl->ocl_resp->content);
+			if(ocl->maxHistoryCtx>=0) OCl_save_message(ocl, messageParsed, ocl->ocl_resp->content);
+		}
+	}
+	return OCL_RETURN_OK;
+}
+
+int OCl_send_chat(OCl *ocl, const char *message, const char *imageFile, void (*callback)(const char *, bool, int)){
+	int retVal=send_chat(ocl, message, message, imageFile, callback);
+	atomic_store(&ocl->canceled, false);
+	return retVal;
+}
+
+/*
+ * Cancels the request in progress of the instance (or the next one, if none), from any thread: its connection is
+ * closed, so the server stops generating. OCl_send_chat() returns what was received until then.
+ */
+int OCl_cancel(OCl *ocl){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	atomic_store(&ocl->canceled, true);
+	pthread_mutex_lock(&ocl->connMutex);
+	// Only the reading side: the receiving loop wakes up and closes the connection (writing could raise SIGPIPE).
+	if(ocl->activeSocket>0) shutdown(ocl->activeSocket, SHUT_RD);
+	pthread_mutex_unlock(&ocl->connMutex);
+	return OCL_RETURN_OK;
+}
+
+/*
+ * Racing: the same chat is sent through several branches (forks with their own model and/or server) at once. The
+ * winner is the first to stream a token, the first to finish, or (quorum) the answer given by most of the first
+ * 'quorum' to finish. The rest are canceled (their connections shut down) as soon as the race is decided.
+ */
+typedef struct RaceBranch{
+	struct Race *race;
+	int index;
+	OCl *ocl;
+	pthread_t thread;
+	atomic_bool canceled;
+	atomic_bool finished;
+	OCl_race_branch *stats;
+}RaceBranch;
+
+// Internal policy (ensembles): no winner, every branch runs to the end.
+#define OCL_RACE_ALL				-1
+
+typedef struct Race{
+	pthread_mutex_t mutex;
+	pthread_cond_t ended;
+	int cantEnded;
+	int policy;
+	int quorum;
+	atomic_int winner;
+	int cantDone;
+	int doneOrder[OCL_RACE_MAX_BRANCHES];
+	double startedAt;
+	char const *message;
+	char const *imageFile;
+	void (*callback)(const char *, bool, int);
+	int cantBranches;
+	RaceBranch branches[OCL_RACE_MAX_BRANCHES];
+}Race;
+
+// The chat callback has no user data: every branch runs in its own thread.
+static _Thread_local RaceBranch *raceBranch=NULL;
+
+static void race_cancel_others(Race *race, int index){
+	for(int i=0;i<race->cantBranches;i++){
+		RaceBranch *branch=&race->branches[i];
+		if(i==index || atomic_load(&branch->finished)) continue;
+		atomic_store(&branch->canceled, true);
+		OCl_cancel(branch->ocl);
+	}
+}
+
+static void race_callback(const char *token, bool done, int type){
+	RaceBranch *branch=raceBranch;
+	Race *race=branch->race;
+	if(branch->stats->firstToken==0) branch->stats->firstToken=ocl_now()-race->startedAt;
+	if(race->policy!=OCL_RACE_FIRST_TOKEN) return;
+	int winner=-1;
+	if(atomic_compare_exchange_strong(&race->winner, &winner, branch->index)){
+		race_cancel_others(race, branch->index);
+	}else if(winner!=branch->index){
+		return;
+	}
+	if(race->callback!=NULL) race->callback(token, done, type);
+}
+
+static void race_branch_run(RaceBranch *branch){
+	Race *race=branch->race;
+	raceBranch=branch;
+	int retVal=OCl_send_chat(branch->ocl, race->message, race->imageFile, race_callback);
+	branch->stats->elapsed=ocl_now()-race->startedAt;
+	branch->stats->result=retVal;
+	if(retVal!=OCL_RETURN_OK || atomic_load(&branch->canceled) || !branch->ocl->ocl_resp->done) return;
+	atomic_store(&branch->finished, true);
+	pthread_mutex_lock(&race->mutex);
+	race->doneOrder[race->cantDone++]=branch->index;
+	bool decided=(race->policy==OCL_RACE_FIRST_DONE && race->cantDone==1)
+			|| (race->policy==OCL_RACE_QUORUM && race->cantDone==race->quorum);
+	pthread_mutex_unlock(&race->mutex);
+	if(!decided) return;
+	if(race->policy==OCL_RACE_FIRST_DONE) atomic_store(&race->winner, branch->index);
+	race_cancel_others(race, branch->index);
+}
+
+static void *race_run(void *arg){
+	RaceBranch *branch=arg;
+	race_branch_run(branch);
+	pthread_mutex_lock(&branch->race->mutex);
+	branch->race->cantEnded++;
+	pthread_cond_signal(&branch->race->ended);
+	pthread_mutex_unlock(&branch->race->mutex);
+	return NULL;
+}
+
+/*
+ * Waits for the started branches. The instance's cancellation (OCl_cancel(), on the caller's instance) isn't seen by
+ * the forks: every branch still running is canceled.
+ */
+static void race_wait(Race *race, OCl const *ocl, int cantStarted){
+	bool canceled=false;
+	pthread_mutex_lock(&race->mutex);
+	while(race->cantEnded<cantStarted){
+		if(!canceled && ocl_canceled(ocl)){
+			canceled=true;
+			race_cancel_others(race, -1);
+		}
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec+=OCL_POLL_SLICE_MS*1000000L;
+		if(until.tv_nsec>=1000000000L){
+			until.tv_sec++;
+			until.tv_nsec-=1000000000L;
+		}
+		pthread_cond_timedwait(&race->ended, &race->mutex, &until);
+	}
+	pthread_mutex_unlock(&race->mutex);
+}
+
+// Quorum: the content given by most of the finished branches (ties: the first to finish).
+static int race_quorum_winner(Race const *race){
+	int winner=-1, winnerVotes=0;
+	for(int i=0;i<race->cantDone;i++){
+		char const *content=race->branches[race->doneOrder[i]].ocl->ocl_resp->content;
+		int votes=0;
+		for(int j=0;j<race->cantDone;j++)
+			if(strcmp(content, race->branches[race->doneOrder[j]].ocl->ocl_resp->content)==0) votes++;
+		if(votes>winnerVotes){
+			winner=race->doneOrder[i];
+			winnerVotes=votes;
+		}
+	}
+	return winner;
+}
+
+// Forks and runs every branch, and waits for all of them. 'race' must be zeroed, with policy, quorum & message set.
+static int race_branches(Race *race, OCl *ocl, OCl_race_branch *branches, int cantBranches){
+	pthread_mutex_init(&race->mutex, NULL);
+	pthread_cond_init(&race->ended, NULL);
+	atomic_init(&race->winner, -1);
+	int retVal=OCL_RETURN_OK;
+	for(int i=0;i<cantBranches && retVal==OCL_RETURN_OK;i++){
+		RaceBranch *branch=&race->branches[i];
+		OCl_race_branch *stats=&branches[i];
+		stats->result=OCL_RETURN_OK;
+		stats->winner=stats->canceled=false;
+		stats->firstToken=stats->elapsed=stats->tokensPerSec=0;
+		stats->evalCount=0;
+		branch->race=race;
+		branch->index=i;
+		branch->stats=stats;
+		atomic_init(&branch->canceled, false);
+		atomic_init(&branch->finished, false);
+		if((retVal=OCl_fork(ocl, NULL, &branch->ocl))!=OCL_RETURN_OK) break;
+		race->cantBranches++;
+		if(stats->model!=NULL && (retVal=OCl_set_model(branch->ocl, stats->model))!=OCL_RETURN_OK) break;
+		// A branch pinned to a server doesn't fail over to the instance's endpoints.
+		if(stats->serverAddr!=NULL){
+			if((retVal=OCl_set_server_addr(branch->ocl, stats->serverAddr))!=OCL_RETURN_OK) break;
+			branch->ocl->cantEndpoints=0;
+		}
+		if(stats->serverPort!=0) retVal=OCl_set_server_port(branch->ocl, stats->serverPort);
+	}
+	race->startedAt=ocl_now();
+	int cantStarted=0;
+	for(;cantStarted<race->cantBranches && retVal==OCL_RETURN_OK;cantStarted++){
+		if(pthread_create(&race->branches[cantStarted].thread, NULL, race_run, &race->branches[cantStarted])!=0){
+			race_cancel_others(race, -1);
+			retVal=OCL_ERR_RACE;
+			break;
+		}
+	}
+	race_wait(race, ocl, cantStarted);
+	for(int i=0;i<cantStarted;i++){
+		pthread_join(race->branches[i].thread, NULL);
+		OCl_race_branch *stats=race->branches[i].stats;
+		stats->canceled=atomic_load(&race->branches[i].canceled);
+		stats->evalCount=race->branches[i].ocl->ocl_resp->evalCount;
+		stats->tokensPerSec=race->branches[i].ocl->ocl_resp->tokensPerSec;
+	}
+	return retVal;
+}
+
+static void race_free(Race *race){
+	for(int i=0;i<race->cantBranches;i++) OCl_free(race->branches[i].ocl);
+	pthread_cond_destroy(&race->ended);
+	pthread_mutex_destroy(&race->mutex);
+	sfree(race);
+}
+
+// The error of the first branch that failed, if any.
+static int race_error(OCl_race_branch const *branches, int cantBranches){
+	for(int i=0;i<cantBranches;i++) if(branches[i].result<0) return branches[i].result;
+	return OCL_ERR_RACE;
+}
+
+/*
+ * The winner's response (and its interaction, appended to the history) becomes the instance's. Returns the winner's
+ * index, or the error of the first branch when none won. With OCL_RACE_FIRST_TOKEN, the callback is called from the
+ * winner's thread as it streams; otherwise, once decided, from the calling thread. OCl_cancel() on the instance
+ * cancels every branch.
+ */
+int OCl_race(OCl *ocl, const char *message, const char *imageFile, OCl_race_branch *branches, int cantBranches
+		, int policy, int quorum, void (*callback)(const char *, bool, int)){
+	if(ocl==NULL || branches==NULL) return OCL_ERR_NULL_STRUCT;
+	if(cantBranches<1 || cantBranches>OCL_RACE_MAX_BRANCHES || policy<OCL_RACE_FIRST_TOKEN || policy>OCL_RACE_QUORUM
+			|| (policy==OCL_RACE_QUORUM && (quorum<1 || quorum>cantBranches))) return OCL_ERR_RACE;
+	Race *race=calloc(1, sizeof(Race));
+	if(race==NULL) return OCL_ERR_MALLOC;
+	race->policy=policy;
+	race->quorum=quorum;
+	race->message=message;
+	race->imageFile=imageFile;
+	race->callback=callback;
+	int retVal=race_branches(race, ocl, branches, cantBranches);
+	int winner=(policy==OCL_RACE_QUORUM)?race_quorum_winner(race):atomic_load(&race->winner);
+	for(int i=0;i<race->cantBranches;i++) branches[i].winner=(i==winner);
+	if(retVal==OCL_RETURN_OK && winner>=0){
+		OCl *branch=race->branches[winner].ocl;
+		struct _ocl_response *ocl_resp=ocl->ocl_resp;
+		ocl->ocl_resp=branch->ocl_resp;
+		branch->ocl_resp=ocl_resp;
+		if(branch->contextMessages!=ocl->contextMessages){
+			MessageList *contextMessages=ocl->contextMessages;
+			ocl->contextMessages=branch->contextMessages;
+			branch->contextMessages=contextMessages;
+			Message const *last=ocl->contextMessages->messages[ocl->contextMessages->cant-1];
+			if(ocl->maxHistoryCtx>=0) OCl_save_message(ocl, last->userMessage, last->assistantMessage);
+		}
+		int32_t *genContext=ocl->genContext;
+		int cantGenContext=ocl->cantGenContext;
+		ocl->genContext=branch->genContext;
+		ocl->cantGenContext=branch->cantGenContext;
+		snprintf(ocl->genContextModel, sizeof(ocl->genContextModel), "%s", branch->genContextModel);
+		branch->genContext=genContext;
+		branch->cantGenContext=cantGenContext;
+		if(policy!=OCL_RACE_FIRST_TOKEN && callback!=NULL){
+			if(ocl->ocl_resp->thoughts[0]!=0) callback(ocl->ocl_resp->thoughts, false, OCL_THINKING_TYPE);
+			for(int i=0;i<ocl->ocl_resp->contTools;i++) callback(ocl->ocl_resp->toolCalls[i], false, OCL_TOOL_TYPE);
+			callback(ocl->ocl_resp->content, true, OCL_CONTENT_TYPE);
+		}
+		retVal=(branches[winner].result!=OCL_RETURN_OK)?branches[winner].result:winner;
+	}else if(retVal==OCL_RETURN_OK){
+		retVal=race_error(branches, race->cantBranches);
+	}
+	race_free(race);
+	atomic_store(&ocl->canceled, false);
+	return retVal;
+}
+
+/*
+ * Ensemble: every member answers the chat at once (so it takes about as long as the slowest), and then the instance's
+ * model answers it (with 'prompt' appended, NULL: OCL_ENSEMBLE_PROMPT) having the members' answers as static
+ * context, after its own. Only this last answer is streamed through the callback and kept in the history (with the
+ * message as given).
+ */
+int OCl_ensemble(OCl *ocl, const char *message, const char *imageFile, OCl_race_branch *members, int cantMembers
+		, const char *prompt, void (*callback)(const char *, bool, int)){
+	if(ocl==NULL || members==NULL || message==NULL) return OCL_ERR_NULL_STRUCT;
+	if(cantMembers<1 || cantMembers>OCL_RACE_MAX_BRANCHES) return OCL_ERR_RACE;
+	Race *race=calloc(1, sizeof(Race));
+	if(race==NULL) return OCL_ERR_MALLOC;
+	race->policy=OCL_RACE_ALL;
+	race->message=message;
+	race->imageFile=imageFile;
+	int retVal=race_branches(race, ocl, members, cantMembers);
+	if(retVal==OCL_RETURN_OK && race->cantDone==0 && !ocl_canceled(ocl)) retVal=race_error(members, race->cantBranches);
+	// Canceled: the instance's model isn't asked either.
+	if(retVal!=OCL_RETURN_OK || ocl_canceled(ocl)){
+		race_free(race);
+		atomic_store(&ocl->canceled, false);
 		return retVal;
 	}
-	socklen_t len = sizeof(retVal);
-	getsockopt(socketConn, SOL_SOCKET, SO_ERROR, &retVal, &len);
-	if(retVal!=0){
-		errno=retVal;
-		return OCL_ERR_SOCKET_CONNECTION;
+	// Appended to a copy: the instance's static context is given back as it was.
+	MessageList *staticContextMessages=message_list_retain(ocl->staticContextMessages);
+	char *messageParsed=NULL;
+	size_t messageParsedLen=0, messageParsedSize=0;
+	retVal=json_escape_append(NULL, &messageParsed, &messageParsedLen, &messageParsedSize, message, strlen(message));
+	for(int i=0;i<race->cantBranches && retVal==OCL_RETURN_OK;i++){
+		OCl const *member=race->branches[i].ocl;
+		if(atomic_load(&race->branches[i].finished) && member->ocl_resp->content[0]!=0)
+			retVal=message_list_append(&ocl->staticContextMessages, messageParsed, member->ocl_resp->content, -1);
+	}
+	sfree(messageParsed);
+	race_free(race);
+	char *aggregate=NULL;
+	size_t aggregateLen=0, aggregateSize=0;
+	if(retVal==OCL_RETURN_OK)
+		retVal=buffer_printf(NULL, &aggregate, &aggregateLen, &aggregateSize, "%s%s", message
+				, (prompt!=NULL)?prompt:OCL_ENSEMBLE_PROMPT);
+	// The token context ('/api/generate') doesn't carry static context.
+	bool generate=ocl->generate;
+	ocl->generate=false;
+	// The history keeps the user's message: the next chats don't carry the suffix.
+	if(retVal==OCL_RETURN_OK) retVal=send_chat(ocl, aggregate, message, imageFile, callback);
+	ocl->generate=generate;
+	sfree(aggregate);
+	message_list_release(ocl->staticContextMessages);
+	ocl->staticContextMessages=staticContextMessages;
+	atomic_store(&ocl->canceled, false);
+	return retVal;
+}
+
+int OCl_check_service_status(OCl *ocl){
+	char msg[2048]="", host[OCL_HOST_SIZE];
+	snprintf(msg,2048,
+			"GET / HTTP/1.1\r\n"
+			"Host: %s\r\n\r\n",http_host(ocl->srvAddr, host, sizeof(host)));
+	int retVal=0;
+	if((retVal=send_message(ocl, msg, strlen(msg), NULL, NULL))<=0) return retVal;
+	return OCL_RETURN_OK;
+}
+
+int OCl_check_model_loaded(OCl *ocl){
+	OCl_model_info info;
+	int retVal=OCl_get_model_info(ocl, ocl->model, &info, false);
+	if(retVal==OCL_ERR_MODEL_NOT_FOUND) return false;
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	return info.loaded;
+}
+
+static int model_load(OCl *ocl, char const *model, bool load, double *loadTime){
+	char body[BUFFER_SIZE_1K]="";
+	if(load){
+		snprintf(body,BUFFER_SIZE_1K,"{\"model\": \"%s\", \"keep_alive\": %d}",model,ocl->keepalive);
+	}else{
+		snprintf(body,BUFFER_SIZE_1K,"{\"model\": \"%s\", \"keep_alive\": 0}",model);
+	}
+	char msg[BUFFER_SIZE_16K]="", host[OCL_HOST_SIZE];
+	snprintf(msg,sizeof(msg),
+			"POST /api/chat HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Authorization: Bearer %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %d\r\n\r\n"
+			"%s",http_host(ocl->srvAddr, host, sizeof(host)),ocl->apiKey,(int) strlen(body), body);
+	int prevRecvTo=ocl->socketRecvTimeout;
+	ocl->socketRecvTimeout=ocl->loadTimeout;
+	int retVal=0;
+	double sentAt=ocl_now();
+	retVal=send_message(ocl, msg, strlen(msg), NULL, NULL);
+	ocl->socketRecvTimeout=prevRecvTo;
+	if(retVal<=0) return retVal;
+	if(strstr(ocl->ocl_resp->response,"200 OK")!=NULL){
+		double elapsed=ocl_now()-sentAt;
+		if(loadTime!=NULL) *loadTime=elapsed;
+		if(load && metrics_on()) metrics_observe(oclMetrics.load, loadBuckets, OCL_LOAD_BUCKETS, &oclMetrics.loadSumUs, elapsed);
+		return OCL_RETURN_OK;
+	}
+	if(load) return OCL_ERR_LOADING_MODEL;
+	return OCL_ERR_UNLOADING_MODEL;
+}
+
+int OCl_load_model(OCl *ocl, bool load){
+	return model_load(ocl, ocl->model, load, NULL);
+}
+
+int OCl_set_load_timeout(OCl *ocl, int loadTimeout){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(loadTimeout<1) return OCL_ERR_LOAD_TIMEOUT_NOT_VALID;
+	ocl->loadTimeout=loadTimeout;
+	return OCL_RETURN_OK;
+}
+
+/*
+ * Warm-up scheduler: a thread (on a shadow instance) that preloads the models added with 'OCl_warmup_add()' and renews
+ * their keep_alive before it expires, while the policy of each model wants it loaded:
+ *  - OCL_WARMUP_ALWAYS: always.
+ *  - OCL_WARMUP_ON_USAGE: while it was used in a chat within the last 'from' seconds.
+ *  - OCL_WARMUP_SCHEDULE: between the minutes of the day (local time) 'from' and 'to' (it can wrap midnight).
+ * Models no longer wanted are not unloaded: they just expire.
+ */
+typedef struct{
+	char model[512];
+	int policy;
+	int from;
+	int to;
+	OCl_warmup_stats stats;
+	double lastUsed;
+	double nextRenewal;
+}WarmupEntry;
+
+struct _ocl_warmup{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	WarmupEntry entries[OCL_MAX_WARMUP_MODELS];
+	int cantEntries;
+	bool running;
+	pthread_t thread;
+	OCl *shadow;
+};
+
+static bool warmup_wanted(WarmupEntry const *entry, double now){
+	switch(entry->policy){
+	case OCL_WARMUP_ON_USAGE:
+		return entry->lastUsed!=0 && now-entry->lastUsed<entry->from;
+	case OCL_WARMUP_SCHEDULE:{
+		time_t t=time(NULL);
+		struct tm tm;
+		localtime_r(&t, &tm);
+		int minute=tm.tm_hour*60+tm.tm_min;
+		if(entry->from<=entry->to) return minute>=entry->from && minute<entry->to;
+		return minute>=entry->from || minute<entry->to;
+	}
+	case OCL_WARMUP_ALWAYS:
+	default:
+		return true;
+	}
+}
+
+static void *warmup_loop(void *arg){
+	struct _ocl_warmup *warmup=arg;
+	double renewal=warmup->shadow->keepalive*OCL_WARMUP_RENEWAL_RATIO;
+	if(renewal<1) renewal=1;
+	pthread_mutex_lock(&warmup->mutex);
+	while(warmup->running){
+		double now=ocl_now(), nextWake=now+OCL_WARMUP_TICK_S;
+		for(int i=0;i<warmup->cantEntries && warmup->running;i++){
+			WarmupEntry *entry=&warmup->entries[i];
+			if(!warmup_wanted(entry, now)){
+				entry->nextRenewal=0;
+				continue;
+			}
+			if(now<entry->nextRenewal){
+				if(entry->nextRenewal<nextWake) nextWake=entry->nextRenewal;
+				continue;
+			}
+			char model[512]="";
+			snprintf(model, sizeof(model), "%s", entry->model);
+			pthread_mutex_unlock(&warmup->mutex);
+			double loadTime=0;
+			int retVal=model_load(warmup->shadow, model, true, &loadTime);
+			pthread_mutex_lock(&warmup->mutex);
+			// Canceled by OCl_warmup_stop(): neither a load nor a failure.
+			if(!warmup->running) break;
+			now=ocl_now();
+			if(retVal==OCL_RETURN_OK){
+				entry->stats.loads++;
+				entry->stats.lastLoadTime=loadTime;
+				entry->stats.totalLoadTime+=loadTime;
+				if(loadTime>entry->stats.maxLoadTime) entry->stats.maxLoadTime=loadTime;
+				entry->stats.lastLoadAt=time(NULL);
+				entry->nextRenewal=now+renewal;
+			}else{
+				entry->stats.failures++;
+				entry->nextRenewal=now+OCL_WARMUP_RETRY_S;
+			}
+			if(entry->nextRenewal<nextWake) nextWake=entry->nextRenewal;
+		}
+		if(!warmup->running) break;
+		double wait=nextWake-ocl_now();
+		if(wait<=0) continue;
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec+=(time_t) wait;
+		until.tv_nsec+=(long) ((wait-(time_t) wait)*1000000000.0);
+		if(until.tv_nsec>=1000000000L){
+			until.tv_sec++;
+			until.tv_nsec-=1000000000L;
+		}
+		pthread_cond_timedwait(&warmup->cond, &warmup->mutex, &until);
+	}
+	pthread_mutex_unlock(&warmup->mutex);
+	return NULL;
+}
+
+/*
+ * Called on every chat: feeds OCL_WARMUP_ON_USAGE and wakes the scheduler up when a cold model starts being used.
+ */
+static void warmup_touch(OCl *ocl){
+	if(ocl->warmup==NULL) return;
+	pthread_mutex_lock(&ocl->warmup->mutex);
+	for(int i=0;i<ocl->warmup->cantEntries;i++){
+		WarmupEntry *entry=&ocl->warmup->entries[i];
+		if(strcmp(entry->model, ocl->model)!=0) continue;
+		entry->lastUsed=ocl_now();
+		if(entry->policy==OCL_WARMUP_ON_USAGE && entry->nextRenewal==0) pthread_cond_signal(&ocl->warmup->cond);
+	}
+	pthread_mutex_unlock(&ocl->warmup->mutex);
+}
+
+int OCl_warmup_add(OCl *ocl, const char *model, int policy, int from, int to){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(model==NULL || strcmp(model,"")==0 || strlen(model)>=512 || policy<OCL_WARMUP_ALWAYS || policy>OCL_WARMUP_SCHEDULE
+			|| (policy==OCL_WARMUP_ON_USAGE && from<1)
+			|| (policy==OCL_WARMUP_SCHEDULE && (from<0 || from>=24*60 || to<0 || to>=24*60))) return OCL_ERR_WARMUP;
+	if(ocl->warmup==NULL){
+		if((ocl->warmup=calloc(1, sizeof(struct _ocl_warmup)))==NULL) return OCL_ERR_MALLOC;
+		pthread_mutex_init(&ocl->warmup->mutex, NULL);
+		pthread_cond_init(&ocl->warmup->cond, NULL);
+	}
+	pthread_mutex_lock(&ocl->warmup->mutex);
+	if(ocl->warmup->cantEntries>=OCL_MAX_WARMUP_MODELS){
+		pthread_mutex_unlock(&ocl->warmup->mutex);
+		return OCL_ERR_WARMUP;
+	}
+	WarmupEntry *entry=&ocl->warmup->entries[ocl->warmup->cantEntries++];
+	memset(entry, 0, sizeof(WarmupEntry));
+	snprintf(entry->model, sizeof(entry->model), "%s", model);
+	entry->policy=policy;
+	entry->from=from;
+	entry->to=to;
+	pthread_cond_signal(&ocl->warmup->cond);
+	pthread_mutex_unlock(&ocl->warmup->mutex);
+	return OCL_RETURN_OK;
+}
+
+int OCl_warmup_start(OCl *ocl){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(ocl->warmup==NULL || ocl->warmup->running) return OCL_ERR_WARMUP;
+	if((ocl->warmup->shadow=ocl_shadow_new(ocl))==NULL) return OCL_ERR_MALLOC;
+	ocl->warmup->running=true;
+	if(pthread_create(&ocl->warmup->thread, NULL, warmup_loop, ocl->warmup)!=0){
+		ocl->warmup->running=false;
+		ocl_shadow_free(ocl->warmup->shadow);
+		ocl->warmup->shadow=NULL;
+		return OCL_ERR_WARMUP;
+	}
+	return OCL_RETURN_OK;
+}
+
+int OCl_warmup_stop(OCl *ocl){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(ocl->warmup==NULL) return OCL_RETURN_OK;
+	pthread_mutex_lock(&ocl->warmup->mutex);
+	bool running=ocl->warmup->running;
+	ocl->warmup->running=false;
+	pthread_cond_signal(&ocl->warmup->cond);
+	pthread_mutex_unlock(&ocl->warmup->mutex);
+	// A load in progress would keep the thread up to the load timeout: its connection is closed.
+	if(running){
+		OCl_cancel(ocl->warmup->shadow);
+		pthread_join(ocl->warmup->thread, NULL);
+	}
+	ocl_shadow_free(ocl->warmup->shadow);
+	ocl->warmup->shadow=NULL;
+	return OCL_RETURN_OK;
+}
+
+int OCl_warmup_get_stats(OCl *ocl, const char *model, OCl_warmup_stats *stats){
+	if(ocl==NULL || stats==NULL) return OCL_ERR_NULL_STRUCT;
+	if(ocl->warmup==NULL) return OCL_ERR_WARMUP;
+	int retVal=OCL_ERR_WARMUP;
+	pthread_mutex_lock(&ocl->warmup->mutex);
+	for(int i=0;i<ocl->warmup->cantEntries && retVal!=OCL_RETURN_OK;i++){
+		if(strcmp(ocl->warmup->entries[i].model, model)!=0) continue;
+		*stats=ocl->warmup->entries[i].stats;
+		retVal=OCL_RETURN_OK;
+	}
+	pthread_mutex_unlock(&ocl->warmup->mutex);
+	return retVal;
+}
+
+static void warmup_free(OCl *ocl){
+	if(ocl->warmup==NULL) return;
+	OCl_warmup_stop(ocl);
+	pthread_mutex_destroy(&ocl->warmup->mutex);
+	pthread_cond_destroy(&ocl->warmup->cond);
+	sfree(ocl->warmup);
+	ocl->warmup=NULL;
+}
+
+
+/*
+ * Models registry: /api/tags and /api/ps parsed once into a table sorted by name, and hashed by exact name. It's
+ * refreshed on demand when older than OCL_MODELS_TTL_S or, if 'OCl_set_models_refresh()' was set, by a background
+ * thread working on a shadow instance (so the caller's response buffers are never touched from there).
+ */
+typedef struct{
+	OCl_model_info info;
+	int nextInBucket;
+}ModelEntry;
+
+typedef struct{
+	ModelEntry *entries;
+	int cant;
+	int buckets[OCL_MODELS_BUCKETS];
+}ModelTable;
+
+struct _ocl_models{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	ModelTable *table;
+	double refreshedAt;
+	int interval;
+	bool running;
+	pthread_t thread;
+	OCl *shadow;
+};
+
+static unsigned int model_hash(char const *name){
+	unsigned int hash=2166136261u;
+	for(;*name;name++) hash=(hash^(unsigned char) *name)*16777619u;
+	return hash&(OCL_MODELS_BUCKETS-1);
+}
+
+static void model_table_free(ModelTable *table){
+	if(table==NULL) return;
+	sfree(table->entries);
+	sfree(table);
+}
+
+static ModelEntry *model_table_find(ModelTable *table, char const *name){
+	if(table==NULL) return NULL;
+	for(int i=table->buckets[model_hash(name)];i>=0;i=table->entries[i].nextInBucket){
+		if(strcmp(table->entries[i].info.name, name)==0) return &table->entries[i];
+	}
+	// 'llama3' is 'llama3:latest' for the server.
+	if(strchr(name, ':')==NULL){
+		char latest[512]="";
+		snprintf(latest, sizeof(latest), "%s:latest", name);
+		for(int i=table->buckets[model_hash(latest)];i>=0;i=table->entries[i].nextInBucket){
+			if(strcmp(table->entries[i].info.name, latest)==0) return &table->entries[i];
+		}
+	}
+	return NULL;
+}
+
+static int model_entry_compare(void const *a, void const *b){
+	return strcmp(((ModelEntry const *) a)->info.name, ((ModelEntry const *) b)->info.name);
+}
+
+/*
+ * Server responses may be chunked: the body is de-chunked through a fresh HttpStream before being parsed.
+ */
+static char *http_response_body(char const *response){
+	HttpStream hs={0};
+	if(http_stream_feed(&hs, response, strlen(response))!=OCL_RETURN_OK || !hs.headersParsed
+			|| hs.statusCode<200 || hs.statusCode>299){
+		http_stream_free(&hs);
+		return NULL;
+	}
+	char *body=hs.body;
+	hs.body=NULL;
+	http_stream_free(&hs);
+	if(body==NULL) body=calloc(1,1);
+	return body;
+}
+
+static int models_parse(char *json, ModelTable *table, int *size, bool loaded){
+	char const *nameToken="\"name\":\"";
+	char *model=strstr(json, nameToken);
+	while(model!=NULL){
+		char *nextModel=strstr(model+1, nameToken);
+		if(nextModel!=NULL) nextModel[0]=0;
+		char name[512]="", result[128]="";
+		get_string_from_token(model, nameToken, name, sizeof(name), '"', 0);
+		ModelEntry *entry=NULL;
+		for(int i=0;i<table->cant && entry==NULL;i++) if(strcmp(table->entries[i].info.name, name)==0) entry=&table->entries[i];
+		if(entry==NULL){
+			if(table->cant>=OCL_MAX_MODELS) break;
+			if(table->cant>=*size){
+				*size=(*size==0)?32:*size*2;
+				ModelEntry *entries=realloc(table->entries, *size*sizeof(ModelEntry));
+				if(entries==NULL) return OCL_ERR_REALLOC;
+				table->entries=entries;
+			}
+			entry=&table->entries[table->cant++];
+			memset(entry, 0, sizeof(ModelEntry));
+			snprintf(entry->info.name, sizeof(entry->info.name), "%s", name);
+		}
+		// In /api/ps, 'size' is the memory used: the one of /api/tags is kept.
+		if(entry->info.size==0 && get_string_from_token(model, "\"size\":", result, sizeof(result), ',', '}'))
+			entry->info.size=strtol(result, NULL, 10);
+		if(entry->info.digest[0]==0) get_string_from_token(model, "\"digest\":\"", entry->info.digest, sizeof(entry->info.digest), '"', 0);
+		if(loaded){
+			entry->info.loaded=true;
+			get_string_from_token(model, "\"expires_at\":\"", entry->info.expiresAt, sizeof(entry->info.expiresAt), '"', 0);
+			if(get_string_from_token(model, "\"context_length\":", result, sizeof(result), ',', '}'))
+				entry->info.contextLength=strtol(result, NULL, 10);
+		}
+		if(nextModel!=NULL) nextModel[0]='"';
+		model=nextModel;
+	}
+	return OCL_RETURN_OK;
+}
+
+static int models_fetch(OCl *ocl, ModelTable **table){
+	char const *paths[]={"/api/tags","/api/ps"};
+	int retVal=OCL_RETURN_OK, size=0;
+	if((*table=calloc(1, sizeof(ModelTable)))==NULL) return OCL_ERR_MALLOC;
+	for(int p=0;p<2 && retVal==OCL_RETURN_OK;p++){
+		char msg[BUFFER_SIZE_16K]="", host[OCL_HOST_SIZE];
+		snprintf(msg,sizeof(msg),
+				"GET %s HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"Authorization: Bearer %s\r\n\r\n",paths[p],http_host(ocl->srvAddr, host, sizeof(host)),ocl->apiKey);
+		if((retVal=send_message(ocl, msg, strlen(msg), NULL, NULL))<=0){
+			if(retVal==0) retVal=OCL_ERR_GETTING_MODELS;
+			break;
+		}
+		char *body=http_response_body(ocl->ocl_resp->response);
+		if(body==NULL){
+			retVal=OCL_ERR_GETTING_MODELS;
+			break;
+		}
+		retVal=models_parse(body, *table, &size, p==1);
+		sfree(body);
+	}
+	if(retVal<0 || (*table)->cant==0){
+		bool empty=(retVal>=0);
+		model_table_free(*table);
+		*table=NULL;
+		if(!empty) return retVal;
+		if((*table=calloc(1, sizeof(ModelTable)))==NULL) return OCL_ERR_MALLOC;
 	}
-	fcntl(socketConn, F_SETFL, socketFlags & ~O_NONBLOCK);
-	return socketConn;
+	if((*table)->cant>1) qsort((*table)->entries, (*table)->cant, sizeof(ModelEntry), model_entry_compare);
+	for(int i=0;i<OCL_MODELS_BUCKETS;i++) (*table)->buckets[i]=-1;
+	for(int i=0;i<(*table)->cant;i++){
+		unsigned int bucket=model_hash((*table)->entries[i].info.name);
+		(*table)->entries[i].nextInBucket=(*table)->buckets[bucket];
+		(*table)->buckets[bucket]=i;
+	}
+	return OCL_RETURN_OK;
 }
 
-static int send_message(OCl *ocl, char const *payload, void (*callback)(const char *, bool, int)){
-	oclSslError=0;
-	int socketConn=create_connection(ocl->srvAddr, ocl->srvPort, ocl->socketConnectTimeout);
-	if(socketConn<=0) return socketConn;
-	if(oclSslCtx==NULL) return OCL_ERR_SSLCTX_NULL;
-	SSL *sslConn=NULL;
-	if((sslConn=SSL_new(oclSslCtx))==NULL){
-		clean_ssl(sslConn);
-		return OCL_ERR_SSL_CONTEXT;
+static void models_swap(struct _ocl_models *models, ModelTable *table){
+	pthread_mutex_lock(&models->mutex);
+	for(int i=0;i<table->cant;i++){
+		ModelEntry const *old=model_table_find(models->table, table->entries[i].info.name);
+		if(old!=NULL && table->entries[i].info.contextLength==0
+				&& strcmp(old->info.digest, table->entries[i].info.digest)==0)
+			table->entries[i].info.contextLength=old->info.contextLength;
 	}
-	if(!SSL_set_fd(sslConn, socketConn)){
-		clean_ssl(sslConn);
-		return OCL_ERR_SSL_FD;
+	model_table_free(models->table);
+	models->table=table;
+	models->refreshedAt=ocl_now();
+	pthread_mutex_unlock(&models->mutex);
+}
+
+static int models_init(OCl *ocl){
+	if(ocl->models!=NULL) return OCL_RETURN_OK;
+	if((ocl->models=calloc(1, sizeof(struct _ocl_models)))==NULL) return OCL_ERR_MALLOC;
+	pthread_mutex_init(&ocl->models->mutex, NULL);
+	pthread_cond_init(&ocl->models->cond, NULL);
+	return OCL_RETURN_OK;
+}
+
+static void *models_refresh_loop(void *arg){
+	struct _ocl_models *models=arg;
+	pthread_mutex_lock(&models->mutex);
+	while(models->running){
+		pthread_mutex_unlock(&models->mutex);
+		ModelTable *table=NULL;
+		if(models_fetch(models->shadow, &table)==OCL_RETURN_OK) models_swap(models, table);
+		pthread_mutex_lock(&models->mutex);
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec+=models->interval;
+		while(models->running && pthread_cond_timedwait(&models->cond, &models->mutex, &until)!=ETIMEDOUT);
 	}
-	SSL_set_connect_state(sslConn);
-	SSL_set_tlsext_host_name(sslConn, ocl->srvAddr);
-	int retVal=0;
-	if((retVal=SSL_connect(sslConn))<1){
-		oclSslError=ERR_get_error();
-		clean_ssl(sslConn);
-		return OCL_ERR_SSL_CONNECT;
+	pthread_mutex_unlock(&models->mutex);
+	return NULL;
+}
+
+static void models_stop_refreshing(struct _ocl_models *models){
+	pthread_mutex_lock(&models->mutex);
+	bool running=models->running;
+	models->running=false;
+	pthread_cond_signal(&models->cond);
+	pthread_mutex_unlock(&models->mutex);
+	if(running) pthread_join(models->thread, NULL);
+	ocl_shadow_free(models->shadow);
+	models->shadow=NULL;
+}
+
+static void models_free(OCl *ocl){
+	if(ocl->models==NULL) return;
+	models_stop_refreshing(ocl->models);
+	model_table_free(ocl->models->table);
+	pthread_mutex_destroy(&ocl->models->mutex);
+	pthread_cond_destroy(&ocl->models->cond);
+	sfree(ocl->models);
+	ocl->models=NULL;
+}
+
+/*
+ * Refreshes the registry if it's stale (or 'force'). With background refresh the table is never considered stale
+ * once loaded.
+ */
+static int models_update(OCl *ocl, bool force){
+	int retVal=models_init(ocl);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	pthread_mutex_lock(&ocl->models->mutex);
+	bool stale=ocl->models->table==NULL
+			|| (!ocl->models->running && ocl_now()-ocl->models->refreshedAt>=OCL_MODELS_TTL_S);
+	pthread_mutex_unlock(&ocl->models->mutex);
+	if(!stale && !force) return OCL_RETURN_OK;
+	ModelTable *table=NULL;
+	if((retVal=models_fetch(ocl, &table))!=OCL_RETURN_OK) return retVal;
+	models_swap(ocl->models, table);
+	return OCL_RETURN_OK;
+}
+
+int OCl_set_models_refresh(OCl *ocl, int interval){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(interval<0) return OCL_ERR_MODELS_REFRESH_NOT_VALID;
+	int retVal=models_init(ocl);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	models_stop_refreshing(ocl->models);
+	if(interval==0) return OCL_RETURN_OK;
+	if((ocl->models->shadow=ocl_shadow_new(ocl))==NULL) return OCL_ERR_MALLOC;
+	ocl->models->interval=interval;
+	ocl->models->running=true;
+	if(pthread_create(&ocl->models->thread, NULL, models_refresh_loop, ocl->models)!=0){
+		ocl->models->running=false;
+		ocl_shadow_free(ocl->models->shadow);
+		ocl->models->shadow=NULL;
+		return OCL_ERR_MODELS_REFRESH_NOT_VALID;
 	}
-	struct pollfd po[1];
-	po[0].fd=socketConn;
-	po[0].events=POLLOUT;
-	size_t totalBytesSent=0;
-	while(totalBytesSent<strlen(payload)){
-		retVal=poll(po,1,ocl->socketSendTimeout*1000);
-		if (retVal<=0){
-			clean_ssl(sslConn);
-			close(socketConn);
-			if(retVal==0) return OCL_ERR_SEND_TIMEOUT;
-			return OCL_ERR_POLLOUT;
+	return OCL_RETURN_OK;
+}
+
+int OCl_refresh_models(OCl *ocl){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	return models_update(ocl, true);
+}
+
+static int model_fetch_context_length(OCl *ocl, char const *name){
+	char body[BUFFER_SIZE_1K]="", msg[BUFFER_SIZE_16K]="", result[128]="", host[OCL_HOST_SIZE];
+	snprintf(body,sizeof(body),"{\"model\": \"%s\"}",name);
+	snprintf(msg,sizeof(msg),
+			"POST /api/show HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Authorization: Bearer %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %d\r\n\r\n"
+			"%s",http_host(ocl->srvAddr, host, sizeof(host)),ocl->apiKey,(int) strlen(body), body);
+	int retVal=send_message(ocl, msg, strlen(msg), NULL, NULL);
+	if(retVal<=0) return (retVal==0)?OCL_ERR_GETTING_MODELS:retVal;
+	char *response=http_response_body(ocl->ocl_resp->response);
+	if(response==NULL) return OCL_ERR_GETTING_MODELS;
+	int contextLength=0;
+	if(get_string_from_token(response, "context_length\":", result, sizeof(result), ',', '}')) contextLength=strtol(result, NULL, 10);
+	sfree(response);
+	return contextLength;
+}
+
+int OCl_get_model_info(OCl *ocl, const char *name, OCl_model_info *info, bool withContextLength){
+	if(ocl==NULL || info==NULL) return OCL_ERR_NULL_STRUCT;
+	int retVal=models_update(ocl, false);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	pthread_mutex_lock(&ocl->models->mutex);
+	ModelEntry const *entry=model_table_find(ocl->models->table, name);
+	if(entry!=NULL) *info=entry->info;
+	pthread_mutex_unlock(&ocl->models->mutex);
+	if(entry==NULL) return OCL_ERR_MODEL_NOT_FOUND;
+	if(!withContextLength || info->contextLength!=0) return OCL_RETURN_OK;
+	int contextLength=model_fetch_context_length(ocl, info->name);
+	if(contextLength<0) return contextLength;
+	info->contextLength=contextLength;
+	pthread_mutex_lock(&ocl->models->mutex);
+	ModelEntry *current=model_table_find(ocl->models->table, info->name);
+	if(current!=NULL) current->info.contextLength=contextLength;
+	pthread_mutex_unlock(&ocl->models->mutex);
+	return OCL_RETURN_OK;
+}
+
+int OCl_get_models(OCl *ocl, char(*models)[512]){
+	int retVal=models_update(ocl, false);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	pthread_mutex_lock(&ocl->models->mutex);
+	int cantModels=ocl->models->table->cant;
+	for(int i=0;i<cantModels;i++) snprintf(models[i], 512, "%s", ocl->models->table->entries[i].info.name);
+	pthread_mutex_unlock(&ocl->models->mutex);
+	return cantModels;
+}
+
+/*
+ * Embeddings: the inputs are packed into batches (by count and bytes) and sent to '/api/embed' by a few workers, each
+ * one on its own keep-alive connection (spread across the endpoints) with up to OCL_EMBED_PIPELINE_DEPTH requests in
+ * flight. The vectors are parsed straight into the caller's array (row i at vectors+i*dimensions) and/or written to
+ * 'outFile': "OCLEMB01", int32 rows, int32 dimensions, and the float32 rows.
+ */
+typedef struct{
+	const char **inputs;
+	float *vectors;
+	int dimensions;
+	int fd;
+	int *batches;
+	int cantBatches;
+	int maxBatchInputs;
+	atomic_int nextBatch;
+	atomic_int error;
+	pthread_mutex_t mutex;
+	char errorMsg[BUFFER_SIZE_1K];
+}EmbedJob;
+
+typedef struct{
+	EmbedJob *job;
+	OCl *shadow;
+	int slot;
+	pthread_t thread;
+	char *body;
+	size_t bodyLen;
+	size_t bodySize;
+	float *scratch;
+	int connRequests;
+}EmbedWorker;
+
+static int embed_parse(char const *json, float *vectors, int maxVectors, int *dimensions){
+	char const *p=strstr(json, "\"embeddings\":");
+	if(p==NULL || (p=strchr(p, '['))==NULL) return OCL_ERR_EMBED;
+	p++;
+	int cant=0;
+	while(true){
+		while(isspace((unsigned char) *p) || *p==',') p++;
+		if(*p==']') break;
+		if(*p!='[' || cant>=maxVectors) return OCL_ERR_EMBED;
+		p++;
+		int dims=0;
+		while(true){
+			while(isspace((unsigned char) *p) || *p==',') p++;
+			if(*p==']'){
+				p++;
+				break;
+			}
+			char *end=NULL;
+			float value=strtof(p, &end);
+			if(end==p) return OCL_ERR_EMBED;
+			if(*dimensions>0 && dims>=*dimensions) return OCL_ERR_EMBED_DIMENSIONS;
+			if(vectors!=NULL) vectors[(size_t) cant*(*dimensions)+dims]=value;
+			dims++;
+			p=end;
 		}
-		if(po[0].revents && POLLOUT) totalBytesSent+=SSL_write(sslConn, payload+totalBytesSent, strlen(payload)-totalBytesSent);
+		if(*dimensions==0) *dimensions=dims;
+		if(dims!=*dimensions) return OCL_ERR_EMBED_DIMENSIONS;
+		cant++;
 	}
-	ssize_t bytesReceived=0,totalBytesReceived=0;
-	ocl->ocl_resp->thoughts[0]=0;
-	ocl->ocl_resp->content[0]=0;
-	ocl->ocl_resp->response[0]=0;
-	for(int i=0;i<512;i++) memset(ocl->ocl_resp->toolCalls[i],0,512);
-	memset(ocl->ocl_resp->error,0,BUFFER_SIZE_1K);
-	ocl->ocl_resp->done=false;
-	long int bufferAssigned=BUFFER_SIZE_1M;
-	int reAttempts=0;
+	return cant;
+}
+
+static int embed_send(EmbedWorker *worker, SSL *sslConn, int socketConn, char const *srvAddr, int batch){
+	OCl *ocl=worker->shadow;
+	EmbedJob *job=worker->job;
+	char header[BUFFER_SIZE_2K]="", host[OCL_HOST_SIZE];
+	worker->bodyLen=0;
+	int retVal=OCL_RETURN_OK;
+	snprintf(header, sizeof(header), "{\"model\":\"%s\",\"keep_alive\":%d,\"input\":[", ocl->model, ocl->keepalive);
+	retVal=buffer_append(NULL, &worker->body, &worker->bodyLen, &worker->bodySize, header, strlen(header));
+	for(int i=job->batches[batch];i<job->batches[batch+1] && retVal==OCL_RETURN_OK;i++){
+		if(i>job->batches[batch]) retVal=buffer_append(NULL, &worker->body, &worker->bodyLen, &worker->bodySize, ",\"", 2);
+		else retVal=buffer_append(NULL, &worker->body, &worker->bodyLen, &worker->bodySize, "\"", 1);
+		if(retVal==OCL_RETURN_OK) retVal=json_escape_append(NULL, &worker->body, &worker->bodyLen, &worker->bodySize, job->inputs[i]
+				, strlen(job->inputs[i]));
+		if(retVal==OCL_RETURN_OK) retVal=buffer_append(NULL, &worker->body, &worker->bodyLen, &worker->bodySize, "\"", 1);
+	}
+	if(retVal==OCL_RETURN_OK) retVal=buffer_append(NULL, &worker->body, &worker->bodyLen, &worker->bodySize, "]}", 2);
+	if(retVal!=OCL_RETURN_OK) return retVal;
+	snprintf(header, sizeof(header),
+			"POST %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"User-agent: Ollama-C-lient/%s (Linux; x64)\r\n"
+			"Accept: */*\r\n"
+			"Content-Type: application/json; charset=utf-8\r\n"
+			"Authorization: Bearer %s\r\n"
+			"Content-Length: %zu\r\n\r\n"
+			,OCL_EMBED_ENDPOINT
+			,http_host(srvAddr, host, sizeof(host))
+			,OCL_VERSION
+			,ocl->apiKey
+			,worker->bodyLen);
+	if(metrics_on()){
+		metrics_add(&oclMetrics.requests, 1);
+		if(worker->connRequests>0) metrics_add(&oclMetrics.connectionsReused, 1);
+	}
+	worker->connRequests++;
+	if((retVal=ssl_send(ocl, sslConn, socketConn, header, strlen(header)))!=OCL_RETURN_OK) return retVal;
+	return ssl_send(ocl, sslConn, socketConn, worker->body, worker->bodyLen);
+}
+
+static int embed_receive(OCl *ocl, SSL *sslConn, int socketConn, HttpStream *hs, bool *received){
+	int retVal=http_stream_feed(hs, "", 0);
 	struct pollfd pi[1];
 	pi[0].fd=socketConn;
 	pi[0].events=POLLIN;
-	while(true && !oclCanceled){
-		retVal=poll(pi,1,ocl->socketRecvTimeout*1000);
-		if (retVal<=0){
-			close(socketConn);
-			clean_ssl(sslConn);
-			if(retVal==0) return OCL_ERR_RECV_TIMEOUT;
-			return OCL_ERR_POLLIN;
-		}
-		if(pi[0].revents && POLLIN){
-			char buffer[BUFFER_SIZE_16K]="";
-			bytesReceived=SSL_read(sslConn,buffer, BUFFER_SIZE_16K);
-			if(bytesReceived<0){
-				oclSslError=SSL_get_error(sslConn, bytesReceived);
-				clean_ssl(sslConn);
-				return OCL_ERR_RECEIVING_PACKETS;
-			}
-			if(bytesReceived==0) break;
-			if(bytesReceived>0){
-				reAttempts=0;
-				totalBytesReceived+=bytesReceived;
-				if(totalBytesReceived>bufferAssigned){
-					bufferAssigned*=2;
-					ocl->ocl_resp->thoughts=realloc(ocl->ocl_resp->thoughts,bufferAssigned);
-					ocl->ocl_resp->response=realloc(ocl->ocl_resp->response,bufferAssigned);
-					ocl->ocl_resp->content=realloc(ocl->ocl_resp->content,bufferAssigned);
-					if(!ocl->ocl_resp->thoughts || !ocl->ocl_resp->response || !ocl->ocl_resp->content){
-						close(socketConn);
-						clean_ssl(sslConn);
-						return OCL_ERR_REALLOC;
-					}
-				}
-				strncat(ocl->ocl_resp->response,buffer, bufferAssigned-1);
-				char token[1024]="";
-				if(get_string_from_token(buffer, "\"thinking\":\"", token, '"',0)){
-					strncat(ocl->ocl_resp->thoughts,token, bufferAssigned-1);
-					if(callback!=NULL) callback(token, ocl->ocl_resp->done, OCL_THINKING_TYPE);
-					continue;
-				}
-				if(get_string_from_token(buffer, "\"tool_calls\":\[", token, ']',0)){
-					strncat(ocl->ocl_resp->toolCalls[ocl->ocl_resp->contTools],token,BUFFER_SIZE_1K-1);
-					strncat(ocl->ocl_resp->toolCalls[ocl->ocl_resp->contTools],"}}}",BUFFER_SIZE_1K-1);
-					ocl->ocl_resp->contTools++;
-					if(callback!=NULL) callback(ocl->ocl_resp->toolCalls[ocl->ocl_resp->contTools-1], ocl->ocl_resp->done, OCL_TOOL_TYPE);
-					continue;
-				}
-				if(get_string_from_token(buffer, "\"content\":\"", token, '"',0)){
-					if(strstr(buffer,"\"done\":true")!=NULL || strstr(buffer,"\"done\": true")!=NULL) ocl->ocl_resp->done=true;
-					if(callback!=NULL) callback(token, ocl->ocl_resp->done, OCL_CONTENT_TYPE);
-					strncat(ocl->ocl_resp->content,token, bufferAssigned-1);
-					if(ocl->ocl_resp->done){
-						char result[128]="";
-						if(get_string_from_token(buffer, "\"load_duration\":", result, ',',0)) ocl->ocl_resp->loadDuration=strtod(result,NULL)/1000000000.0;
-						if(get_string_from_token(buffer, "\"prompt_eval_duration\":", result, ',',0)) ocl->ocl_resp->promptEvalDuration=strtod(result,NULL)/1000000000.0;
-						if(get_string_from_token(buffer, "\"eval_duration\":", result, '}',0)) ocl->ocl_resp->evalDuration=strtod(result,NULL)/1000000000.0;
-						if(get_string_from_token(buffer, "\"total_duration\":", result, ',',0)) ocl->ocl_resp->totalDuration=strtod(result,NULL)/1000000000.0;
-						if(get_string_from_token(buffer, "\"prompt_eval_count\":", result, ',',0)) ocl->ocl_resp->promptEvalCount=strtol(result,NULL,10);
-						if(get_string_from_token(buffer, "\"eval_count\":", result, '}',',')) ocl->ocl_resp->evalCount=strtol(result,NULL,10);
-						if(ocl->ocl_resp->evalDuration!=0) ocl->ocl_resp->tokensPerSec=ocl->ocl_resp->evalCount/ocl->ocl_resp->evalDuration;
-						break;
-					}
-					continue;
-				}
-				if(strstr(ocl->ocl_resp->response,"{\"models\":[{\"")!=NULL){
-					if(strstr(ocl->ocl_resp->response,"}}]}")!=NULL) break;
-					continue;
-				}
-				char httpResponse[128]="";
-				for(int i=0;buffer[i]!='\r' && buffer[i]!='\n';i++) httpResponse[i]=buffer[i];
-				if(strstr(httpResponse, "HTTP/1.1 5")){
-					snprintf(ocl->ocl_resp->error,BUFFER_SIZE_1K,"%s", httpResponse);
-					close(socketConn);
-					clean_ssl(sslConn);
-					return OCL_ERR_SERVICE_UNAVAILABLE;
-				}
-				char err[512]="";
-				if(get_string_from_token(buffer,"{\"error\":", err,'}',0) || get_string_from_token(buffer,"\r\n\r\n", err,'\n',0)){
-					snprintf(ocl->ocl_resp->error,BUFFER_SIZE_1K,"%s: %s", httpResponse, err);
-					close(socketConn);
-					clean_ssl(sslConn);
-					return OCL_ERR_MSG_FOUND;
-				}
-				if(strcmp(httpResponse,"HTTP/1.1 200 OK")==0) return OCL_RETURN_OK;
-				if(++reAttempts<3) continue;
-				close(socketConn);
-				clean_ssl(sslConn);
-				return OCL_ERR_UNKNOWN;
-			}
+	while(!hs->finished && retVal==OCL_RETURN_OK && !ocl_canceled(ocl)){
+		if(SSL_pending(sslConn)==0){
+			int waited=0;
+			while((retVal=poll(pi,1,OCL_POLL_SLICE_MS))==0 && !ocl_canceled(ocl)
+					&& (waited+=OCL_POLL_SLICE_MS)<ocl->socketRecvTimeout*1000);
+			if(ocl_canceled(ocl)) return OCL_RETURN_OK;
+			if(retVal<=0) return (retVal==0)?OCL_ERR_RECV_TIMEOUT:OCL_ERR_POLLIN;
+			retVal=OCL_RETURN_OK;
+			if(!(pi[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
 		}
+		char buffer[BUFFER_SIZE_16K];
+		int bytesReceived=SSL_read(sslConn, buffer, BUFFER_SIZE_16K);
+		if(bytesReceived<0){
+			oclSslError=SSL_get_error(sslConn, bytesReceived);
+			return OCL_ERR_RECEIVING_PACKETS;
+		}
+		if(bytesReceived==0){
+			if(hs->headersParsed && !hs->chunked && hs->contentLength<0) break;
+			return (*received)?OCL_ERR_PARTIAL_RESPONSE_RECV:OCL_ERR_ZEROBYTESRECV;
+		}
+		*received=true;
+		if(metrics_on()) metrics_add(&oclMetrics.bytesRecv, bytesReceived);
+		retVal=http_stream_feed(hs, buffer, bytesReceived);
 	}
-	close(socketConn);
-	clean_ssl(sslConn);
-	return totalBytesReceived;
+	if(retVal!=OCL_RETURN_OK || ocl_canceled(ocl)) return retVal;
+	if(hs->statusCode<200 || hs->statusCode>299){
+		char err[512]="";
+		if(hs->body==NULL || !get_string_from_token(hs->body, "{\"error\":", err, 512, '}', 0)) snprintf(err, 512, "%s", "");
+		snprintf(ocl->ocl_resp->error, BUFFER_SIZE_1K, "%s: %s", hs->status, err);
+		return (hs->statusCode>=500)?OCL_ERR_SERVICE_UNAVAILABLE:OCL_ERR_MSG_FOUND;
+	}
+	return OCL_RETURN_OK;
 }
 
-static char encoding_table[]=
-{'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-		'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-		'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-		'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-		'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-		'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-		'w', 'x', 'y', 'z', '0', '1', '2', '3',
-		'4', '5', '6', '7', '8', '9', '+', '/'};
-
-static char *decoding_table=NULL;
-static int mod_table[]={0,2,1};
-
-void build_decoding_table() {
-	decoding_table = malloc(256);
-	for (int i=0;i<64;i++) decoding_table[(unsigned char) encoding_table[i]] = i;
+static int embed_store(EmbedWorker *worker, HttpStream *hs, int batch){
+	EmbedJob *job=worker->job;
+	int start=job->batches[batch], cant=job->batches[batch+1]-start, dimensions=job->dimensions;
+	float *vectors=(job->vectors!=NULL)?job->vectors+(size_t) start*dimensions:worker->scratch;
+	int retVal=embed_parse((hs->body!=NULL)?hs->body:"", vectors, cant, &dimensions);
+	if(retVal<0) return retVal;
+	if(retVal!=cant) return OCL_ERR_EMBED;
+	if(job->fd<0) return OCL_RETURN_OK;
+	size_t len=(size_t) cant*dimensions*sizeof(float), written=0;
+	off_t offset=16+(off_t) start*dimensions*sizeof(float);
+	while(written<len){
+		ssize_t bytesWritten=pwrite(job->fd, (char *) vectors+written, len-written, offset+written);
+		if(bytesWritten<0){
+			if(errno==EINTR) continue;
+			return OCL_ERR_OPENING_FILE;
+		}
+		written+=bytesWritten;
+	}
+	return OCL_RETURN_OK;
 }
 
-int base64_encode(const char* fileName, size_t *outLen, char **encodedData) {
-	FILE *f=fopen(fileName, "rb");
-	if(f==NULL) return OCL_ERR_IMAGE_FILE;
-	fseek(f,0,SEEK_END);
-	size_t inLen=ftell(f);
-	rewind(f);
-	unsigned char *data=malloc(inLen);
-	size_t br=fread(data,1,inLen,f);
-	if (br!=inLen) {
-		sfree(data);
-		fclose(f);
-		return OCL_ERR_IMAGE_FILE;
+/*
+ * Responses come back in order, so the batches in flight are a FIFO. If the connection is found closed (v.gr. an idle
+ * keep-alive timed out by the server) before the response started, it's re-opened once and the batches re-sent.
+ */
+static int embed_run(EmbedWorker *worker){
+	OCl *ocl=worker->shadow;
+	EmbedJob *job=worker->job;
+	char srvAddr[512]="";
+	int srvPort=0, index=endpoint_index(ocl, worker->slot);
+	pthread_mutex_lock(&oclEndpoints.mutex);
+	snprintf(srvAddr, sizeof(srvAddr), "%s", (index>=0)?oclEndpoints.endpoints[index].addr:ocl->srvAddr);
+	srvPort=(index>=0)?oclEndpoints.endpoints[index].port:ocl->srvPort;
+	pthread_mutex_unlock(&oclEndpoints.mutex);
+	bool admitted=false;
+	int retVal=scheduler_admit(ocl, ocl->model, ocl->tenant, &admitted);
+	if(retVal!=OCL_RETURN_OK || (ocl_canceled(ocl) && !admitted)) return retVal;
+	if(job->vectors==NULL && (worker->scratch=malloc(sizeof(float)*job->maxBatchInputs*job->dimensions))==NULL){
+		if(admitted) scheduler_release(ocl->model, ocl->tenant);
+		return OCL_ERR_MALLOC;
 	}
-	*outLen = 4*((inLen+2)/3);
-	*encodedData = malloc(*outLen);
-	if(*encodedData==NULL){
-		fclose(f);
-		sfree(data);
-		return OCL_ERR_IMAGE_FILE;
+	int socketConn=-1, inFlight[OCL_EMBED_PIPELINE_DEPTH], first=0, cantInFlight=0, reconnects=0;
+	SSL *sslConn=NULL;
+	HttpStream hs={0};
+	while(retVal==OCL_RETURN_OK && !ocl_canceled(ocl) && atomic_load(&job->error)==OCL_RETURN_OK){
+		if(socketConn<0){
+			if((retVal=ssl_open(ocl, srvAddr, srvPort, &socketConn, &sslConn))!=OCL_RETURN_OK){
+				socketConn=-1;
+				break;
+			}
+			worker->connRequests=0;
+			hs.rawLen=0;
+			http_stream_next(&hs);
+			for(int i=0;i<cantInFlight && retVal==OCL_RETURN_OK;i++){
+				retVal=embed_send(worker, sslConn, socketConn, srvAddr, inFlight[(first+i)%OCL_EMBED_PIPELINE_DEPTH]);
+			}
+		}
+		while(retVal==OCL_RETURN_OK && cantInFlight<OCL_EMBED_PIPELINE_DEPTH){
+			int batch=atomic_fetch_add(&job->nextBatch, 1);
+			if(batch>=job->cantBatches) break;
+			inFlight[(first+cantInFlight++)%OCL_EMBED_PIPELINE_DEPTH]=batch;
+			retVal=embed_send(worker, sslConn, socketConn, srvAddr, batch);
+		}
+		if(cantInFlight==0) break;
+		bool received=false;
+		if(retVal==OCL_RETURN_OK) retVal=embed_receive(ocl, sslConn, socketConn, &hs, &received);
+		if(retVal!=OCL_RETURN_OK && !received && reconnects==0 && retVal!=OCL_ERR_REALLOC && retVal!=OCL_ERR_MALLOC){
+			clean_ssl(sslConn);
+			close(socketConn);
+			socketConn=-1;
+			reconnects++;
+			retVal=OCL_RETURN_OK;
+			continue;
+		}
+		if(retVal!=OCL_RETURN_OK || ocl_canceled(ocl)) break;
+		retVal=embed_store(worker, &hs, inFlight[first]);
+		first=(first+1)%OCL_EMBED_PIPELINE_DEPTH;
+		cantInFlight--;
+		reconnects=0;
+		http_stream_next(&hs);
 	}
-	for(size_t i=0, j=0; i<inLen;) {
-		uint32_t octetA=i<inLen ? (unsigned char)data[i++] : 0;
-		uint32_t octetB=i<inLen ? (unsigned char)data[i++] : 0;
-		uint32_t octetC=i<inLen ? (unsigned char)data[i++] : 0;
-		uint32_t triple = (octetA << 0x10) + (octetB << 0x08) + octetC;
-		(*encodedData)[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
-		(*encodedData)[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
-		(*encodedData)[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
-		(*encodedData)[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
+	if(socketConn>=0){
+		clean_ssl(sslConn);
+		close(socketConn);
 	}
-	for(int i=0; i<mod_table[inLen % 3]; i++) (*encodedData)[*outLen-1-i]='=';
-	fclose(f);
-	sfree(data);
-	return OCL_RETURN_OK;
+	http_stream_free(&hs);
+	if(admitted) scheduler_release(ocl->model, ocl->tenant);
+	metrics_count_error(retVal);
+	return retVal;
 }
 
-int OCl_send_chat(OCl *ocl, const char *message, const char *imageFile, void (*callback)(const char *, bool, int)){
-	char *imageFileBase64=NULL;
-	size_t imageFileSize=0;
-	if(imageFile!=NULL){
-		int retVal=base64_encode(imageFile, &imageFileSize, &imageFileBase64);
-		if(retVal!=OCL_RETURN_OK){
-			sfree(imageFileBase64);
-			return retVal;
-		}
+static void *embed_worker(void *arg){
+	EmbedWorker *worker=arg;
+	int retVal=embed_run(worker);
+	if(retVal==OCL_RETURN_OK) return NULL;
+	int expected=OCL_RETURN_OK;
+	if(atomic_compare_exchange_strong(&worker->job->error, &expected, retVal)){
+		pthread_mutex_lock(&worker->job->mutex);
+		snprintf(worker->job->errorMsg, BUFFER_SIZE_1K, "%s", worker->shadow->ocl_resp->error);
+		pthread_mutex_unlock(&worker->job->mutex);
 	}
-	char *messageParsed=NULL;
-	OCl_parse_string(&messageParsed, message);
-	char *context=malloc(1), *buf=NULL;
-	context[0]=0;
-	char const *contextTemplate="{\"role\":\"user\",\"content\":\"%s\"},{\"role\":\"assistant\",\"content\":\"%s\"},";
-	Message *temp=ocl->rootStaticContextMessages;
-	ssize_t len=0;
-	while(temp!=NULL){
-		len=strlen(contextTemplate)+strlen(temp->userMessage)+strlen(temp->assistantMessage);
-		buf=malloc(len);
-		if(buf==NULL){
-			sfree(imageFileBase64);
-			sfree(messageParsed);
-			sfree(context);
-			return OCL_ERR_MALLOC;
-		}
-		memset(buf,0,len);
-		snprintf(buf,len,contextTemplate,temp->userMessage,temp->assistantMessage);
-		context=realloc(context, strlen(context)+strlen(buf)+1);
-		strcat(context,buf);
-		temp=temp->nextMessage;
-		sfree(buf);
-	}
-	if(message[strlen(message)-1]!=';'){
-		temp=ocl->rootContextMessages;
-		while(temp!=NULL){
-			len=strlen(contextTemplate)+strlen(temp->userMessage)+strlen(temp->assistantMessage);
-			buf=malloc(len);
-			if(buf==NULL){
-				sfree(imageFileBase64);
-				sfree(messageParsed);
-				sfree(context);
-				return OCL_ERR_MALLOC;
-			}
-			memset(buf,0,len);
-			snprintf(buf,len,contextTemplate,temp->userMessage,temp->assistantMessage);
-			context=realloc(context, strlen(context)+strlen(buf)+1);
-			strcat(context,buf);
-			temp=temp->nextMessage;
-			sfree(buf);
-		}
-	}
-	len=
-			strlen(ocl->model)
-			+sizeof(ocl->temp)
-			+sizeof(ocl->maxTokensCtx)
-			+strlen(ocl->systemRole)
-			+strlen(ocl->tools)
-			+strlen(context)
-			+strlen(messageParsed)
-			+imageFileSize
-			+512;
-	char *body=malloc(len);
-	memset(body,0,len);
-	if(imageFileBase64){
-		snprintf(body,len,
-				"{\"model\":\"%s\","
-				"\"messages\":["
-				"{\"role\":\"system\",\"content\":\"%s\"},"
-				"%s""{\"role\": \"user\",\"content\": \"%s\",\"images\": [\"%s\"]}],"
-				"\"tools\": [%s],"
-				"\"think\": %s,"
-				"\"keep_alive\": %d,"
-				"\"stream\": %s,"
-				"\"options\": {"
-				"\"temperature\": %f,"
-				"\"repeat_last_n\": %d,"
-				"\"repeat_penalty\": %f,"
-				"\"seed\": %d,"
-				"\"top_k\": %d,"
-				"\"top_p\": %f,"
-				"\"min_p\": %f,"
-				"\"num_predict\": %d,"
-				"\"num_ctx\": %d,"
-				"\"stop\": null}}",
-				ocl->model,
-				ocl->systemRole,
-				context,
-				messageParsed,
-				imageFileBase64,
-				ocl->tools,
-				ocl->think,
-				ocl->keepalive,
-				"true",
-				ocl->temp,
-				ocl->repeat_last_n,
-				ocl->repeat_penalty,
-				ocl->seed,
-				ocl->top_k,
-				ocl->top_p,
-				ocl->min_p,
-				ocl->num_predict,
-				ocl->maxTokensCtx);
-	}else{
-		snprintf(body,len,
-				"{\"model\":\"%s\","
-				"\"messages\":["
-				"{\"role\":\"system\",\"content\":\"%s\"},"
-				"%s""{\"role\": \"user\",\"content\": \"%s\"}],"
-				"\"tools\": [%s],"
-				"\"think\": %s,"
-				"\"keep_alive\": %d,"
-				"\"stream\": %s,"
-				"\"options\": {"
-				"\"temperature\": %f,"
-				"\"repeat_last_n\": %d,"
-				"\"repeat_penalty\": %f,"
-				"\"seed\": %d,"
-				"\"top_k\": %d,"
-				"\"top_p\": %f,"
-				"\"min_p\": %f,"
-				"\"num_predict\": %d,"
-				"\"num_ctx\": %d,"
-				"\"stop\": null}}",
-				ocl->model,
-				ocl->systemRole,
-				context,
-				messageParsed,
-				ocl->tools,
-				ocl->think,
-				ocl->keepalive,
-				"true",
-				ocl->temp,
-				ocl->repeat_last_n,
-				ocl->repeat_penalty,
-				ocl->seed,
-				ocl->top_k,
-				ocl->top_p,
-				ocl->min_p,
-				ocl->num_predict,
-				ocl->maxTokensCtx);
-	}
-	sfree(imageFileBase64);
-	sfree(context);
-	len=strlen(ocl->srvAddr)+sizeof(ocl->srvPort)+sizeof((int) strlen(body))+strlen(body)+512;
-	char *msg=malloc(len);
-	memset(msg,0,len);
-	snprintf(msg,len,
+	return NULL;
+}
+
+int OCl_set_embed_pipeline(OCl *ocl, int connections, int batchInputs, int batchBytes){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(connections<1 || connections>OCL_MAX_EMBED_CONNECTIONS || batchInputs<1 || batchBytes<1) return OCL_ERR_EMBED;
+	ocl->embedConnections=connections;
+	ocl->embedBatchInputs=batchInputs;
+	ocl->embedBatchBytes=batchBytes;
+	return OCL_RETURN_OK;
+}
+
+/*
+ * Embeds a short input (single request, through the endpoints' failover) to learn the model's dimensions.
+ */
+int OCl_get_embed_dimensions(OCl *ocl){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	char body[BUFFER_SIZE_1K]="", msg[BUFFER_SIZE_16K]="", host[OCL_HOST_SIZE];
+	snprintf(body, sizeof(body), "{\"model\":\"%s\",\"keep_alive\":%d,\"input\":[\".\"]}", ocl->model, ocl->keepalive);
+	snprintf(msg, sizeof(msg),
 			"POST %s HTTP/1.1\r\n"
 			"Host: %s\r\n"
 			"User-agent: Ollama-C-lient/%s (Linux; x64)\r\n"
 			"Accept: */*\r\n"
 			"Content-Type: application/json; charset=utf-8\r\n"
 			"Authorization: Bearer %s\r\n"
-			"Content-Length: %d\r\n\r\n"
+			"Content-Length: %d\r\n"
+			"Connection: close\r\n\r\n"
 			"%s"
-			,OCL_ENDPOINT
-			,ocl->srvAddr
+			,OCL_EMBED_ENDPOINT
+			,http_host(ocl->srvAddr, host, sizeof(host))
 			,OCL_VERSION
 			,ocl->apiKey
 			,(int) strlen(body), body);
-	sfree(body);
-	int retVal=send_message(ocl, msg, callback);
-	sfree(msg);
-	if(retVal<0){
-		sfree(messageParsed);
-		return retVal;
+	int retVal=send_message(ocl, msg, strlen(msg), NULL, NULL);
+	if(retVal<=0) return (retVal==0)?OCL_ERR_ZEROBYTESRECV:retVal;
+	char *json=http_response_body(ocl->ocl_resp->response);
+	if(json==NULL) return OCL_ERR_MALLOC;
+	int dimensions=0;
+	retVal=embed_parse(json, NULL, 1, &dimensions);
+	sfree(json);
+	if(retVal<0) return retVal;
+	if(retVal!=1 || dimensions<1) return OCL_ERR_EMBED;
+	return dimensions;
+}
+
+int OCl_embed(OCl *ocl, const char **inputs, int cantInputs, float *vectors, int dimensions, const char *outFile){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	if(inputs==NULL || cantInputs<0 || dimensions<1 || (vectors==NULL && outFile==NULL)) return OCL_ERR_EMBED;
+	EmbedJob job={0};
+	job.inputs=inputs;
+	job.vectors=vectors;
+	job.dimensions=dimensions;
+	job.fd=-1;
+	pthread_mutex_init(&job.mutex, NULL);
+	if((job.batches=malloc(sizeof(int)*(cantInputs+1)))==NULL) return OCL_ERR_MALLOC;
+	size_t batchBytes=0;
+	for(int i=0;i<cantInputs;i++){
+		if(inputs[i]==NULL){
+			sfree(job.batches);
+			return OCL_ERR_EMBED;
+		}
+		size_t inputBytes=strlen(inputs[i])+3;
+		int batchInputs=(job.cantBatches>0)?i-job.batches[job.cantBatches-1]:0;
+		if(job.cantBatches==0 || batchInputs>=ocl->embedBatchInputs || batchBytes+inputBytes>(size_t) ocl->embedBatchBytes){
+			job.batches[job.cantBatches++]=i;
+			batchBytes=0;
+		}
+		batchBytes+=inputBytes;
 	}
-	if(!ocl->ocl_resp->done && !oclCanceled){
-		sfree(messageParsed);
-		return OCL_ERR_PARTIAL_RESPONSE_RECV;
+	job.batches[job.cantBatches]=cantInputs;
+	job.maxBatchInputs=ocl->embedBatchInputs;
+	int retVal=OCL_RETURN_OK;
+	if(outFile!=NULL){
+		if((job.fd=open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644))<0){
+			sfree(job.batches);
+			return OCL_ERR_OPENING_FILE;
+		}
+		char header[16]="OCLEMB01";
+		int32_t rows=cantInputs, dims=dimensions;
+		memcpy(header+8, &rows, 4);
+		memcpy(header+12, &dims, 4);
+		if(pwrite(job.fd, header, 16, 0)!=16) retVal=OCL_ERR_OPENING_FILE;
 	}
-	if(!oclCanceled && retVal>0){
-		if(message[strlen(message)-1]!=';' && strcmp(ocl->ocl_resp->content,"")!=0){
-			create_new_context_message(ocl, messageParsed, ocl->ocl_resp->content);
-			if(ocl->maxHistoryCtx>=0) OCl_save_message(ocl, messageParsed, ocl->ocl_resp->content);
+	int cantWorkers=(job.cantBatches<ocl->embedConnections)?job.cantBatches:ocl->embedConnections;
+	EmbedWorker workers[OCL_MAX_EMBED_CONNECTIONS];
+	int started=0;
+	for(int i=0;i<cantWorkers && retVal==OCL_RETURN_OK;i++){
+		memset(&workers[i], 0, sizeof(EmbedWorker));
+		workers[i].job=&job;
+		workers[i].slot=i%(ocl->cantEndpoints+1);
+		if((workers[i].shadow=ocl_shadow_new(ocl))==NULL){
+			retVal=OCL_ERR_MALLOC;
+			break;
 		}
+		if(pthread_create(&workers[i].thread, NULL, embed_worker, &workers[i])!=0){
+			ocl_shadow_free(workers[i].shadow);
+			retVal=OCL_ERR_EMBED;
+			break;
+		}
+		started++;
+	}
+	// Already running workers finish the job.
+	if(started>0) retVal=OCL_RETURN_OK;
+	for(int i=0;i<started;i++){
+		pthread_join(workers[i].thread, NULL);
+		sfree(workers[i].body);
+		sfree(workers[i].scratch);
+		ocl_shadow_free(workers[i].shadow);
+	}
+	if(retVal==OCL_RETURN_OK && (retVal=atomic_load(&job.error))!=OCL_RETURN_OK){
+		snprintf(ocl->ocl_resp->error, BUFFER_SIZE_1K, "%s", job.errorMsg);
+	}
+	if(retVal==OCL_RETURN_OK && job.nextBatch<job.cantBatches && !ocl_canceled(ocl)) retVal=OCL_ERR_EMBED;
+	if(job.fd>=0) close(job.fd);
+	pthread_mutex_destroy(&job.mutex);
+	sfree(job.batches);
+	return retVal;
+}
+
+/*
+ * Retrieval over the static context: each interaction ("user assistant") is embedded once into an index file, mapped
+ * with mmap(), and at query time only the top-k interactions most similar (cosine) to the message are injected. The
+ * rows are normalized when built, so the search is a brute-force dot product. The index is rebuilt when the static
+ * context file (size, mtime), its number of interactions or the embedding model change.
+ */
+typedef struct{
+	char magic[8];
+	int32_t rows;
+	int32_t dimensions;
+	int64_t srcSize;
+	int64_t srcMtime;
+	char model[256];
+}VectorIndexHeader;
+
+struct _ocl_vindex{
+	int topK;
+	int rows;
+	int dimensions;
+	void *map;
+	size_t mapLen;
+	float const *vectors;
+	char *indexFile;
+	OCl *shadow;
+};
+
+static void vindex_normalize(float *vector, int dimensions){
+	double norm=0;
+	for(int i=0;i<dimensions;i++) norm+=(double) vector[i]*vector[i];
+	if(norm==0) return;
+	float inv=(float) (1.0/sqrt(norm));
+	for(int i=0;i<dimensions;i++) vector[i]*=inv;
+}
+
+static float vindex_dot(float const *a, float const *b, int dimensions){
+	int i=0;
+	float dot=0;
+#if defined(__SSE__)
+	__m128 acc0=_mm_setzero_ps(), acc1=_mm_setzero_ps();
+	for(;i+8<=dimensions;i+=8){
+		acc0=_mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+		acc1=_mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4)));
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+	dot=lanes[0]+lanes[1]+lanes[2]+lanes[3];
+#endif
+	for(;i<dimensions;i++) dot+=a[i]*b[i];
+	return dot;
+}
+
+static int vindex_count_rows(OCl const *ocl){
+	return message_list_count(ocl->staticContextMessages);
+}
+
+static bool vindex_valid(VectorIndexHeader const *header, size_t len, int rows, struct stat const *src, char const *model){
+	return len>=sizeof(VectorIndexHeader) && memcmp(header->magic, OCL_VINDEX_FILE_MAGIC, 8)==0 && header->rows==rows
+			&& header->dimensions>0 && header->srcSize==(int64_t) src->st_size && header->srcMtime==(int64_t) src->st_mtime
+			&& strncmp(header->model, model, sizeof(header->model))==0
+			&& len==sizeof(VectorIndexHeader)+(size_t) header->rows*header->dimensions*sizeof(float);
+}
+
+static int vindex_build(OCl *ocl, struct _ocl_vindex *vindex, char const *indexFile, struct stat const *src){
+	int rows=vindex_count_rows(ocl), dimensions=OCl_get_embed_dimensions(vindex->shadow);
+	if(dimensions<0) return dimensions;
+	char const **texts=malloc(sizeof(char *)*(rows+1));
+	float *vectors=malloc(sizeof(float)*((size_t) rows*dimensions+1));
+	if(texts==NULL || vectors==NULL){
+		sfree(texts);
+		sfree(vectors);
+		return OCL_ERR_MALLOC;
+	}
+	int retVal=OCL_RETURN_OK, i=0;
+	for(;i<rows && retVal==OCL_RETURN_OK;i++){
+		Message const *temp=ocl->staticContextMessages->messages[i];
+		size_t len=strlen(temp->userMessage)+strlen(temp->assistantMessage)+2;
+		char *text=malloc(len);
+		if(text==NULL){
+			retVal=OCL_ERR_MALLOC;
+			break;
+		}
+		snprintf(text, len, "%s %s", temp->userMessage, temp->assistantMessage);
+		texts[i]=text;
+	}
+	if(retVal==OCL_RETURN_OK) retVal=OCl_embed(vindex->shadow, texts, rows, vectors, dimensions, NULL);
+	for(int j=0;j<i;j++) sfree((void *) texts[j]);
+	sfree(texts);
+	if(retVal!=OCL_RETURN_OK){
+		snprintf(ocl->ocl_resp->error, BUFFER_SIZE_1K, "%s", vindex->shadow->ocl_resp->error);
+		sfree(vectors);
+		return retVal;
+	}
+	for(int j=0;j<rows;j++) vindex_normalize(vectors+(size_t) j*dimensions, dimensions);
+	VectorIndexHeader header={0};
+	memcpy(header.magic, OCL_VINDEX_FILE_MAGIC, 8);
+	header.rows=rows;
+	header.dimensions=dimensions;
+	header.srcSize=src->st_size;
+	header.srcMtime=src->st_mtime;
+	snprintf(header.model, sizeof(header.model), "%.255s", vindex->shadow->model);
+	// Written aside and renamed, so a reader never maps a half-written index.
+	char tmpFile[BUFFER_SIZE_1K]="";
+	snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", indexFile);
+	FILE *f=fopen(tmpFile, "wb");
+	if(f==NULL){
+		sfree(vectors);
+		return OCL_ERR_OPENING_FILE;
+	}
+	bool written=fwrite(&header, sizeof(header), 1, f)==1
+			&& fwrite(vectors, sizeof(float), (size_t) rows*dimensions, f)==(size_t) rows*dimensions;
+	written=(fclose(f)==0) && written;
+	sfree(vectors);
+	if(!written || rename(tmpFile, indexFile)!=0){
+		unlink(tmpFile);
+		return OCL_ERR_OPENING_FILE;
 	}
-	sfree(messageParsed);
 	return OCL_RETURN_OK;
 }
 
-int OCl_check_service_status(OCl *ocl){
-	char msg[2048]="";
-	snprintf(msg,2048,
-			"GET / HTTP/1.1\r\n"
-			"Host: %s\r\n\r\n",ocl->srvAddr);
-	int retVal=0;
-	if((retVal=send_message(ocl, msg, NULL))<=0) return retVal;
+static int vindex_map(struct _ocl_vindex *vindex, char const *indexFile, int rows, struct stat const *src){
+	int fd=open(indexFile, O_RDONLY);
+	if(fd<0) return OCL_ERR_OPENING_FILE;
+	struct stat st;
+	if(fstat(fd, &st)!=0 || st.st_size<(off_t) sizeof(VectorIndexHeader)){
+		close(fd);
+		return OCL_ERR_VECTOR_INDEX;
+	}
+	void *map=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map==MAP_FAILED) return OCL_ERR_VECTOR_INDEX;
+	if(!vindex_valid(map, st.st_size, rows, src, vindex->shadow->model)){
+		munmap(map, st.st_size);
+		return OCL_ERR_VECTOR_INDEX;
+	}
+	VectorIndexHeader const *header=map;
+	vindex->map=map;
+	vindex->mapLen=st.st_size;
+	vindex->rows=header->rows;
+	vindex->dimensions=header->dimensions;
+	vindex->vectors=(float const *) ((char const *) map+sizeof(VectorIndexHeader));
 	return OCL_RETURN_OK;
 }
 
-int OCl_check_model_loaded(OCl *ocl){
-	char msg[2048]="";
-	snprintf(msg,2048,
-			"GET /api/ps HTTP/1.1\r\n"
-			"Host: %s\r\n\r\n",ocl->srvAddr);
-	int retVal=0;
-	if((retVal=send_message(ocl, msg, NULL))<0) return retVal;
-	if(strstr(ocl->ocl_resp->response,ocl->model)==NULL) return false;
-	return true;
+static void vindex_free(OCl *ocl){
+	if(ocl->vindex==NULL) return;
+	if(ocl->vindex->map!=NULL) munmap(ocl->vindex->map, ocl->vindex->mapLen);
+	ocl_shadow_free(ocl->vindex->shadow);
+	sfree(ocl->vindex->indexFile);
+	sfree(ocl->vindex);
+	ocl->vindex=NULL;
 }
 
-int OCl_load_model(OCl *ocl, bool load){
-	char body[BUFFER_SIZE_1K]="";
-	if(load){
-		snprintf(body,BUFFER_SIZE_1K,"{\"model\": \"%s\", \"keep_alive\": %d}",ocl->model,ocl->keepalive);
-	}else{
-		snprintf(body,BUFFER_SIZE_1K,"{\"model\": \"%s\", \"keep_alive\": 0}",ocl->model);
+int OCl_set_static_context_index(OCl *ocl, const char *indexFile, const char *embedModel, int topK){
+	if(ocl==NULL) return OCL_ERR_NULL_STRUCT;
+	vindex_free(ocl);
+	if(indexFile==NULL) return OCL_RETURN_OK;
+	if(ocl->staticContextFile==NULL || embedModel==NULL || strcmp(embedModel,"")==0 || strlen(embedModel)>=256
+			|| topK<1 || topK>OCL_VINDEX_MAX_TOP_K) return OCL_ERR_VECTOR_INDEX;
+	struct stat src;
+	if(stat(ocl->staticContextFile, &src)!=0) return OCL_ERR_OPENING_STATIC_CTX_FILE;
+	struct _ocl_vindex *vindex=calloc(1, sizeof(struct _ocl_vindex));
+	if(vindex==NULL) return OCL_ERR_MALLOC;
+	if((vindex->shadow=ocl_shadow_new(ocl))==NULL){
+		sfree(vindex);
+		return OCL_ERR_MALLOC;
 	}
-	char msg[2048]="";
-	snprintf(msg,2048,
-			"POST /api/chat HTTP/1.1\r\n"
-			"Host: %s\r\n"
-			"Content-Type: application/json\r\n"
-			"Content-Length: %d\r\n\r\n"
-			"%s",ocl->srvAddr,(int) strlen(body), body);
-	int prevRecvTo=ocl->socketRecvTimeout;
-	ocl->socketRecvTimeout=120;
-	int retVal=0;
-	retVal=send_message(ocl, msg, NULL);
-	ocl->socketRecvTimeout=prevRecvTo;
-	if(retVal<=0) return retVal;
-	if(strstr(ocl->ocl_resp->response,"200 OK")!=NULL) return OCL_RETURN_OK;
-	if(load) return OCL_ERR_LOADING_MODEL;
-	return OCL_ERR_UNLOADING_MODEL;
+	snprintf(vindex->shadow->model, sizeof(vindex->shadow->model), "%s", embedModel);
+	vindex->topK=topK;
+	ocl->vindex=vindex;
+	if((vindex->indexFile=malloc(strlen(indexFile)+1))==NULL){
+		vindex_free(ocl);
+		return OCL_ERR_MALLOC;
+	}
+	memcpy(vindex->indexFile, indexFile, strlen(indexFile)+1);
+	int rows=vindex_count_rows(ocl), retVal=OCL_RETURN_OK;
+	if(vindex_map(vindex, indexFile, rows, &src)==OCL_RETURN_OK) return OCL_RETURN_OK;
+	if((retVal=vindex_build(ocl, vindex, indexFile, &src))==OCL_RETURN_OK) retVal=vindex_map(vindex, indexFile, rows, &src);
+	if(retVal!=OCL_RETURN_OK) vindex_free(ocl);
+	return retVal;
 }
 
-int OCl_get_models(OCl *ocl, char(*models)[512]){
-	char body[BUFFER_SIZE_1K]="", msg[2048]="";
-	snprintf(msg,2048,
-			"GET /api/tags HTTP/1.1\r\n"
-			"Host: %s\r\n"
-			"Content-Type: application/json\r\n"
-			"Content-Length: %d\r\n\r\n"
-			"%s",ocl->srvAddr,(int) strlen(body), body);
-	int retVal=0;
-	if((retVal=send_message(ocl, msg, NULL))<=0) return retVal;
-	char *model=strstr(ocl->ocl_resp->response,"\"model\":\"");
-	int contModel=0;
-	while(model!=NULL){
-		size_t cont=0, len=strlen("\"model\":\"");
-		for(size_t i=len;(model[i-1]=='\\' || model[i]!='"');i++, cont++) models[contModel][cont]=model[i];
-		models[contModel][cont]=0;
-		contModel++;
-		model[0]=' ';
-		model=strstr(model,"\"model\":\"");
-	}
-	for(int i=0;i<contModel-1;i++){
-		for(int j=i;j<contModel;j++){
-			if(strcmp(models[i],models[j])>0){
-				char buf[255]="";
-				strcpy(buf,models[i]);
-				strcpy(models[i],models[j]);
-				strcpy(models[j],buf);
-			}
+// The branch maps the same index file (it's only rebuilt if the static context changed meanwhile).
+static int vindex_fork(OCl const *ocl, OCl *branch){
+	if(ocl->vindex==NULL) return OCL_RETURN_OK;
+	return OCl_set_static_context_index(branch, ocl->vindex->indexFile, ocl->vindex->shadow->model, ocl->vindex->topK);
+}
+
+/*
+ * Fills 'rows' (ascending, so the interactions keep their order) with the top-k static interactions for the message.
+ * Returns how many, or <0 when everything has to be injected (no index, or the message couldn't be embedded).
+ */
+static int vindex_rows(OCl const *ocl){
+	return (ocl->vindex==NULL)?0:ocl->vindex->rows;
+}
+
+static int vindex_select(OCl *ocl, char const *message, int *rows){
+	struct _ocl_vindex *vindex=ocl->vindex;
+	if(vindex==NULL || vindex->rows<=vindex->topK) return -1;
+	float *query=malloc(sizeof(float)*vindex->dimensions);
+	if(query==NULL) return -1;
+	if(OCl_embed(vindex->shadow, &message, 1, query, vindex->dimensions, NULL)!=OCL_RETURN_OK){
+		sfree(query);
+		return -1;
+	}
+	vindex_normalize(query, vindex->dimensions);
+	float scores[OCL_VINDEX_MAX_TOP_K];
+	int cant=0;
+	for(int i=0;i<vindex->rows;i++){
+		float score=vindex_dot(query, vindex->vectors+(size_t) i*vindex->dimensions, vindex->dimensions);
+		if(cant==vindex->topK && score<=scores[cant-1]) continue;
+		int j=(cant<vindex->topK)?cant++:cant-1;
+		for(;j>0 && scores[j-1]<score;j--){
+			scores[j]=scores[j-1];
+			rows[j]=rows[j-1];
 		}
+		scores[j]=score;
+		rows[j]=i;
+	}
+	sfree(query);
+	for(int i=1;i<cant;i++){
+		int row=rows[i], j=i;
+		for(;j>0 && rows[j-1]>row;j--) rows[j]=rows[j-1];
+		rows[j]=row;
 	}
-	return contModel;
+	return cant;
 }
@@ -46,6 +46,21 @@
 #define OCL_NUM_PREDICT							"-1"
 #define OCL_MAX_HISTORY_CTX						"3"
 #define OCL_MAX_TOKENS_CTX						"4096"
+#define OCL_LOAD_TIMEOUT_S						120
+#define OCL_GENERATE_ENDPOINT					"/api/generate"
+#define OCL_EMBED_ENDPOINT						"/api/embed"
+#define OCL_EMBED_CONNECTIONS					4
+#define OCL_EMBED_BATCH_INPUTS					64
+#define OCL_EMBED_BATCH_BYTES					(256*1024)
+#define OCL_COMPRESSION_MIN_SIZE				(32*1024)
+#define OCL_STATIC_CONTEXT_TOP_K				4
+#define OCL_RETRY_MAX_ATTEMPTS					1
+#define OCL_RETRY_BACKOFF_MS					500
+#define OCL_RETRY_MAX_BACKOFF_MS				30000
+#define OCL_RACE_MAX_BRANCHES					16
+#define OCL_MAX_STOP_SEQUENCES					16
+#define OCL_STOP_MAX_LEN						256
+#define OCL_ENSEMBLE_PROMPT						". Give an answer based on the context provided."
 
 enum ocl_response_types{
 	OCL_CONTENT_TYPE=0,
@@ -53,6 +68,44 @@ enum ocl_response_types{
 	OCL_TOOL_TYPE
 };
 
+enum ocl_endpoint_policies{
+	OCL_POLICY_ROUND_ROBIN=0,
+	OCL_POLICY_LEAST_OUTSTANDING,
+	OCL_POLICY_LATENCY_EWMA,
+	OCL_POLICY_MODEL_AFFINITY
+};
+
+enum ocl_compression_algorithms{
+	OCL_COMPRESSION_NONE=0,
+	OCL_COMPRESSION_GZIP,
+	OCL_COMPRESSION_ZSTD
+};
+
+enum ocl_race_policies{
+	OCL_RACE_FIRST_TOKEN=0,
+	OCL_RACE_FIRST_DONE,
+	OCL_RACE_QUORUM
+};
+
+enum ocl_stop_reasons{
+	OCL_STOP_NONE=0,
+	OCL_STOP_SEQUENCE,
+	OCL_STOP_MAX_CHARS,
+	OCL_STOP_MAX_TIME
+};
+
+enum ocl_warmup_policies{
+	OCL_WARMUP_ALWAYS=0,
+	OCL_WARMUP_ON_USAGE,
+	OCL_WARMUP_SCHEDULE
+};
+
+enum ocl_priorities{
+	OCL_PRIORITY_INTERACTIVE=0,
+	OCL_PRIORITY_NORMAL,
+	OCL_PRIORITY_BATCH
+};
+
 enum ocl_errors{
 	OCL_ERR_INIT=-100,
 	OCL_ERR_MALLOC,
@@ -113,10 +166,94 @@ enum ocl_errors{
 	OCL_ERR_SOCKET_SEND_TIMEOUT_NOT_VALID,
 	OCL_ERR_SOCKET_RECV_TIMEOUT_NOT_VALID,
 	OCL_ERR_RESPONSE_SPEED_NOT_VALID,
-	OCL_ERR_MSG_FOUND
+	OCL_ERR_MSG_FOUND,
+	OCL_ERR_METRICS_SOCKET,
+	OCL_ERR_RESPONSE_CACHE,
+	OCL_ERR_RETRY_POLICY,
+	OCL_ERR_ENDPOINT,
+	OCL_ERR_MODEL_NOT_FOUND,
+	OCL_ERR_MODELS_REFRESH_NOT_VALID,
+	OCL_ERR_WARMUP,
+	OCL_ERR_SCHEDULER,
+	OCL_ERR_SCHEDULER_QUEUE_FULL,
+	OCL_ERR_SCHEDULER_DEADLINE,
+	OCL_ERR_EMBED,
+	OCL_ERR_EMBED_DIMENSIONS,
+	OCL_ERR_VECTOR_INDEX,
+	OCL_ERR_COMPRESSION,
+	OCL_ERR_RACE,
+	OCL_ERR_FORMAT,
+	OCL_ERR_FORMAT_VIOLATION,
+	OCL_ERR_STOP,
+	OCL_ERR_BUDGET,
+	OCL_ERR_LOAD_TIMEOUT_NOT_VALID,
+	OCL_ERR_MODEL_NAME,
+	OCL_ERR_API_KEY,
+	OCL_ERR_THINK,
+	OCL_ERR_REQUEST_HEADERS
 };
 
 typedef struct _ocl OCl;
+typedef struct _ocl_conversation OCl_conversation;
+
+typedef struct _ocl_model_info{
+	char name[512];
+	long int size;
+	char digest[128];
+	bool loaded;
+	char expiresAt[64];
+	int contextLength;
+}OCl_model_info;
+
+typedef struct _ocl_config{
+	const char *serverAddr;
+	int serverPort;
+	int connectTimeout;
+	int sendTimeout;
+	int recvTimeout;
+	const char *apiKey;
+	const char *model;
+	const char *think;
+	int keepAlive;
+	const char *systemRole;
+	const char *systemRoleFile;
+	int maxHistoryCtx;
+	double temp;
+	int repeatLastN;
+	double repeatPenalty;
+	int seed;
+	int topK;
+	double topP;
+	double minP;
+	int numPredict;
+	int maxTokensCtx;
+	const char *contextFile;
+	const char *staticContextFile;
+	const char *toolsFile;
+}OCl_config;
+
+// 'model', 'serverAddr' & 'serverPort' (NULL/0: the instance's) are set by the caller, the rest by OCl_race()/OCl_ensemble().
+typedef struct _ocl_race_branch{
+	const char *model;
+	const char *serverAddr;
+	int serverPort;
+	int result;
+	bool winner;
+	bool canceled;
+	double firstToken;
+	double elapsed;
+	int evalCount;
+	double tokensPerSec;
+}OCl_race_branch;
+
+typedef struct _ocl_warmup_stats{
+	int loads;
+	int failures;
+	double lastLoadTime;
+	double maxLoadTime;
+	double totalLoadTime;
+	long int lastLoadAt;
+}OCl_warmup_stats;
 
 extern int oclSslError;
 extern bool oclCanceled;
@@ -126,17 +263,37 @@ int OCl_get_instance(OCl **, const char *, const char *, const char *, const cha
 		, const char *, const char *, const char *, const char *, const char *,const char *,const char *
 		,const char *, const char *, const char *,const char *,const char *, const char *, const char *
 		, const char *, const char *, const char *, const char *, const char *);
+void OCl_config_defaults(OCl_config *);
+int OCl_get_instance_config(OCl **, const OCl_config *);
+int OCl_configure(OCl *, const OCl_config *);
 int OCl_free(OCl *);
 int OCl_shutdown();
 
 int OCl_flush_context(OCl *);
+int OCl_snapshot(OCl *, OCl_conversation **);
+int OCl_snapshot_free(OCl_conversation *);
+int OCl_fork(OCl *, OCl_conversation const *, OCl **);
 int OCl_load_model(OCl *, bool load);
+int OCl_set_load_timeout(OCl *, int);
+int OCl_warmup_add(OCl *, const char *, int, int, int);
+int OCl_warmup_start(OCl *);
+int OCl_warmup_stop(OCl *);
+int OCl_warmup_get_stats(OCl *, const char *, OCl_warmup_stats *);
 int OCl_send_chat(OCl *, const char *, const char *, void (*)(const char *, bool, int));
+int OCl_cancel(OCl *);
+int OCl_race(OCl *, const char *, const char *, OCl_race_branch *, int, int, int, void (*)(const char *, bool, int));
+int OCl_ensemble(OCl *, const char *, const char *, OCl_race_branch *, int, const char *, void (*)(const char *, bool, int));
+int OCl_set_generate(OCl *, bool);
+int OCl_save_generate_context(OCl *, const char *);
+int OCl_load_generate_context(OCl *, const char *);
 int OCl_check_service_status(OCl *);
 int OCl_check_model_loaded(OCl *);
 char * OCL_error_handling(OCl *, int);
 
 int OCl_get_models(OCl *, char(*)[512]);
+int OCl_get_model_info(OCl *, const char *, OCl_model_info *, bool);
+int OCl_refresh_models(OCl *);
+int OCl_set_models_refresh(OCl *, int);
 char * OCL_get_response(OCl *);
 char * OCL_get_response_thoughts(OCl *);
 int OCL_get_response_tools(OCl *, char ***);
@@ -148,11 +305,56 @@ int OCL_get_response_prompt_eval_count(const OCl *);
 int OCL_get_response_eval_count(const OCl *);
 double OCL_get_response_tokens_per_sec(const OCl *);
 int OCL_get_response_chars_content(const OCl *);
+int OCL_get_response_stop_reason(const OCl *);
 long int OCL_get_response_size(const OCl *ocl);
 
+int OCl_set_server_addr(OCl *, const char *);
+int OCl_set_server_port(OCl *, int);
+int OCl_set_timeouts(OCl *, int, int, int);
+int OCl_set_apiKey(OCl *, const char *);
 int OCl_set_model(OCl *, const char *);
+int OCl_set_think(OCl *, const char *);
+int OCl_set_keepalive(OCl *, int);
 int OCl_set_role(OCl *, const char *);
+int OCl_set_temp(OCl *, double);
+int OCl_set_repeat_last_n(OCl *, int);
+int OCl_set_repeat_penalty(OCl *, double);
+int OCl_set_seed(OCl *, int);
+int OCl_set_top_k(OCl *, int);
+int OCl_set_top_p(OCl *, double);
+int OCl_set_min_p(OCl *, double);
+int OCl_set_num_predict(OCl *, int);
+int OCl_set_max_history_ctx(OCl *, int);
+int OCl_set_max_tokens_ctx(OCl *, int);
+int OCl_set_static_context_index(OCl *, const char *, const char *, int);
+int OCl_set_response_cache(OCl *, int, long int, int, const char *);
+int OCl_flush_response_cache(OCl *);
+int OCl_set_compression(OCl *, int, int, int);
+int OCl_set_format(OCl *, const char *);
+int OCl_set_stop(OCl *, const char **, int);
+int OCl_set_budget(OCl *, int, int);
+int OCl_set_retry_policy(OCl *, int, int, const int *, int);
+int OCl_add_endpoint(OCl *, const char *, const char *);
+int OCl_set_endpoint_policy(OCl *, int);
+int OCl_set_request_class(OCl *, int, const char *, int);
+
+int OCl_scheduler_set(int, int);
+int OCl_scheduler_set_model_concurrency(const char *, int);
+
+int OCl_set_embed_pipeline(OCl *, int, int, int);
+int OCl_get_embed_dimensions(OCl *);
+int OCl_embed(OCl *, const char **, int, float *, int, const char *);
 
 int OCl_parse_string(char **, char const *);
 
+/*
+ * Process wide. 'ocl_errors_total' counts the errors of the requests sent to the server (chats, also raced or ensembled,
+ * embeddings, models...), not the ones returned before sending (v.gr. settings, memory, a race without winner). Only
+ * the embeddings pipeline keeps connections open: 'ocl_connections_reused_total' counts embeddings requests alone.
+ */
+int OCl_metrics_enable(bool);
+int OCl_metrics_dump(int);
+int OCl_metrics_serve(const char *);
+int OCl_metrics_stop_serving();
+
 #endif /* HEADERS_LIBOLLAMA_C_LIENT_H_ */